@@ -59,6 +59,7 @@ enum spa_io_type {
 	SPA_IO_Position,	/**< position information in the graph, struct spa_io_position */
 	SPA_IO_RateMatch,	/**< rate matching between nodes, struct spa_io_rate_match */
 	SPA_IO_Memory,		/**< memory pointer, struct spa_io_memory */
+	SPA_IO_Meter,		/**< level meters, struct spa_io_meter */
 };
 
 /**
@@ -293,6 +294,39 @@ struct spa_io_rate_match {
 	uint32_t padding[7];
 };
 
+/** level meter of one channel */
+struct spa_io_meter_channel {
+	float peak;			/**< max absolute sample value */
+	float true_peak;		/**< max absolute value of the 4x oversampled signal */
+	double energy;			/**< running sum of the squared samples */
+};
+
+#define SPA_IO_METER_MAX_CHANNELS	64
+
+/**
+ * Level meters, updated by the node in every cycle.
+ *
+ * peak and true_peak hold the maximum value since the last reset.
+ * energy and n_samples only increase, the RMS level over an interval is
+ * sqrt(delta energy / delta n_samples).
+ *
+ * seq is incremented before and after an update, a reader should retry
+ * when seq was odd or changed while reading the values.
+ *
+ * Only the node writes the values. To reset the peaks, the reader stores
+ * the seq of the values it read in reset_seq. The node starts the peaks
+ * from 0 in its next update when seq did not change since then, otherwise
+ * the reset is ignored so that no peak is lost.
+ */
+struct spa_io_meter {
+	uint32_t seq;			/**< sequence number, odd while updating */
+	uint32_t n_channels;		/**< number of valid channels */
+	uint32_t reset_seq;		/**< written by the reader to reset the peaks */
+	uint32_t padding;
+	uint64_t n_samples;		/**< number of measured samples */
+	struct spa_io_meter_channel channels[SPA_IO_METER_MAX_CHANNELS];
+};
+
 /**
  * \}
  */
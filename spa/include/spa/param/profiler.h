@@ -82,6 +82,19 @@ enum spa_profiler {
 							  *      Long : finish,
 							  *      Int : status,
 							  *      Fraction : latency))  */
+	SPA_PROFILER_followerHistogram,			/**< log scaled histograms of the follower
+							  *  wakeup latency (awake - signal) and
+							  *  run time (finish - awake) in nanoseconds.
+							  *  Bucket 0 counts values below 1 << min_shift,
+							  *  then each octave has sub_buckets buckets
+							  *  and the last bucket counts larger values.
+							  *  Counters are free running and wrap around.
+							  *  (Struct(
+							  *      Int : id,
+							  *      Int : min_shift,
+							  *      Int : sub_buckets,
+							  *      Array of Int : wakeup counts,
+							  *      Array of Int : run counts))  */
 
 	SPA_PROFILER_START_CUSTOM	= 0x1000000,
 };
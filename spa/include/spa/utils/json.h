@@ -36,6 +36,9 @@ extern "C" {
 #include <string.h>
 #include <math.h>
 #include <float.h>
+#if defined(__SSE2__) && !defined(SPA_JSON_NO_SIMD)
+#include <emmintrin.h>
+#endif
 
 #include <spa/utils/defs.h>
 #include <spa/utils/string.h>
@@ -73,11 +76,87 @@ static inline void spa_json_enter(struct spa_json * iter, struct spa_json * sub)
 
 #define SPA_JSON_SAVE(iter) ((struct spa_json) { (iter)->cur, (iter)->end, })
 
+/** Get the number of bytes at \a p that can be skipped inside a string
+ * without further checks: printable ASCII that is not a quote or a
+ * backslash. */
+static inline size_t spa_json_string_span(const char *p, const char *end)
+{
+	const char *s = p;
+#if defined(__SSE2__) && !defined(SPA_JSON_NO_SIMD)
+	const __m128i ctrl = _mm_set1_epi8(0x20), del = _mm_set1_epi8(0x7f);
+	const __m128i quote = _mm_set1_epi8('"'), esc = _mm_set1_epi8('\\');
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		/* signed compare catches both control chars and bytes >= 0x80 */
+		__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmplt_epi8(v, ctrl), _mm_cmpeq_epi8(v, del)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, esc)));
+		int mask = _mm_movemask_epi8(m);
+		if (mask != 0)
+			return p - s + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	for (; p < end; p++) {
+		unsigned char c = (unsigned char)*p;
+		if (c < 32 || c > 126 || c == '"' || c == '\\')
+			break;
+	}
+	return p - s;
+}
+
+/** Get the number of bytes at \a p until the end of a comment line */
+static inline size_t spa_json_comment_span(const char *p, const char *end)
+{
+	const char *s = p;
+#if defined(__SSE2__) && !defined(SPA_JSON_NO_SIMD)
+	const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+		if (mask != 0)
+			return p - s + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	for (; p < end; p++) {
+		if (*p == '\n' || *p == '\r')
+			break;
+	}
+	return p - s;
+}
+
+/** Get the number of whitespace bytes at \a p */
+static inline size_t spa_json_space_span(const char *p, const char *end)
+{
+	const char *s = p;
+#if defined(__SSE2__) && !defined(SPA_JSON_NO_SIMD)
+	const __m128i sp = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	while (end - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i m = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, sp), _mm_cmpeq_epi8(v, tab)),
+				_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)));
+		int mask = _mm_movemask_epi8(m) ^ 0xffff;
+		if (mask != 0)
+			return p - s + __builtin_ctz(mask);
+		p += 16;
+	}
+#endif
+	for (; p < end; p++) {
+		if (*p != ' ' && *p != '\t' && *p != '\n' && *p != '\r')
+			break;
+	}
+	return p - s;
+}
+
 /** Get the next token. \a value points to the token and the return value
  * is the length. */
 static inline int spa_json_next(struct spa_json * iter, const char **value)
 {
 	int utf8_remain = 0;
+	size_t skip;
 	enum { __NONE, __STRUCT, __BARE, __STRING, __UTF8, __ESC, __COMMENT };
 
 	*value = iter->cur;
@@ -91,7 +170,12 @@ static inline int spa_json_next(struct spa_json * iter, const char **value)
 			goto again;
 		case __STRUCT:
 			switch (cur) {
-			case '\0': case '\t': case ' ': case '\r': case '\n': case ':': case '=': case ',':
+			case '\t': case ' ': case '\r': case '\n':
+				/* indentation usually comes in long runs */
+				skip = spa_json_space_span(iter->cur, iter->end);
+				iter->cur += skip - 1;
+				continue;
+			case '\0': case ':': case '=': case ',':
 				continue;
 			case '#':
 				iter->state = __COMMENT;
@@ -130,6 +214,10 @@ static inline int spa_json_next(struct spa_json * iter, const char **value)
 			}
 			continue;
 		case __STRING:
+			if ((skip = spa_json_string_span(iter->cur, iter->end)) > 0) {
+				iter->cur += skip - 1;
+				continue;
+			}
 			switch (cur) {
 			case '\\':
 				iter->state = __ESC;
@@ -171,6 +259,10 @@ static inline int spa_json_next(struct spa_json * iter, const char **value)
 			}
 			return -1;
 		case __COMMENT:
+			if ((skip = spa_json_comment_span(iter->cur, iter->end)) > 0) {
+				iter->cur += skip - 1;
+				continue;
+			}
 			switch (cur) {
 			case '\n': case '\r':
 				iter->state = __STRUCT;
@@ -710,6 +710,11 @@ static int impl_node_set_io(void *object, uint32_t id, void *data, size_t size)
 	case SPA_IO_Position:
 		this->io_position = data;
 		break;
+	case SPA_IO_Meter:
+		/* only the converter measures the levels */
+		if (this->convert == NULL)
+			return -ENOTSUP;
+		return spa_node_set_io(this->convert, id, data, size);
 	default:
 		break;
 	}
@@ -717,9 +722,12 @@ static int impl_node_set_io(void *object, uint32_t id, void *data, size_t size)
 	if (this->target)
 		res = spa_node_set_io(this->target, id, data, size);
 
-	if (this->target != this->follower)
-		res = spa_node_set_io(this->follower, id, data, size);
-
+	if (this->target != this->follower) {
+		int r = spa_node_set_io(this->follower, id, data, size);
+		/* it's enough when one of the nodes knows the io */
+		if (res == -ENOENT || (r < 0 && r != -ENOENT))
+			res = r;
+	}
 	return res;
 }
 
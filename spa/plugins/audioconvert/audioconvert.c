@@ -48,6 +48,7 @@
 #include "volume-ops.h"
 #include "fmt-ops.h"
 #include "channelmix-ops.h"
+#include "peaks-ops.h"
 #include "resample.h"
 
 #undef SPA_LOG_TOPIC_DEFAULT
@@ -61,6 +62,7 @@ static struct spa_log_topic *log_topic = &SPA_LOG_TOPIC(0, "spa.audioconvert");
 #define MAX_BUFFERS	32
 #define MAX_DATAS	SPA_AUDIO_MAX_CHANNELS
 #define MAX_PORTS	(SPA_AUDIO_MAX_CHANNELS+1)
+#define MAX_RAMP_POINTS	256
 
 #define DEFAULT_MUTE	false
 #define DEFAULT_VOLUME	VOLUME_NORM
@@ -192,6 +194,7 @@ struct impl {
 
 	struct spa_io_position *io_position;
 	struct spa_io_rate_match *io_rate_match;
+	struct spa_io_meter *io_meter;
 
 	uint64_t info_all;
 	struct spa_node_info info;
@@ -211,6 +214,8 @@ struct impl {
 	struct channelmix mix;
 	struct resample resample;
 	struct volume volume;
+	struct peaks peaks;
+	struct peaks_level levels[SPA_IO_METER_MAX_CHANNELS];
 	double rate_scale;
 
 	uint32_t in_offset;
@@ -227,6 +232,12 @@ struct impl {
 	float *scratch;
 	float *tmp[2];
 	float *tmp_datas[2][MAX_PORTS];
+
+	float *ramp;
+	struct ramp_point {
+		uint32_t offset;
+		float gain[SPA_AUDIO_MAX_CHANNELS];
+	} ramp_points[MAX_RAMP_POINTS];
 };
 
 #define CHECK_PORT(this,d,p)		((p) < this->dir[d].n_ports)
@@ -764,6 +775,12 @@ static int impl_node_set_io(void *object, uint32_t id, void *data, size_t size)
 	case SPA_IO_Position:
 		this->io_position = data;
 		break;
+	case SPA_IO_Meter:
+		if (data && size < sizeof(struct spa_io_meter))
+			return -EINVAL;
+		spa_zero(this->levels);
+		this->io_meter = data;
+		break;
 	default:
 		return -ENOENT;
 	}
@@ -2102,8 +2119,10 @@ impl_node_port_use_buffers(void *object,
 		this->scratch = realloc(this->scratch, maxsize + MAX_ALIGN);
 		this->tmp[0] = realloc(this->tmp[0], (maxsize + MAX_ALIGN) * MAX_PORTS);
 		this->tmp[1] = realloc(this->tmp[1], (maxsize + MAX_ALIGN) * MAX_PORTS);
+		this->ramp = realloc(this->ramp, maxsize + MAX_ALIGN);
 		if (this->empty == NULL || this->scratch == NULL ||
-		    this->tmp[0] == NULL || this->tmp[1] == NULL)
+		    this->tmp[0] == NULL || this->tmp[1] == NULL ||
+		    this->ramp == NULL)
 			return -errno;
 		memset(this->empty, 0, maxsize + MAX_ALIGN);
 		this->empty_size = maxsize;
@@ -2157,6 +2176,122 @@ static int impl_node_port_reuse_buffer(void *object, uint32_t port_id, uint32_t
 	return 0;
 }
 
+static bool control_is_volume(struct spa_pod_control *c)
+{
+	struct spa_pod_prop *prop;
+
+	switch (c->type) {
+	case SPA_CONTROL_Midi:
+		/* only the volume controller is handled */
+		return true;
+	case SPA_CONTROL_Properties:
+		if (!spa_pod_is_object(&c->value))
+			return false;
+		SPA_POD_OBJECT_FOREACH((struct spa_pod_object*)&c->value, prop) {
+			switch (prop->key) {
+			case SPA_PROP_volume:
+			case SPA_PROP_mute:
+			case SPA_PROP_channelVolumes:
+			case SPA_PROP_softMute:
+			case SPA_PROP_softVolumes:
+				break;
+			default:
+				return false;
+			}
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* when every output channel is a scaled copy of the same input channel,
+ * the matrix diagonal is the volume of each channel */
+static bool channelmix_is_diagonal(struct channelmix *mix)
+{
+	uint32_t i, j;
+
+	if (mix->src_chan != mix->dst_chan)
+		return false;
+	for (i = 0; i < mix->dst_chan; i++) {
+		if (mix->lr4[i].active)
+			return false;
+		for (j = 0; j < mix->src_chan; j++) {
+			if (mix->matrix_orig[i][j] != (i == j ? 1.0f : 0.0f))
+				return false;
+		}
+	}
+	return true;
+}
+
+/* Dense volume changes in a quantum are collected as a gain per sample
+ * for each channel, which is then applied in one pass. Returns -1 when
+ * the controls can't or don't need to be handled this way. */
+static int channelmix_process_ramp(struct impl *this, struct port *ctrlport,
+				      void * SPA_RESTRICT dst[], const void * SPA_RESTRICT src[],
+				      uint32_t n_samples)
+{
+	struct spa_pod_control *c;
+	const struct spa_pod_sequence_body *body = &(ctrlport->ctrl)->body;
+	uint32_t size = SPA_POD_BODY_SIZE(ctrlport->ctrl);
+	uint32_t i, j, n_points = 0, n_chan = this->mix.dst_chan;
+	uint32_t start = ctrlport->ctrl_offset, end = start + n_samples;
+	float *ramp = SPA_PTR_ALIGN(this->ramp, MAX_ALIGN, float);
+	struct ramp_point *p;
+
+	if (!channelmix_is_diagonal(&this->mix))
+		return -1;
+
+	/* controls before this quantum are applied at the start */
+	for (c = spa_pod_control_first(body);
+	     spa_pod_control_is_inside(body, size, c) && c->offset < end;
+	     c = spa_pod_control_next(c)) {
+		if (!control_is_volume(c))
+			return -1;
+		if (c->offset > start && ++n_points >= MAX_RAMP_POINTS)
+			return -1;
+	}
+	if (n_points == 0 || n_points * this->volume.ramp_segment < n_samples)
+		return -1;
+
+	n_points = 0;
+	p = &this->ramp_points[n_points++];
+	p->offset = 0;
+	for (c = spa_pod_control_first(body);
+	     spa_pod_control_is_inside(body, size, c) && c->offset < end;
+	     c = spa_pod_control_next(c)) {
+		if (c->offset > start + p->offset) {
+			for (i = 0; i < n_chan; i++)
+				p->gain[i] = this->mix.matrix[i][i];
+			p = &this->ramp_points[n_points++];
+			p->offset = c->offset - start;
+		}
+		spa_log_trace_fp(this->log, "%p: ramp point %d", this, c->offset);
+		if (c->type == SPA_CONTROL_Midi)
+			apply_midi(this, &c->value);
+		else
+			apply_props(this, &c->value);
+	}
+	for (i = 0; i < n_chan; i++)
+		p->gain[i] = this->mix.matrix[i][i];
+
+	for (i = 0; i < n_chan; i++) {
+		/* channels with the same gains as the previous one reuse the ramp */
+		bool same = i > 0;
+		for (j = 0; same && j < n_points; j++)
+			same = this->ramp_points[j].gain[i] == this->ramp_points[j].gain[i-1];
+		for (j = 0; !same && j < n_points; j++) {
+			uint32_t o = this->ramp_points[j].offset;
+			uint32_t e = j + 1 < n_points ? this->ramp_points[j + 1].offset : n_samples;
+			volume_ramp_fill(&ramp[o], this->ramp_points[j].gain[i], e - o);
+		}
+		volume_process_ramp(&this->volume, dst[i], src[i], ramp, n_samples);
+	}
+	ctrlport->ctrl_offset = end;
+
+	return spa_pod_control_is_inside(body, size, c) ? 0 : 1;
+}
+
 static int channelmix_process_control(struct impl *this, struct port *ctrlport,
 				      void * SPA_RESTRICT dst[], const void * SPA_RESTRICT src[],
 				      uint32_t n_samples)
@@ -2169,6 +2304,10 @@ static int channelmix_process_control(struct impl *this, struct port *ctrlport,
 	const struct spa_pod_sequence_body *body = &(ctrlport->ctrl)->body;
 	uint32_t size = SPA_POD_BODY_SIZE(ctrlport->ctrl);
 	bool end = false;
+	int res;
+
+	if ((res = channelmix_process_ramp(this, ctrlport, dst, src, n_samples)) >= 0)
+		return res;
 
 	c = spa_pod_control_first(body);
 	while (true) {
@@ -2273,6 +2412,46 @@ static inline bool resample_is_passthrough(struct impl *this)
 		 !SPA_FLAG_IS_SET(this->io_rate_match->flags, SPA_IO_RATE_MATCH_FLAG_ACTIVE));
 }
 
+/* measure the levels of the input channels and publish them in the
+ * meter io area, see struct spa_io_meter */
+static void meter_process(struct impl *this, const float **datas,
+		uint32_t n_channels, uint32_t n_samples)
+{
+	struct spa_io_meter *m = this->io_meter;
+	uint32_t i, seq;
+	bool reset;
+
+	n_channels = SPA_MIN(n_channels, SPA_IO_METER_MAX_CHANNELS);
+
+	seq = m->seq;
+	/* the reader saw all the peaks we published */
+	reset = __atomic_load_n(&m->reset_seq, __ATOMIC_ACQUIRE) == seq;
+
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i = 0; i < n_channels; i++) {
+		struct peaks_level *l = &this->levels[i];
+		struct spa_io_meter_channel *c = &m->channels[i];
+
+		if (reset) {
+			l->peak = 0.0f;
+			l->true_peak = 0.0f;
+		}
+		l->energy = 0.0f;
+
+		peaks_level(&this->peaks, l, datas[i], n_samples);
+
+		c->peak = l->peak;
+		c->true_peak = l->true_peak;
+		c->energy += l->energy;
+	}
+	m->n_channels = n_channels;
+	m->n_samples += n_samples;
+
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
 static int impl_node_process(void *object)
 {
 	struct impl *this = object;
@@ -2580,6 +2759,10 @@ static int impl_node_process(void *object)
 		}
 	}
 
+	if (SPA_UNLIKELY(this->io_meter != NULL))
+		meter_process(this, (const float**)out_datas,
+				this->dir[SPA_DIRECTION_INPUT].conv.n_channels, n_samples);
+
 	if (!mix_passthrough) {
 		in_datas = (const void**)out_datas;
 		if (resample_passthrough && out_passthrough) {
@@ -2762,6 +2945,7 @@ static int impl_clear(struct spa_handle *handle)
 	free(this->scratch);
 	free(this->tmp[0]);
 	free(this->tmp[1]);
+	free(this->ramp);
 
 	if (this->resample.free)
 		resample_free(&this->resample);
@@ -2903,6 +3087,10 @@ impl_init(const struct spa_handle_factory *factory,
 	this->volume.cpu_flags = this->cpu_flags;
 	volume_init(&this->volume);
 
+	this->peaks.log = this->log;
+	this->peaks.cpu_flags = this->cpu_flags;
+	peaks_init(&this->peaks);
+
 	this->rate_scale = 1.0;
 
 	reconfigure_mode(this, SPA_PARAM_PORT_CONFIG_MODE_convert, SPA_DIRECTION_INPUT, false, false, NULL);
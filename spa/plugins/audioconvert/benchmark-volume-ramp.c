@@ -0,0 +1,175 @@
+/* Spa
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* Cost of a quantum with a number of volume changes in it, applied by
+ * splitting the quantum at each change and mixing each part, and applied
+ * as a gain per sample in one pass. */
+
+#include "config.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include <spa/support/log-impl.h>
+
+SPA_LOG_IMPL(logger);
+
+#include "test-helper.h"
+#include "channelmix-ops.h"
+#include "volume-ops.h"
+
+static uint32_t cpu_flags;
+
+#define N_SAMPLES	1024
+#define N_CHANNELS	2
+#define MAX_POINTS	256
+
+#define MAX_COUNT 2000
+
+static float samp_in[N_CHANNELS][N_SAMPLES] SPA_ALIGNED(16);
+static float samp_out[2][N_CHANNELS][N_SAMPLES] SPA_ALIGNED(16);
+static float ramp[N_SAMPLES] SPA_ALIGNED(16);
+
+static const uint32_t n_points[] = { 1, 16, 64, 128, 171, 192, 255 };
+
+/* control points are spread evenly and don't fall on aligned offsets */
+static uint32_t point_offset(uint32_t p, uint32_t points)
+{
+	return p * N_SAMPLES / points;
+}
+
+static float point_volume(uint32_t p)
+{
+	return 0.25f + (p % 4) * 0.25f;
+}
+
+static void run_split(struct channelmix *mix, float **out, const float **in, uint32_t points)
+{
+	uint32_t p, i, offset, chunk;
+	const float *s[N_CHANNELS];
+	float *d[N_CHANNELS];
+
+	for (p = 0; p < points; p++) {
+		offset = point_offset(p, points);
+		chunk = point_offset(p + 1, points) - offset;
+
+		channelmix_set_volume(mix, point_volume(p), false, 0, NULL);
+		for (i = 0; i < N_CHANNELS; i++) {
+			s[i] = in[i] + offset;
+			d[i] = out[i] + offset;
+		}
+		channelmix_process(mix, (void**)d, (const void**)s, chunk);
+	}
+}
+
+static void run_ramp(struct channelmix *mix, struct volume *vol, float **out,
+		const float **in, uint32_t points)
+{
+	uint32_t p, i, o, e;
+	float gain[MAX_POINTS][N_CHANNELS];
+	bool same;
+
+	for (p = 0; p < points; p++) {
+		channelmix_set_volume(mix, point_volume(p), false, 0, NULL);
+		for (i = 0; i < N_CHANNELS; i++)
+			gain[p][i] = mix->matrix[i][i];
+	}
+	for (i = 0; i < N_CHANNELS; i++) {
+		same = i > 0;
+		for (p = 0; same && p < points; p++)
+			same = gain[p][i] == gain[p][i-1];
+		for (p = 0; !same && p < points; p++) {
+			o = point_offset(p, points);
+			e = point_offset(p + 1, points);
+			volume_ramp_fill(&ramp[o], gain[p][i], e - o);
+		}
+		volume_process_ramp(vol, out[i], in[i], ramp, N_SAMPLES);
+	}
+}
+
+static uint64_t get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+int main(int argc, char *argv[])
+{
+	struct channelmix mix;
+	struct volume vol;
+	float *out[2][N_CHANNELS];
+	const float *in[N_CHANNELS];
+	uint32_t i, j, n;
+	uint64_t t1, t2, t3;
+
+	cpu_flags = get_cpu_flags();
+	printf("got get CPU flags %d\n", cpu_flags);
+
+	spa_zero(mix);
+	mix.src_chan = mix.dst_chan = N_CHANNELS;
+	mix.src_mask = mix.dst_mask = (1ULL << SPA_AUDIO_CHANNEL_FL) | (1ULL << SPA_AUDIO_CHANNEL_FR);
+	mix.cpu_flags = cpu_flags;
+	mix.log = &logger.log;
+	spa_assert_se(channelmix_init(&mix) == 0);
+
+	spa_zero(vol);
+	vol.cpu_flags = cpu_flags;
+	vol.log = &logger.log;
+	spa_assert_se(volume_init(&vol) == 0);
+
+	for (i = 0; i < N_CHANNELS; i++) {
+		for (n = 0; n < N_SAMPLES; n++)
+			samp_in[i][n] = sinf(n * 0.01f * (i + 1));
+		in[i] = samp_in[i];
+		out[0][i] = samp_out[0][i];
+		out[1][i] = samp_out[1][i];
+	}
+
+	fprintf(stderr, "%s %s, %d samples, %d channels, ramp segment %d\n",
+			mix.func_name, vol.func_name, N_SAMPLES, N_CHANNELS,
+			vol.ramp_segment);
+
+	for (i = 0; i < SPA_N_ELEMENTS(n_points); i++) {
+		t1 = get_nsec();
+		for (j = 0; j < MAX_COUNT; j++)
+			run_split(&mix, out[0], in, n_points[i]);
+		t2 = get_nsec();
+		for (j = 0; j < MAX_COUNT; j++)
+			run_ramp(&mix, &vol, out[1], in, n_points[i]);
+		t3 = get_nsec();
+
+		for (j = 0; j < N_CHANNELS; j++)
+			for (n = 0; n < N_SAMPLES; n++)
+				spa_assert_se(fabsf(out[0][j][n] - out[1][j][n]) < 0.000001f);
+
+		fprintf(stderr, "points %2d: split %8.1f ns ramp %8.1f ns\n", n_points[i],
+				(double)(t2 - t1) / MAX_COUNT, (double)(t3 - t2) / MAX_COUNT);
+	}
+	return 0;
+}
@@ -0,0 +1,132 @@
+/* Spa
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <math.h>
+
+#include <immintrin.h>
+
+#include "peaks-ops.h"
+
+static inline float hmax_ps(__m256 val)
+{
+	__m128 t = _mm_max_ps(_mm256_castps256_ps128(val), _mm256_extractf128_ps(val, 1));
+	t = _mm_max_ps(t, _mm_movehl_ps(t, t));
+	t = _mm_max_ss(t, _mm_shuffle_ps(t, t, 0x55));
+	return _mm_cvtss_f32(t);
+}
+
+static inline float hsum_ps(__m256 val)
+{
+	__m128 t = _mm_add_ps(_mm256_castps256_ps128(val), _mm256_extractf128_ps(val, 1));
+	t = _mm_add_ps(t, _mm_movehl_ps(t, t));
+	t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 0x55));
+	return _mm_cvtss_f32(t);
+}
+
+void peaks_level_avx(struct peaks *peaks, struct peaks_level *level,
+		const float * SPA_RESTRICT src, uint32_t n_samples)
+{
+	float work[PEAKS_LEVEL_TAPS + 256];
+	uint32_t n, k, p, chunk;
+	__m256 c[3][PEAKS_LEVEL_TAPS], in, in2, v0, v1, v2, u0, u1, u2;
+	__m256 pk = _mm256_set1_ps(level->peak);
+	__m256 tp = _mm256_set1_ps(level->true_peak);
+	__m256 en = _mm256_setzero_ps();
+	const __m256 mask = _mm256_set1_ps(-0.0f);
+	float peak, true_peak, energy = level->energy;
+
+	for (p = 0; p < 3; p++)
+		for (k = 0; k < PEAKS_LEVEL_TAPS; k++)
+			c[p][k] = _mm256_set1_ps(peaks_level_coefs[p][k]);
+
+	memcpy(work, level->hist, sizeof(level->hist));
+
+	while (n_samples > 0) {
+		chunk = SPA_MIN(n_samples, SPA_N_ELEMENTS(work) - PEAKS_LEVEL_TAPS);
+		memcpy(&work[PEAKS_LEVEL_TAPS], src, chunk * sizeof(float));
+
+		/* two vectors at a time to have enough independent additions */
+		for (n = 0; n + 15 < chunk; n += 16) {
+			const float *w = &work[PEAKS_LEVEL_TAPS + n];
+
+			in = _mm256_loadu_ps(w);
+			in2 = _mm256_loadu_ps(w + 8);
+			pk = _mm256_max_ps(pk, _mm256_andnot_ps(mask, in));
+			pk = _mm256_max_ps(pk, _mm256_andnot_ps(mask, in2));
+			en = _mm256_fmadd_ps(in, in, en);
+			en = _mm256_fmadd_ps(in2, in2, en);
+
+			v0 = _mm256_mul_ps(in, c[0][0]);
+			v1 = _mm256_mul_ps(in, c[1][0]);
+			v2 = _mm256_mul_ps(in, c[2][0]);
+			u0 = _mm256_mul_ps(in2, c[0][0]);
+			u1 = _mm256_mul_ps(in2, c[1][0]);
+			u2 = _mm256_mul_ps(in2, c[2][0]);
+			for (k = 1; k < PEAKS_LEVEL_TAPS; k++) {
+				in = _mm256_loadu_ps(w - k);
+				in2 = _mm256_loadu_ps(w + 8 - k);
+				v0 = _mm256_fmadd_ps(in, c[0][k], v0);
+				v1 = _mm256_fmadd_ps(in, c[1][k], v1);
+				v2 = _mm256_fmadd_ps(in, c[2][k], v2);
+				u0 = _mm256_fmadd_ps(in2, c[0][k], u0);
+				u1 = _mm256_fmadd_ps(in2, c[1][k], u1);
+				u2 = _mm256_fmadd_ps(in2, c[2][k], u2);
+			}
+			v0 = _mm256_max_ps(_mm256_andnot_ps(mask, v0), _mm256_andnot_ps(mask, u0));
+			v1 = _mm256_max_ps(_mm256_andnot_ps(mask, v1), _mm256_andnot_ps(mask, u1));
+			v2 = _mm256_max_ps(_mm256_andnot_ps(mask, v2), _mm256_andnot_ps(mask, u2));
+			tp = _mm256_max_ps(tp, _mm256_max_ps(v0, _mm256_max_ps(v1, v2)));
+		}
+		peak = hmax_ps(pk);
+		true_peak = hmax_ps(tp);
+		for (; n < chunk; n++) {
+			const float *w = &work[PEAKS_LEVEL_TAPS + n];
+
+			peak = SPA_MAX(peak, fabsf(w[0]));
+			energy += w[0] * w[0];
+
+			for (p = 0; p < 3; p++) {
+				float v = 0.0f;
+				for (k = 0; k < PEAKS_LEVEL_TAPS; k++)
+					v += peaks_level_coefs[p][k] * w[-(int)k];
+				true_peak = SPA_MAX(true_peak, fabsf(v));
+			}
+		}
+		pk = _mm256_set1_ps(peak);
+		tp = _mm256_set1_ps(true_peak);
+
+		memmove(work, &work[chunk], sizeof(level->hist));
+		src += chunk;
+		n_samples -= chunk;
+	}
+	memcpy(level->hist, work, sizeof(level->hist));
+
+	peak = hmax_ps(pk);
+	true_peak = hmax_ps(tp);
+
+	level->peak = peak;
+	level->true_peak = SPA_MAX(true_peak, peak);
+	level->energy = energy + hsum_ps(en);
+}
@@ -22,10 +22,21 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include <math.h>
 
 #include "peaks-ops.h"
 
+/* Kaiser windowed sinc, beta 8, 48 taps */
+const float peaks_level_coefs[3][PEAKS_LEVEL_TAPS] = {
+	{ -0.00025623f, 0.00273089f, -0.01180758f, 0.03574196f, -0.09294754f, 0.28300187f,
+	   0.89447250f, -0.15281944f, 0.05803402f, -0.02117562f, 0.00604100f, -0.00101584f },
+	{ -0.00077610f, 0.00585225f, -0.02256329f, 0.06462777f, -0.16736728f, 0.62022665f,
+	   0.62022665f, -0.16736728f, 0.06462777f, -0.02256329f, 0.00585225f, -0.00077610f },
+	{ -0.00101584f, 0.00604100f, -0.02117562f, 0.05803402f, -0.15281944f, 0.89447250f,
+	   0.28300187f, -0.09294754f, 0.03574196f, -0.01180758f, 0.00273089f, -0.00025623f },
+};
+
 void peaks_min_max_c(struct peaks *peaks, const float * SPA_RESTRICT src,
 		uint32_t n_samples, float *min, float *max)
 {
@@ -48,3 +59,42 @@ float peaks_abs_max_c(struct peaks *peaks, const float * SPA_RESTRICT src,
 		max = fmaxf(fabsf(src[n]), max);
 	return max;
 }
+
+void peaks_level_c(struct peaks *peaks, struct peaks_level *level,
+		const float * SPA_RESTRICT src, uint32_t n_samples)
+{
+	float work[PEAKS_LEVEL_TAPS + 256];
+	float peak = level->peak, true_peak = level->true_peak, energy = level->energy;
+	uint32_t n, k, p, chunk;
+
+	/* the history and the new samples are put after each other so that the
+	 * filter can simply look back */
+	memcpy(work, level->hist, sizeof(level->hist));
+
+	while (n_samples > 0) {
+		chunk = SPA_MIN(n_samples, SPA_N_ELEMENTS(work) - PEAKS_LEVEL_TAPS);
+		memcpy(&work[PEAKS_LEVEL_TAPS], src, chunk * sizeof(float));
+
+		for (n = 0; n < chunk; n++) {
+			const float *w = &work[PEAKS_LEVEL_TAPS + n];
+
+			peak = fmaxf(peak, fabsf(w[0]));
+			energy += w[0] * w[0];
+
+			for (p = 0; p < 3; p++) {
+				float v = 0.0f;
+				for (k = 0; k < PEAKS_LEVEL_TAPS; k++)
+					v += peaks_level_coefs[p][k] * w[-(int)k];
+				true_peak = fmaxf(true_peak, fabsf(v));
+			}
+		}
+		memmove(work, &work[chunk], sizeof(level->hist));
+		src += chunk;
+		n_samples -= chunk;
+	}
+	memcpy(level->hist, work, sizeof(level->hist));
+
+	level->peak = peak;
+	level->true_peak = fmaxf(true_peak, peak);
+	level->energy = energy;
+}
@@ -22,6 +22,7 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include <math.h>
 
 #include <xmmintrin.h>
@@ -120,3 +121,89 @@ float peaks_abs_max_sse(struct peaks *peaks, const float * SPA_RESTRICT src,
 	}
 	return hmax_ps(ma);
 }
+
+void peaks_level_sse(struct peaks *peaks, struct peaks_level *level,
+		const float * SPA_RESTRICT src, uint32_t n_samples)
+{
+	float work[PEAKS_LEVEL_TAPS + 256];
+	uint32_t n, k, p, chunk;
+	__m128 c[3][PEAKS_LEVEL_TAPS], in, in2, v0, v1, v2, u0, u1, u2;
+	__m128 pk = _mm_set1_ps(level->peak);
+	__m128 tp = _mm_set1_ps(level->true_peak);
+	__m128 en = _mm_setzero_ps();
+	const __m128 mask = _mm_set1_ps(-0.0f);
+	float peak, true_peak, energy = level->energy;
+
+	for (p = 0; p < 3; p++)
+		for (k = 0; k < PEAKS_LEVEL_TAPS; k++)
+			c[p][k] = _mm_set1_ps(peaks_level_coefs[p][k]);
+
+	memcpy(work, level->hist, sizeof(level->hist));
+
+	while (n_samples > 0) {
+		chunk = SPA_MIN(n_samples, SPA_N_ELEMENTS(work) - PEAKS_LEVEL_TAPS);
+		memcpy(&work[PEAKS_LEVEL_TAPS], src, chunk * sizeof(float));
+
+		/* two vectors at a time to have enough independent additions */
+		for (n = 0; n + 7 < chunk; n += 8) {
+			const float *w = &work[PEAKS_LEVEL_TAPS + n];
+
+			in = _mm_loadu_ps(w);
+			in2 = _mm_loadu_ps(w + 4);
+			pk = _mm_max_ps(pk, _mm_andnot_ps(mask, in));
+			pk = _mm_max_ps(pk, _mm_andnot_ps(mask, in2));
+			en = _mm_add_ps(en, _mm_mul_ps(in, in));
+			en = _mm_add_ps(en, _mm_mul_ps(in2, in2));
+
+			v0 = _mm_mul_ps(in, c[0][0]);
+			v1 = _mm_mul_ps(in, c[1][0]);
+			v2 = _mm_mul_ps(in, c[2][0]);
+			u0 = _mm_mul_ps(in2, c[0][0]);
+			u1 = _mm_mul_ps(in2, c[1][0]);
+			u2 = _mm_mul_ps(in2, c[2][0]);
+			for (k = 1; k < PEAKS_LEVEL_TAPS; k++) {
+				in = _mm_loadu_ps(w - k);
+				in2 = _mm_loadu_ps(w + 4 - k);
+				v0 = _mm_add_ps(v0, _mm_mul_ps(in, c[0][k]));
+				v1 = _mm_add_ps(v1, _mm_mul_ps(in, c[1][k]));
+				v2 = _mm_add_ps(v2, _mm_mul_ps(in, c[2][k]));
+				u0 = _mm_add_ps(u0, _mm_mul_ps(in2, c[0][k]));
+				u1 = _mm_add_ps(u1, _mm_mul_ps(in2, c[1][k]));
+				u2 = _mm_add_ps(u2, _mm_mul_ps(in2, c[2][k]));
+			}
+			v0 = _mm_max_ps(_mm_andnot_ps(mask, v0), _mm_andnot_ps(mask, u0));
+			v1 = _mm_max_ps(_mm_andnot_ps(mask, v1), _mm_andnot_ps(mask, u1));
+			v2 = _mm_max_ps(_mm_andnot_ps(mask, v2), _mm_andnot_ps(mask, u2));
+			tp = _mm_max_ps(tp, _mm_max_ps(v0, _mm_max_ps(v1, v2)));
+		}
+		for (; n < chunk; n++) {
+			const float *w = &work[PEAKS_LEVEL_TAPS + n];
+
+			in = _mm_load_ss(w);
+			pk = _mm_max_ss(pk, _mm_andnot_ps(mask, in));
+			en = _mm_add_ss(en, _mm_mul_ss(in, in));
+
+			for (p = 0; p < 3; p++) {
+				v0 = _mm_mul_ss(in, c[p][0]);
+				for (k = 1; k < PEAKS_LEVEL_TAPS; k++)
+					v0 = _mm_add_ss(v0, _mm_mul_ss(_mm_load_ss(w - k), c[p][k]));
+				tp = _mm_max_ss(tp, _mm_andnot_ps(mask, v0));
+			}
+		}
+		memmove(work, &work[chunk], sizeof(level->hist));
+		src += chunk;
+		n_samples -= chunk;
+	}
+	memcpy(level->hist, work, sizeof(level->hist));
+
+	en = _mm_add_ps(en, _mm_movehl_ps(en, en));
+	en = _mm_add_ss(en, _mm_shuffle_ps(en, en, 0x55));
+	energy += _mm_cvtss_f32(en);
+
+	peak = hmax_ps(pk);
+	true_peak = hmax_ps(tp);
+
+	level->peak = peak;
+	level->true_peak = SPA_MAX(true_peak, peak);
+	level->energy = energy;
+}
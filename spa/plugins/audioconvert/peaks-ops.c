@@ -37,21 +37,28 @@ typedef void (*peaks_min_max_func_t) (struct peaks *peaks, const float * SPA_RES
 		uint32_t n_samples, float *min, float *max);
 typedef float (*peaks_abs_max_func_t) (struct peaks *peaks, const float * SPA_RESTRICT src,
 			uint32_t n_samples, float max);
+typedef void (*peaks_level_func_t) (struct peaks *peaks, struct peaks_level *level,
+			const float * SPA_RESTRICT src, uint32_t n_samples);
 
-#define MAKE(min_max,abs_max,...) \
-	{ min_max, abs_max, #min_max , __VA_ARGS__ }
+#define MAKE(min_max,abs_max,level,...) \
+	{ min_max, abs_max, level, #min_max , __VA_ARGS__ }
 
 static const struct peaks_info {
 	peaks_min_max_func_t min_max;
 	peaks_abs_max_func_t abs_max;
+	peaks_level_func_t level;
 	const char *name;
 	uint32_t cpu_flags;
 } peaks_table[] =
 {
+#if defined (HAVE_AVX) && defined (HAVE_FMA) && defined (HAVE_SSE)
+	MAKE(peaks_min_max_sse, peaks_abs_max_sse, peaks_level_avx,
+			SPA_CPU_FLAG_AVX | SPA_CPU_FLAG_FMA3),
+#endif
 #if defined (HAVE_SSE)
-	MAKE(peaks_min_max_sse, peaks_abs_max_sse, SPA_CPU_FLAG_SSE),
+	MAKE(peaks_min_max_sse, peaks_abs_max_sse, peaks_level_sse, SPA_CPU_FLAG_SSE),
 #endif
-	MAKE(peaks_min_max_c, peaks_abs_max_c),
+	MAKE(peaks_min_max_c, peaks_abs_max_c, peaks_level_c),
 };
 #undef MAKE
 
@@ -70,6 +77,7 @@ static void impl_peaks_free(struct peaks *peaks)
 {
 	peaks->min_max = NULL;
 	peaks->abs_max = NULL;
+	peaks->level = NULL;
 }
 
 int peaks_init(struct peaks *peaks)
@@ -85,5 +93,6 @@ int peaks_init(struct peaks *peaks)
 	peaks->free = impl_peaks_free;
 	peaks->min_max = info->min_max;
 	peaks->abs_max = info->abs_max;
+	peaks->level = info->level;
 	return 0;
 }
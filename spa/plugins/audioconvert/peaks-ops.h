@@ -27,6 +27,19 @@
 
 #include <spa/utils/defs.h>
 
+#define PEAKS_LEVEL_TAPS	12
+
+/** level of a channel, accumulated over the processed samples */
+struct peaks_level {
+	float peak;			/**< max absolute sample value */
+	float true_peak;		/**< max absolute value of the 4x oversampled signal */
+	float energy;			/**< sum of the squared samples */
+	float hist[PEAKS_LEVEL_TAPS];	/**< last samples, for the oversampling filter */
+};
+
+/** polyphase filter for the 3 interpolated phases of the 4x oversampling */
+extern const float peaks_level_coefs[3][PEAKS_LEVEL_TAPS];
+
 struct peaks {
 	uint32_t cpu_flags;
 	const char *func_name;
@@ -39,6 +52,8 @@ struct peaks {
 		uint32_t n_samples, float *min, float *max);
 	float (*abs_max) (struct peaks *peaks, const float * SPA_RESTRICT src,
 			uint32_t n_samples, float max);
+	void (*level) (struct peaks *peaks, struct peaks_level *level,
+			const float * SPA_RESTRICT src, uint32_t n_samples);
 
 	void (*free) (struct peaks *peaks);
 };
@@ -47,6 +62,7 @@ int peaks_init(struct peaks *peaks);
 
 #define peaks_min_max(peaks,...)	(peaks)->min_max(peaks, __VA_ARGS__)
 #define peaks_abs_max(peaks,...)	(peaks)->abs_max(peaks, __VA_ARGS__)
+#define peaks_level(peaks,...)		(peaks)->level(peaks, __VA_ARGS__)
 #define peaks_free(peaks)		(peaks)->free(peaks)
 
 #define DEFINE_MIN_MAX_FUNCTION(arch)				\
@@ -59,14 +75,25 @@ float peaks_abs_max_##arch(struct peaks *peaks,			\
 		const float * SPA_RESTRICT src,			\
 		uint32_t n_samples, float max);
 
+#define DEFINE_LEVEL_FUNCTION(arch)				\
+void peaks_level_##arch(struct peaks *peaks,			\
+		struct peaks_level *level,			\
+		const float * SPA_RESTRICT src,			\
+		uint32_t n_samples);
+
 #define PEAKS_OPS_MAX_ALIGN	16
 
 DEFINE_MIN_MAX_FUNCTION(c);
 DEFINE_ABS_MAX_FUNCTION(c);
+DEFINE_LEVEL_FUNCTION(c);
 
 #if defined (HAVE_SSE)
 DEFINE_MIN_MAX_FUNCTION(sse);
 DEFINE_ABS_MAX_FUNCTION(sse);
+DEFINE_LEVEL_FUNCTION(sse);
+#endif
+#if defined (HAVE_AVX) && defined(HAVE_FMA)
+DEFINE_LEVEL_FUNCTION(avx);
 #endif
 
 #undef DEFINE_FUNCTION
@@ -36,6 +36,7 @@
 #include <spa/param/audio/format.h>
 #include <spa/param/audio/format-utils.h>
 #include <spa/node/node.h>
+#include <spa/node/io.h>
 #include <spa/debug/mem.h>
 #include <spa/support/log-impl.h>
 
@@ -284,6 +285,34 @@ static int test_passthrough_setup(struct context *ctx)
 }
 
 
+static int test_set_io(struct context *ctx)
+{
+	struct spa_io_position position;
+	struct spa_io_meter meter;
+	int res;
+
+	/* handled by the follower and the converter */
+	res = spa_node_set_io(ctx->adapter_node, SPA_IO_Position, &position, sizeof(position));
+	spa_assert_se(res == 0);
+
+	/* only the converter knows the meter */
+	res = spa_node_set_io(ctx->adapter_node, SPA_IO_Meter, &meter, sizeof(meter));
+	spa_assert_se(res == 0);
+	res = spa_node_set_io(ctx->adapter_node, SPA_IO_Meter, &meter, sizeof(meter) - 1);
+	spa_assert_se(res == -EINVAL);
+	res = spa_node_set_io(ctx->adapter_node, SPA_IO_Meter, NULL, 0);
+	spa_assert_se(res == 0);
+
+	/* nobody knows this one */
+	res = spa_node_set_io(ctx->adapter_node, SPA_IO_Memory, NULL, 0);
+	spa_assert_se(res == -ENOENT);
+
+	res = spa_node_set_io(ctx->adapter_node, SPA_IO_Position, NULL, 0);
+	spa_assert_se(res == 0);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct context ctx;
@@ -295,6 +324,7 @@ int main(int argc, char *argv[])
 	test_init_state(&ctx);
 	test_split_setup(&ctx);
 	test_passthrough_setup(&ctx);
+	test_set_io(&ctx);
 
 	clean_context(&ctx);
 
@@ -28,6 +28,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
 
 #include <spa/utils/names.h>
 #include <spa/utils/string.h>
@@ -35,8 +36,11 @@
 #include <spa/param/param.h>
 #include <spa/param/audio/format.h>
 #include <spa/param/audio/format-utils.h>
+#include <spa/param/props.h>
 #include <spa/node/node.h>
 #include <spa/node/io.h>
+#include <spa/control/control.h>
+#include <spa/pod/builder.h>
 #include <spa/debug/mem.h>
 #include <spa/support/log-impl.h>
 
@@ -1128,6 +1132,209 @@ static int test_convert_remap_conv(struct context *ctx)
 	return 0;
 }
 
+static int test_meter(struct context *ctx)
+{
+	struct spa_io_meter meter;
+	float peaks[SPA_IO_METER_MAX_CHANNELS], louder[24];
+	struct data conv_louder;
+	uint32_t i, j;
+	int res;
+
+	spa_zero(meter);
+	res = spa_node_set_io(ctx->convert_node, SPA_IO_Meter, &meter, sizeof(meter));
+	spa_assert_se(res == 0);
+
+	run_convert(ctx, &dsp_5p1, &conv_f32_48000_5p1);
+
+	spa_assert_se((meter.seq & 1) == 0);
+	spa_assert_se(meter.seq != 0);
+	spa_assert_se(meter.n_channels == 6);
+	spa_assert_se(meter.n_samples == 4);
+	for (i = 0; i < meter.n_channels; i++) {
+		float v = (i + 1) * 0.1f;
+		spa_assert_se(meter.channels[i].peak == v);
+		spa_assert_se(meter.channels[i].true_peak >= v);
+		spa_assert_se(fabs(meter.channels[i].energy - 4 * v * v) < 0.00001);
+		/* only the node writes the peaks */
+		meter.channels[i].peak = 10.0f;
+	}
+
+	/* louder rear channels, the peaks are kept until a reset */
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j < 4; j++)
+			louder[j * 6 + i] = ((const float *)dsp_5p1_from_6p1.data[i])[j];
+	}
+	conv_louder = conv_f32_48000_5p1;
+	conv_louder.data[0] = louder;
+	run_convert(ctx, &dsp_5p1_from_6p1, &conv_louder);
+	for (i = 0; i < meter.n_channels; i++)
+		peaks[i] = meter.channels[i].peak;
+	for (i = 0; i < 4; i++)
+		spa_assert_se(peaks[i] == (i + 1) * 0.1f);
+	spa_assert_se(peaks[4] == data_f32p_5_6p1[0]);
+	spa_assert_se(peaks[5] == data_f32p_6_6p1[0]);
+
+	/* a reset of values that were updated since is ignored */
+	meter.reset_seq = meter.seq - 2;
+	run_convert(ctx, &dsp_5p1, &conv_f32_48000_5p1);
+	for (i = 0; i < meter.n_channels; i++)
+		spa_assert_se(meter.channels[i].peak == peaks[i]);
+
+	meter.reset_seq = meter.seq;
+	run_convert(ctx, &dsp_5p1, &conv_f32_48000_5p1);
+	for (i = 0; i < meter.n_channels; i++)
+		spa_assert_se(meter.channels[i].peak == (i + 1) * 0.1f);
+
+	res = spa_node_set_io(ctx->convert_node, SPA_IO_Meter, NULL, 0);
+	spa_assert_se(res == 0);
+	return 0;
+}
+
+#define RAMP_SAMPLES	64
+#define RAMP_STEP	4
+
+static float ramp_volume(uint32_t offset)
+{
+	return 0.1f * (offset / RAMP_STEP % 8 + 1);
+}
+
+/* a volume control every few samples is applied as a gain ramp */
+static int test_volume_ramp(struct context *ctx)
+{
+	struct spa_audio_info_raw info = SPA_AUDIO_INFO_RAW_INIT(
+			.format = SPA_AUDIO_FORMAT_F32P,
+			.rate = 48000,
+			.channels = 2,
+			.position = { SPA_AUDIO_CHANNEL_FL, SPA_AUDIO_CHANNEL_FR });
+	static float in[2][RAMP_SAMPLES] SPA_ALIGNED(16);
+	static float out[2][RAMP_SAMPLES] SPA_ALIGNED(16);
+	static uint8_t ctrl[4096] SPA_ALIGNED(16);
+	struct spa_pod_builder b = { 0 };
+	struct spa_pod_frame f;
+	struct spa_pod *param, *format;
+	struct buffer in_buffers[3], out_buffer;
+	struct spa_buffer *buffers[1];
+	struct spa_io_buffers in_io[3], out_io;
+	struct spa_command cmd;
+	uint8_t buffer[1024];
+	uint32_t i, j;
+	int res;
+
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	format = spa_format_audio_raw_build(&b, SPA_PARAM_Format, &info);
+	param = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_ParamPortConfig, SPA_PARAM_PortConfig,
+		SPA_PARAM_PORT_CONFIG_direction,	SPA_POD_Id(SPA_DIRECTION_INPUT),
+		SPA_PARAM_PORT_CONFIG_mode,		SPA_POD_Id(SPA_PARAM_PORT_CONFIG_MODE_dsp),
+		SPA_PARAM_PORT_CONFIG_control,		SPA_POD_Bool(true),
+		SPA_PARAM_PORT_CONFIG_format,		SPA_POD_Pod(format));
+	res = spa_node_set_param(ctx->convert_node, SPA_PARAM_PortConfig, 0, param);
+	spa_assert_se(res == 0);
+
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	format = spa_format_audio_dsp_build(&b, SPA_PARAM_Format,
+			&SPA_AUDIO_INFO_DSP_INIT(.format = SPA_AUDIO_FORMAT_F32P));
+	for (i = 0; i < 2; i++) {
+		res = spa_node_port_set_param(ctx->convert_node, SPA_DIRECTION_INPUT, i,
+			SPA_PARAM_Format, 0, format);
+		spa_assert_se(res == 0);
+	}
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	format = spa_pod_builder_add_object(&b,
+		SPA_TYPE_OBJECT_Format, SPA_PARAM_Format,
+		SPA_FORMAT_mediaType,		SPA_POD_Id(SPA_MEDIA_TYPE_application),
+		SPA_FORMAT_mediaSubtype,	SPA_POD_Id(SPA_MEDIA_SUBTYPE_control));
+	res = spa_node_port_set_param(ctx->convert_node, SPA_DIRECTION_INPUT, 2,
+		SPA_PARAM_Format, 0, format);
+	spa_assert_se(res == 0);
+
+	setup_direction(ctx, SPA_DIRECTION_OUTPUT, SPA_PARAM_PORT_CONFIG_MODE_convert, &info);
+
+	cmd = SPA_NODE_COMMAND_INIT(SPA_NODE_COMMAND_Start);
+	res = spa_node_send_command(ctx->convert_node, &cmd);
+	spa_assert_se(res == 0);
+
+	spa_pod_builder_init(&b, ctrl, sizeof(ctrl));
+	spa_pod_builder_push_sequence(&b, &f, 0);
+	for (i = 0; i < RAMP_SAMPLES; i += RAMP_STEP) {
+		spa_pod_builder_control(&b, i, SPA_CONTROL_Properties);
+		spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_Props, 0,
+			SPA_PROP_volume,	SPA_POD_Float(ramp_volume(i)));
+	}
+	spa_pod_builder_pop(&b, &f);
+	spa_assert_se(b.state.offset <= sizeof(ctrl));
+
+	for (i = 0; i < 3; i++) {
+		struct buffer *bf = &in_buffers[i];
+		spa_zero(*bf);
+		bf->buffer.datas = bf->datas;
+		bf->buffer.n_datas = 1;
+		bf->datas[0].type = SPA_DATA_MemPtr;
+		bf->datas[0].fd = -1;
+		bf->datas[0].chunk = &bf->chunks[0];
+		if (i < 2) {
+			for (j = 0; j < RAMP_SAMPLES; j++)
+				in[i][j] = 0.5f / (i + 1);
+			bf->datas[0].data = in[i];
+			bf->datas[0].maxsize = sizeof(in[i]);
+			bf->datas[0].chunk->size = sizeof(in[i]);
+		} else {
+			bf->datas[0].data = ctrl;
+			bf->datas[0].maxsize = sizeof(ctrl);
+			bf->datas[0].chunk->size = b.state.offset;
+		}
+		buffers[0] = &bf->buffer;
+		res = spa_node_port_use_buffers(ctx->convert_node, SPA_DIRECTION_INPUT, i,
+				0, buffers, 1);
+		spa_assert_se(res == 0);
+
+		in_io[i].status = SPA_STATUS_HAVE_DATA;
+		in_io[i].buffer_id = 0;
+		res = spa_node_port_set_io(ctx->convert_node, SPA_DIRECTION_INPUT, i,
+				SPA_IO_Buffers, &in_io[i], sizeof(in_io[i]));
+		spa_assert_se(res == 0);
+	}
+
+	spa_zero(out_buffer);
+	out_buffer.buffer.datas = out_buffer.datas;
+	out_buffer.buffer.n_datas = 2;
+	for (j = 0; j < 2; j++) {
+		out_buffer.datas[j].type = SPA_DATA_MemPtr;
+		out_buffer.datas[j].fd = -1;
+		out_buffer.datas[j].maxsize = sizeof(out[j]);
+		out_buffer.datas[j].data = out[j];
+		out_buffer.datas[j].chunk = &out_buffer.chunks[j];
+	}
+	buffers[0] = &out_buffer.buffer;
+	res = spa_node_port_use_buffers(ctx->convert_node, SPA_DIRECTION_OUTPUT, 0,
+			0, buffers, 1);
+	spa_assert_se(res == 0);
+
+	out_io.status = SPA_STATUS_NEED_DATA;
+	out_io.buffer_id = -1;
+	res = spa_node_port_set_io(ctx->convert_node, SPA_DIRECTION_OUTPUT, 0,
+			SPA_IO_Buffers, &out_io, sizeof(out_io));
+	spa_assert_se(res == 0);
+
+	res = spa_node_process(ctx->convert_node);
+	spa_assert_se(res == (SPA_STATUS_NEED_DATA | SPA_STATUS_HAVE_DATA));
+
+	spa_assert_se(out_io.status == SPA_STATUS_HAVE_DATA);
+	spa_assert_se(in_io[2].status == SPA_STATUS_OK);
+	for (j = 0; j < 2; j++) {
+		spa_assert_se(out_buffer.datas[j].chunk->size == sizeof(out[j]));
+		for (i = 0; i < RAMP_SAMPLES; i++)
+			spa_assert_se(out[j][i] == in[j][i] * ramp_volume(i));
+	}
+
+	cmd = SPA_NODE_COMMAND_INIT(SPA_NODE_COMMAND_Suspend);
+	res = spa_node_send_command(ctx->convert_node, &cmd);
+	spa_assert_se(res == 0);
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	struct context ctx;
@@ -1151,6 +1358,8 @@ int main(int argc, char *argv[])
 
 	test_convert_remap_dsp(&ctx);
 	test_convert_remap_conv(&ctx);
+	test_meter(&ctx);
+	test_volume_ramp(&ctx);
 
 	clean_context(&ctx);
 
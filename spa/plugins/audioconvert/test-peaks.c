@@ -30,6 +30,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <time.h>
+#include <math.h>
 
 #include <spa/support/log-impl.h>
 #include <spa/debug/mem.h>
@@ -107,6 +108,73 @@ static void test_abs_max(void)
 	spa_assert(max == 0.8f);
 }
 
+static void check_level(const struct peaks_level *l1, const struct peaks_level *l2)
+{
+	spa_assert(l1->peak == l2->peak);
+	spa_assert(fabsf(l1->true_peak - l2->true_peak) < 1e-5f);
+	spa_assert(fabsf(l1->energy - l2->energy) < 1e-4f * l1->energy);
+	spa_assert(memcmp(l1->hist, l2->hist, sizeof(l1->hist)) == 0);
+}
+
+static void test_level_impl(void)
+{
+	struct peaks peaks;
+	unsigned int i;
+	float vals[1038];
+	struct peaks_level l[3];
+
+	for (i = 0; i < SPA_N_ELEMENTS(vals); i++)
+		vals[i] = (drand48() - 0.5f) * 2.5f;
+
+	spa_zero(l);
+	/* in two steps with an odd split to check the history */
+	peaks_level_c(&peaks, &l[0], &vals[1], 301);
+	peaks_level_c(&peaks, &l[0], &vals[302], SPA_N_ELEMENTS(vals) - 302);
+	printf("c level peak:%f true-peak:%f energy:%f\n", l[0].peak, l[0].true_peak, l[0].energy);
+
+#if defined(HAVE_SSE)
+	if (cpu_flags & SPA_CPU_FLAG_SSE) {
+		peaks_level_sse(&peaks, &l[1], &vals[1], 301);
+		peaks_level_sse(&peaks, &l[1], &vals[302], SPA_N_ELEMENTS(vals) - 302);
+		printf("sse level peak:%f true-peak:%f energy:%f\n", l[1].peak, l[1].true_peak, l[1].energy);
+		check_level(&l[0], &l[1]);
+	}
+#endif
+#if defined(HAVE_AVX) && defined(HAVE_FMA)
+	if (SPA_FLAG_IS_SET(cpu_flags, SPA_CPU_FLAG_AVX | SPA_CPU_FLAG_FMA3)) {
+		peaks_level_avx(&peaks, &l[2], &vals[1], 301);
+		peaks_level_avx(&peaks, &l[2], &vals[302], SPA_N_ELEMENTS(vals) - 302);
+		printf("avx level peak:%f true-peak:%f energy:%f\n", l[2].peak, l[2].true_peak, l[2].energy);
+		check_level(&l[0], &l[2]);
+	}
+#endif
+}
+
+static void test_level(void)
+{
+	struct peaks peaks;
+	struct peaks_level l;
+	float vals[4800];
+	unsigned int i;
+
+	spa_zero(peaks);
+	peaks.log = &logger.log;
+	peaks.cpu_flags = cpu_flags;
+	peaks_init(&peaks);
+
+	/* a full scale sine at fs/4 with a 45 degree phase offset never
+	 * hits the peak on a sample, the true peak should find it */
+	for (i = 0; i < SPA_N_ELEMENTS(vals); i++)
+		vals[i] = sinf(M_PI_2 * (i % 4) + M_PI_4);
+
+	spa_zero(l);
+	peaks_level(&peaks, &l, vals, SPA_N_ELEMENTS(vals));
+
+	spa_assert(fabsf(l.peak - M_SQRT1_2) < 1e-5f);
+	spa_assert(fabsf(l.true_peak - 1.0f) < 0.02f);
+	spa_assert(fabsf(sqrtf(l.energy / SPA_N_ELEMENTS(vals)) - M_SQRT1_2) < 1e-3f);
+}
+
 int main(int argc, char *argv[])
 {
 	struct timespec ts;
@@ -121,8 +189,11 @@ int main(int argc, char *argv[])
 
 	test_impl();
 
+	test_level_impl();
+
 	test_min_max();
 	test_abs_max();
+	test_level();
 
 	return 0;
 }
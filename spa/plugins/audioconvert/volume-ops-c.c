@@ -43,3 +43,16 @@ volume_f32_c(struct volume *vol, void * SPA_RESTRICT dst,
 			d[n] = s[n] * volume;
 	}
 }
+
+void
+volume_f32_ramp_c(struct volume *vol, void * SPA_RESTRICT dst,
+		const void * SPA_RESTRICT src, const float * SPA_RESTRICT volume,
+		uint32_t n_samples)
+{
+	uint32_t n;
+	float *d = (float*)dst;
+	const float *s = (const float*)src;
+
+	for (n = 0; n < n_samples; n++)
+		d[n] = s[n] * volume[n];
+}
@@ -64,3 +64,34 @@ volume_f32_sse(struct volume *vol, void * SPA_RESTRICT dst,
 			_mm_store_ss(&d[n], _mm_mul_ss(_mm_load_ss(&s[n]), vol));
 	}
 }
+
+void
+volume_f32_ramp_sse(struct volume *vol, void * SPA_RESTRICT dst,
+		const void * SPA_RESTRICT src, const float * SPA_RESTRICT volume,
+		uint32_t n_samples)
+{
+	uint32_t n, unrolled;
+	float *d = (float*)dst;
+	const float *s = (const float*)src;
+	__m128 t[4];
+
+	if (SPA_IS_ALIGNED(d, 16) &&
+	    SPA_IS_ALIGNED(s, 16) &&
+	    SPA_IS_ALIGNED(volume, 16))
+		unrolled = n_samples & ~15;
+	else
+		unrolled = 0;
+
+	for(n = 0; n < unrolled; n += 16) {
+		t[0] = _mm_mul_ps(_mm_load_ps(&s[n]), _mm_load_ps(&volume[n]));
+		t[1] = _mm_mul_ps(_mm_load_ps(&s[n+4]), _mm_load_ps(&volume[n+4]));
+		t[2] = _mm_mul_ps(_mm_load_ps(&s[n+8]), _mm_load_ps(&volume[n+8]));
+		t[3] = _mm_mul_ps(_mm_load_ps(&s[n+12]), _mm_load_ps(&volume[n+12]));
+		_mm_store_ps(&d[n], t[0]);
+		_mm_store_ps(&d[n+4], t[1]);
+		_mm_store_ps(&d[n+8], t[2]);
+		_mm_store_ps(&d[n+12], t[3]);
+	}
+	for(; n < n_samples; n++)
+		_mm_store_ss(&d[n], _mm_mul_ss(_mm_load_ss(&s[n]), _mm_load_ss(&volume[n])));
+}
@@ -35,20 +35,25 @@
 
 typedef void (*volume_func_t) (struct volume *vol, void * SPA_RESTRICT dst,
 			const void * SPA_RESTRICT src, float volume, uint32_t n_samples);
+typedef void (*volume_ramp_func_t) (struct volume *vol, void * SPA_RESTRICT dst,
+			const void * SPA_RESTRICT src, const float * SPA_RESTRICT volume,
+			uint32_t n_samples);
 
-#define MAKE(func,...) \
-	{ func, #func , __VA_ARGS__ }
+#define MAKE(func,ramp,segment,...) \
+	{ func, ramp, #func , segment, __VA_ARGS__ }
 
 static const struct volume_info {
 	volume_func_t process;
+	volume_ramp_func_t process_ramp;
 	const char *name;
+	uint32_t ramp_segment;
 	uint32_t cpu_flags;
 } volume_table[] =
 {
 #if defined (HAVE_SSE)
-	MAKE(volume_f32_sse, SPA_CPU_FLAG_SSE),
+	MAKE(volume_f32_sse, volume_f32_ramp_sse, 8, SPA_CPU_FLAG_SSE),
 #endif
-	MAKE(volume_f32_c),
+	MAKE(volume_f32_c, volume_f32_ramp_c, 6),
 };
 #undef MAKE
 
@@ -66,6 +71,7 @@ static const struct volume_info *find_volume_info(uint32_t cpu_flags)
 static void impl_volume_free(struct volume *vol)
 {
 	vol->process = NULL;
+	vol->process_ramp = NULL;
 }
 
 int volume_init(struct volume *vol)
@@ -78,7 +84,9 @@ int volume_init(struct volume *vol)
 
 	vol->cpu_flags = info->cpu_flags;
 	vol->func_name = info->name;
+	vol->ramp_segment = info->ramp_segment;
 	vol->free = impl_volume_free;
 	vol->process = info->process;
+	vol->process_ramp = info->process_ramp;
 	return 0;
 }
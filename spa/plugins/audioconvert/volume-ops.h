@@ -38,9 +38,15 @@ struct volume {
 	struct spa_log *log;
 
 	uint32_t flags;
+	/* process_ramp is cheaper than calling process for each step when the
+	 * steps are at most this many samples apart */
+	uint32_t ramp_segment;
 
 	void (*process) (struct volume *vol, void * SPA_RESTRICT dst,
 			const void * SPA_RESTRICT src, float volume, uint32_t n_samples);
+	void (*process_ramp) (struct volume *vol, void * SPA_RESTRICT dst,
+			const void * SPA_RESTRICT src, const float * SPA_RESTRICT volume,
+			uint32_t n_samples);
 	void (*free) (struct volume *vol);
 
 	void *data;
@@ -49,13 +55,31 @@ struct volume {
 int volume_init(struct volume *vol);
 
 #define volume_process(vol,...)		(vol)->process(vol, __VA_ARGS__)
+#define volume_process_ramp(vol,...)	(vol)->process_ramp(vol, __VA_ARGS__)
 #define volume_free(vol)		(vol)->free(vol)
 
+/* set n_samples of a ramp to volume, short ramps are filled directly and
+ * longer ones by doubling the copied block each time */
+static inline void volume_ramp_fill(float *ramp, float volume, uint32_t n_samples)
+{
+	uint32_t n, n_fill = SPA_MIN(n_samples, 16u);
+
+	for (n = 0; n < n_fill; n++)
+		ramp[n] = volume;
+	for (; n < n_samples; n *= 2)
+		memcpy(&ramp[n], ramp, SPA_MIN(n, n_samples - n) * sizeof(float));
+}
+
 #define DEFINE_FUNCTION(name,arch)			\
 void volume_##name##_##arch(struct volume *vol,		\
 		void * SPA_RESTRICT dst,		\
 		const void * SPA_RESTRICT src,		\
-		float volume, uint32_t n_samples);
+		float volume, uint32_t n_samples);	\
+void volume_##name##_ramp_##arch(struct volume *vol,	\
+		void * SPA_RESTRICT dst,		\
+		const void * SPA_RESTRICT src,		\
+		const float * SPA_RESTRICT volume,	\
+		uint32_t n_samples);
 
 #define VOLUME_OPS_MAX_ALIGN	16
 
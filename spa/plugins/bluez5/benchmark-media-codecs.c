@@ -0,0 +1,411 @@
+/* Spa
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <dlfcn.h>
+
+#include "config.h"
+
+#include <spa/support/plugin.h>
+#include <spa/support/plugin-loader.h>
+#include <spa/support/log-impl.h>
+#include <spa/utils/string.h>
+#include <spa/utils/result.h>
+
+#include "codec-loader.h"
+
+/* Encode and decode synthetic audio with all the media codecs that can be
+ * loaded and print the time needed per codec frame. */
+
+#define N_PACKETS	2000
+#define MTU		1024
+#define BUFFER_SIZE	(8192*8)
+#define MAX_PLUGINS	64
+
+static SPA_LOG_IMPL(default_log);
+
+struct data {
+	struct spa_plugin_loader loader;
+	struct spa_log *log;
+	const char *plugin_dir;
+	struct spa_support support[1];
+	uint32_t n_support;
+
+	struct {
+		struct spa_handle *handle;
+		void *hnd;
+	} plugins[MAX_PLUGINS];
+	uint32_t n_plugins;
+};
+
+static uint8_t pcm[BUFFER_SIZE];
+static uint8_t packet[BUFFER_SIZE];
+static uint8_t out[BUFFER_SIZE];
+
+static struct spa_handle *loader_load(void *object, const char *factory_name, const struct spa_dict *info)
+{
+	struct data *d = object;
+	const char *lib;
+	char path[PATH_MAX];
+	spa_handle_factory_enum_func_t enum_func;
+	const struct spa_handle_factory *factory;
+	struct spa_handle *handle;
+	uint32_t i;
+	void *hnd;
+
+	if (info == NULL || (lib = spa_dict_lookup(info, SPA_KEY_LIBRARY_NAME)) == NULL)
+		return NULL;
+	if (d->n_plugins >= MAX_PLUGINS) {
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.so", d->plugin_dir, lib);
+	if ((hnd = dlopen(path, RTLD_NOW)) == NULL)
+		return NULL;
+
+	if ((enum_func = dlsym(hnd, SPA_HANDLE_FACTORY_ENUM_FUNC_NAME)) == NULL)
+		goto error;
+
+	for (i = 0; enum_func(&factory, &i) > 0;) {
+		if (!spa_streq(factory->name, factory_name))
+			continue;
+
+		handle = calloc(1, spa_handle_factory_get_size(factory, NULL));
+		if (handle == NULL)
+			goto error;
+		if (spa_handle_factory_init(factory, handle, info,
+					d->support, d->n_support) < 0) {
+			free(handle);
+			goto error;
+		}
+		d->plugins[d->n_plugins].handle = handle;
+		d->plugins[d->n_plugins].hnd = hnd;
+		d->n_plugins++;
+		return handle;
+	}
+error:
+	dlclose(hnd);
+	return NULL;
+}
+
+static int loader_unload(void *object, struct spa_handle *handle)
+{
+	struct data *d = object;
+	uint32_t i;
+
+	for (i = 0; i < d->n_plugins; i++) {
+		if (d->plugins[i].handle != handle)
+			continue;
+
+		spa_handle_clear(handle);
+		free(handle);
+		dlclose(d->plugins[i].hnd);
+		d->plugins[i] = d->plugins[--d->n_plugins];
+		return 0;
+	}
+	return -ENOENT;
+}
+
+static const struct spa_plugin_loader_methods loader_methods = {
+	SPA_VERSION_PLUGIN_LOADER_METHODS,
+	.load = loader_load,
+	.unload = loader_unload,
+};
+
+static uint64_t get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+static uint32_t fill_pcm(const struct spa_audio_info *info)
+{
+	uint32_t i, n_samples, stride;
+
+	switch (info->info.raw.format) {
+	case SPA_AUDIO_FORMAT_S16:
+		stride = 2;
+		break;
+	case SPA_AUDIO_FORMAT_S24:
+		stride = 3;
+		break;
+	case SPA_AUDIO_FORMAT_S24_32:
+	case SPA_AUDIO_FORMAT_S32:
+	case SPA_AUDIO_FORMAT_F32:
+		stride = 4;
+		break;
+	default:
+		return 0;
+	}
+
+	/* a sine sweep with a little noise on all channels */
+	n_samples = sizeof(pcm) / stride;
+	for (i = 0; i < n_samples; i++) {
+		float v = 0.5f * sinf(i * (0.01f + i * 0.0000002f)) +
+			0.01f * (drand48() - 0.5f);
+		int32_t s = (int32_t)(v * 8388607.0f);
+		uint8_t *p = &pcm[i * stride];
+
+		switch (info->info.raw.format) {
+		case SPA_AUDIO_FORMAT_S16:
+			*(int16_t*)p = s >> 8;
+			break;
+		case SPA_AUDIO_FORMAT_S24:
+			p[0] = s;
+			p[1] = s >> 8;
+			p[2] = s >> 16;
+			break;
+		case SPA_AUDIO_FORMAT_S24_32:
+			*(int32_t*)p = s;
+			break;
+		case SPA_AUDIO_FORMAT_S32:
+			*(int32_t*)p = s * 256;
+			break;
+		case SPA_AUDIO_FORMAT_F32:
+			*(float*)p = v;
+			break;
+		default:
+			break;
+		}
+	}
+	return stride * info->info.raw.channels;
+}
+
+static int encode_packet(const struct media_codec *codec, void *data,
+		uint32_t block_size, uint32_t *offset, uint16_t seq, uint32_t *n_blocks)
+{
+	int res, need_flush = 0;
+	size_t used, out_size;
+
+	if ((res = codec->start_encode(data, packet, sizeof(packet), seq, 0)) < 0)
+		return res;
+	used = res;
+
+	while (!need_flush) {
+		if (*offset + block_size > sizeof(pcm))
+			*offset = 0;
+
+		res = codec->encode(data, pcm + *offset, block_size,
+				packet + used, sizeof(packet) - used,
+				&out_size, &need_flush);
+		if (res < 0)
+			return res;
+		if (res == 0 && out_size == 0)
+			return -EINVAL;
+
+		*offset += res;
+		*n_blocks += res / block_size;
+		used += out_size;
+
+		while (need_flush == NEED_FLUSH_FRAGMENT) {
+			/* we don't care about the packet itself, just continue
+			 * with the next fragment */
+			if ((res = codec->start_encode(data, packet, sizeof(packet), seq, 0)) < 0)
+				return res;
+			used = res;
+			need_flush = 0;
+			if ((res = codec->encode(data, NULL, 0, packet + used, sizeof(packet) - used,
+					&out_size, &need_flush)) < 0)
+				return res;
+			used += out_size;
+		}
+	}
+	return used;
+}
+
+static int decode_packet(const struct media_codec *codec, void *data, size_t size)
+{
+	const uint8_t *src = packet;
+	size_t written;
+	int res;
+
+	if ((res = codec->start_decode(data, src, size, NULL, NULL)) < 0)
+		return res;
+
+	src += res;
+	size -= res;
+
+	while (size > 0) {
+		if ((res = codec->decode(data, src, size, out, sizeof(out), &written)) <= 0)
+			return res;
+		src += res;
+		size -= res;
+	}
+	return 0;
+}
+
+static void *codec_new(const struct media_codec *codec, const uint8_t *config, size_t config_size,
+		const struct spa_audio_info *info, void **props)
+{
+	*props = codec->init_props ? codec->init_props(codec, 0, NULL) : NULL;
+	return codec->init(codec, 0, (void*)config, config_size, info, *props, MTU);
+}
+
+static void codec_free(const struct media_codec *codec, void *data, void *props)
+{
+	if (data)
+		codec->deinit(data);
+	if (props && codec->clear_props)
+		codec->clear_props(props);
+}
+
+static int bench_codec(const struct media_codec *codec)
+{
+	uint8_t caps[A2DP_MAX_CAPS_SIZE];
+	uint8_t config[A2DP_MAX_CAPS_SIZE];
+	struct media_codec_audio_info ainfo = { A2DP_CODEC_DEFAULT_RATE, A2DP_CODEC_DEFAULT_CHANNELS };
+	struct spa_audio_info info;
+	void *enc = NULL, *dec = NULL, *enc_props = NULL, *dec_props = NULL;
+	uint64_t t1, t2, t3;
+	uint32_t i, frame_size, block_size, offset = 0, n_blocks = 0, n_frames;
+	int res, caps_size, config_size, size;
+	double enc_us, dec_us = 0.0, block_us;
+
+	if (codec->fill_caps == NULL || codec->encode == NULL)
+		return 0;
+
+	if ((caps_size = codec->fill_caps(codec, 0, caps)) < 0)
+		return caps_size;
+	if ((config_size = codec->select_config(codec, 0, caps, caps_size,
+					&ainfo, NULL, config)) < 0)
+		return config_size;
+
+	spa_zero(info);
+	if ((res = codec->validate_config(codec, 0, config, config_size, &info)) < 0)
+		return res;
+
+	if ((frame_size = fill_pcm(&info)) == 0)
+		return -ENOTSUP;
+
+	if ((enc = codec_new(codec, config, config_size, &info, &enc_props)) == NULL) {
+		res = -errno;
+		goto done;
+	}
+	block_size = codec->get_block_size(enc);
+	if (block_size == 0 || block_size > sizeof(pcm)) {
+		res = -EINVAL;
+		goto done;
+	}
+
+	/* warm up */
+	for (i = 0; i < N_PACKETS / 10; i++) {
+		if ((res = encode_packet(codec, enc, block_size, &offset, i, &n_blocks)) < 0)
+			goto done;
+	}
+	n_blocks = 0;
+
+	t1 = get_time();
+	for (i = 0; i < N_PACKETS; i++) {
+		if ((res = encode_packet(codec, enc, block_size, &offset, i, &n_blocks)) < 0)
+			goto done;
+	}
+	t2 = get_time();
+
+	/* the codec only buffered the input */
+	if (n_blocks == 0) {
+		res = -ENODATA;
+		goto done;
+	}
+
+	n_frames = n_blocks * block_size / frame_size;
+	block_us = (double)block_size / frame_size * SPA_USEC_PER_SEC / info.info.raw.rate;
+	enc_us = (t2 - t1) / 1000.0 / n_blocks;
+
+	if (codec->start_decode && codec->decode &&
+	    (dec = codec_new(codec, config, config_size, &info, &dec_props)) != NULL) {
+		uint32_t packet_blocks = 0;
+
+		/* decode one packet over and over */
+		if ((size = encode_packet(codec, enc, block_size, &offset, 0, &packet_blocks)) > 0 &&
+		    packet_blocks > 0) {
+			t2 = get_time();
+			for (i = 0; i < N_PACKETS; i++) {
+				if (decode_packet(codec, dec, size) < 0)
+					break;
+			}
+			t3 = get_time();
+			if (i > 0)
+				dec_us = (t3 - t2) / 1000.0 / ((uint64_t)i * packet_blocks);
+		}
+	}
+
+	fprintf(stderr, "%-16s %6u Hz %u ch %5u frames/block: encode %8.2f us/block "
+			"(%6.1fx realtime)", codec->name, info.info.raw.rate,
+			info.info.raw.channels, block_size / frame_size,
+			enc_us, block_us / enc_us);
+	if (dec_us > 0.0)
+		fprintf(stderr, " decode %8.2f us/block (%6.1fx realtime)",
+				dec_us, block_us / dec_us);
+	fprintf(stderr, " %u frames\n", n_frames);
+	res = 0;
+
+done:
+	codec_free(codec, enc, enc_props);
+	codec_free(codec, dec, dec_props);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	struct data data;
+	const struct media_codec * const *codecs;
+	const char *filter = argc > 1 ? argv[1] : NULL;
+	int res;
+	size_t i;
+
+	spa_zero(data);
+	data.log = &default_log.log;
+	data.support[data.n_support++] = SPA_SUPPORT_INIT(SPA_TYPE_INTERFACE_Log, data.log);
+	data.loader.iface = SPA_INTERFACE_INIT(SPA_TYPE_INTERFACE_PluginLoader,
+			SPA_VERSION_PLUGIN_LOADER, &loader_methods, &data);
+
+	if ((data.plugin_dir = getenv("SPA_PLUGIN_DIR")) == NULL)
+		data.plugin_dir = PLUGINDIR;
+
+	srand48(0);
+
+	if ((codecs = load_media_codecs(&data.loader, data.log)) == NULL) {
+		fprintf(stderr, "can't load codecs from %s: %m\n", data.plugin_dir);
+		return 0;
+	}
+
+	for (i = 0; codecs[i]; i++) {
+		if (filter && !spa_streq(filter, codecs[i]->name))
+			continue;
+		if ((res = bench_codec(codecs[i])) < 0)
+			fprintf(stderr, "%-16s skipped: %s\n", codecs[i]->name,
+					spa_strerror(res));
+	}
+
+	free_media_codecs(codecs);
+	return 0;
+}
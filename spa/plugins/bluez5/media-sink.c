@@ -27,16 +27,19 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include <spa/support/plugin.h>
 #include <spa/support/loop.h>
 #include <spa/support/log.h>
 #include <spa/support/system.h>
+#include <spa/support/thread.h>
 #include <spa/utils/list.h>
 #include <spa/utils/keys.h>
 #include <spa/utils/names.h>
 #include <spa/utils/result.h>
 #include <spa/utils/string.h>
+#include <spa/utils/ringbuffer.h>
 #include <spa/monitor/device.h>
 
 #include <spa/node/node.h>
@@ -73,6 +76,36 @@ struct props {
 #define MAX_BUFFERS 32
 #define BUFFER_SIZE	(8192*8)
 
+/* size of the packet ring of the encode thread, must be a power of 2 */
+#define PACKET_RING_SIZE	(BUFFER_SIZE*4)
+
+struct packet_header {
+	uint32_t size;
+	uint32_t frames;
+};
+
+/* When enabled, encoding runs in a separate thread. The data thread copies
+ * the samples into pcm_ring and sends the encoded packets from packet_ring
+ * so that a slow codec can not make the graph miss its deadline. */
+struct encoder {
+	struct spa_thread *thread;
+	int pcm_fd;
+	int packet_fd;
+	struct spa_source packet_source;
+
+	struct spa_ringbuffer pcm_ring;
+	uint8_t *pcm;
+	uint32_t pcm_size;
+	struct spa_ringbuffer packet_ring;
+	uint8_t *packets;
+
+	/* shared between data and encode thread */
+	int running;
+	int stalled;
+	int bitpool;
+	int unsent;
+};
+
 struct buffer {
 	uint32_t id;
 #define BUFFER_FLAG_OUT	(1<<0)
@@ -116,6 +149,7 @@ struct impl {
 	struct spa_log *log;
 	struct spa_loop *data_loop;
 	struct spa_system *data_system;
+	struct spa_thread_utils *thread_utils;
 
 	struct spa_hook_list hooks;
 	struct spa_callbacks callbacks;
@@ -141,6 +175,7 @@ struct impl {
 	unsigned int flush_pending:1;
 
 	unsigned int is_duplex:1;
+	unsigned int use_encode_thread:1;
 
 	struct spa_source source;
 	int timerfd;
@@ -178,6 +213,8 @@ struct impl {
 	uint8_t tmp_buffer[BUFFER_SIZE];
 	uint32_t tmp_buffer_used;
 	uint32_t fd_buffer_size;
+
+	struct encoder encoder;
 };
 
 #define CHECK_PORT(this,d,p)	((d) == SPA_DIRECTION_INPUT && (p) == 0)
@@ -630,6 +667,336 @@ static uint32_t get_queued_frames(struct impl *this)
 	return bytes / port->frame_size;
 }
 
+static void encoder_wakeup(struct impl *this)
+{
+	spa_system_eventfd_write(this->data_system, this->encoder.pcm_fd, 1);
+}
+
+/* called from the data thread, copy all ready samples to the encoder */
+static void queue_data(struct impl *this)
+{
+	struct encoder *enc = &this->encoder;
+	struct port *port = &this->port;
+	uint32_t index, queued = 0;
+	int32_t filled;
+
+	filled = spa_ringbuffer_get_write_index(&enc->pcm_ring, &index);
+
+	while (!spa_list_is_empty(&port->ready)) {
+		struct buffer *b;
+		struct spa_data *d;
+		uint32_t offs, avail, n_bytes, l0;
+
+		b = spa_list_first(&port->ready, struct buffer, link);
+		d = b->buf->datas;
+
+		offs = (d[0].chunk->offset + port->ready_offset) % d[0].maxsize;
+		avail = d[0].chunk->size - port->ready_offset;
+
+		n_bytes = SPA_MIN(avail, enc->pcm_size - (uint32_t)filled);
+		n_bytes -= n_bytes % port->frame_size;
+		if (n_bytes < avail)
+			spa_log_debug(this->log, "%p: encoder overrun, dropping %u bytes",
+					this, avail - n_bytes);
+
+		l0 = SPA_MIN(n_bytes, d[0].maxsize - offs);
+		spa_ringbuffer_write_data(&enc->pcm_ring, enc->pcm, enc->pcm_size,
+				(index + queued) & (enc->pcm_size - 1),
+				SPA_PTROFF(d[0].data, offs, void), l0);
+		if (n_bytes > l0)
+			spa_ringbuffer_write_data(&enc->pcm_ring, enc->pcm, enc->pcm_size,
+					(index + queued + l0) & (enc->pcm_size - 1),
+					d[0].data, n_bytes - l0);
+		filled += n_bytes;
+		queued += n_bytes;
+
+		spa_list_remove(&b->link);
+		SPA_FLAG_SET(b->flags, BUFFER_FLAG_OUT);
+		spa_log_trace(this->log, "%p: reuse buffer %u", this, b->id);
+		this->port.io->buffer_id = b->id;
+
+		spa_node_call_reuse_buffer(&this->callbacks, 0, b->id);
+		port->ready_offset = 0;
+	}
+	if (queued > 0) {
+		spa_ringbuffer_write_update(&enc->pcm_ring, index + queued);
+		encoder_wakeup(this);
+	}
+}
+
+/* called from the encode thread, move the complete packet to the packet ring */
+static int push_packet(struct impl *this)
+{
+	struct encoder *enc = &this->encoder;
+	struct packet_header hdr;
+	uint32_t index;
+	int32_t filled;
+	int unsent;
+	bool fragment;
+
+	hdr.size = this->buffer_used;
+	hdr.frames = this->block_count * this->block_size / this->port.frame_size;
+
+	filled = spa_ringbuffer_get_write_index(&enc->packet_ring, &index);
+	if (filled + sizeof(hdr) + hdr.size > PACKET_RING_SIZE)
+		return -ENOSPC;
+
+	unsent = __atomic_load_n(&enc->unsent, __ATOMIC_RELAXED);
+	if (unsent >= 0)
+		this->codec->abr_process(this->codec_data, unsent);
+
+	spa_ringbuffer_write_data(&enc->packet_ring, enc->packets, PACKET_RING_SIZE,
+			index & (PACKET_RING_SIZE - 1), &hdr, sizeof(hdr));
+	spa_ringbuffer_write_data(&enc->packet_ring, enc->packets, PACKET_RING_SIZE,
+			(index + sizeof(hdr)) & (PACKET_RING_SIZE - 1),
+			this->buffer, hdr.size);
+	spa_ringbuffer_write_update(&enc->packet_ring, index + sizeof(hdr) + hdr.size);
+
+	fragment = this->need_flush == NEED_FLUSH_FRAGMENT;
+	reset_buffer(this);
+	if (fragment && encode_fragment(this) < 0)
+		reset_buffer(this);
+
+	return 0;
+}
+
+static void encode_queued(struct impl *this)
+{
+	struct encoder *enc = &this->encoder;
+	uint32_t index, offs;
+	int32_t avail;
+	int res, bitpool;
+	bool pushed = false;
+
+	bitpool = __atomic_exchange_n(&enc->bitpool, 0, __ATOMIC_RELAXED);
+	if (bitpool < 0) {
+		res = this->codec->reduce_bitpool(this->codec_data);
+		spa_log_debug(this->log, "%p: reduce bitpool: %i", this, res);
+	} else if (bitpool > 0) {
+		res = this->codec->increase_bitpool(this->codec_data);
+		spa_log_debug(this->log, "%p: increase bitpool: %i", this, res);
+	}
+
+	avail = spa_ringbuffer_get_read_index(&enc->pcm_ring, &index);
+
+	while (true) {
+		if (this->need_flush) {
+			if (push_packet(this) < 0) {
+				/* the data thread wakes us up when there is space again */
+				__atomic_store_n(&enc->stalled, 1, __ATOMIC_SEQ_CST);
+				if (push_packet(this) < 0)
+					break;
+				__atomic_store_n(&enc->stalled, 0, __ATOMIC_SEQ_CST);
+			}
+			pushed = true;
+			continue;
+		}
+		if (avail <= 0)
+			break;
+
+		offs = index & (enc->pcm_size - 1);
+		res = encode_buffer(this, enc->pcm + offs,
+				SPA_MIN((uint32_t)avail, enc->pcm_size - offs));
+		if (res <= 0) {
+			spa_log_warn(this->log, "%p: encode error %s, dropping %d bytes",
+					this, spa_strerror(res), avail);
+			res = avail;
+			reset_buffer(this);
+		}
+		index += res;
+		avail -= res;
+		spa_ringbuffer_read_update(&enc->pcm_ring, index);
+	}
+	if (pushed)
+		spa_system_eventfd_write(this->data_system, enc->packet_fd, 1);
+}
+
+static void *encoder_thread(void *data)
+{
+	struct impl *this = data;
+	struct encoder *enc = &this->encoder;
+	uint64_t count;
+	int res;
+
+	while (__atomic_load_n(&enc->running, __ATOMIC_ACQUIRE)) {
+		if ((res = spa_system_eventfd_read(this->data_system, enc->pcm_fd, &count)) < 0) {
+			if (res == -EINTR)
+				continue;
+			spa_log_error(this->log, "%p: encoder read error: %s",
+					this, spa_strerror(res));
+			break;
+		}
+		encode_queued(this);
+	}
+	return NULL;
+}
+
+/* called from the data thread, send the encoded packets at the right pace */
+static int flush_packets(struct impl *this, uint64_t now_time)
+{
+	struct encoder *enc = &this->encoder;
+	struct port *port = &this->port;
+	struct packet_header hdr;
+	struct iovec iov[2];
+	struct msghdr msg;
+	uint32_t index, offs;
+	int32_t avail;
+	int written, unused_buffer;
+
+	queue_data(this);
+
+	while (!this->flush_pending) {
+		avail = spa_ringbuffer_get_read_index(&enc->packet_ring, &index);
+		if (avail < (int32_t)sizeof(hdr))
+			break;
+
+		spa_ringbuffer_read_data(&enc->packet_ring, enc->packets, PACKET_RING_SIZE,
+				index & (PACKET_RING_SIZE - 1), &hdr, sizeof(hdr));
+
+		offs = (index + sizeof(hdr)) & (PACKET_RING_SIZE - 1);
+		iov[0].iov_base = enc->packets + offs;
+		iov[0].iov_len = SPA_MIN(hdr.size, PACKET_RING_SIZE - offs);
+		iov[1].iov_base = enc->packets;
+		iov[1].iov_len = hdr.size - iov[0].iov_len;
+
+		spa_zero(msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov[1].iov_len > 0 ? 2 : 1;
+
+		unused_buffer = get_transport_unused_size(this);
+		if (unused_buffer >= 0)
+			__atomic_store_n(&enc->unsent, this->fd_buffer_size - unused_buffer,
+					__ATOMIC_RELAXED);
+
+		written = sendmsg(this->flush_source.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written < 0) {
+			written = -errno;
+			/* drop the packet, there will be a glitch in any case */
+			spa_log_trace(this->log, "%p: fail flush: %s", this, spa_strerror(written));
+			if (written == -EAGAIN &&
+			    now_time - this->last_error > SPA_NSEC_PER_SEC / 2) {
+				__atomic_store_n(&enc->bitpool, -1, __ATOMIC_RELAXED);
+				this->last_error = now_time;
+			}
+		} else if (now_time - this->last_error > SPA_NSEC_PER_SEC) {
+			if (unused_buffer == (int)this->fd_buffer_size)
+				__atomic_store_n(&enc->bitpool, 1, __ATOMIC_RELAXED);
+			this->last_error = now_time;
+		}
+
+		spa_ringbuffer_read_update(&enc->packet_ring, index + sizeof(hdr) + hdr.size);
+
+		if (__atomic_exchange_n(&enc->stalled, 0, __ATOMIC_SEQ_CST))
+			encoder_wakeup(this);
+
+		if (this->next_flush_time < now_time)
+			this->next_flush_time = now_time;
+		this->next_flush_time += (uint64_t)hdr.frames * SPA_NSEC_PER_SEC
+			/ port->current_format.info.raw.rate;
+
+		spa_log_trace(this->log, "%p: sent %u bytes, flush at:%"PRIu64,
+				this, hdr.size, this->next_flush_time);
+
+		enable_flush_timer(this, true);
+	}
+	return 0;
+}
+
+static void media_on_packet(struct spa_source *source)
+{
+	struct impl *this = source->data;
+	uint64_t count;
+
+	if (spa_system_eventfd_read(this->data_system, this->encoder.packet_fd, &count) < 0)
+		return;
+
+	if (this->transport == NULL || !this->flush_source.loop)
+		return;
+
+	flush_packets(this, this->current_time);
+}
+
+static void encoder_stop(struct impl *this)
+{
+	struct encoder *enc = &this->encoder;
+
+	if (enc->running) {
+		__atomic_store_n(&enc->running, 0, __ATOMIC_RELEASE);
+		encoder_wakeup(this);
+		spa_thread_utils_join(this->thread_utils, enc->thread, NULL);
+	}
+	if (enc->pcm_fd >= 0)
+		spa_system_close(this->data_system, enc->pcm_fd);
+	if (enc->packet_fd >= 0)
+		spa_system_close(this->data_system, enc->packet_fd);
+	enc->pcm_fd = enc->packet_fd = -1;
+	free(enc->pcm);
+	free(enc->packets);
+	enc->pcm = enc->packets = NULL;
+}
+
+static int encoder_start(struct impl *this)
+{
+	static const struct spa_dict_item thread_items[] = {
+		{ SPA_KEY_THREAD_NAME, "bluez5-encoder" },
+	};
+	struct encoder *enc = &this->encoder;
+	uint32_t size = this->quantum_limit * this->port.frame_size * 4;
+	int res;
+
+	for (enc->pcm_size = BUFFER_SIZE; enc->pcm_size < size; enc->pcm_size <<= 1);
+
+	enc->pcm = malloc(enc->pcm_size);
+	enc->packets = malloc(PACKET_RING_SIZE);
+	if (enc->pcm == NULL || enc->packets == NULL) {
+		res = -errno;
+		goto error;
+	}
+	spa_ringbuffer_init(&enc->pcm_ring);
+	spa_ringbuffer_init(&enc->packet_ring);
+
+	if ((enc->pcm_fd = spa_system_eventfd_create(this->data_system,
+				SPA_FD_CLOEXEC)) < 0) {
+		res = enc->pcm_fd;
+		goto error;
+	}
+	if ((enc->packet_fd = spa_system_eventfd_create(this->data_system,
+				SPA_FD_CLOEXEC | SPA_FD_NONBLOCK)) < 0) {
+		res = enc->packet_fd;
+		goto error;
+	}
+
+	enc->stalled = 0;
+	enc->bitpool = 0;
+	enc->unsent = -1;
+	enc->running = 1;
+	enc->thread = spa_thread_utils_create(this->thread_utils,
+			&SPA_DICT_INIT_ARRAY(thread_items), encoder_thread, this);
+	if (enc->thread == NULL) {
+		enc->running = 0;
+		res = -errno;
+		goto error;
+	}
+	/* the encoder has the same deadline as the data thread */
+	spa_thread_utils_acquire_rt(this->thread_utils, enc->thread, -1);
+
+	enc->packet_source.data = this;
+	enc->packet_source.fd = enc->packet_fd;
+	enc->packet_source.func = media_on_packet;
+	enc->packet_source.mask = SPA_IO_IN;
+	enc->packet_source.rmask = 0;
+	spa_loop_add_source(this->data_loop, &enc->packet_source);
+
+	spa_log_info(this->log, "%p: encoding in separate thread", this);
+	return 0;
+
+error:
+	spa_log_error(this->log, "%p: can't start encoder thread: %s",
+			this, spa_strerror(res));
+	encoder_stop(this);
+	return res;
+}
+
 static int flush_data(struct impl *this, uint64_t now_time)
 {
 	int written;
@@ -642,6 +1009,9 @@ static int flush_data(struct impl *this, uint64_t now_time)
 		return -EIO;
 	}
 
+	if (this->encoder.running)
+		return flush_packets(this, now_time);
+
 	total_frames = 0;
 again:
 	written = 0;
@@ -1029,6 +1399,9 @@ static int do_start(struct impl *this)
 
 	this->flush_pending = false;
 
+	if (this->use_encode_thread && (res = encoder_start(this)) < 0)
+		spa_log_warn(this->log, "%p: encoding in data thread", this);
+
 	set_timers(this);
 	this->started = true;
 
@@ -1056,6 +1429,9 @@ static int do_remove_source(struct spa_loop *loop,
 	if (this->flush_source.loop)
 		spa_loop_remove_source(this->data_loop, &this->flush_source);
 
+	if (this->encoder.packet_source.loop)
+		spa_loop_remove_source(this->data_loop, &this->encoder.packet_source);
+
 	if (this->flush_timer_source.loop)
 		spa_loop_remove_source(this->data_loop, &this->flush_timer_source);
 	ts.it_value.tv_sec = 0;
@@ -1080,6 +1456,8 @@ static int do_stop(struct impl *this)
 
 	this->started = false;
 
+	encoder_stop(this);
+
 	if (this->transport)
 		res = spa_bt_transport_release(this->transport);
 
@@ -1711,6 +2089,7 @@ impl_init(const struct spa_handle_factory *factory,
 	this->log = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_Log);
 	this->data_loop = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_DataLoop);
 	this->data_system = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_DataSystem);
+	this->thread_utils = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_ThreadUtils);
 
 	spa_log_topic_init(this->log, &log_topic);
 
@@ -1783,6 +2162,17 @@ impl_init(const struct spa_handle_factory *factory,
 
 	this->codec = this->transport->media_codec;
 
+	if ((info && (str = spa_dict_lookup(info, "api.bluez5.encode-thread")) != NULL) ||
+	    (this->transport->device->settings &&
+	     (str = spa_dict_lookup(this->transport->device->settings,
+					"bluez5.encode-thread")) != NULL))
+		this->use_encode_thread = spa_atob(str);
+
+	if (this->use_encode_thread && this->thread_utils == NULL) {
+		spa_log_warn(this->log, "no thread utils, encoding in the data thread");
+		this->use_encode_thread = false;
+	}
+
 	if (this->is_duplex) {
 		if (!this->codec->duplex_codec) {
 			spa_log_error(this->log, "transport codec doesn't support duplex");
@@ -1814,6 +2204,9 @@ impl_init(const struct spa_handle_factory *factory,
 	this->flush_timerfd = spa_system_timerfd_create(this->data_system,
 			CLOCK_MONOTONIC, SPA_FD_CLOEXEC | SPA_FD_NONBLOCK);
 
+	this->encoder.pcm_fd = -1;
+	this->encoder.packet_fd = -1;
+
 	return 0;
 }
 
@@ -0,0 +1,176 @@
+/* Spa
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <spa/utils/json.h>
+#include <spa/utils/string.h>
+
+#define MAX_COUNT 1000
+
+struct stats {
+	uint64_t tokens;
+	uint64_t strings;
+};
+
+static int walk(struct spa_json *iter, struct stats *s)
+{
+	const char *val;
+	char str[1024];
+	int len;
+
+	while ((len = spa_json_next(iter, &val)) > 0) {
+		s->tokens++;
+		if (spa_json_is_container(val, len)) {
+			struct spa_json sub;
+			spa_json_enter(iter, &sub);
+			if (walk(&sub, s) < 0)
+				return -1;
+		} else if (spa_json_is_string(val, len) && len < (int)sizeof(str)) {
+			spa_json_parse_stringn(val, len, str, sizeof(str));
+			s->strings++;
+		}
+	}
+	return len;
+}
+
+/* something that looks like a daemon config with a couple of big
+ * filter-chain and rules sections */
+static char *gen_config(size_t *size)
+{
+	FILE *f;
+	char *data = NULL;
+	int i, j;
+
+	if ((f = open_memstream(&data, size)) == NULL)
+		return NULL;
+
+	fprintf(f, "# generated config\ncontext.properties = {\n"
+			"    default.clock.rate          = 48000\n"
+			"    default.clock.quantum       = 1024\n"
+			"    core.daemon                 = true\n}\n");
+	fprintf(f, "context.modules = [\n");
+	for (i = 0; i < 32; i++) {
+		fprintf(f, "    {   name = libpipewire-module-filter-chain\n"
+				"        args = {\n"
+				"            node.description = \"Equalizer Sink %d with a long description\"\n"
+				"            filter.graph = {\n"
+				"                nodes = [\n", i);
+		for (j = 0; j < 8; j++)
+			fprintf(f, "                    { type = builtin name = eq_band_%d label = bq_peaking "
+					"control = { \"Freq\" = %d.0 \"Q\" = 1.0 \"Gain\" = -3.0 } }\n",
+					j, 100 * (j + 1));
+		fprintf(f, "                ]\n"
+				"            }\n"
+				"            capture.props = { node.name = \"effect_input.eq%d\" media.class = Audio/Sink }\n"
+				"            playback.props = { node.name = \"effect_output.eq%d\" node.passive = true }\n"
+				"        }\n"
+				"    }\n", i, i);
+	}
+	fprintf(f, "]\nnode.rules = [\n");
+	for (i = 0; i < 64; i++)
+		fprintf(f, "    {   matches = [ { node.name = \"~alsa_output.pci-0000_00_1f.3.analog-stereo.%d\" } ]\n"
+				"        actions = { update-props = { session.suspend-timeout-seconds = 0 } }\n"
+				"    }\n", i);
+	fprintf(f, "]\n");
+	fclose(f);
+	return data;
+}
+
+static void test_parse(const char *data, size_t size)
+{
+	struct timespec ts;
+	struct stats s;
+	uint64_t t1, t2;
+	uint32_t i;
+
+	spa_zero(s);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t1 = SPA_TIMESPEC_TO_NSEC(&ts);
+
+	for (i = 0; i < MAX_COUNT; i++) {
+		struct spa_json it;
+		spa_json_init(&it, data, size);
+		walk(&it, &s);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	t2 = SPA_TIMESPEC_TO_NSEC(&ts);
+
+	fprintf(stderr, "%zd bytes, %"PRIu64" tokens %"PRIu64" strings: %"PRIu64" ns/parse %f MB/s\n",
+			size, s.tokens / MAX_COUNT, s.strings / MAX_COUNT,
+			(t2 - t1) / MAX_COUNT,
+			(double)size * MAX_COUNT * 1000.0 / (t2 - t1));
+}
+
+int main(int argc, char *argv[])
+{
+	char *data;
+	size_t size;
+
+	fprintf(stderr, "json scanner: %s\n",
+#if defined(__SSE2__) && !defined(SPA_JSON_NO_SIMD)
+			"sse2"
+#else
+			"c"
+#endif
+			);
+
+	if (argc > 1) {
+		struct stat sbuf;
+		int fd;
+
+		if ((fd = open(argv[1], O_CLOEXEC | O_RDONLY)) < 0 ||
+		    fstat(fd, &sbuf) < 0) {
+			fprintf(stderr, "can't open %s: %m\n", argv[1]);
+			return -1;
+		}
+		size = sbuf.st_size;
+		data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			fprintf(stderr, "can't map %s: %m\n", argv[1]);
+			return -1;
+		}
+		test_parse(data, size);
+		munmap(data, size);
+	} else {
+		if ((data = gen_config(&size)) == NULL)
+			return -1;
+		/* warmup */
+		test_parse(data, size);
+		test_parse(data, size);
+		free(data);
+	}
+	return 0;
+}
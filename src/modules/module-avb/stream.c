@@ -23,6 +23,7 @@
  */
 
 #include <unistd.h>
+#include <sys/mman.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
 #include <linux/net_tstamp.h>
@@ -106,12 +107,9 @@ set_iovec(struct spa_ringbuffer *rbuf, void *buffer, uint32_t size,
 static int flush_write(struct stream *stream, uint64_t current_time)
 {
 	int32_t avail;
-	uint32_t index;
-        uint64_t ptime, txtime;
-	int pdu_count;
-	ssize_t n;
-	struct avb_frame_header *h = (void*)stream->pdu;
-	struct avb_packet_iec61883 *p = SPA_PTROFF(h, sizeof(*h), void);
+	uint32_t index, i, n_pdus, sent;
+	uint64_t ptime, txtime;
+	int pdu_count, res;
 	uint8_t dbc;
 
 	avail = spa_ringbuffer_get_read_index(&stream->ring, &index);
@@ -122,29 +120,53 @@ static int flush_write(struct stream *stream, uint64_t current_time)
 	ptime = txtime + stream->mtt;
 	dbc = stream->dbc;
 
-	while (pdu_count--) {
-		*(uint64_t*)CMSG_DATA(stream->cmsg) = txtime;
+	/* send the PDUs in batches, each PDU has its own header and
+	 * launch time, the payload is taken from the ringbuffer */
+	while (pdu_count > 0) {
+		n_pdus = SPA_MIN(pdu_count, TX_BATCH);
+
+		for (i = 0; i < n_pdus; i++) {
+			struct msghdr *msg = &stream->mmsg[i].msg_hdr;
+			struct avb_frame_header *h = (void*)stream->hdr[i];
+			struct avb_packet_iec61883 *p = SPA_PTROFF(h, sizeof(*h), void);
+
+			memcpy(h, stream->pdu, stream->hdr_size);
+			p->seq_num = stream->pdu_seq++;
+			p->tv = 1;
+			p->timestamp = ptime;
+			p->dbc = dbc;
 
-		set_iovec(&stream->ring,
-			stream->buffer_data,
-			stream->buffer_size,
-			index % stream->buffer_size,
-			&stream->iov[1], stream->payload_size);
+			*(uint64_t*)CMSG_DATA(CMSG_FIRSTHDR(msg)) = txtime;
 
-		p->seq_num = stream->pdu_seq++;
-		p->tv = 1;
-		p->timestamp = ptime;
-		p->dbc = dbc;
+			set_iovec(&stream->ring,
+				stream->buffer_data,
+				stream->buffer_size,
+				index % stream->buffer_size,
+				&stream->iov[i][1], stream->payload_size);
 
-		n = sendmsg(stream->source->fd, &stream->msg, MSG_NOSIGNAL);
-		if (n < 0 || n != (ssize_t)stream->pdu_size) {
-			pw_log_error("sendmsg() failed %zd != %zd: %m",
-					n, stream->pdu_size);
+			txtime += stream->pdu_period;
+			ptime += stream->pdu_period;
+			index += stream->payload_size;
+			dbc += stream->frames_per_pdu;
+		}
+		/* a partial send reports the error on the next call, keep
+		 * sending as long as PDUs go out */
+		for (sent = 0; sent < n_pdus; sent += res) {
+			res = sendmmsg(stream->source->fd, &stream->mmsg[sent],
+					n_pdus - sent, MSG_NOSIGNAL);
+			if (res <= 0)
+				break;
 		}
-		txtime += stream->pdu_period;
-		ptime += stream->pdu_period;
-		index += stream->payload_size;
-		dbc += stream->frames_per_pdu;
+		if (sent < n_pdus) {
+			stream->tx_dropped += n_pdus - sent;
+			if (res < 0)
+				pw_log_error("sendmmsg() failed, dropped %u of %u PDUs: %m",
+						n_pdus - sent, n_pdus);
+			else
+				pw_log_error("sendmmsg() stalled, dropped %u of %u PDUs",
+						n_pdus - sent, n_pdus);
+		}
+		pdu_count -= n_pdus;
 	}
 	stream->dbc = dbc;
 	spa_ringbuffer_read_update(&stream->ring, index);
@@ -230,22 +252,27 @@ static void setup_pdu(struct stream *stream)
 
 static int setup_msg(struct stream *stream)
 {
-	stream->iov[0].iov_base = stream->pdu;
-	stream->iov[0].iov_len = stream->hdr_size;
-	stream->iov[1].iov_base = SPA_PTROFF(stream->pdu, stream->hdr_size, void);
-	stream->iov[1].iov_len = stream->payload_size;
-	stream->iov[2].iov_base = SPA_PTROFF(stream->pdu, stream->hdr_size, void);
-	stream->iov[2].iov_len = 0;
-	stream->msg.msg_name = &stream->sock_addr;
-	stream->msg.msg_namelen = sizeof(stream->sock_addr);
-	stream->msg.msg_iov = stream->iov;
-	stream->msg.msg_iovlen = 3;
-	stream->msg.msg_control = stream->control;
-	stream->msg.msg_controllen = sizeof(stream->control);
-	stream->cmsg = CMSG_FIRSTHDR(&stream->msg);
-	stream->cmsg->cmsg_level = SOL_SOCKET;
-	stream->cmsg->cmsg_type = SCM_TXTIME;
-	stream->cmsg->cmsg_len = CMSG_LEN(sizeof(__u64));
+	uint32_t i;
+
+	for (i = 0; i < TX_BATCH; i++) {
+		struct msghdr *msg = &stream->mmsg[i].msg_hdr;
+		struct cmsghdr *cmsg;
+
+		stream->iov[i][0].iov_base = stream->hdr[i];
+		stream->iov[i][0].iov_len = stream->hdr_size;
+		stream->iov[i][1].iov_len = 0;
+		stream->iov[i][2].iov_len = 0;
+		msg->msg_name = &stream->sock_addr;
+		msg->msg_namelen = sizeof(stream->sock_addr);
+		msg->msg_iov = stream->iov[i];
+		msg->msg_iovlen = 3;
+		msg->msg_control = stream->control[i];
+		msg->msg_controllen = sizeof(stream->control[i]);
+		cmsg = CMSG_FIRSTHDR(msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(__u64));
+	}
 	return 0;
 }
 
@@ -385,6 +412,39 @@ void stream_destroy(struct stream *stream)
 	free(stream);
 }
 
+static int setup_rx_ring(struct stream *stream, int fd)
+{
+	int version = TPACKET_V3;
+	struct tpacket_req3 req;
+	size_t size;
+	void *ring;
+
+	spa_zero(req);
+	req.tp_block_size = RX_BLOCK_SIZE;
+	req.tp_block_nr = RX_BLOCK_NR;
+	req.tp_frame_size = RX_FRAME_SIZE;
+	req.tp_frame_nr = (RX_BLOCK_SIZE / RX_FRAME_SIZE) * RX_BLOCK_NR;
+	req.tp_retire_blk_tov = RX_BLOCK_TOV;
+	size = (size_t)req.tp_block_size * req.tp_block_nr;
+
+	if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0 ||
+	    setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+		pw_log_warn("can't setup TPACKET_V3 ring, using recv(): %m");
+		return -errno;
+	}
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, fd, 0);
+	if (ring == MAP_FAILED)
+		ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED) {
+		pw_log_warn("can't mmap TPACKET_V3 ring, using recv(): %m");
+		return -errno;
+	}
+	stream->rx_ring = ring;
+	stream->rx_ring_size = size;
+	stream->rx_block = 0;
+	return 0;
+}
+
 static int setup_socket(struct stream *stream)
 {
 	struct server *server = stream->server;
@@ -442,6 +502,10 @@ static int setup_socket(struct stream *stream)
 			goto error_close;
 		}
 
+		/* only after bind(), the ring would otherwise fill with
+		 * frames from all interfaces */
+		setup_rx_ring(stream, fd);
+
 		spa_zero(mreq);
 		mreq.mr_ifindex = req.ifr_ifindex;
 		mreq.mr_type = PACKET_MR_MULTICAST;
@@ -461,6 +525,10 @@ static int setup_socket(struct stream *stream)
 	return fd;
 
 error_close:
+	if (stream->rx_ring != NULL) {
+		munmap(stream->rx_ring, stream->rx_ring_size);
+		stream->rx_ring = NULL;
+	}
 	close(fd);
 	return res;
 }
@@ -487,6 +555,49 @@ static void handle_iec61883_packet(struct stream *stream,
 	}
 }
 
+static void handle_frame(struct stream *stream, uint8_t *data, int len)
+{
+	struct avb_frame_header *h = (void*)data;
+	struct avb_packet_iec61883 *p = SPA_PTROFF(h, sizeof(*h), void);
+
+	if (len < (int)(sizeof(*h) + sizeof(struct avb_packet_header))) {
+		pw_log_warn("short packet received (%d < %d)", len,
+				(int)(sizeof(*h) + sizeof(struct avb_packet_header)));
+		return;
+	}
+	if (memcmp(h->dest, stream->addr, 6) != 0 ||
+	    p->subtype != AVB_SUBTYPE_61883_IIDC)
+		return;
+
+	handle_iec61883_packet(stream, p, len - sizeof(*h));
+}
+
+static void read_rx_ring(struct stream *stream)
+{
+	while (true) {
+		struct tpacket_block_desc *bd = SPA_PTROFF(stream->rx_ring,
+				stream->rx_block * RX_BLOCK_SIZE, void);
+		struct tpacket3_hdr *ph;
+		uint32_t i, n_pkts;
+
+		if ((__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+		    TP_STATUS_USER) == 0)
+			break;
+
+		n_pkts = bd->hdr.bh1.num_pkts;
+		ph = SPA_PTROFF(bd, bd->hdr.bh1.offset_to_first_pkt, void);
+
+		for (i = 0; i < n_pkts; i++) {
+			handle_frame(stream, SPA_PTROFF(ph, ph->tp_mac, uint8_t),
+					ph->tp_snaplen);
+			ph = SPA_PTROFF(ph, ph->tp_next_offset, void);
+		}
+		__atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+				__ATOMIC_RELEASE);
+		stream->rx_block = (stream->rx_block + 1) % RX_BLOCK_NR;
+	}
+}
+
 static void on_socket_data(void *data, int fd, uint32_t mask)
 {
 	struct stream *stream = data;
@@ -495,24 +606,17 @@ static void on_socket_data(void *data, int fd, uint32_t mask)
 		int len;
 		uint8_t buffer[2048];
 
-		len = recv(fd, buffer, sizeof(buffer), 0);
-
-		if (len < 0) {
-			pw_log_warn("got recv error: %m");
+		if (stream->rx_ring != NULL) {
+			read_rx_ring(stream);
+			return;
 		}
-		else if (len < (int)sizeof(struct avb_packet_header)) {
-			pw_log_warn("short packet received (%d < %d)", len,
-					(int)sizeof(struct avb_packet_header));
-		} else {
-			struct avb_frame_header *h = (void*)buffer;
-			struct avb_packet_iec61883 *p = SPA_PTROFF(h, sizeof(*h), void);
 
-			if (memcmp(h->dest, stream->addr, 6) != 0 ||
-			    p->subtype != AVB_SUBTYPE_61883_IIDC)
-				return;
+		len = recv(fd, buffer, sizeof(buffer), 0);
 
-			handle_iec61883_packet(stream, p, len - sizeof(*h));
-		}
+		if (len < 0)
+			pw_log_warn("got recv error: %m");
+		else
+			handle_frame(stream, buffer, len);
 	}
 }
 
@@ -577,6 +681,10 @@ int stream_deactivate(struct stream *stream, uint64_t now)
 		pw_loop_destroy_source(stream->server->impl->loop, stream->source);
 		stream->source = NULL;
 	}
+	if (stream->rx_ring != NULL) {
+		munmap(stream->rx_ring, stream->rx_ring_size);
+		stream->rx_ring = NULL;
+	}
 
 	avb_mrp_attribute_leave(stream->vlan_attr->mrp, now);
 
@@ -38,6 +38,15 @@
 #define BUFFER_SIZE	(1u<<16)
 #define BUFFER_MASK	(BUFFER_SIZE-1)
 
+/* max number of PDUs sent with one sendmmsg() */
+#define TX_BATCH	32
+
+/* TPACKET_V3 receive ring */
+#define RX_BLOCK_SIZE	(1u<<14)
+#define RX_BLOCK_NR	16
+#define RX_FRAME_SIZE	2048
+#define RX_BLOCK_TOV	1	/* msec */
+
 struct stream {
 	struct spa_list link;
 
@@ -70,11 +79,16 @@ struct stream {
 	uint8_t prev_seq;
 	uint8_t dbc;
 
-	struct iovec iov[3];
 	struct sockaddr_ll sock_addr;
-	struct msghdr msg;
-	char control[CMSG_SPACE(sizeof(uint64_t))];
-	struct cmsghdr *cmsg;
+	struct mmsghdr mmsg[TX_BATCH];
+	struct iovec iov[TX_BATCH][3];
+	uint8_t hdr[TX_BATCH][64];
+	char control[TX_BATCH][CMSG_SPACE(sizeof(uint64_t))];
+	uint64_t tx_dropped;
+
+	void *rx_ring;
+	size_t rx_ring_size;
+	uint32_t rx_block;
 
 	struct spa_ringbuffer ring;
 	void *buffer_data;
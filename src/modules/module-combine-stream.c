@@ -691,8 +691,11 @@ static void combine_input_process(void *d)
 
 				outsize = SPA_MAX(outsize, size);
 				stride = SPA_MAX(stride, ds->chunk->stride);
+				SPA_FLAG_UPDATE(dd->chunk->flags, SPA_CHUNK_FLAG_EMPTY,
+						SPA_FLAG_IS_SET(ds->chunk->flags, SPA_CHUNK_FLAG_EMPTY));
 			} else {
 				memset(dd->data, 0, outsize);
+				SPA_FLAG_SET(dd->chunk->flags, SPA_CHUNK_FLAG_EMPTY);
 			}
 			dd->chunk->offset = 0;
 			dd->chunk->size = outsize;
@@ -755,6 +758,8 @@ static void combine_output_process(void *d)
 				dd->chunk->offset = 0;
 				dd->chunk->size = outsize;
 				dd->chunk->stride = stride;
+				SPA_FLAG_UPDATE(dd->chunk->flags, SPA_CHUNK_FLAG_EMPTY,
+						SPA_FLAG_IS_SET(ds->chunk->flags, SPA_CHUNK_FLAG_EMPTY));
 			}
 		}
 		pw_stream_queue_buffer(s->stream, in);
@@ -36,6 +36,7 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <spa/debug/types.h>
@@ -77,6 +78,8 @@
  * - `aec.args = <str>`: arguments to pass to the echo cancellation method
  * - `monitor.mode`: Instead of making a sink, make a stream that captures from
  *                   the monitor ports of the default sink.
+ * - `aec.thread`: run the echo canceller in a separate realtime thread. This
+ *                 adds one block of latency on the capture side. (Default `false`)
  *
  * ## General options
  *
@@ -103,6 +106,7 @@
  *          # library.name  = aec/libspa-aec-webrtc
  *          # node.latency = 1024/48000
  *          # monitor.mode = false
+ *          # aec.thread = false
  *          capture.props = {
  *             node.name = "Echo Cancellation Capture"
  *          }
@@ -145,6 +149,9 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 #define MAX_BUFSIZE_MS 100
 #define DELAY_MS 0
 
+/* number of blocks that can be queued for the canceller thread */
+#define MAX_BLOCKS 4
+
 static const struct spa_dict_item module_props[] = {
 	{ PW_KEY_MODULE_AUTHOR, "Wim Taymans <wim.taymans@gmail.com>" },
 	{ PW_KEY_MODULE_DESCRIPTION, "Echo Cancellation" },
@@ -157,6 +164,7 @@ static const struct spa_dict_item module_props[] = {
 				"[ buffer.play_delay=<delay as fraction> ] "
 				"[ library.name =<library name> ] "
 				"[ aec.args=<aec arguments> ] "
+				"[ aec.thread=<run canceller in a thread> ] "
 				"[ capture.props=<properties> ] "
 				"[ source.props=<properties> ] "
 				"[ sink.props=<properties> ] "
@@ -211,6 +219,28 @@ struct impl {
 	struct spa_audio_aec *aec;
 	uint32_t aec_blocksize;
 
+	/* rec, play_delayed and out samples of a block, one set for the
+	 * synchronous case and MAX_BLOCKS + 1 when using a thread */
+	float *work;
+	uint32_t work_size;
+	struct block {
+		uint32_t size;
+		uint32_t skip;
+	} blocks[MAX_BLOCKS + 1];
+	struct spa_ringbuffer work_ring;
+
+	struct pw_data_loop *worker;
+	struct pw_loop *worker_loop;
+	struct spa_source *wakeup;
+
+	struct spa_source *report_timer;
+	struct stats {
+		uint64_t blocks;
+		uint64_t time;
+		uint64_t max_time;
+		uint64_t dropped;
+	} stats, last_stats;
+
 	unsigned int capture_ready:1;
 	unsigned int sink_ready:1;
 
@@ -226,30 +256,156 @@ struct impl {
 	bool monitor_mode;
 };
 
-static void process(struct impl *impl)
+static inline float *work_data(struct impl *impl, uint32_t block,
+		uint32_t which, uint32_t channel)
+{
+	uint32_t idx = (block * 3 + which) * impl->info.channels + channel;
+	return SPA_PTROFF(impl->work, idx * impl->work_size, float);
+}
+
+#define WORK_REC		0
+#define WORK_PLAY_DELAYED	1
+#define WORK_OUT		2
+
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+/* run the canceller on a block and place the result in the output
+ * ringbuffer. Called from the processing thread or from the canceller
+ * thread. */
+static void run_block(struct impl *impl, uint32_t block)
+{
+	const uint32_t n_channels = impl->info.channels;
+	const float *rec[n_channels];
+	const float *play_delayed[n_channels];
+	float *out[n_channels];
+	uint32_t i, size = impl->blocks[block].size, skip = impl->blocks[block].skip;
+	uint32_t oindex;
+	int32_t avail;
+	uint64_t t1, t2;
+
+	for (i = 0; i < n_channels; i++) {
+		rec[i] = work_data(impl, block, WORK_REC, i);
+		play_delayed[i] = work_data(impl, block, WORK_PLAY_DELAYED, i) + skip;
+		out[i] = work_data(impl, block, WORK_OUT, i);
+		/* silence while the play buffer is not filled */
+		memset(out[i], 0, skip * sizeof(float));
+		out[i] += skip;
+	}
+
+	t1 = get_time_ns();
+	if (skip * sizeof(float) < size)
+		spa_audio_aec_run(impl->aec, rec, play_delayed, out,
+				size / sizeof(float) - skip);
+	t2 = get_time_ns();
+
+	/* only this thread writes them, the report timer reads them */
+	__atomic_store_n(&impl->stats.blocks, impl->stats.blocks + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&impl->stats.time, impl->stats.time + t2 - t1, __ATOMIC_RELAXED);
+	__atomic_store_n(&impl->stats.max_time,
+			SPA_MAX(impl->stats.max_time, t2 - t1), __ATOMIC_RELAXED);
+
+	/* Next, copy over the output to the output ringbuffer */
+	avail = spa_ringbuffer_get_write_index(&impl->out_ring, &oindex);
+	if (avail + size > impl->out_ringsize) {
+		uint32_t rindex, drop;
+
+		/* Drop enough so we have size bytes left */
+		drop = avail + size - impl->out_ringsize;
+		pw_log_debug("output ringbuffer xrun %d + %u > %u, dropping %u",
+				avail, size, impl->out_ringsize, drop);
+
+		if (impl->worker != NULL) {
+			/* the processing thread reads the ringbuffer, we can
+			 * only drop the new block */
+			__atomic_fetch_add(&impl->stats.dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		spa_ringbuffer_get_read_index(&impl->out_ring, &rindex);
+		spa_ringbuffer_read_update(&impl->out_ring, rindex + drop);
+
+		avail += drop;
+	}
+
+	for (i = 0; i < n_channels; i++) {
+		/* filtered samples, without echo from sink */
+		spa_ringbuffer_write_data(&impl->out_ring, impl->out_buffer[i],
+				impl->out_ringsize, oindex % impl->out_ringsize,
+				work_data(impl, block, WORK_OUT, i), size);
+	}
+
+	spa_ringbuffer_write_update(&impl->out_ring, oindex + size);
+}
+
+/* take data from the output ringbuffer and make it available on the source */
+static void flush_out(struct impl *impl)
 {
 	struct pw_buffer *cout;
+	struct spa_data *dd;
+	uint32_t i, oindex, size = impl->aec_blocksize;
+	int32_t avail;
+
+	avail = spa_ringbuffer_get_read_index(&impl->out_ring, &oindex);
+	while (avail >= (int32_t)size) {
+		if ((cout = pw_stream_dequeue_buffer(impl->source)) == NULL) {
+			pw_log_debug("out of source buffers: %m");
+			break;
+		}
+
+		for (i = 0; i < impl->info.channels; i++) {
+			dd = &cout->buffer->datas[i];
+			spa_ringbuffer_read_data(&impl->out_ring, impl->out_buffer[i],
+					impl->out_ringsize, oindex % impl->out_ringsize,
+					(void *)dd->data, size);
+			dd->chunk->offset = 0;
+			dd->chunk->size = size;
+			dd->chunk->stride = 0;
+		}
+
+		pw_stream_queue_buffer(impl->source, cout);
+
+		oindex += size;
+		spa_ringbuffer_read_update(&impl->out_ring, oindex);
+		avail -= size;
+	}
+}
+
+static void process(struct impl *impl)
+{
 	struct pw_buffer *pout = NULL;
-	float rec_buf[impl->info.channels][impl->aec_blocksize / sizeof(float)];
-	float play_buf[impl->info.channels][impl->aec_blocksize / sizeof(float)];
-	float play_delayed_buf[impl->info.channels][impl->aec_blocksize / sizeof(float)];
-	float out_buf[impl->info.channels][impl->aec_blocksize / sizeof(float)];
-	const float *rec[impl->info.channels];
-	const float *play[impl->info.channels];
-	const float *play_delayed[impl->info.channels];
-	float *out[impl->info.channels];
 	struct spa_data *dd;
-	uint32_t i, size;
-	uint32_t rindex, pindex, oindex, pdindex, avail;
-	int32_t stride = 0;
+	uint32_t i, size, block = 0, windex = 0;
+	uint32_t rindex, pindex, pdindex;
 
 	if (impl->playback != NULL && (pout = pw_stream_dequeue_buffer(impl->playback)) == NULL) {
 		pw_log_debug("out of playback buffers: %m");
 		goto done;
 	}
 
+	/* the work blocks hold at least aec_blocksize, flush_out() sends
+	 * the output in blocks of the same size */
 	size = impl->aec_blocksize;
 
+	if (impl->worker != NULL) {
+		/* Send out what the canceller thread produced in the previous
+		 * cycles. This gives a fixed latency of one block. */
+		flush_out(impl);
+
+		if (spa_ringbuffer_get_write_index(&impl->work_ring, &windex) >= MAX_BLOCKS) {
+			/* canceller thread is behind, read the rings into
+			 * the spare block and drop it */
+			pw_log_debug("canceller thread busy, dropping block");
+			__atomic_fetch_add(&impl->stats.dropped, 1, __ATOMIC_RELAXED);
+			block = MAX_BLOCKS;
+		} else {
+			block = windex % MAX_BLOCKS;
+		}
+	}
+
 	/* First read a block from the playback and capture ring buffers */
 
 	spa_ringbuffer_get_read_index(&impl->rec_ring, &rindex);
@@ -258,37 +414,25 @@ static void process(struct impl *impl)
 
 	for (i = 0; i < impl->info.channels; i++) {
 		/* captured samples, with echo from sink */
-		rec[i] = &rec_buf[i][0];
-		/* echo from sink */
-		play[i] = &play_buf[i][0];
-		/* echo from sink delayed */
-		play_delayed[i] = &play_delayed_buf[i][0];
-		/* filtered samples, without echo from sink */
-		out[i] = &out_buf[i][0];
-
-		stride = 0;
 		spa_ringbuffer_read_data(&impl->rec_ring, impl->rec_buffer[i],
 				impl->rec_ringsize, rindex % impl->rec_ringsize,
-				(void*)rec[i], size);
-
-		stride = 0;
-		spa_ringbuffer_read_data(&impl->play_ring, impl->play_buffer[i],
-				impl->play_ringsize, pindex % impl->play_ringsize,
-				(void *)play[i], size);
+				work_data(impl, block, WORK_REC, i), size);
 
-		stride = 0;
+		/* echo from sink delayed */
 		spa_ringbuffer_read_data(&impl->play_delayed_ring, impl->play_buffer[i],
 				impl->play_ringsize, pdindex % impl->play_ringsize,
-				(void *)play_delayed[i], size);
+				work_data(impl, block, WORK_PLAY_DELAYED, i), size);
 
 		if (pout != NULL) {
-			/* output to sink, just copy */
+			/* output to sink, just copy the echo from sink */
 			dd = &pout->buffer->datas[i];
-			memcpy(dd->data, play[i], size);
+			spa_ringbuffer_read_data(&impl->play_ring, impl->play_buffer[i],
+					impl->play_ringsize, pindex % impl->play_ringsize,
+					dd->data, size);
 
 			dd->chunk->offset = 0;
 			dd->chunk->size = size;
-			dd->chunk->stride = stride;
+			dd->chunk->stride = 0;
 		}
 	}
 
@@ -299,6 +443,9 @@ static void process(struct impl *impl)
 	if (impl->playback != NULL)
 		pw_stream_queue_buffer(impl->playback, pout);
 
+	impl->blocks[block].size = size;
+	impl->blocks[block].skip = 0;
+
 	if (SPA_UNLIKELY (impl->current_delay < impl->buffer_delay)) {
 		uint32_t delay_left = impl->buffer_delay - impl->current_delay;
 		uint32_t silence_size;
@@ -306,81 +453,57 @@ static void process(struct impl *impl)
 		/* don't run the canceller until play_buffer has been filled,
 		 * copy silence to output in the meantime */
 		silence_size = SPA_MIN(size, delay_left * sizeof(float));
-		for (i = 0; i < impl->info.channels; i++)
-			memset(out[i], 0, silence_size);
+		impl->blocks[block].skip = silence_size / sizeof(float);
 		impl->current_delay += silence_size / sizeof(float);
 		pw_log_debug("current_delay %d", impl->current_delay);
-
-		if (silence_size != size) {
-			const float *pd[impl->info.channels];
-			float *o[impl->info.channels];
-
-			for (i = 0; i < impl->info.channels; i++) {
-				pd[i] = play_delayed[i] + delay_left;
-				o[i] = out[i] + delay_left;
-			}
-			spa_audio_aec_run(impl->aec, rec, pd, o, size / sizeof(float) - delay_left);
-		}
-	} else {
-		/* run the canceller */
-		spa_audio_aec_run(impl->aec, rec, play_delayed, out, size / sizeof(float));
 	}
 
-	/* Next, copy over the output to the output ringbuffer */
-	avail = spa_ringbuffer_get_write_index(&impl->out_ring, &oindex);
-	if (avail + size > impl->out_ringsize) {
-		uint32_t rindex, drop;
-
-		/* Drop enough so we have size bytes left */
-		drop = avail + size - impl->out_ringsize;
-		pw_log_debug("output ringbuffer xrun %d + %u > %u, dropping %u",
-				avail, size, impl->out_ringsize, drop);
+	if (impl->worker == NULL) {
+		run_block(impl, block);
+		flush_out(impl);
+	} else if (block != MAX_BLOCKS) {
+		spa_ringbuffer_write_update(&impl->work_ring, windex + 1);
+		pw_loop_signal_event(impl->worker_loop, impl->wakeup);
+	}
 
-		spa_ringbuffer_get_read_index(&impl->out_ring, &rindex);
-		spa_ringbuffer_read_update(&impl->out_ring, rindex + drop);
+done:
+	impl->sink_ready = false;
+	impl->capture_ready = false;
+}
 
-		avail += drop;
-	}
+/* canceller thread, process all queued blocks */
+static void on_wakeup(void *data, uint64_t count)
+{
+	struct impl *impl = data;
+	uint32_t index;
 
-	for (i = 0; i < impl->info.channels; i++) {
-		/* captured samples, with echo from sink */
-		spa_ringbuffer_write_data(&impl->out_ring, impl->out_buffer[i],
-				impl->out_ringsize, oindex % impl->out_ringsize,
-				(void *)out[i], size);
+	while (spa_ringbuffer_get_read_index(&impl->work_ring, &index) > 0) {
+		run_block(impl, index % MAX_BLOCKS);
+		spa_ringbuffer_read_update(&impl->work_ring, index + 1);
 	}
+}
 
-	spa_ringbuffer_write_update(&impl->out_ring, oindex + size);
-
-	/* And finally take data from the output ringbuffer and make it
-	 * available on the source */
+static void on_report_timeout(void *data, uint64_t expirations)
+{
+	struct impl *impl = data;
+	struct stats now;
 
-	avail = spa_ringbuffer_get_read_index(&impl->out_ring, &oindex);
-	while (avail >= size) {
-		if ((cout = pw_stream_dequeue_buffer(impl->source)) == NULL) {
-			pw_log_debug("out of source buffers: %m");
-			break;
-		}
+	now.blocks = __atomic_load_n(&impl->stats.blocks, __ATOMIC_RELAXED);
+	now.time = __atomic_load_n(&impl->stats.time, __ATOMIC_RELAXED);
+	now.max_time = __atomic_load_n(&impl->stats.max_time, __ATOMIC_RELAXED);
+	now.dropped = __atomic_load_n(&impl->stats.dropped, __ATOMIC_RELAXED);
 
-		for (i = 0; i < impl->info.channels; i++) {
-			dd = &cout->buffer->datas[i];
-			spa_ringbuffer_read_data(&impl->out_ring, impl->out_buffer[i],
-					impl->out_ringsize, oindex % impl->out_ringsize,
-					(void *)dd->data, size);
-			dd->chunk->offset = 0;
-			dd->chunk->size = size;
-			dd->chunk->stride = 0;
-		}
-
-		pw_stream_queue_buffer(impl->source, cout);
+	if (now.blocks == impl->last_stats.blocks)
+		return;
 
-		oindex += size;
-		spa_ringbuffer_read_update(&impl->out_ring, oindex);
-		avail -= size;
-	}
+	pw_log_info("%p: blocks:%"PRIu64" avg:%"PRIu64"us max:%"PRIu64"us dropped:%"PRIu64,
+			impl, now.blocks - impl->last_stats.blocks,
+			(uint64_t)((now.time - impl->last_stats.time) /
+				(now.blocks - impl->last_stats.blocks) / SPA_NSEC_PER_USEC),
+			(uint64_t)(now.max_time / SPA_NSEC_PER_USEC),
+			now.dropped - impl->last_stats.dropped);
 
-done:
-	impl->sink_ready = false;
-	impl->capture_ready = false;
+	impl->last_stats = now;
 }
 
 static void capture_destroy(void *d)
@@ -427,7 +550,7 @@ static void capture_process(void *data)
 	 * if it has a specific requirement, else keep the block size the same
 	 * on input and output or what the resampler needs */
 	if (impl->aec_blocksize == 0) {
-		impl->aec_blocksize = size;
+		impl->aec_blocksize = SPA_MIN(size, impl->work_size);
 		pw_log_debug("Setting AEC block size to %u", impl->aec_blocksize);
 	}
 
@@ -523,6 +646,17 @@ static void input_param_latency_changed(struct impl *impl, const struct spa_pod
 	if (spa_latency_parse(param, &latency) < 0)
 		return;
 
+	if (impl->worker != NULL) {
+		/* the canceller thread delays the capture path with one block */
+		if (impl->aec_blocksize > 0) {
+			latency.min_rate += impl->aec_blocksize / sizeof(float);
+			latency.max_rate += impl->aec_blocksize / sizeof(float);
+		} else {
+			latency.min_quantum += 1.0f;
+			latency.max_quantum += 1.0f;
+		}
+	}
+
 	spa_pod_builder_init(&b, buffer, sizeof(buffer));
 	params[0] = spa_latency_build(&b, SPA_PARAM_Latency, &latency);
 
@@ -726,7 +860,7 @@ static void sink_process(void *data)
 	}
 
 	if (impl->aec_blocksize == 0) {
-		impl->aec_blocksize = size;
+		impl->aec_blocksize = SPA_MIN(size, impl->work_size);
 		pw_log_debug("Setting AEC block size to %u", impl->aec_blocksize);
 	}
 
@@ -930,6 +1064,28 @@ static int setup_streams(struct impl *impl)
 	return 0;
 }
 
+static int create_thread(struct impl *impl)
+{
+	struct spa_thread_utils *utils;
+
+	/* a data loop, so that the thread gets the same realtime priority
+	 * as the processing thread and keeps up under load */
+	impl->worker = pw_data_loop_new(NULL);
+	if (impl->worker == NULL)
+		return -errno;
+	impl->worker_loop = pw_data_loop_get_loop(impl->worker);
+
+	utils = pw_context_get_object(impl->context, SPA_TYPE_INTERFACE_ThreadUtils);
+	if (utils != NULL)
+		pw_data_loop_set_thread_utils(impl->worker, utils);
+
+	impl->wakeup = pw_loop_add_event(impl->worker_loop, on_wakeup, impl);
+	if (impl->wakeup == NULL)
+		return -errno;
+
+	return pw_data_loop_start(impl->worker);
+}
+
 static void core_error(void *data, uint32_t id, int seq, int res, const char *message)
 {
 	struct impl *impl = data;
@@ -966,6 +1122,7 @@ static const struct pw_proxy_events core_proxy_events = {
 static void impl_destroy(struct impl *impl)
 {
 	uint32_t i;
+	/* destroy the streams first, they wake up the canceller thread */
 	if (impl->capture)
 		pw_stream_destroy(impl->capture);
 	if (impl->source)
@@ -976,6 +1133,16 @@ static void impl_destroy(struct impl *impl)
 		pw_stream_destroy(impl->sink);
 	if (impl->core && impl->do_disconnect)
 		pw_core_disconnect(impl->core);
+	/* stop the canceller thread before freeing the buffers it uses */
+	if (impl->worker) {
+		pw_data_loop_stop(impl->worker);
+		if (impl->wakeup)
+			pw_loop_destroy_source(impl->worker_loop, impl->wakeup);
+		pw_data_loop_destroy(impl->worker);
+	}
+	if (impl->report_timer)
+		pw_loop_destroy_source(pw_context_get_main_loop(impl->context),
+				impl->report_timer);
 	if (impl->spa_handle)
 		spa_plugin_loader_unload(impl->loader, impl->spa_handle);
 	pw_properties_free(impl->capture_props);
@@ -991,6 +1158,7 @@ static void impl_destroy(struct impl *impl)
 		if (impl->out_buffer[i])
 			free(impl->out_buffer[i]);
 	}
+	free(impl->work);
 
 	free(impl);
 }
@@ -1326,6 +1494,34 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 		impl->buffer_delay = DELAY_MS * impl->info.rate / 1000;
 	}
 
+	if (pw_properties_get_bool(props, "aec.thread", false) &&
+	    (res = create_thread(impl)) < 0) {
+		pw_log_error("can't create canceller thread: %s", spa_strerror(res));
+		goto error;
+	}
+
+	/* blocks are never larger than the capture ringbuffer or the block
+	 * size the canceller asked for */
+	impl->work_size = SPA_MAX(impl->aec_blocksize,
+			sizeof(float) * impl->max_buffer_size * impl->info.rate / 1000);
+	impl->work = calloc((impl->worker ? MAX_BLOCKS + 1 : 1) * 3 * impl->info.channels,
+			impl->work_size);
+	if (impl->work == NULL) {
+		res = -errno;
+		goto error;
+	}
+	spa_ringbuffer_init(&impl->work_ring);
+
+	impl->report_timer = pw_loop_add_timer(pw_context_get_main_loop(context),
+			on_report_timeout, impl);
+	if (impl->report_timer != NULL) {
+		struct timespec value, interval;
+		value.tv_sec = interval.tv_sec = 10;
+		value.tv_nsec = interval.tv_nsec = 0;
+		pw_loop_update_timer(pw_context_get_main_loop(context),
+				impl->report_timer, &value, &interval, false);
+	}
+
 	pw_properties_free(props);
 
 	pw_proxy_add_listener((struct pw_proxy*)impl->core,
@@ -30,10 +30,12 @@
 #include <fcntl.h>
 #include <dlfcn.h>
 #include <unistd.h>
+#include <semaphore.h>
 
 #include "config.h"
 
 #include "module-filter-chain/plugin.h"
+#include "module-filter-chain/graph-tail.h"
 
 #include <spa/utils/result.h>
 #include <spa/utils/string.h>
@@ -45,6 +47,7 @@
 
 #include <pipewire/utils.h>
 #include <pipewire/impl.h>
+#include <pipewire/thread.h>
 #include <pipewire/extensions/profiler.h>
 
 #define NAME "filter-chain"
@@ -71,6 +74,8 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
  *
  * - `node.description`: a human readable name for the filter chain
  * - `filter.graph = []`: a description of the filter graph to run, see below
+ * - `filter.threads`: the number of extra realtime threads used to run the
+ *                 independent parts of the graph in parallel, see below. (Default 0)
  * - `capture.props = {}`: properties to be passed to the input stream
  * - `playback.props = {}`: properties to be passed to the output stream
  *
@@ -104,6 +109,21 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
  *    }
  *\endcode
  *
+ * Parts of the graph that are not linked to each other, such as the copies
+ * of the graph for each channel or separate chains of filters, are independent.
+ * With `filter.threads` they are spread over the processing thread and the
+ * extra threads. All plugins must then be safe to run from different
+ * threads at the same time.
+ *
+ * When the input is marked as silent, the graph runs until the tails of
+ * the filters have been output, where the tails of filters that are linked
+ * after each other add up, and is then skipped, producing silence,
+ * until the input is not silent anymore. This is only done when all
+ * plugins in the graph can report their tail, which is currently only the
+ * case for the builtin plugins. The number of processed and skipped quanta
+ * is set in the `filter.quanta.processed` and `filter.quanta.skipped`
+ * properties of the output stream when it is paused.
+ *
  * ### Nodes
  *
  * Nodes describe the processing filters in the graph. Use a tool like lv2ls
@@ -195,7 +215,9 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
  *
  * The convolver can be used to apply an impulse response to a signal. It is usually used
  * for reverbs or virtual surround. The convolver is implemented with a fast FFT
- * implementation.
+ * implementation. Convolvers in the same process that use the same IR share the
+ * transformed IR partitions. Convolvers in a graph that use the same files and
+ * parameters load and resample them only once.
  *
  * The convolver has an input port "In" and an output port "Out". It requires a config
  * section in the node declaration in this format:
@@ -216,6 +238,7 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
  *                 offset = ...
  *                 length = ...
  *                 channel = ...
+ *                 tail_thread = ...
  *             }
  *             ...
  *         }
@@ -241,6 +264,10 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
  * - `offset`  The sample offset in the file as the start of the IR.
  * - `length`  The number of samples to use as the IR.
  * - `channel` The channel to use from the file as the IR.
+ * - `tail_thread` Compute the tail partitions of long IRs in a separate
+ *               thread instead of in the processing thread. This keeps the
+ *               processing time per cycle constant at the cost of an extra
+ *               thread per convolver. Default false.
  *
  * ### Delay
  *
@@ -416,6 +443,7 @@ static const struct spa_dict_item module_props[] = {
 				"    inputs = [ <portname> ... ] "
 				"    outputs = [ <portname> ... ] "
 				"] "
+				"[ filter.threads=<number of extra threads> ] "
 				"[ capture.props=<properties> ] "
 				"[ playback.props=<properties> ] " },
 	{ PW_KEY_MODULE_VERSION, PACKAGE_VERSION },
@@ -438,6 +466,8 @@ static const struct spa_dict_item module_props[] = {
 
 #define MAX_HNDL 64
 #define MAX_SAMPLES 8192
+#define MAX_WORKERS 16
+#define MAX_SUPPORT 32
 
 static float silence_data[MAX_SAMPLES];
 static float discard_data[MAX_SAMPLES];
@@ -503,6 +533,8 @@ struct node {
 	uint32_t n_hndl;
 	void *hndl[MAX_HNDL];
 
+	uint32_t group;
+	uint32_t hndl_index;
 	unsigned int n_deps;
 	unsigned int visited:1;
 	unsigned int disabled:1;
@@ -525,9 +557,10 @@ struct graph_port {
 	unsigned next:1;
 };
 
-struct graph_hndl {
-	const struct fc_descriptor *desc;
-	void **hndl;
+/* a range of handles that does not depend on any other group */
+struct graph_group {
+	uint32_t start;
+	uint32_t n_hndl;
 };
 
 struct graph {
@@ -545,8 +578,26 @@ struct graph {
 	uint32_t n_hndl;
 	struct graph_hndl *hndl;
 
+	uint32_t n_group;
+	struct graph_group *group;
+
 	uint32_t n_control;
 	struct port **control_port;
+
+	/* state of the current cycle, shared with the workers */
+	uint32_t n_samples;
+	uint32_t next_group;
+	sem_t done;
+
+	uint32_t *hndl_deps;
+
+	struct graph_silence silence;
+};
+
+struct worker {
+	struct impl *impl;
+	struct spa_thread *thread;
+	sem_t sem;
 };
 
 struct impl {
@@ -579,6 +630,14 @@ struct impl {
 	long unsigned rate;
 
 	struct graph graph;
+
+	struct spa_support support[MAX_SUPPORT];
+	uint32_t n_support;
+
+	struct spa_thread_utils *thread_utils;
+	bool workers_quit;
+	uint32_t n_workers;
+	struct worker workers[MAX_WORKERS];
 };
 
 static int graph_instantiate(struct graph *graph);
@@ -598,15 +657,125 @@ static void capture_process(void *d)
 	pw_stream_trigger_process(impl->playback);
 }
 
+static void graph_run_group(struct graph *graph, struct graph_group *group)
+{
+	uint32_t i;
+	for (i = 0; i < group->n_hndl; i++) {
+		struct graph_hndl *hndl = &graph->hndl[group->start + i];
+		hndl->desc->run(*hndl->hndl, graph->n_samples);
+	}
+}
+
+/* take groups until there are none left, called from the processing
+ * thread and the workers at the same time */
+static void graph_run_groups(struct graph *graph)
+{
+	uint32_t g;
+	while ((g = __atomic_fetch_add(&graph->next_group, 1, __ATOMIC_RELAXED)) < graph->n_group)
+		graph_run_group(graph, &graph->group[g]);
+}
+
+static void graph_run(struct impl *impl, uint32_t n_samples)
+{
+	struct graph *graph = &impl->graph;
+	uint32_t i, n_wake;
+
+	graph->n_samples = n_samples;
+	graph->next_group = 0;
+
+	n_wake = SPA_MIN(impl->n_workers, graph->n_group > 0 ? graph->n_group - 1 : 0);
+	for (i = 0; i < n_wake; i++)
+		sem_post(&impl->workers[i].sem);
+
+	graph_run_groups(graph);
+
+	/* wait until all workers are done with this cycle */
+	for (i = 0; i < n_wake; i++) {
+		while (sem_wait(&graph->done) < 0 && errno == EINTR);
+	}
+}
+
+static void *worker_thread(void *data)
+{
+	struct worker *w = data;
+	struct impl *impl = w->impl;
+
+	while (true) {
+		while (sem_wait(&w->sem) < 0 && errno == EINTR);
+		if (__atomic_load_n(&impl->workers_quit, __ATOMIC_ACQUIRE))
+			break;
+		graph_run_groups(&impl->graph);
+		sem_post(&impl->graph.done);
+	}
+	return NULL;
+}
+
+static void stop_workers(struct impl *impl)
+{
+	uint32_t i;
+
+	__atomic_store_n(&impl->workers_quit, true, __ATOMIC_RELEASE);
+	for (i = 0; i < impl->n_workers; i++) {
+		sem_post(&impl->workers[i].sem);
+		spa_thread_utils_join(impl->thread_utils, impl->workers[i].thread, NULL);
+		sem_destroy(&impl->workers[i].sem);
+	}
+	if (impl->n_workers > 0)
+		sem_destroy(&impl->graph.done);
+	impl->n_workers = 0;
+}
+
+static int start_workers(struct impl *impl, uint32_t n_workers)
+{
+	struct graph *graph = &impl->graph;
+	struct worker *w;
+	int res;
+
+	/* the processing thread runs one group itself */
+	n_workers = SPA_MIN(n_workers, graph->n_group > 0 ? graph->n_group - 1 : 0);
+	n_workers = SPA_MIN(n_workers, MAX_WORKERS);
+	if (n_workers == 0)
+		return 0;
+
+	if (sem_init(&graph->done, 0, 0) < 0)
+		return -errno;
+
+	while (impl->n_workers < n_workers) {
+		w = &impl->workers[impl->n_workers];
+		w->impl = impl;
+		if (sem_init(&w->sem, 0, 0) < 0) {
+			res = -errno;
+			goto error;
+		}
+		w->thread = spa_thread_utils_create(impl->thread_utils, NULL, worker_thread, w);
+		if (w->thread == NULL) {
+			res = -errno;
+			sem_destroy(&w->sem);
+			goto error;
+		}
+		spa_thread_utils_acquire_rt(impl->thread_utils, w->thread, -1);
+		impl->n_workers++;
+	}
+	pw_log_info("%p: running %u groups with %u extra threads", impl,
+			graph->n_group, impl->n_workers);
+	return 0;
+error:
+	if (impl->n_workers == 0)
+		sem_destroy(&graph->done);
+	stop_workers(impl);
+	return res;
+}
+
 static void playback_process(void *d)
 {
 	struct impl *impl = d;
 	struct pw_buffer *in, *out;
 	struct graph *graph = &impl->graph;
-	uint32_t i, j, insize = 0, outsize = 0, n_hndl = graph->n_hndl;
+	uint32_t i, j, insize = 0, outsize = 0;
 	int32_t stride = 0;
 	struct graph_port *port;
 	struct spa_data *bd;
+	bool silent = true, skip;
 
 	if ((in = pw_stream_dequeue_buffer(impl->capture)) == NULL)
 		pw_log_debug("%p: out of capture buffers: %m", impl);
@@ -636,17 +805,22 @@ static void playback_process(void *d)
 		}
 		insize = i == 0 ? size : SPA_MIN(insize, size);
 		stride = SPA_MAX(stride, bd->chunk->stride);
+		if (!SPA_FLAG_IS_SET(bd->chunk->flags, SPA_CHUNK_FLAG_EMPTY))
+			silent = false;
 	}
 	outsize = insize;
+	for (i = 0; i < out->buffer->n_datas; i++)
+		outsize = SPA_MIN(outsize, out->buffer->datas[i].maxsize);
+
+	skip = graph_silence_skip(&graph->silence, silent, outsize / sizeof(float),
+			graph->hndl, graph->n_hndl);
 
 	for (i = 0; i < out->buffer->n_datas; i++) {
 		bd = &out->buffer->datas[i];
 
-		outsize = SPA_MIN(outsize, bd->maxsize);
-
 		port = i < graph->n_output ? &graph->output[i] : NULL;
 
-		if (port && port->desc)
+		if (port && port->desc && !skip)
 			port->desc->connect_port(*port->hndl, port->port, bd->data);
 		else
 			memset(bd->data, 0, outsize);
@@ -654,15 +828,14 @@ static void playback_process(void *d)
 		bd->chunk->offset = 0;
 		bd->chunk->size = outsize;
 		bd->chunk->stride = stride;
+		bd->chunk->flags = skip ? SPA_CHUNK_FLAG_EMPTY : 0;
 	}
 
-	pw_log_trace_fp("%p: stride:%d in:%d out:%d requested:%"PRIu64" (%"PRIu64")", impl,
-			stride, insize, outsize, out->requested, out->requested * stride);
+	pw_log_trace_fp("%p: stride:%d in:%d out:%d requested:%"PRIu64" (%"PRIu64") skip:%d", impl,
+			stride, insize, outsize, out->requested, out->requested * stride, skip);
 
-	for (i = 0; i < n_hndl; i++) {
-		struct graph_hndl *hndl = &graph->hndl[i];
-		hndl->desc->run(*hndl->hndl, outsize / sizeof(float));
-	}
+	if (!skip)
+		graph_run(impl, outsize / sizeof(float));
 
 done:
 	if (in != NULL)
@@ -927,6 +1100,8 @@ static int parse_params(struct graph *graph, const struct spa_pod *pod)
 static void graph_reset(struct graph *graph)
 {
 	uint32_t i;
+
+	graph->silence.left = -1;
 	for (i = 0; i < graph->n_hndl; i++) {
 		struct graph_hndl *hndl = &graph->hndl[i];
 		const struct fc_descriptor *d = hndl->desc;
@@ -981,6 +1156,25 @@ static void param_latency_changed(struct impl *impl, const struct spa_pod *param
 		pw_stream_update_params(impl->playback, params, 1);
 }
 
+static void update_stats(struct impl *impl)
+{
+	struct graph *graph = &impl->graph;
+	struct spa_dict_item items[2];
+	char processed[32], skipped[32];
+
+	if (impl->playback == NULL)
+		return;
+
+	pw_log_info("%p: processed:%"PRIu64" skipped:%"PRIu64" quanta", impl,
+			graph->silence.n_processed, graph->silence.n_skipped);
+
+	snprintf(processed, sizeof(processed), "%"PRIu64, graph->silence.n_processed);
+	snprintf(skipped, sizeof(skipped), "%"PRIu64, graph->silence.n_skipped);
+	items[0] = SPA_DICT_ITEM_INIT("filter.quanta.processed", processed);
+	items[1] = SPA_DICT_ITEM_INIT("filter.quanta.skipped", skipped);
+	pw_stream_update_properties(impl->playback, &SPA_DICT_INIT_ARRAY(items));
+}
+
 static void state_changed(void *data, enum pw_stream_state old,
 		enum pw_stream_state state, const char *error)
 {
@@ -992,6 +1186,7 @@ static void state_changed(void *data, enum pw_stream_state old,
 		pw_stream_flush(impl->playback, false);
 		pw_stream_flush(impl->capture, false);
 		graph_reset(graph);
+		update_stats(impl);
 		break;
 	case PW_STREAM_STATE_UNCONNECTED:
 		pw_log_info("module %p: unconnected", impl);
@@ -1190,8 +1385,8 @@ static struct plugin *plugin_load(struct impl *impl, const char *type, const cha
 {
 	struct fc_plugin *pl = NULL;
 	struct plugin *hndl;
-	const struct spa_support *support;
-	uint32_t n_support;
+	const struct spa_support *support = impl->support;
+	uint32_t n_support = impl->n_support;
 
 	spa_list_for_each(hndl, &impl->plugin_list, link) {
 		if (spa_streq(hndl->type, type) &&
@@ -1200,8 +1395,6 @@ static struct plugin *plugin_load(struct impl *impl, const char *type, const cha
 			return hndl;
 		}
 	}
-	support = pw_context_get_support(impl->context, &n_support);
-
 	if (spa_streq(type, "builtin")) {
 		pl = load_builtin_plugin(support, n_support, &impl->dsp, path, NULL);
 	}
@@ -1706,6 +1899,15 @@ static void graph_cleanup(struct graph *graph)
 		node_cleanup(node);
 }
 
+static void graph_instantiate_done(struct graph *graph)
+{
+	struct impl *impl = graph->impl;
+	struct plugin *p;
+
+	spa_list_for_each(p, &impl->plugin_list, link)
+		fc_plugin_instantiate_done(p->plugin);
+}
+
 static int graph_instantiate(struct graph *graph)
 {
 	struct impl *impl = graph->impl;
@@ -1769,8 +1971,10 @@ static int graph_instantiate(struct graph *graph)
 				d->activate(node->hndl[i]);
 		}
 	}
+	graph_instantiate_done(graph);
 	return 0;
 error:
+	graph_instantiate_done(graph);
 	graph_cleanup(graph);
 	return res;
 }
@@ -1787,6 +1991,30 @@ static struct node *find_next_node(struct graph *graph)
 	return NULL;
 }
 
+/* give all nodes that are linked to node the same group. Copy nodes don't
+ * run and don't make the nodes they feed depend on each other. */
+static void assign_group(struct node *node, uint32_t group)
+{
+	struct descriptor *desc = node->desc;
+	struct link *link;
+	uint32_t i;
+
+	if (node->group != SPA_ID_INVALID)
+		return;
+	node->group = group;
+	if (node->disabled)
+		return;
+
+	for (i = 0; i < desc->n_input; i++) {
+		spa_list_for_each(link, &node->input_port[i].link_list, input_link)
+			assign_group(link->output->node, group);
+	}
+	for (i = 0; i < desc->n_output; i++) {
+		spa_list_for_each(link, &node->output_port[i].link_list, output_link)
+			assign_group(link->input->node, group);
+	}
+}
+
 static int setup_graph(struct graph *graph, struct spa_json *inputs, struct spa_json *outputs)
 {
 	struct impl *impl = graph->impl;
@@ -1795,7 +2023,10 @@ static int setup_graph(struct graph *graph, struct spa_json *inputs, struct spa_
 	struct link *link;
 	struct graph_port *gp;
 	struct graph_hndl *gh;
-	uint32_t i, j, n_nodes, n_input, n_output, n_control, n_hndl = 0;
+	struct graph_group *gg;
+	struct node **order = NULL;
+	uint32_t i, j, k, l, n_nodes, n_order, n_input, n_output, n_control, n_hndl = 0, n_groups;
+	uint32_t n_links, n_deps;
 	int res;
 	struct descriptor *desc;
 	const struct fc_descriptor *d;
@@ -2004,11 +2235,33 @@ static int setup_graph(struct graph *graph, struct spa_json *inputs, struct spa_
 		}
 	}
 
+	/* find the parts of the graph that are not linked together */
+	n_groups = 0;
+	spa_list_for_each(node, &graph->node_list, link)
+		node->group = SPA_ID_INVALID;
+	spa_list_for_each(node, &graph->node_list, link) {
+		if (node->group == SPA_ID_INVALID)
+			assign_group(node, n_groups++);
+	}
+
 	/* order all nodes based on dependencies */
+	order = calloc(n_nodes, sizeof(struct node *));
 	graph->n_hndl = 0;
 	graph->hndl = calloc(n_nodes * n_hndl, sizeof(struct graph_hndl));
+	graph->n_group = 0;
+	graph->group = calloc(n_groups * n_hndl, sizeof(struct graph_group));
 	graph->n_control = 0;
 	graph->control_port = calloc(n_control, sizeof(struct port *));
+	n_links = 0;
+	spa_list_for_each(link, &graph->link_list, link)
+		n_links++;
+	graph->hndl_deps = calloc(n_links * n_hndl, sizeof(uint32_t));
+	if (order == NULL || graph->hndl == NULL || graph->group == NULL ||
+	    graph->control_port == NULL || graph->hndl_deps == NULL) {
+		res = -errno;
+		goto error;
+	}
+	n_order = 0;
 	while (true) {
 		if ((node = find_next_node(graph)) == NULL)
 			break;
@@ -2016,13 +2269,8 @@ static int setup_graph(struct graph *graph, struct spa_json *inputs, struct spa_
 		desc = node->desc;
 		d = desc->desc;
 
-		if (!node->disabled) {
-			for (i = 0; i < n_hndl; i++) {
-				gh = &graph->hndl[graph->n_hndl++];
-				gh->hndl = &node->hndl[i];
-				gh->desc = d;
-			}
-		}
+		order[n_order++] = node;
+
 		for (i = 0; i < desc->n_output; i++) {
 			spa_list_for_each(link, &node->output_port[i].link_list, output_link)
 				link->input->node->n_deps--;
@@ -2034,8 +2282,46 @@ static int setup_graph(struct graph *graph, struct spa_json *inputs, struct spa_
 			graph->n_control++;
 		}
 	}
+
+	/* make a group with the handles of each instance of each part of
+	 * the graph, in dependency order */
+	n_deps = 0;
+	for (i = 0; i < n_groups; i++) {
+		for (j = 0; j < n_hndl; j++) {
+			gg = &graph->group[graph->n_group];
+			gg->start = graph->n_hndl;
+
+			for (k = 0; k < n_order; k++) {
+				node = order[k];
+				if (node->group != i || node->disabled)
+					continue;
+				node->hndl_index = graph->n_hndl;
+				gh = &graph->hndl[graph->n_hndl++];
+				gh->hndl = &node->hndl[j];
+				gh->desc = node->desc->desc;
+
+				/* the same instance of the nodes linked to our
+				 * inputs, they were added before us */
+				gh->deps = &graph->hndl_deps[n_deps];
+				gh->n_deps = 0;
+				for (l = 0; l < node->desc->n_input; l++) {
+					spa_list_for_each(link, &node->input_port[l].link_list, input_link) {
+						if (link->output->node->disabled)
+							continue;
+						graph->hndl_deps[n_deps++] = link->output->node->hndl_index;
+						gh->n_deps++;
+					}
+				}
+			}
+			gg->n_hndl = graph->n_hndl - gg->start;
+			if (gg->n_hndl > 0)
+				graph->n_group++;
+		}
+	}
+	pw_log_info("graph has %u independent groups", graph->n_group);
 	res = 0;
 error:
+	free(order);
 	return res;
 }
 
@@ -2133,6 +2419,8 @@ static void graph_free(struct graph *graph)
 	free(graph->input);
 	free(graph->output);
 	free(graph->hndl);
+	free(graph->hndl_deps);
+	free(graph->group);
 	free(graph->control_port);
 }
 
@@ -2185,6 +2473,8 @@ static void impl_destroy(struct impl *impl)
 	if (impl->core && impl->do_disconnect)
 		pw_core_disconnect(impl->core);
 
+	stop_workers(impl);
+
 	pw_properties_free(impl->capture_props);
 	pw_properties_free(impl->playback_props);
 	graph_free(&impl->graph);
@@ -2297,6 +2587,7 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 	impl->module = module;
 	impl->context = context;
 	impl->graph.impl = impl;
+	impl->graph.silence = GRAPH_SILENCE_INIT;
 
 	spa_list_init(&impl->plugin_list);
 
@@ -2306,6 +2597,16 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 	impl->dsp.cpu_flags = cpu_iface ? spa_cpu_get_flags(cpu_iface) : 0;
 	dsp_ops_init(&impl->dsp);
 
+	impl->thread_utils = pw_context_get_object(impl->context, SPA_TYPE_INTERFACE_ThreadUtils);
+	if (impl->thread_utils == NULL)
+		impl->thread_utils = pw_thread_utils_get();
+
+	/* plugins get the context support and the thread utils */
+	impl->n_support = SPA_MIN(n_support, MAX_SUPPORT - 1);
+	memcpy(impl->support, support, impl->n_support * sizeof(struct spa_support));
+	impl->support[impl->n_support++] =
+		SPA_SUPPORT_INIT(SPA_TYPE_INTERFACE_ThreadUtils, impl->thread_utils);
+
 	if (pw_properties_get(props, PW_KEY_NODE_GROUP) == NULL)
 		pw_properties_setf(props, PW_KEY_NODE_GROUP, "filter-chain-%u-%u", pid, id);
 	if (pw_properties_get(props, PW_KEY_NODE_LINK_GROUP) == NULL)
@@ -2372,6 +2673,11 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 		goto error;
 	}
 
+	if ((res = start_workers(impl, pw_properties_get_uint32(props, "filter.threads", 0))) < 0) {
+		pw_log_error("can't start threads: %s", spa_strerror(res));
+		goto error;
+	}
+
 	impl->core = pw_context_get_object(impl->context, PW_TYPE_INTERFACE_Core);
 	if (impl->core == NULL) {
 		str = pw_properties_get(props, PW_KEY_REMOTE_NAME);
@@ -0,0 +1,171 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Time spent per quantum in the convolver for growing IR lengths.
+ *
+ * Noise is convolved with a decaying noise IR one quantum at a time,
+ * paced like a real driver would, once with the tail partitions
+ * computed inline and once with them computed in the background thread.
+ * The average and the worst case time of a quantum are reported. Both
+ * runs must produce the same output.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <spa/support/cpu.h>
+#include <spa/utils/result.h>
+
+#include <pipewire/pipewire.h>
+#include <pipewire/thread.h>
+
+#include "pffft.h"
+#include "convolver.h"
+#include "dsp-ops.h"
+
+#define RATE		48000
+#define BLOCK_SIZE	256
+#define TAIL_SIZE	4096
+
+static struct dsp_ops dsp;
+
+static uint64_t get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * SPA_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void fill_noise(float *data, int n_samples, float decay)
+{
+	int i;
+	for (i = 0; i < n_samples; i++)
+		data[i] = (drand48() * 2.0 - 1.0) * expf(-decay * i / RATE);
+}
+
+static int run(const float *ir, int ir_len, const float *in, float *out,
+		int n_samples, int quantum, bool threaded)
+{
+	struct convolver *conv;
+	struct timespec ts;
+	uint64_t t, next, total = 0, worst = 0;
+	int i, res, n_quantums = n_samples / quantum;
+
+	conv = convolver_new(&dsp, BLOCK_SIZE, TAIL_SIZE, ir, ir_len);
+	if (conv == NULL)
+		return -errno;
+	if (threaded &&
+	    (res = convolver_start_thread(conv, pw_thread_utils_get())) < 0)
+		goto done;
+
+	next = get_nsec();
+	for (i = 0; i < n_quantums; i++) {
+		next += (uint64_t)quantum * SPA_NSEC_PER_SEC / RATE;
+		ts.tv_sec = next / SPA_NSEC_PER_SEC;
+		ts.tv_nsec = next % SPA_NSEC_PER_SEC;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+		t = get_nsec();
+		convolver_run(conv, &in[i * quantum], &out[i * quantum], quantum);
+		t = get_nsec() - t;
+		total += t;
+		worst = SPA_MAX(worst, t);
+	}
+	fprintf(stdout, "ir:%6.2fs quantum:%5d %-8s avg:%8.2f us max:%8.2f us\n",
+			(double)ir_len / RATE, quantum, threaded ? "thread" : "inline",
+			(double)total / n_quantums / 1000.0, (double)worst / 1000.0);
+	res = 0;
+done:
+	convolver_free(conv);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	static const float ir_seconds[] = { 0.1f, 0.5f, 1.0f, 2.0f, 5.0f, 10.0f };
+	struct spa_support support[16];
+	struct spa_cpu *cpu_iface;
+	uint32_t i, n_support;
+	int quantum = 256, n_samples = 4 * RATE, res = 0;
+	float *ir = NULL, *in = NULL, *out[2] = { NULL, NULL };
+
+	pw_init(&argc, &argv);
+
+	if (argc > 1)
+		quantum = atoi(argv[1]);
+	if (quantum <= 0 || quantum > TAIL_SIZE) {
+		fprintf(stderr, "usage: %s [quantum]\n", argv[0]);
+		return -1;
+	}
+	n_samples = SPA_ROUND_DOWN(n_samples, quantum);
+
+	n_support = pw_get_support(support, SPA_N_ELEMENTS(support));
+	cpu_iface = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_CPU);
+	dsp.cpu_flags = cpu_iface ? spa_cpu_get_flags(cpu_iface) : 0;
+	dsp_ops_init(&dsp);
+	pffft_select_cpu(dsp.cpu_flags);
+
+	ir = malloc(10 * RATE * sizeof(float));
+	in = malloc(n_samples * sizeof(float));
+	out[0] = malloc(n_samples * sizeof(float));
+	out[1] = malloc(n_samples * sizeof(float));
+	if (ir == NULL || in == NULL || out[0] == NULL || out[1] == NULL) {
+		res = -ENOMEM;
+		goto done;
+	}
+	fill_noise(in, n_samples, 0.0f);
+
+	for (i = 0; i < SPA_N_ELEMENTS(ir_seconds); i++) {
+		int ir_len = ir_seconds[i] * RATE;
+
+		fill_noise(ir, ir_len, 3.0f / ir_seconds[i]);
+
+		if ((res = run(ir, ir_len, in, out[0], n_samples, quantum, false)) < 0 ||
+		    (res = run(ir, ir_len, in, out[1], n_samples, quantum, true)) < 0)
+			goto done;
+
+		if (memcmp(out[0], out[1], n_samples * sizeof(float)) != 0) {
+			fprintf(stderr, "ir:%d threaded output differs\n", ir_len);
+			res = -EIO;
+			goto done;
+		}
+	}
+done:
+	if (res < 0)
+		fprintf(stderr, "error: %s\n", spa_strerror(res));
+	free(ir);
+	free(in);
+	free(out[0]);
+	free(out[1]);
+	dsp_ops_free(&dsp);
+	pw_deinit();
+	return res < 0 ? -1 : 0;
+}
@@ -33,6 +33,7 @@
 #include <spa/utils/json.h>
 #include <spa/utils/result.h>
 #include <spa/support/cpu.h>
+#include <spa/support/thread.h>
 #include <spa/plugins/audioconvert/resample.h>
 
 #include <pipewire/log.h>
@@ -47,6 +48,7 @@
 #define MAX_RATES	32u
 
 static struct dsp_ops *dsp_ops;
+static struct spa_thread_utils *thread_utils;
 
 struct builtin {
 	unsigned long rate;
@@ -84,6 +86,33 @@ static void builtin_cleanup(void * Instance)
 	free(impl);
 }
 
+/* copy and mixer don't keep any state, their output is silent as soon as
+ * their input is */
+static int64_t builtin_no_tail(void * Instance)
+{
+	return 0;
+}
+
+/* the time for the filter output to decay by 100dB */
+static int64_t builtin_get_tail(void * Instance)
+{
+	struct builtin *impl = Instance;
+	struct biquad *bq = &impl->bq;
+	float d = bq->a1 * bq->a1 - 4.0f * bq->a2, r;
+
+	/* largest magnitude of the poles */
+	if (d < 0.0f)
+		r = sqrtf(bq->a2);
+	else
+		r = (fabsf(bq->a1) + sqrtf(d)) / 2.0f;
+
+	if (r >= 1.0f)
+		return -1;
+	if (r < FLT_EPSILON)
+		return 2;
+	return 2 + (int64_t)ceilf(logf(1e-5f) / logf(r));
+}
+
 /** copy */
 static void copy_run(void * Instance, unsigned long SampleCount)
 {
@@ -114,6 +143,7 @@ static const struct fc_descriptor copy_desc = {
 	.connect_port = builtin_connect_port,
 	.run = copy_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_no_tail,
 };
 
 /** mixer */
@@ -233,6 +263,7 @@ static const struct fc_descriptor mixer_desc = {
 	.connect_port = builtin_connect_port,
 	.run = mixer_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_no_tail,
 };
 
 static struct fc_port bq_ports[] = {
@@ -297,6 +328,7 @@ static const struct fc_descriptor bq_lowpass_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_lowpass_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 /** bq_highpass */
@@ -316,6 +348,7 @@ static const struct fc_descriptor bq_highpass_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_highpass_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 /** bq_bandpass */
@@ -335,6 +368,7 @@ static const struct fc_descriptor bq_bandpass_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_bandpass_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 /** bq_lowshelf */
@@ -354,6 +388,7 @@ static const struct fc_descriptor bq_lowshelf_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_lowshelf_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 /** bq_highshelf */
@@ -373,6 +408,7 @@ static const struct fc_descriptor bq_highshelf_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_highshelf_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 /** bq_peaking */
@@ -392,6 +428,7 @@ static const struct fc_descriptor bq_peaking_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_peaking_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 /** bq_notch */
@@ -411,6 +448,7 @@ static const struct fc_descriptor bq_notch_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_notch_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 
@@ -431,16 +469,84 @@ static const struct fc_descriptor bq_allpass_desc = {
 	.connect_port = builtin_connect_port,
 	.run = bq_allpass_run,
 	.cleanup = builtin_cleanup,
+	.get_tail = builtin_get_tail,
 };
 
 /** convolve */
+/* Loaded and resampled IRs, shared between the convolvers of a graph that
+ * use the same files with the same parameters. They are freed when all
+ * instances of the graph were created. */
+struct ir_samples {
+	struct spa_list link;
+	char *key;
+	float *samples;
+	int n_samples;
+};
+
+static struct spa_list ir_samples_list = SPA_LIST_INIT(&ir_samples_list);
+
 struct convolver_impl {
 	unsigned long rate;
 	float *port[64];
 
+	int n_samples;
 	struct convolver *conv;
 };
 
+static char *make_ir_key(char **filenames, float gain, int delay, int offset,
+		int length, int channel, unsigned long rate, int resample_quality)
+{
+	FILE *f;
+	char *key = NULL;
+	size_t size;
+	uint32_t i;
+
+	if ((f = open_memstream(&key, &size)) == NULL)
+		return NULL;
+
+	for (i = 0; i < MAX_RATES && filenames[i]; i++)
+		fprintf(f, "%s:", filenames[i]);
+	fprintf(f, "%g:%d:%d:%d:%d:%lu:%d", gain, delay, offset, length,
+			channel, rate, resample_quality);
+	fclose(f);
+
+	return key;
+}
+
+static struct ir_samples *ir_samples_find(const char *key)
+{
+	struct ir_samples *ir;
+	spa_list_for_each(ir, &ir_samples_list, link) {
+		if (spa_streq(ir->key, key))
+			return ir;
+	}
+	return NULL;
+}
+
+static struct ir_samples *ir_samples_add(char *key, float *samples, int n_samples)
+{
+	struct ir_samples *ir;
+
+	if ((ir = calloc(1, sizeof(*ir))) == NULL)
+		return NULL;
+	ir->key = key;
+	ir->samples = samples;
+	ir->n_samples = n_samples;
+	spa_list_append(&ir_samples_list, &ir->link);
+	return ir;
+}
+
+static void ir_samples_clear(void)
+{
+	struct ir_samples *ir;
+	spa_list_consume(ir, &ir_samples_list, link) {
+		spa_list_remove(&ir->link);
+		free(ir->key);
+		free(ir->samples);
+		free(ir);
+	}
+}
+
 #ifdef HAVE_SNDFILE
 static float *read_samples_from_sf(SNDFILE *f, SF_INFO info, float gain, int delay,
 		int offset, int length, int channel, long unsigned *rate, int *n_samples) {
@@ -643,7 +749,9 @@ static void * convolver_instantiate(const struct fc_descriptor * Descriptor,
 		unsigned long SampleRate, int index, const char *config)
 {
 	struct convolver_impl *impl;
-	float *samples;
+	struct ir_samples *ir = NULL;
+	float *samples = NULL;
+	char *ir_key;
 	int offset = 0, length = 0, channel = index, n_samples, len;
 	uint32_t i = 0;
 	struct spa_json it[3];
@@ -654,6 +762,7 @@ static void * convolver_instantiate(const struct fc_descriptor * Descriptor,
 	int delay = 0;
 	int resample_quality = RESAMPLE_DEFAULT_QUALITY;
 	float gain = 1.0f;
+	bool tail_thread = false;
 	unsigned long rate;
 
 	errno = EINVAL;
@@ -733,6 +842,12 @@ static void * convolver_instantiate(const struct fc_descriptor * Descriptor,
 				return NULL;
 			}
 		}
+		else if (spa_streq(key, "tail_thread")) {
+			if (spa_json_get_bool(&it[1], &tail_thread) <= 0) {
+				pw_log_error("convolver:tail_thread requires a boolean");
+				return NULL;
+			}
+		}
 		else if (spa_json_next(&it[1], &val) < 0)
 			break;
 	}
@@ -746,29 +861,44 @@ static void * convolver_instantiate(const struct fc_descriptor * Descriptor,
 	if (offset < 0)
 		offset = 0;
 
-	if (spa_streq(filenames[0], "/hilbert")) {
-		samples = create_hilbert(filenames[0], gain, delay, offset,
-				length, &n_samples);
-	} else if (spa_streq(filenames[0], "/dirac")) {
-		samples = create_dirac(filenames[0], gain, delay, offset,
-				length, &n_samples);
+	ir_key = make_ir_key(filenames, gain, delay, offset, length, channel,
+			SampleRate, resample_quality);
+	if (ir_key != NULL && (ir = ir_samples_find(ir_key)) != NULL) {
+		pw_log_info("using loaded IR %s", ir_key);
+		free(ir_key);
+		samples = ir->samples;
+		n_samples = ir->n_samples;
 	} else {
-		rate = SampleRate;
-		samples = read_closest(filenames, gain, delay, offset,
-				length, channel, &rate, &n_samples);
-		if (samples != NULL && rate != SampleRate)
-			samples = resample_buffer(samples, &n_samples,
-					rate, SampleRate, resample_quality);
-	}
-	if (samples == NULL) {
-		errno = ENOENT;
-		return NULL;
+		if (spa_streq(filenames[0], "/hilbert")) {
+			samples = create_hilbert(filenames[0], gain, delay, offset,
+					length, &n_samples);
+		} else if (spa_streq(filenames[0], "/dirac")) {
+			samples = create_dirac(filenames[0], gain, delay, offset,
+					length, &n_samples);
+		} else {
+			rate = SampleRate;
+			samples = read_closest(filenames, gain, delay, offset,
+					length, channel, &rate, &n_samples);
+			if (samples != NULL && rate != SampleRate)
+				samples = resample_buffer(samples, &n_samples,
+						rate, SampleRate, resample_quality);
+		}
+		/* without a cache entry, we free the samples ourselves */
+		if (samples != NULL && ir_key != NULL &&
+		    (ir = ir_samples_add(ir_key, samples, n_samples)) != NULL)
+			ir_key = NULL;
+		free(ir_key);
 	}
 
 	for (i = 0; i < MAX_RATES; i++)
 		if (filenames[i])
 			free(filenames[i]);
 
+	if (samples == NULL) {
+		errno = ENOENT;
+		return NULL;
+	}
+
 	if (blocksize <= 0)
 		blocksize = SPA_CLAMP(n_samples, 64, 256);
 	if (tailsize <= 0)
@@ -782,16 +912,28 @@ static void * convolver_instantiate(const struct fc_descriptor * Descriptor,
 		goto error;
 
 	impl->rate = SampleRate;
+	impl->n_samples = n_samples;
 
 	impl->conv = convolver_new(dsp_ops, blocksize, tailsize, samples, n_samples);
 	if (impl->conv == NULL)
 		goto error;
 
-	free(samples);
+	if (tail_thread) {
+		int res;
+		if (thread_utils == NULL)
+			pw_log_warn("convolver:tail_thread needs thread utils");
+		else if ((res = convolver_start_thread(impl->conv, thread_utils)) < 0)
+			pw_log_warn("convolver: can't start tail thread: %s",
+					spa_strerror(res));
+	}
+
+	if (ir == NULL)
+		free(samples);
 
 	return impl;
 error:
-	free(samples);
+	if (ir == NULL)
+		free(samples);
 	free(impl);
 	return NULL;
 }
@@ -834,6 +976,12 @@ static void convolve_run(void * Instance, unsigned long SampleCount)
 	convolver_run(impl->conv, impl->port[1], impl->port[0], SampleCount);
 }
 
+static int64_t convolver_get_tail(void * Instance)
+{
+	struct convolver_impl *impl = Instance;
+	return impl->n_samples;
+}
+
 static const struct fc_descriptor convolve_desc = {
 	.name = "convolver",
 
@@ -845,6 +993,7 @@ static const struct fc_descriptor convolve_desc = {
 	.deactivate = convolver_deactivate,
 	.run = convolve_run,
 	.cleanup = convolver_cleanup,
+	.get_tail = convolver_get_tail,
 };
 
 /** delay */
@@ -966,6 +1115,12 @@ static struct fc_port delay_ports[] = {
 	},
 };
 
+static int64_t delay_get_tail(void * Instance)
+{
+	struct delay_impl *impl = Instance;
+	return impl->buffer_samples;
+}
+
 static const struct fc_descriptor delay_desc = {
 	.name = "delay",
 
@@ -976,6 +1131,7 @@ static const struct fc_descriptor delay_desc = {
 	.connect_port = delay_connect_port,
 	.run = delay_run,
 	.cleanup = delay_cleanup,
+	.get_tail = delay_get_tail,
 };
 
 static const struct fc_descriptor * builtin_descriptor(unsigned long Index)
@@ -1022,14 +1178,21 @@ static const struct fc_descriptor *builtin_make_desc(struct fc_plugin *plugin, c
 	return NULL;
 }
 
+static void builtin_instantiate_done(struct fc_plugin *plugin)
+{
+	ir_samples_clear();
+}
+
 static struct fc_plugin builtin_plugin = {
-	.make_desc = builtin_make_desc
+	.make_desc = builtin_make_desc,
+	.instantiate_done = builtin_instantiate_done,
 };
 
 struct fc_plugin *load_builtin_plugin(const struct spa_support *support, uint32_t n_support,
 		struct dsp_ops *dsp, const char *plugin, const char *config)
 {
 	dsp_ops = dsp;
+	thread_utils = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_ThreadUtils);
 	pffft_select_cpu(dsp->cpu_flags);
 	return &builtin_plugin;
 }
@@ -27,11 +27,36 @@
 #include "convolver.h"
 
 #include <spa/utils/defs.h>
+#include <spa/utils/list.h>
+#include <spa/support/thread.h>
 
+#include <errno.h>
 #include <math.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <string.h>
 
 static struct dsp_ops *dsp;
 
+/* The transformed partitions of an IR, shared between all convolvers
+ * in the process that use the same IR samples and block size. The samples
+ * are not kept, they are matched on their length and a 64 bit hash and
+ * the first partition is transformed again to rule out a collision. */
+struct spectrum {
+	struct spa_list link;
+	int ref;
+
+	uint64_t hash;
+	int blockSize;
+	int irlen;
+
+	int segCount;
+	float **segmentsIr;
+};
+
+static pthread_mutex_t spectrum_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spa_list spectrum_list = SPA_LIST_INIT(&spectrum_list);
+
 struct convolver1 {
 	int blockSize;
 	int segSize;
@@ -40,6 +65,7 @@ struct convolver1 {
 
 	float **segments;
 	float **segmentsIr;
+	struct spectrum *spectrum;
 
 	float *fft_buffer;
 
@@ -96,6 +122,130 @@ static int next_power_of_two(int val)
 	return r;
 }
 
+static uint64_t hash_samples(const float *ir, int irlen)
+{
+	const uint8_t *p = (const uint8_t *)ir;
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t i, n = (size_t)irlen * sizeof(float);
+
+	/* FNV-1a */
+	for (i = 0; i < n; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static void spectrum_free(struct spectrum *s)
+{
+	int i;
+	if (s->segmentsIr) {
+		for (i = 0; i < s->segCount; i++)
+			fft_cpx_free(s->segmentsIr[i]);
+		free(s->segmentsIr);
+	}
+	free(s);
+}
+
+/* transform partition i of the IR */
+static void spectrum_transform(struct convolver1 *conv, const float *ir, int irlen,
+		int i, float *out)
+{
+	int left = irlen - (i * conv->blockSize);
+	int copy = SPA_MIN(conv->blockSize, left);
+
+	dsp_ops_copy(dsp, conv->fft_buffer, &ir[i * conv->blockSize], copy);
+	if (copy < conv->segSize)
+		dsp_ops_clear(dsp, conv->fft_buffer + copy, conv->segSize - copy);
+
+	dsp_ops_fft_run(dsp, conv->fft, 1, conv->fft_buffer, out);
+}
+
+static bool spectrum_matches(struct spectrum *s, struct convolver1 *conv,
+		const float *ir, int irlen)
+{
+	float *check;
+	bool res;
+
+	if ((check = fft_cpx_alloc(conv->fftComplexSize)) == NULL)
+		return false;
+
+	spectrum_transform(conv, ir, irlen, 0, check);
+	res = memcmp(check, s->segmentsIr[0],
+			conv->fftComplexSize * 2 * sizeof(float)) == 0;
+
+	fft_cpx_free(check);
+	return res;
+}
+
+static struct spectrum *spectrum_new(struct convolver1 *conv, const float *ir, int irlen)
+{
+	struct spectrum *s;
+	int i;
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL)
+		return NULL;
+
+	s->ref = 1;
+	s->blockSize = conv->blockSize;
+	s->irlen = irlen;
+	s->segCount = conv->segCount;
+
+	s->segmentsIr = calloc(sizeof(float*), s->segCount);
+	if (s->segmentsIr == NULL)
+		goto error;
+
+	for (i = 0; i < s->segCount; i++) {
+		s->segmentsIr[i] = fft_cpx_alloc(conv->fftComplexSize);
+		if (s->segmentsIr[i] == NULL)
+			goto error;
+
+		spectrum_transform(conv, ir, irlen, i, s->segmentsIr[i]);
+	}
+	return s;
+error:
+	spectrum_free(s);
+	return NULL;
+}
+
+static struct spectrum *spectrum_get(struct convolver1 *conv, const float *ir, int irlen)
+{
+	struct spectrum *s;
+	uint64_t hash = hash_samples(ir, irlen);
+
+	pthread_mutex_lock(&spectrum_lock);
+	spa_list_for_each(s, &spectrum_list, link) {
+		if (s->hash == hash &&
+		    s->blockSize == conv->blockSize &&
+		    s->irlen == irlen &&
+		    spectrum_matches(s, conv, ir, irlen)) {
+			s->ref++;
+			goto done;
+		}
+	}
+	if ((s = spectrum_new(conv, ir, irlen)) != NULL) {
+		s->hash = hash;
+		spa_list_append(&spectrum_list, &s->link);
+	}
+done:
+	pthread_mutex_unlock(&spectrum_lock);
+	return s;
+}
+
+static void spectrum_unref(struct spectrum *s)
+{
+	pthread_mutex_lock(&spectrum_lock);
+	if (--s->ref == 0)
+		spa_list_remove(&s->link);
+	else
+		s = NULL;
+	pthread_mutex_unlock(&spectrum_lock);
+
+	if (s)
+		spectrum_free(s);
+}
+
 static void convolver1_reset(struct convolver1 *conv)
 {
 	int i;
@@ -143,22 +293,15 @@ static struct convolver1 *convolver1_new(int block, const float *ir, int irlen)
 	if (conv->fft_buffer == NULL)
 		goto error;
 
-	conv->segments = calloc(sizeof(float*), conv->segCount);
-	conv->segmentsIr = calloc(sizeof(float*), conv->segCount);
-
-	for (i = 0; i < conv->segCount; i++) {
-		int left = irlen - (i * conv->blockSize);
-		int copy = SPA_MIN(conv->blockSize, left);
+	conv->spectrum = spectrum_get(conv, ir, irlen);
+	if (conv->spectrum == NULL)
+		goto error;
+	conv->segmentsIr = conv->spectrum->segmentsIr;
 
+	conv->segments = calloc(sizeof(float*), conv->segCount);
+	for (i = 0; i < conv->segCount; i++)
 		conv->segments[i] = fft_cpx_alloc(conv->fftComplexSize);
-		conv->segmentsIr[i] = fft_cpx_alloc(conv->fftComplexSize);
 
-		dsp_ops_copy(dsp, conv->fft_buffer, &ir[i * conv->blockSize], copy);
-		if (copy < conv->segSize)
-			dsp_ops_clear(dsp, conv->fft_buffer + copy, conv->segSize - copy);
-
-	        dsp_ops_fft_run(dsp, conv->fft, 1, conv->fft_buffer, conv->segmentsIr[i]);
-	}
 	conv->pre_mult = fft_cpx_alloc(conv->fftComplexSize);
 	conv->conv = fft_cpx_alloc(conv->fftComplexSize);
 	conv->overlap = fft_alloc(conv->blockSize);
@@ -181,10 +324,10 @@ error:
 static void convolver1_free(struct convolver1 *conv)
 {
 	int i;
-	for (i = 0; i < conv->segCount; i++) {
+	for (i = 0; i < conv->segCount; i++)
 		fft_cpx_free(conv->segments[i]);
-		fft_cpx_free(conv->segmentsIr[i]);
-	}
+	if (conv->spectrum)
+		spectrum_unref(conv->spectrum);
 	if (conv->fft)
 		dsp_ops_fft_free(dsp, conv->fft);
 	if (conv->ifft)
@@ -192,7 +335,6 @@ static void convolver1_free(struct convolver1 *conv)
 	if (conv->fft_buffer)
 		fft_free(conv->fft_buffer);
 	free(conv->segments);
-	free(conv->segmentsIr);
 	fft_cpx_free(conv->pre_mult);
 	fft_cpx_free(conv->conv);
 	fft_free(conv->overlap);
@@ -286,10 +428,28 @@ struct convolver
 	float *tailInput;
 	int tailInputFill;
 	int precalculatedPos;
+
+	struct spa_thread_utils *thread_utils;
+	struct spa_thread *thread;
+	sem_t start;
+	sem_t done;
+	float *backgroundInput;
+	bool backgroundBusy;
+	bool backgroundQuit;
 };
 
+static void wait_background(struct convolver *conv)
+{
+	if (conv->backgroundBusy) {
+		while (sem_wait(&conv->done) < 0 && errno == EINTR);
+		conv->backgroundBusy = false;
+	}
+}
+
 void convolver_reset(struct convolver *conv)
 {
+	wait_background(conv);
+
 	if (conv->headConvolver)
 		convolver1_reset(conv->headConvolver);
 	if (conv->tailConvolver0) {
@@ -358,8 +518,84 @@ struct convolver *convolver_new(struct dsp_ops *dsp_ops, int head_block, int tai
 	return conv;
 }
 
+static void *background_thread(void *data)
+{
+	struct convolver *conv = data;
+
+	while (true) {
+		while (sem_wait(&conv->start) < 0 && errno == EINTR);
+		if (conv->backgroundQuit)
+			break;
+		convolver1_run(conv->tailConvolver, conv->backgroundInput,
+				conv->tailOutput, conv->tailBlockSize);
+		sem_post(&conv->done);
+	}
+	return NULL;
+}
+
+int convolver_start_thread(struct convolver *conv, struct spa_thread_utils *utils)
+{
+	int res;
+
+	/* only the tail partitions are worth computing in the background */
+	if (conv->tailConvolver == NULL || conv->thread != NULL)
+		return 0;
+
+	conv->backgroundInput = fft_alloc(conv->tailBlockSize);
+	if (conv->backgroundInput == NULL)
+		return -errno;
+
+	if (sem_init(&conv->start, 0, 0) < 0) {
+		res = -errno;
+		goto error_free;
+	}
+	if (sem_init(&conv->done, 0, 0) < 0) {
+		res = -errno;
+		goto error_start;
+	}
+
+	conv->thread_utils = utils;
+	conv->backgroundQuit = false;
+	conv->thread = spa_thread_utils_create(utils, NULL, background_thread, conv);
+	if (conv->thread == NULL) {
+		res = -errno;
+		goto error_done;
+	}
+	spa_thread_utils_acquire_rt(utils, conv->thread, -1);
+
+	return 0;
+
+error_done:
+	sem_destroy(&conv->done);
+error_start:
+	sem_destroy(&conv->start);
+error_free:
+	fft_free(conv->backgroundInput);
+	conv->backgroundInput = NULL;
+	return res;
+}
+
+static void stop_thread(struct convolver *conv)
+{
+	if (conv->thread == NULL)
+		return;
+
+	wait_background(conv);
+	conv->backgroundQuit = true;
+	sem_post(&conv->start);
+	spa_thread_utils_join(conv->thread_utils, conv->thread, NULL);
+	conv->thread = NULL;
+
+	sem_destroy(&conv->start);
+	sem_destroy(&conv->done);
+	fft_free(conv->backgroundInput);
+	conv->backgroundInput = NULL;
+}
+
 void convolver_free(struct convolver *conv)
 {
+	stop_thread(conv);
+
 	if (conv->headConvolver)
 		convolver1_free(conv->headConvolver);
 	if (conv->tailConvolver0)
@@ -410,9 +646,20 @@ int convolver_run(struct convolver *conv, const float *input, float *output, int
 
 			if (conv->tailPrecalculated &&
 			    conv->tailInputFill == conv->tailBlockSize) {
-				SPA_SWAP(conv->tailPrecalculated, conv->tailOutput);
-				convolver1_run(conv->tailConvolver, conv->tailInput,
-						conv->tailOutput, conv->tailBlockSize);
+				if (conv->thread) {
+					/* the previous block was handed to the thread one
+					 * tail block ago, it should long be finished */
+					wait_background(conv);
+					SPA_SWAP(conv->tailPrecalculated, conv->tailOutput);
+					dsp_ops_copy(dsp, conv->backgroundInput,
+							conv->tailInput, conv->tailBlockSize);
+					conv->backgroundBusy = true;
+					sem_post(&conv->start);
+				} else {
+					SPA_SWAP(conv->tailPrecalculated, conv->tailOutput);
+					convolver1_run(conv->tailConvolver, conv->tailInput,
+							conv->tailOutput, conv->tailBlockSize);
+				}
 			}
 			if (conv->tailInputFill == conv->tailBlockSize) {
 				conv->tailInputFill = 0;
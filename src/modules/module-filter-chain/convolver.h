@@ -27,8 +27,12 @@
 
 #include "dsp-ops.h"
 
+struct spa_thread_utils;
+
 struct convolver *convolver_new(struct dsp_ops *dsp, int block, int tail, const float *ir, int irlen);
 void convolver_free(struct convolver *conv);
 
+int convolver_start_thread(struct convolver *conv, struct spa_thread_utils *utils);
+
 void convolver_reset(struct convolver *conv);
 int convolver_run(struct convolver *conv, const float *input, float *output, int length);
@@ -0,0 +1,105 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef GRAPH_TAIL_H
+#define GRAPH_TAIL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <spa/utils/defs.h>
+
+#include "plugin.h"
+
+/* a plugin instance in the graph, in dependency order */
+struct graph_hndl {
+	const struct fc_descriptor *desc;
+	void **hndl;
+
+	/* indexes of the earlier handles that feed the inputs of this one */
+	uint32_t n_deps;
+	const uint32_t *deps;
+	/* the longest tail along a path ending in this handle */
+	int64_t path_tail;
+};
+
+/* Get the number of samples the graph can still output after its input
+ * became silent. The tails of handles that feed each other add up, the
+ * result is the longest path through the graph. Returns INT64_MAX when a
+ * handle can't report its tail. */
+static inline int64_t graph_hndl_get_tail(struct graph_hndl *hndl, uint32_t n_hndl)
+{
+	uint32_t i, j;
+	int64_t tail = 0, t, in;
+
+	for (i = 0; i < n_hndl; i++) {
+		struct graph_hndl *h = &hndl[i];
+
+		if (h->desc->get_tail == NULL ||
+		    (t = h->desc->get_tail(*h->hndl)) < 0)
+			return INT64_MAX;
+
+		in = 0;
+		for (j = 0; j < h->n_deps; j++)
+			in = SPA_MAX(in, hndl[h->deps[j]].path_tail);
+
+		h->path_tail = in + t;
+		tail = SPA_MAX(tail, h->path_tail);
+	}
+	return tail;
+}
+
+struct graph_silence {
+	/* samples to run after the input became silent, -1 when not silent */
+	int64_t left;
+	uint64_t n_processed;
+	uint64_t n_skipped;
+};
+
+#define GRAPH_SILENCE_INIT	(struct graph_silence) { .left = -1, }
+
+/* When the input is silent, keep running until the tail of the graph has
+ * been played and then skip the graph until the input is not silent
+ * anymore. Returns true when the graph can be skipped. */
+static inline bool graph_silence_skip(struct graph_silence *s, bool silent,
+		uint32_t n_samples, struct graph_hndl *hndl, uint32_t n_hndl)
+{
+	if (!silent) {
+		s->left = -1;
+		s->n_processed++;
+		return false;
+	}
+	if (s->left < 0)
+		s->left = graph_hndl_get_tail(hndl, n_hndl);
+
+	if (s->left > 0) {
+		s->left -= SPA_MIN(s->left, (int64_t)n_samples);
+		s->n_processed++;
+		return false;
+	}
+	s->n_skipped++;
+	return true;
+}
+
+#endif /* GRAPH_TAIL_H */
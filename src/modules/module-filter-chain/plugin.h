@@ -41,6 +41,10 @@
 struct fc_plugin {
 	const struct fc_descriptor *(*make_desc)(struct fc_plugin *plugin, const char *name);
 	void (*unload) (struct fc_plugin *plugin);
+
+	/* called when the instances of a graph were created, the plugin can
+	 * free what it kept to share between them */
+	void (*instantiate_done) (struct fc_plugin *plugin);
 };
 
 struct fc_port {
@@ -88,6 +92,10 @@ struct fc_descriptor {
 	void (*deactivate) (void *instance);
 
 	void (*run) (void *instance, unsigned long SampleCount);
+
+	/* number of samples the instance can still output after its input
+	 * became silent, < 0 when unknown. */
+	int64_t (*get_tail) (void *instance);
 };
 
 static inline void fc_plugin_free(struct fc_plugin *plugin)
@@ -96,6 +104,12 @@ static inline void fc_plugin_free(struct fc_plugin *plugin)
 		plugin->unload(plugin);
 }
 
+static inline void fc_plugin_instantiate_done(struct fc_plugin *plugin)
+{
+	if (plugin->instantiate_done)
+		plugin->instantiate_done(plugin);
+}
+
 static inline void fc_descriptor_free(const struct fc_descriptor *desc)
 {
 	if (desc->free)
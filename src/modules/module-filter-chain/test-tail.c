@@ -0,0 +1,162 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <spa/utils/defs.h>
+
+#include <module-filter-chain/graph-tail.h>
+
+/* the instance is the tail it reports */
+static int64_t fake_get_tail(void *Instance)
+{
+	return *(int64_t*)Instance;
+}
+
+static const struct fc_descriptor fake_desc = {
+	.name = "fake",
+	.get_tail = fake_get_tail,
+};
+
+static const struct fc_descriptor no_tail_desc = {
+	.name = "no-tail",
+};
+
+struct fake_graph {
+	int64_t tail[8];
+	void *inst[8];
+	struct graph_hndl hndl[8];
+	uint32_t n_hndl;
+};
+
+static struct graph_hndl *add_hndl(struct fake_graph *g, int64_t tail,
+		uint32_t n_deps, const uint32_t *deps)
+{
+	uint32_t i = g->n_hndl++;
+	struct graph_hndl *h = &g->hndl[i];
+
+	g->tail[i] = tail;
+	g->inst[i] = &g->tail[i];
+	h->desc = &fake_desc;
+	h->hndl = &g->inst[i];
+	h->n_deps = n_deps;
+	h->deps = deps;
+	return h;
+}
+
+static void test_chain(void)
+{
+	struct fake_graph g = { 0 };
+	static const uint32_t d0[] = { 0 }, d1[] = { 1 };
+
+	/* copy -> delay -> convolver, the tails add up */
+	add_hndl(&g, 0, 0, NULL);
+	add_hndl(&g, 48000, 1, d0);
+	add_hndl(&g, 96000, 1, d1);
+	spa_assert(graph_hndl_get_tail(g.hndl, g.n_hndl) == 144000);
+}
+
+static void test_parallel(void)
+{
+	struct fake_graph g = { 0 };
+	static const uint32_t d0[] = { 0 }, d12[] = { 1, 2 };
+
+	/* copy splits into two branches that are mixed again, the longest
+	 * branch decides */
+	add_hndl(&g, 0, 0, NULL);
+	add_hndl(&g, 1000, 1, d0);
+	add_hndl(&g, 5000, 1, d0);
+	add_hndl(&g, 0, 2, d12);
+	spa_assert(graph_hndl_get_tail(g.hndl, g.n_hndl) == 5000);
+
+	/* an unconnected chain that is longer than the mixed branches */
+	add_hndl(&g, 7000, 0, NULL);
+	spa_assert(graph_hndl_get_tail(g.hndl, g.n_hndl) == 7000);
+}
+
+static void test_unknown(void)
+{
+	struct fake_graph g = { 0 };
+	static const uint32_t d0[] = { 0 };
+
+	add_hndl(&g, 100, 0, NULL);
+	add_hndl(&g, -1, 1, d0);
+	spa_assert(graph_hndl_get_tail(g.hndl, g.n_hndl) == INT64_MAX);
+
+	g.n_hndl = 0;
+	add_hndl(&g, 100, 0, NULL);
+	add_hndl(&g, 100, 1, d0)->desc = &no_tail_desc;
+	spa_assert(graph_hndl_get_tail(g.hndl, g.n_hndl) == INT64_MAX);
+}
+
+static void test_skip(void)
+{
+	struct fake_graph g = { 0 };
+	struct graph_silence s = GRAPH_SILENCE_INIT;
+	static const uint32_t d0[] = { 0 };
+
+	add_hndl(&g, 100, 0, NULL);
+	add_hndl(&g, 200, 1, d0);
+
+	spa_assert(!graph_silence_skip(&s, false, 128, g.hndl, g.n_hndl));
+	spa_assert(s.left == -1);
+
+	/* 300 samples of tail take 3 cycles of 128 */
+	spa_assert(!graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(s.left == 172);
+	spa_assert(!graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(s.left == 44);
+	spa_assert(!graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(s.left == 0);
+	spa_assert(graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(s.n_processed == 4);
+	spa_assert(s.n_skipped == 2);
+
+	/* sound restarts the graph and the next silence plays the tail again */
+	spa_assert(!graph_silence_skip(&s, false, 128, g.hndl, g.n_hndl));
+	spa_assert(s.left == -1);
+	spa_assert(!graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(s.left == 172);
+
+	/* a graph with an unknown tail is never skipped */
+	g.tail[1] = -1;
+	s = GRAPH_SILENCE_INIT;
+	spa_assert(!graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(!graph_silence_skip(&s, true, 128, g.hndl, g.n_hndl));
+	spa_assert(s.n_skipped == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	test_chain();
+	test_parallel();
+	test_unknown();
+	test_skip();
+	return 0;
+}
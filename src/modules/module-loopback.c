@@ -48,6 +48,9 @@
  * It can be used to construct a link between a source and sink but also to
  * create new virtual sinks or sources or to remap channel between streams.
  *
+ * When no delay is configured, the playback buffers are made to point to the
+ * memory of the capture buffers so that the samples are not copied.
+ *
  * Because both ends of the loopback are built with streams, the session manager can
  * manage the configuration and connection with the sinks and sources.
  *
@@ -55,6 +58,8 @@
  *
  * - `node.description`: a human readable name for the loopback streams
  * - `target.delay.sec`: delay in seconds as float (Since 0.3.60)
+ * - `loopback.passthrough`: pass the capture buffer memory to the playback stream
+ *                 when possible instead of copying. (Default `true`)
  * - `capture.props = {}`: properties to be passed to the input stream
  * - `playback.props = {}`: properties to be passed to the output stream
  *
@@ -121,6 +126,9 @@
 PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 #define PW_LOG_TOPIC_DEFAULT mod_topic
 
+#define CAPTURE_BUFFERS		4
+#define MAX_CAPTURE_BUFFERS	32
+
 static const struct spa_dict_item module_props[] = {
 	{ PW_KEY_MODULE_AUTHOR, "Wim Taymans <wim.taymans@gmail.com>" },
 	{ PW_KEY_MODULE_DESCRIPTION, "Create loopback streams" },
@@ -131,6 +139,7 @@ static const struct spa_dict_item module_props[] = {
 				"[ audio.channels=<number of channels> ] "
 				"[ audio.position=<channel map> ] "
 				"[ target.delay.sec=<delay as seconds in float> ] "
+				"[ loopback.passthrough=<avoid copies> ] "
 				"[ capture.props=<properties> ] "
 				"[ playback.props=<properties> ] " },
 	{ PW_KEY_MODULE_VERSION, PACKAGE_VERSION },
@@ -173,11 +182,30 @@ struct impl {
 
 	unsigned int do_disconnect:1;
 	unsigned int recalc_delay:1;
+	unsigned int passthrough:1;
+
+	struct pw_loop *data_loop;
 
 	float target_delay;
 	struct spa_ringbuffer buffer;
 	uint8_t *buffer_data;
 	uint32_t buffer_size;
+
+	struct spa_list out_buffers;
+};
+
+/* A playback buffer. When the playback buffer points to the memory of a
+ * capture buffer, we keep the capture buffer until the playback buffer is
+ * dequeued again, which is when the playback side is done with it. */
+struct out_buffer {
+	struct spa_list link;
+	struct pw_buffer *buffer;
+	struct pw_buffer *in;
+	uint32_t n_datas;
+	struct {
+		void *data;
+		uint32_t maxsize;
+	} orig[];
 };
 
 static void capture_destroy(void *d)
@@ -215,6 +243,47 @@ static void capture_process(void *d)
 	pw_stream_trigger_process(impl->playback);
 }
 
+/* restore the memory of the playback buffer and give back the capture
+ * buffer it pointed to */
+static void release_out_buffer(struct impl *impl, struct out_buffer *ob, bool requeue)
+{
+	uint32_t i;
+
+	if (ob->in == NULL)
+		return;
+
+	for (i = 0; i < ob->n_datas; i++) {
+		struct spa_data *d = &ob->buffer->buffer->datas[i];
+		d->data = ob->orig[i].data;
+		d->maxsize = ob->orig[i].maxsize;
+	}
+	if (requeue && impl->capture != NULL)
+		pw_stream_queue_buffer(impl->capture, ob->in);
+	ob->in = NULL;
+}
+
+static bool can_passthrough(struct impl *impl, struct pw_buffer *in, struct pw_buffer *out)
+{
+	struct out_buffer *ob = out->user_data;
+	uint32_t i;
+
+	if (!impl->passthrough || impl->buffer_size > 0 || ob == NULL ||
+	    in->buffer->n_datas != ob->n_datas)
+		return false;
+
+	/* we can only pass plain memory to a consumer that allows us to change
+	 * the data pointer */
+	for (i = 0; i < ob->n_datas; i++) {
+		struct spa_data *id = &in->buffer->datas[i];
+		struct spa_data *od = &out->buffer->datas[i];
+		if (id->type != SPA_DATA_MemPtr || id->data == NULL ||
+		    od->type != SPA_DATA_MemPtr ||
+		    !SPA_FLAG_IS_SET(od->flags, SPA_DATA_FLAG_DYNAMIC))
+			return false;
+	}
+	return true;
+}
+
 static void playback_process(void *d)
 {
 	struct impl *impl = d;
@@ -231,8 +300,35 @@ static void playback_process(void *d)
 
 	if ((out = pw_stream_dequeue_buffer(impl->playback)) == NULL)
 		pw_log_debug("out of playback buffers: %m");
+	else if (out->user_data != NULL)
+		release_out_buffer(impl, out->user_data, true);
 
-	if (in != NULL && out != NULL) {
+	if (in != NULL && out != NULL && can_passthrough(impl, in, out)) {
+		struct out_buffer *ob = out->user_data;
+		uint32_t outsize = UINT32_MAX;
+		int32_t stride = 0;
+
+		for (i = 0; i < in->buffer->n_datas; i++) {
+			struct spa_data *id = &in->buffer->datas[i];
+			uint32_t offs = SPA_MIN(id->chunk->offset, id->maxsize);
+
+			outsize = SPA_MIN(outsize, SPA_MIN(id->chunk->size, id->maxsize - offs));
+			stride = SPA_MAX(stride, id->chunk->stride);
+		}
+		for (i = 0; i < out->buffer->n_datas; i++) {
+			struct spa_data *id = &in->buffer->datas[i];
+			struct spa_data *od = &out->buffer->datas[i];
+
+			od->data = id->data;
+			od->maxsize = id->maxsize;
+			od->chunk->offset = SPA_MIN(id->chunk->offset, id->maxsize);
+			od->chunk->size = outsize;
+			od->chunk->stride = stride;
+			od->chunk->flags = id->chunk->flags;
+		}
+		ob->in = in;
+		in = NULL;
+	} else if (in != NULL && out != NULL) {
 		uint32_t outsize = UINT32_MAX;
 		int32_t stride = 0;
 		struct spa_data *d;
@@ -268,21 +364,30 @@ static void playback_process(void *d)
 			buffer_size = outsize;
 		}
 		for (i = 0; i < out->buffer->n_datas; i++) {
+			bool empty;
+
 			d = &out->buffer->datas[i];
 
 			outsize = SPA_MIN(outsize, d->maxsize);
 
-			if (i < in->buffer->n_datas)
+			if (i < in->buffer->n_datas) {
 				spa_ringbuffer_read_data(&impl->buffer,
 						src[i], buffer_size,
 						r % buffer_size,
 						d->data, outsize);
-			else
+				/* with a delay buffer, silent input does not mean
+				 * silent output */
+				empty = impl->buffer_size == 0 &&
+					SPA_FLAG_IS_SET(in->buffer->datas[i].chunk->flags,
+							SPA_CHUNK_FLAG_EMPTY);
+			} else {
 				memset(d->data, 0, outsize);
-
+				empty = true;
+			}
 			d->chunk->offset = 0;
 			d->chunk->size = outsize;
 			d->chunk->stride = stride;
+			SPA_FLAG_UPDATE(d->chunk->flags, SPA_CHUNK_FLAG_EMPTY, empty);
 		}
 		if (impl->buffer_size > 0) {
 			r += outsize;
@@ -389,12 +494,35 @@ static void capture_param_changed(void *data, uint32_t id, const struct spa_pod
 	}
 }
 
+static int do_forget_in(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+	struct pw_buffer *in = *(struct pw_buffer **)data;
+	struct out_buffer *ob;
+
+	spa_list_for_each(ob, &impl->out_buffers, link)
+		if (ob->in == in)
+			release_out_buffer(impl, ob, false);
+	return 0;
+}
+
+static void capture_remove_buffer(void *data, struct pw_buffer *buffer)
+{
+	struct impl *impl = data;
+	/* the capture buffer memory goes away, make sure no playback buffer
+	 * points to it anymore */
+	pw_loop_invoke(impl->data_loop, do_forget_in, 0, &buffer, sizeof(buffer),
+			true, impl);
+}
+
 static const struct pw_stream_events in_stream_events = {
 	PW_VERSION_STREAM_EVENTS,
 	.destroy = capture_destroy,
 	.process = capture_process,
 	.state_changed = stream_state_changed,
 	.param_changed = capture_param_changed,
+	.remove_buffer = capture_remove_buffer,
 };
 
 static void playback_destroy(void *d)
@@ -414,19 +542,67 @@ static void playback_param_changed(void *data, uint32_t id, const struct spa_pod
 		break;
 	}
 }
+
+static void playback_add_buffer(void *data, struct pw_buffer *buffer)
+{
+	struct impl *impl = data;
+	struct out_buffer *ob;
+	uint32_t i, n_datas = buffer->buffer->n_datas;
+
+	ob = calloc(1, sizeof(*ob) + n_datas * sizeof(ob->orig[0]));
+	if (ob == NULL)
+		return;
+
+	ob->buffer = buffer;
+	ob->n_datas = n_datas;
+	for (i = 0; i < n_datas; i++) {
+		ob->orig[i].data = buffer->buffer->datas[i].data;
+		ob->orig[i].maxsize = buffer->buffer->datas[i].maxsize;
+	}
+	spa_list_append(&impl->out_buffers, &ob->link);
+	buffer->user_data = ob;
+}
+
+static int do_remove_out(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+	struct out_buffer *ob = *(struct out_buffer **)data;
+
+	release_out_buffer(impl, ob, true);
+	spa_list_remove(&ob->link);
+	return 0;
+}
+
+static void playback_remove_buffer(void *data, struct pw_buffer *buffer)
+{
+	struct impl *impl = data;
+	struct out_buffer *ob = buffer->user_data;
+
+	if (ob == NULL)
+		return;
+
+	pw_loop_invoke(impl->data_loop, do_remove_out, 0, &ob, sizeof(ob),
+			true, impl);
+	buffer->user_data = NULL;
+	free(ob);
+}
+
 static const struct pw_stream_events out_stream_events = {
 	PW_VERSION_STREAM_EVENTS,
 	.destroy = playback_destroy,
 	.process = playback_process,
 	.state_changed = stream_state_changed,
 	.param_changed = playback_param_changed,
+	.add_buffer = playback_add_buffer,
+	.remove_buffer = playback_remove_buffer,
 };
 
 static int setup_streams(struct impl *impl)
 {
 	int res;
 	uint32_t n_params;
-	const struct spa_pod *params[1];
+	const struct spa_pod *params[2];
 	uint8_t buffer[1024];
 	struct spa_pod_builder b;
 
@@ -469,6 +645,13 @@ static int setup_streams(struct impl *impl)
 	spa_pod_builder_init(&b, buffer, sizeof(buffer));
 	params[n_params++] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat,
 			&impl->capture_info);
+	if (impl->passthrough)
+		/* the playback buffers can hold on to capture buffers, ask for
+		 * enough of them so that the capture side never runs out */
+		params[n_params++] = spa_pod_builder_add_object(&b,
+				SPA_TYPE_OBJECT_ParamBuffers, SPA_PARAM_Buffers,
+				SPA_PARAM_BUFFERS_buffers, SPA_POD_CHOICE_RANGE_Int(
+					CAPTURE_BUFFERS, CAPTURE_BUFFERS, MAX_CAPTURE_BUFFERS));
 	if ((res = pw_stream_connect(impl->capture,
 			PW_DIRECTION_INPUT,
 			PW_ID_ANY,
@@ -516,6 +699,8 @@ static const struct pw_proxy_events core_proxy_events = {
 
 static void impl_destroy(struct impl *impl)
 {
+	struct out_buffer *ob;
+
 	/* deactivate both streams before destroying any of them */
 	if (impl->capture)
 		pw_stream_set_active(impl->capture, false);
@@ -527,6 +712,11 @@ static void impl_destroy(struct impl *impl)
 	if (impl->playback)
 		pw_stream_destroy(impl->playback);
 
+	spa_list_consume(ob, &impl->out_buffers, link) {
+		spa_list_remove(&ob->link);
+		free(ob);
+	}
+
 	if (impl->core && impl->do_disconnect)
 		pw_core_disconnect(impl->core);
 
@@ -636,6 +826,8 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 
 	impl->module = module;
 	impl->context = context;
+	impl->data_loop = pw_data_loop_get_loop(pw_context_get_data_loop(context));
+	spa_list_init(&impl->out_buffers);
 
 	if (pw_properties_get(props, PW_KEY_NODE_GROUP) == NULL)
 		pw_properties_setf(props, PW_KEY_NODE_GROUP, "loopback-%u-%u", pid, id);
@@ -671,6 +863,8 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 	copy_props(impl, props, PW_KEY_MEDIA_NAME);
 	copy_props(impl, props, "resample.prefill");
 
+	impl->passthrough = pw_properties_get_bool(props, "loopback.passthrough", true);
+
 	if ((str = pw_properties_get(props, PW_KEY_NODE_NAME)) == NULL) {
 		pw_properties_setf(props, PW_KEY_NODE_NAME,
 				"loopback-%u-%u", pid, id);
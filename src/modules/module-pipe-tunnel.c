@@ -34,6 +34,7 @@
 #include <signal.h>
 #include <limits.h>
 #include <math.h>
+#include <sys/uio.h>
 
 #include "config.h"
 
@@ -60,6 +61,7 @@
  *
  * - `tunnel.mode`: the desired tunnel to create. (Default `playback`)
  * - `pipe.filename`: the filename of the pipe.
+ * - `pipe.thread`: do the pipe I/O in a separate thread. (Default `false`)
  * - `stream.props`: Extra properties for the local stream.
  *
  * When `tunnel.mode` is `capture`, a capture stream on the default source is
@@ -78,6 +80,12 @@
  * `/tmp/fifo_output` will be created that can be written and read respectively,
  * depending on the selected `tunnel.mode`.
  *
+ * By default, the pipe is read and written from the processing thread. When
+ * `pipe.thread` is true, the samples go through a ringbuffer of one second
+ * that is drained or filled by a separate thread, so that a slow or stalled
+ * process on the other end of the pipe does not cause xruns in the graph.
+ * The number of overruns and underruns of the ringbuffer are logged.
+ *
  * ## General options
  *
  * Options with well-known behavior.
@@ -107,6 +115,7 @@
  *         tunnel.mode = playback
  *         # Set the pipe name to tunnel to
  *         pipe.filename = "/tmp/fifo_output"
+ *         #pipe.thread = false
  *         #audio.format=<sample format>
  *         #audio.rate=<sample rate>
  *         #audio.channels=<number of channels>
@@ -145,6 +154,7 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 			"[ audio.position=<channel map> ] "			\
 			"[ tunnel.mode=capture|playback|sink|source "		\
 			"[ pipe.filename=<filename> ]"				\
+			"[ pipe.thread=<do I/O in a thread> ]"			\
 			"[ stream.props=<properties> ] "
 
 
@@ -187,6 +197,22 @@ struct impl {
 	unsigned int do_disconnect:1;
 	uint32_t leftover_count;
 	uint8_t *leftover;
+
+	struct pw_thread_loop *thread_loop;
+	struct pw_loop *thread_loop_loop;
+	struct spa_source *io_source;
+	struct spa_source *wakeup;
+	struct spa_source *report_timer;
+
+	struct spa_ringbuffer ring;
+	uint8_t *ring_data;
+	uint32_t ring_size;
+	uint32_t io_mask;
+
+	uint32_t overruns;
+	uint32_t underruns;
+	uint32_t reported_overruns;
+	uint32_t reported_underruns;
 };
 
 static void stream_destroy(void *d)
@@ -214,6 +240,174 @@ static void stream_state_changed(void *d, enum pw_stream_state old,
 	}
 }
 
+static inline void ring_iovec(struct impl *impl, uint32_t index, uint32_t len,
+		struct iovec *iov)
+{
+	uint32_t offset = index & (impl->ring_size - 1);
+	iov[0].iov_base = SPA_PTROFF(impl->ring_data, offset, void);
+	iov[0].iov_len = SPA_MIN(len, impl->ring_size - offset);
+	iov[1].iov_base = impl->ring_data;
+	iov[1].iov_len = len - iov[0].iov_len;
+}
+
+static void update_io(struct impl *impl, uint32_t mask)
+{
+	if (impl->io_mask != mask) {
+		impl->io_mask = mask;
+		pw_loop_update_io(impl->thread_loop_loop, impl->io_source, mask);
+	}
+}
+
+/* io thread, write everything from the ringbuffer into the pipe, wait
+ * for the pipe to become writable when it is full */
+static void ring_flush(struct impl *impl)
+{
+	struct iovec iov[2];
+	uint32_t index;
+	int32_t avail;
+	ssize_t written;
+
+	while ((avail = spa_ringbuffer_get_read_index(&impl->ring, &index)) > 0) {
+		ring_iovec(impl, index, avail, iov);
+
+		written = writev(impl->fd, iov, 2);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pw_log_warn("failed to write to pipe (%s): %m",
+						impl->filename);
+			break;
+		}
+		spa_ringbuffer_read_update(&impl->ring, index + written);
+	}
+	update_io(impl, avail > 0 ? SPA_IO_OUT : 0);
+}
+
+/* io thread, read from the pipe into the ringbuffer, stop polling the
+ * pipe when the ringbuffer is full */
+static void ring_fill(struct impl *impl)
+{
+	struct iovec iov[2];
+	uint32_t index;
+	int32_t filled;
+	ssize_t nread;
+
+	while (true) {
+		filled = spa_ringbuffer_get_write_index(&impl->ring, &index);
+		if (filled >= (int32_t)impl->ring_size) {
+			if (impl->io_mask & SPA_IO_IN)
+				impl->overruns++;
+			update_io(impl, 0);
+			return;
+		}
+		ring_iovec(impl, index, impl->ring_size - filled, iov);
+
+		nread = readv(impl->fd, iov, 2);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pw_log_warn("failed to read from pipe (%s): %m",
+						impl->filename);
+			break;
+		}
+		if (nread == 0)
+			break;
+		spa_ringbuffer_write_update(&impl->ring, index + nread);
+	}
+	update_io(impl, SPA_IO_IN);
+}
+
+static void on_pipe_io(void *data, int fd, uint32_t mask)
+{
+	struct impl *impl = data;
+
+	if (mask & SPA_IO_OUT)
+		ring_flush(impl);
+	if (mask & SPA_IO_IN)
+		ring_fill(impl);
+}
+
+static void on_wakeup(void *data, uint64_t count)
+{
+	struct impl *impl = data;
+
+	if (impl->direction == PW_DIRECTION_INPUT)
+		ring_flush(impl);
+	else if (!(impl->io_mask & SPA_IO_IN))
+		ring_fill(impl);
+}
+
+static void on_report_timeout(void *data, uint64_t expirations)
+{
+	struct impl *impl = data;
+	uint32_t overruns = impl->overruns, underruns = impl->underruns;
+
+	if (overruns != impl->reported_overruns ||
+	    underruns != impl->reported_underruns) {
+		pw_log_info("pipe '%s': %u overruns, %u underruns",
+				impl->filename, overruns, underruns);
+		impl->reported_overruns = overruns;
+		impl->reported_underruns = underruns;
+	}
+}
+
+/* processing thread, take the samples from the stream into the ringbuffer */
+static void playback_ring_process(struct impl *impl, struct pw_buffer *buf)
+{
+	uint32_t i, size, offs, index;
+	int32_t filled;
+
+	for (i = 0; i < buf->buffer->n_datas; i++) {
+		struct spa_data *d = &buf->buffer->datas[i];
+
+		offs = SPA_MIN(d->chunk->offset, d->maxsize);
+		size = SPA_MIN(d->chunk->size, d->maxsize - offs);
+
+		filled = spa_ringbuffer_get_write_index(&impl->ring, &index);
+		if (filled + size > impl->ring_size) {
+			/* the reader of the pipe can't keep up, drop */
+			impl->overruns++;
+			size = SPA_ROUND_DOWN(impl->ring_size - SPA_MIN((uint32_t)filled,
+						impl->ring_size), impl->frame_size);
+		}
+		spa_ringbuffer_write_data(&impl->ring, impl->ring_data, impl->ring_size,
+				index & (impl->ring_size - 1),
+				SPA_PTROFF(d->data, offs, void), size);
+		spa_ringbuffer_write_update(&impl->ring, index + size);
+	}
+	pw_loop_signal_event(impl->thread_loop_loop, impl->wakeup);
+}
+
+/* processing thread, fill the stream buffer from the ringbuffer */
+static void capture_ring_process(struct impl *impl, struct pw_buffer *buf)
+{
+	struct spa_data *d = &buf->buffer->datas[0];
+	uint32_t req, index;
+	int32_t avail;
+
+	if ((req = buf->requested * impl->frame_size) == 0)
+		req = 4096 * impl->frame_size;
+	req = SPA_MIN(req, d->maxsize);
+
+	avail = spa_ringbuffer_get_read_index(&impl->ring, &index);
+	avail = SPA_ROUND_DOWN(SPA_MAX(avail, 0), (int32_t)impl->frame_size);
+	if ((uint32_t)avail < req) {
+		impl->underruns++;
+		req = avail;
+	}
+	spa_ringbuffer_read_data(&impl->ring, impl->ring_data, impl->ring_size,
+			index & (impl->ring_size - 1), d->data, req);
+	spa_ringbuffer_read_update(&impl->ring, index + req);
+
+	d->chunk->offset = 0;
+	d->chunk->stride = impl->frame_size;
+	d->chunk->size = req;
+
+	pw_loop_signal_event(impl->thread_loop_loop, impl->wakeup);
+}
+
 static void playback_stream_process(void *data)
 {
 	struct impl *impl = data;
@@ -225,6 +419,11 @@ static void playback_stream_process(void *data)
 		pw_log_debug("out of buffers: %m");
 		return;
 	}
+	if (impl->thread_loop != NULL) {
+		playback_ring_process(impl, buf);
+		pw_stream_queue_buffer(impl->stream, buf);
+		return;
+	}
 
 	for (i = 0; i < buf->buffer->n_datas; i++) {
 		struct spa_data *d;
@@ -265,6 +464,11 @@ static void capture_stream_process(void *data)
 		pw_log_debug("out of buffers: %m");
 		return;
 	}
+	if (impl->thread_loop != NULL) {
+		capture_ring_process(impl, buf);
+		pw_stream_queue_buffer(impl->stream, buf);
+		return;
+	}
 
 	d = &buf->buffer->datas[0];
 
@@ -420,6 +624,44 @@ error:
 	return res;
 }
 
+static int create_thread(struct impl *impl)
+{
+	struct timespec value, interval;
+	uint32_t size;
+
+	size = impl->info.rate * impl->frame_size;
+	while (size & (size - 1))
+		size += size & -size;
+
+	impl->ring_size = size;
+	impl->ring_data = calloc(1, size);
+	if (impl->ring_data == NULL)
+		return -errno;
+	spa_ringbuffer_init(&impl->ring);
+
+	impl->thread_loop = pw_thread_loop_new("pipe-tunnel", NULL);
+	if (impl->thread_loop == NULL)
+		return -errno;
+	impl->thread_loop_loop = pw_thread_loop_get_loop(impl->thread_loop);
+
+	impl->io_mask = impl->direction == PW_DIRECTION_INPUT ? 0 : SPA_IO_IN;
+	impl->io_source = pw_loop_add_io(impl->thread_loop_loop, impl->fd,
+			impl->io_mask, false, on_pipe_io, impl);
+	impl->wakeup = pw_loop_add_event(impl->thread_loop_loop, on_wakeup, impl);
+	impl->report_timer = pw_loop_add_timer(impl->thread_loop_loop,
+			on_report_timeout, impl);
+	if (impl->io_source == NULL || impl->wakeup == NULL ||
+	    impl->report_timer == NULL)
+		return -errno;
+
+	value.tv_sec = interval.tv_sec = 1;
+	value.tv_nsec = interval.tv_nsec = 0;
+	pw_loop_update_timer(impl->thread_loop_loop, impl->report_timer,
+			&value, &interval, false);
+
+	return pw_thread_loop_start(impl->thread_loop);
+}
+
 static void core_error(void *data, uint32_t id, int seq, int res, const char *message)
 {
 	struct impl *impl = data;
@@ -454,6 +696,9 @@ static void impl_destroy(struct impl *impl)
 		pw_stream_destroy(impl->stream);
 	if (impl->core && impl->do_disconnect)
 		pw_core_disconnect(impl->core);
+	if (impl->thread_loop)
+		pw_thread_loop_destroy(impl->thread_loop);
+	free(impl->ring_data);
 
 	if (impl->filename) {
 		if (impl->unlink_fifo)
@@ -715,6 +960,12 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 	if ((res = create_fifo(impl)) < 0)
 		goto error;
 
+	if (pw_properties_get_bool(props, "pipe.thread", false) &&
+	    (res = create_thread(impl)) < 0) {
+		pw_log_error("can't create io thread: %s", spa_strerror(res));
+		goto error;
+	}
+
 	if ((res = create_stream(impl)) < 0)
 		goto error;
 
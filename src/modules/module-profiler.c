@@ -29,6 +29,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "config.h"
 
@@ -75,6 +76,8 @@ PW_LOG_TOPIC(mod_topic, "mod." NAME);
 #define MIN_FLUSH		(16 * 1024)
 #define DEFAULT_IDLE		5
 #define DEFAULT_INTERVAL	1
+#define HISTOGRAM_BUFFER	(256 * 1024)
+#define HISTOGRAM_INTERVAL	SPA_NSEC_PER_SEC
 
 int pw_protocol_native_ext_profiler_init(struct pw_context *context);
 
@@ -101,6 +104,7 @@ struct impl {
 	struct spa_hook global_listener;
 
 	int64_t count;
+	uint64_t histogram_nsec;
 	uint32_t busy;
 	uint32_t empty;
 	struct spa_source *flush_timeout;
@@ -111,7 +115,7 @@ struct impl {
 	uint8_t tmp[TMP_BUFFER];
 	uint8_t data[MAX_BUFFER];
 
-	uint8_t flush[MAX_BUFFER + sizeof(struct spa_pod_struct)];
+	uint8_t flush[MAX_BUFFER + HISTOGRAM_BUFFER + sizeof(struct spa_pod_struct)];
 };
 
 struct resource_data {
@@ -150,6 +154,50 @@ static void stop_flush(struct impl *impl)
 	impl->flushing = false;
 }
 
+/* The histograms live in the shared activation memory and are too big to
+ * send every cycle, add them periodically in their own objects, one for
+ * each running follower. */
+static uint32_t add_histograms(struct impl *impl, void *data, uint32_t size)
+{
+	struct spa_pod_builder b;
+	struct spa_pod_frame f[1];
+	struct pw_impl_node *driver, *n;
+	uint32_t offset = 0;
+
+	spa_pod_builder_init(&b, data, size);
+
+	spa_list_for_each(driver, &impl->context->driver_list, driver_link) {
+		if (driver->info.state != PW_NODE_STATE_RUNNING)
+			continue;
+
+		spa_list_for_each(n, &driver->follower_list, follower_link) {
+			struct pw_node_activation *a = n->rt.activation;
+
+			if (n == driver || a == NULL ||
+			    n->info.state != PW_NODE_STATE_RUNNING)
+				continue;
+
+			spa_pod_builder_push_object(&b, &f[0],
+					SPA_TYPE_OBJECT_Profiler, 0);
+			spa_pod_builder_prop(&b, SPA_PROFILER_followerHistogram, 0);
+			spa_pod_builder_add_struct(&b,
+				SPA_POD_Int(n->info.id),
+				SPA_POD_Int(PW_NODE_ACTIVATION_HIST_MIN_SHIFT),
+				SPA_POD_Int(PW_NODE_ACTIVATION_HIST_SUB),
+				SPA_POD_Array(sizeof(uint32_t), SPA_TYPE_Int,
+					PW_NODE_ACTIVATION_HIST_BUCKETS, a->wakeup_hist.count),
+				SPA_POD_Array(sizeof(uint32_t), SPA_TYPE_Int,
+					PW_NODE_ACTIVATION_HIST_BUCKETS, a->run_hist.count));
+			spa_pod_builder_pop(&b, &f[0]);
+
+			if (b.state.offset > size)
+				return offset;
+			offset = b.state.offset;
+		}
+	}
+	return offset;
+}
+
 static void flush_timeout(void *data, uint64_t expirations)
 {
 	struct impl *impl = data;
@@ -157,6 +205,8 @@ static void flush_timeout(void *data, uint64_t expirations)
 	uint32_t idx;
 	struct spa_pod_struct *p;
 	struct pw_resource *resource;
+	struct timespec ts;
+	uint64_t now;
 
 	avail = spa_ringbuffer_get_read_index(&impl->buffer, &idx);
 
@@ -177,6 +227,15 @@ static void flush_timeout(void *data, uint64_t expirations)
 			SPA_PTROFF(p, sizeof(struct spa_pod_struct), void), avail);
 	spa_ringbuffer_read_update(&impl->buffer, idx + avail);
 
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = SPA_TIMESPEC_TO_NSEC(&ts);
+	if (now >= impl->histogram_nsec + HISTOGRAM_INTERVAL) {
+		p->pod.size += add_histograms(impl,
+				SPA_PTROFF(p, sizeof(struct spa_pod_struct) + avail, void),
+				HISTOGRAM_BUFFER);
+		impl->histogram_nsec = now;
+	}
+
 	spa_list_for_each(resource, &impl->global->resource_list, link)
 		pw_profiler_resource_profile(resource, &p->pod);
 }
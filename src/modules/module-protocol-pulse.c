@@ -87,6 +87,8 @@
  *     #pulse.min.quantum      = 256/48000     # 5ms
  *     #pulse.default.format   = F32
  *     #pulse.default.position = [ FL FR ]
+ *     #pulse.shm              = false
+ *     #pulse.srbchannel       = false
  *     # These overrides are only applied when running in a vm.
  *     vm.overrides = {
  *         pulse.min.quantum = 1024/48000      # 22ms
@@ -183,6 +185,26 @@
  * pulseaudio client asks for too small quantums. Lowering this value might
  * decrease latency at the expense of more CPU usage.
  *
+ * ### Transport options
+ *
+ *\code{.unparsed}
+ *     pulse.shm = false
+ *\endcode
+ *
+ * Accept audio data from local clients as references into a shared memory
+ * pool (memfd or POSIX shm) instead of inline on the socket. The data is
+ * copied from the pool directly into the stream buffer. Only clients running
+ * as the same user on a unix socket can use this. Blocks that can't be
+ * imported are dropped. Disabled by default.
+ *
+ *\code{.unparsed}
+ *     pulse.srbchannel = false
+ *\endcode
+ *
+ * Offer a shared ringbuffer channel to memfd capable clients. Control
+ * messages and memblock references are then exchanged over the ringbuffer
+ * instead of the socket. This requires pulse.shm. Disabled by default.
+ *
  * ### Format options
  *
  *\code{.unparsed}
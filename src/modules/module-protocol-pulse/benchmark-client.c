@@ -0,0 +1,480 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/* A minimal pulseaudio protocol client for the benchmarks. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <spa/utils/defs.h>
+#include <spa/utils/string.h>
+
+#include "benchmark-client.h"
+
+void put_u8(struct tagstruct *t, uint8_t tag, uint8_t val)
+{
+	if (tag)
+		t->data[t->length++] = tag;
+	t->data[t->length++] = val;
+}
+
+void put_u32(struct tagstruct *t, uint8_t tag, uint32_t val)
+{
+	if (tag)
+		t->data[t->length++] = tag;
+	val = htonl(val);
+	memcpy(&t->data[t->length], &val, 4);
+	t->length += 4;
+}
+
+void put_bool(struct tagstruct *t, bool val)
+{
+	t->data[t->length++] = val ? TAG_BOOLEAN_TRUE : TAG_BOOLEAN_FALSE;
+}
+
+void put_string(struct tagstruct *t, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	t->data[t->length++] = TAG_STRING;
+	memcpy(&t->data[t->length], str, len);
+	t->length += len;
+}
+
+void put_arbitrary(struct tagstruct *t, const void *data, uint32_t len)
+{
+	put_u32(t, TAG_ARBITRARY, len);
+	memcpy(&t->data[t->length], data, len);
+	t->length += len;
+}
+
+void put_props(struct tagstruct *t, const char *key, const char *value)
+{
+	t->data[t->length++] = TAG_PROPLIST;
+	put_string(t, key);
+	put_u32(t, TAG_U32, strlen(value) + 1);
+	put_arbitrary(t, value, strlen(value) + 1);
+	t->data[t->length++] = TAG_STRING_NULL;
+}
+
+uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+static int conn_send_socket(struct conn *c, const void *data, size_t size,
+		const int *fds, uint32_t n_fds)
+{
+	union {
+		char buf[CMSG_SPACE(MESSAGE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cmsgbuf;
+	struct iovec iov = { (void*)data, size };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+
+	if (n_fds > 0) {
+		msg.msg_control = &cmsgbuf;
+		msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+	}
+	while (size > 0) {
+		ssize_t r = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		iov.iov_base = SPA_PTROFF(iov.iov_base, r, void);
+		iov.iov_len = size -= r;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+	}
+	return 0;
+}
+
+static int conn_send_srb(struct conn *c, const void *data, size_t size)
+{
+	while (size > 0) {
+		size_t r = srbchannel_write(c->srb, data, size);
+		data = SPA_PTROFF(data, r, void);
+		size -= r;
+		if (r == 0) {
+			/* full, wait for the server to read */
+			int res = conn_process(c, 10);
+			if (res < 0)
+				return res;
+		}
+	}
+	return 0;
+}
+
+int conn_send(struct conn *c, uint32_t channel, uint32_t flags,
+		const void *data, uint32_t size, const int *fds, uint32_t n_fds)
+{
+	uint8_t frame[sizeof(struct descriptor) + MAX_FRAME];
+	struct descriptor *desc = (struct descriptor*)frame;
+
+	if (size > MAX_FRAME)
+		return -E2BIG;
+
+	desc->length = htonl(size);
+	desc->channel = htonl(channel);
+	desc->offset_hi = 0;
+	desc->offset_lo = 0;
+	desc->flags = htonl(flags);
+	memcpy(&frame[sizeof(*desc)], data, size);
+	size += sizeof(*desc);
+
+	if (c->srb_enabled && n_fds == 0)
+		return conn_send_srb(c, frame, size);
+
+	return conn_send_socket(c, frame, size, fds, n_fds);
+}
+
+int conn_send_command(struct conn *c, struct tagstruct *t, const int *fds, uint32_t n_fds)
+{
+	return conn_send(c, -1, 0, t->data, t->length, fds, n_fds);
+}
+
+static void input_clear(struct input *in)
+{
+	uint32_t i;
+	for (i = 0; i < in->n_fds; i++)
+		close(in->fds[i]);
+	in->n_fds = 0;
+	in->index = 0;
+}
+
+static void setup_srbchannel(struct conn *c, const struct shm_info *info)
+{
+	struct tagstruct t = { 0 };
+
+	if (c->srb_memfd < 0 || c->srb_fds[0] < 0 ||
+	    ntohl(info->offset) != 0 || !c->use_srb)
+		return;
+
+	c->srb = srbchannel_new_from_template(c->srb_memfd, c->srb_fds[0], c->srb_fds[1]);
+	if (c->srb == NULL) {
+		fprintf(stderr, "can't attach to srbchannel: %m\n");
+		return;
+	}
+	c->srb_memfd = c->srb_fds[0] = c->srb_fds[1] = -1;
+	srbchannel_before_poll(c->srb);
+
+	put_u32(&t, TAG_U32, COMMAND_ENABLE_SRBCHANNEL);
+	put_u32(&t, TAG_U32, c->srb_tag);
+	conn_send_command(c, &t, NULL, 0);
+
+	c->srb_enabled = true;
+}
+
+static void handle_packet(struct conn *c, struct input *in)
+{
+	uint32_t length = ntohl(in->desc.length), command, tag;
+
+	if (length < 10 || in->data[0] != TAG_U32 || in->data[5] != TAG_U32)
+		return;
+
+	memcpy(&command, &in->data[1], 4);
+	memcpy(&tag, &in->data[6], 4);
+	command = ntohl(command);
+	tag = ntohl(tag);
+
+	switch (command) {
+	case COMMAND_ERROR:
+	case COMMAND_REPLY:
+		c->reply_tag = tag;
+		c->reply_error = command == COMMAND_ERROR;
+		c->reply_length = SPA_MIN(length - 10, sizeof(c->reply));
+		memcpy(c->reply, &in->data[10], c->reply_length);
+		break;
+	case COMMAND_REGISTER_MEMFD_SHMID:
+		if (in->n_fds == 1) {
+			c->srb_memfd = in->fds[0];
+			in->n_fds = 0;
+		}
+		break;
+	case COMMAND_ENABLE_SRBCHANNEL:
+		if (in->n_fds == 2) {
+			c->srb_fds[0] = in->fds[0];
+			c->srb_fds[1] = in->fds[1];
+			c->srb_tag = tag;
+			in->n_fds = 0;
+		}
+		break;
+	}
+}
+
+static void handle_frame(struct conn *c, struct input *in)
+{
+	uint32_t flags = ntohl(in->desc.flags);
+	uint32_t channel = ntohl(in->desc.channel);
+
+	if (flags == FLAG_SHMRELEASE)
+		c->n_released++;
+	else if (channel == (uint32_t)-1)
+		handle_packet(c, in);
+	else if (flags & FLAG_SHMDATA)
+		setup_srbchannel(c, (const struct shm_info *)in->data);
+
+	input_clear(in);
+}
+
+static ssize_t conn_recv(struct conn *c, struct input *in, void *data, size_t size)
+{
+	union {
+		char buf[CMSG_SPACE(MESSAGE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cmsgbuf;
+	struct iovec iov = { data, size };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = &cmsgbuf, .msg_controllen = sizeof(cmsgbuf) };
+	struct cmsghdr *cmsg;
+	ssize_t r;
+
+	if (in == &c->srb_in) {
+		r = srbchannel_read(c->srb, data, size);
+		return r > 0 ? r : -EAGAIN;
+	}
+
+	r = recvmsg(c->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (r < 0)
+		return -errno;
+	if (r == 0)
+		return -EPIPE;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int *fds = (int*)CMSG_DATA(cmsg);
+		uint32_t i, n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		for (i = 0; i < n; i++) {
+			if (in->n_fds < MESSAGE_MAX_FDS)
+				in->fds[in->n_fds++] = fds[i];
+			else
+				close(fds[i]);
+		}
+	}
+	return r;
+}
+
+int conn_read(struct conn *c, struct input *in)
+{
+	while (true) {
+		uint32_t length = ntohl(in->desc.length);
+		void *data;
+		size_t size;
+		ssize_t r;
+
+		if (in->index < sizeof(in->desc)) {
+			data = SPA_PTROFF(&in->desc, in->index, void);
+			size = sizeof(in->desc) - in->index;
+		} else {
+			if (length > MAX_FRAME)
+				return -EPROTO;
+			data = &in->data[in->index - sizeof(in->desc)];
+			size = length - (in->index - sizeof(in->desc));
+		}
+		if (size > 0) {
+			if ((r = conn_recv(c, in, data, size)) < 0)
+				return r == -EAGAIN ? 0 : r;
+			in->index += r;
+		}
+		if (in->index >= sizeof(in->desc) &&
+		    in->index == sizeof(in->desc) + ntohl(in->desc.length))
+			handle_frame(c, in);
+	}
+}
+
+int conn_process(struct conn *c, int timeout)
+{
+	struct pollfd pfd[2];
+	int res, n = 1;
+
+	pfd[0] = (struct pollfd) { .fd = c->fd, .events = POLLIN };
+	if (c->srb)
+		pfd[n++] = (struct pollfd) { .fd = c->srb->wait_fd, .events = POLLIN };
+
+	if ((res = poll(pfd, n, timeout)) < 0)
+		return -errno;
+
+	if ((res = conn_read(c, &c->in)) < 0)
+		return res;
+
+	if (c->srb && pfd[1].revents & POLLIN) {
+		srbchannel_after_poll(c->srb);
+		do {
+			if ((res = conn_read(c, &c->srb_in)) < 0)
+				return res;
+		} while (!srbchannel_before_poll(c->srb));
+	}
+	return 0;
+}
+
+int conn_wait_reply(struct conn *c, uint32_t tag)
+{
+	uint64_t end = get_time_ns() + TIMEOUT_MSEC * SPA_NSEC_PER_MSEC;
+	int res;
+
+	while (c->reply_tag != tag) {
+		if (get_time_ns() > end)
+			return -ETIMEDOUT;
+		if ((res = conn_process(c, 100)) < 0)
+			return res;
+	}
+	c->reply_tag = SPA_ID_INVALID;
+	return c->reply_error ? -EIO : 0;
+}
+
+uint32_t reply_u32(struct conn *c, uint32_t idx)
+{
+	uint32_t val;
+	if (c->reply_length < idx * 5 + 5)
+		return 0;
+	memcpy(&val, &c->reply[idx * 5 + 1], 4);
+	return ntohl(val);
+}
+
+int conn_connect(struct conn *c, const char *path, const char *name,
+		bool use_shm, bool use_srb)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	uint8_t cookie[NATIVE_COOKIE_LENGTH] = { 0 };
+	struct tagstruct t = { 0 };
+	uint32_t version;
+	int res;
+
+	spa_zero(*c);
+	c->use_srb = use_srb;
+	c->srb_memfd = c->srb_fds[0] = c->srb_fds[1] = c->pool_fd = -1;
+	c->reply_tag = SPA_ID_INVALID;
+
+	if ((c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -errno;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+		return -errno;
+
+	version = PROTOCOL_VERSION;
+	if (use_shm)
+		version |= PROTOCOL_FLAG_SHM | PROTOCOL_FLAG_MEMFD;
+
+	put_u32(&t, TAG_U32, COMMAND_AUTH);
+	put_u32(&t, TAG_U32, ++c->tag);
+	put_u32(&t, TAG_U32, version);
+	put_arbitrary(&t, cookie, sizeof(cookie));
+	if ((res = conn_send_command(c, &t, NULL, 0)) < 0 ||
+	    (res = conn_wait_reply(c, c->tag)) < 0)
+		return res;
+
+	version = reply_u32(c, 0);
+	c->version = version & PROTOCOL_VERSION_MASK;
+	c->flags = version & PROTOCOL_FLAG_MASK;
+
+	spa_zero(t);
+	put_u32(&t, TAG_U32, COMMAND_SET_CLIENT_NAME);
+	put_u32(&t, TAG_U32, ++c->tag);
+	put_props(&t, "application.name", name);
+	if ((res = conn_send_command(c, &t, NULL, 0)) < 0 ||
+	    (res = conn_wait_reply(c, c->tag)) < 0)
+		return res;
+
+	return 0;
+}
+
+int conn_setup_pool(struct conn *c)
+{
+	struct tagstruct t = { 0 };
+
+	if (!SPA_FLAG_IS_SET(c->flags, PROTOCOL_FLAG_MEMFD))
+		return -ENOTSUP;
+
+	c->pool_fd = memfd_create("pulse-benchmark", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (c->pool_fd < 0 || ftruncate(c->pool_fd, POOL_SIZE) < 0)
+		return -errno;
+	c->pool = mmap(NULL, POOL_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, c->pool_fd, 0);
+	if (c->pool == MAP_FAILED)
+		return -errno;
+	c->pool_id = (uint32_t)getpid() ^ 0x5a5a0000;
+
+	put_u32(&t, TAG_U32, COMMAND_REGISTER_MEMFD_SHMID);
+	put_u32(&t, TAG_U32, -1);
+	put_u32(&t, TAG_U32, c->pool_id);
+	return conn_send_command(c, &t, &c->pool_fd, 1);
+}
+
+void conn_close(struct conn *c)
+{
+	input_clear(&c->in);
+	if (c->srb)
+		srbchannel_free(c->srb);
+	if (c->srb_memfd >= 0)
+		close(c->srb_memfd);
+	if (c->srb_fds[0] >= 0)
+		close(c->srb_fds[0]);
+	if (c->srb_fds[1] >= 0)
+		close(c->srb_fds[1]);
+	if (c->pool != NULL && c->pool != MAP_FAILED)
+		munmap(c->pool, POOL_SIZE);
+	if (c->pool_fd >= 0)
+		close(c->pool_fd);
+	if (c->fd >= 0)
+		close(c->fd);
+}
+
+int conn_get_server_path(char *path, size_t size)
+{
+	const char *server = getenv("PULSE_SERVER");
+	const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+	if (server != NULL && spa_strstartswith(server, "unix:"))
+		snprintf(path, size, "%s", server + 5);
+	else if (runtime_dir != NULL)
+		snprintf(path, size, "%s/pulse/native", runtime_dir);
+	else
+		return -ENOENT;
+
+	if (access(path, F_OK) < 0)
+		return -errno;
+	return 0;
+}
+
@@ -0,0 +1,111 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/* A minimal pulseaudio protocol client for the benchmarks. */
+
+#ifndef PULSE_SERVER_BENCHMARK_CLIENT_H
+#define PULSE_SERVER_BENCHMARK_CLIENT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <spa/utils/defs.h>
+
+#include "client.h"
+#include "commands.h"
+#include "defs.h"
+#include "srbchannel.h"
+
+#define MAX_FRAME	(256u * 1024u)
+#define POOL_SIZE	(4u * 1024u * 1024u)
+#define TIMEOUT_MSEC	5000
+
+#define SAMPLE_S16LE	3
+#define POSITION_FL	1
+#define POSITION_FR	2
+
+struct input {
+	uint32_t index;
+	struct descriptor desc;
+	uint8_t data[MAX_FRAME];
+	uint32_t n_fds;
+	int fds[MESSAGE_MAX_FDS];
+};
+
+struct conn {
+	bool use_srb;
+	int fd;
+
+	uint32_t version;
+	uint32_t flags;
+	uint32_t tag;
+
+	uint32_t reply_tag;
+	uint32_t reply_error;
+	uint8_t reply[256];
+	uint32_t reply_length;
+
+	int srb_memfd;
+	int srb_fds[2];
+	uint32_t srb_tag;
+	struct srbchannel *srb;
+	bool srb_enabled;
+
+	int pool_fd;
+	uint32_t pool_id;
+	void *pool;
+
+	uint64_t n_released;
+
+	struct input in;
+	struct input srb_in;
+};
+
+struct tagstruct {
+	uint8_t data[1024];
+	uint32_t length;
+};
+
+void put_u8(struct tagstruct *t, uint8_t tag, uint8_t val);
+void put_u32(struct tagstruct *t, uint8_t tag, uint32_t val);
+void put_bool(struct tagstruct *t, bool val);
+void put_string(struct tagstruct *t, const char *str);
+void put_arbitrary(struct tagstruct *t, const void *data, uint32_t len);
+void put_props(struct tagstruct *t, const char *key, const char *value);
+uint64_t get_time_ns(void);
+int conn_send(struct conn *c, uint32_t channel, uint32_t flags,
+		const void *data, uint32_t size, const int *fds, uint32_t n_fds);
+int conn_send_command(struct conn *c, struct tagstruct *t, const int *fds, uint32_t n_fds);
+int conn_read(struct conn *c, struct input *in);
+int conn_process(struct conn *c, int timeout);
+int conn_wait_reply(struct conn *c, uint32_t tag);
+uint32_t reply_u32(struct conn *c, uint32_t idx);
+int conn_connect(struct conn *c, const char *path, const char *name,
+		bool use_shm, bool use_srb);
+int conn_setup_pool(struct conn *c);
+void conn_close(struct conn *c);
+int conn_get_server_path(char *path, size_t size);
+
+#endif /* PULSE_SERVER_BENCHMARK_CLIENT_H */
@@ -0,0 +1,307 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Load generator for the pulse server.
+ *
+ * Opens a number of clients with one playback stream each and writes a
+ * block to every stream each period, like low latency applications do.
+ * The CPU time and the read syscalls of the server are sampled from /proc
+ * and reported per stream and per block. Run this against a server with
+ * a sink, without one the streams are not consumed and will overflow.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+
+#include <spa/utils/result.h>
+#include <pipewire/pipewire.h>
+
+#include "benchmark-client.h"
+
+PW_LOG_TOPIC(mod_topic, "mod.protocol-pulse");
+
+#define RATE		48000
+#define CHANNELS	2
+#define WARMUP_SEC	1
+
+struct sample {
+	uint64_t time;
+	uint64_t cpu_ticks;
+	uint64_t syscr;
+	uint64_t syscw;
+	bool have_io;
+};
+
+static int get_server_pid(int fd, pid_t *pid)
+{
+	struct ucred ucred;
+	socklen_t len = sizeof(ucred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &ucred, &len) < 0)
+		return -errno;
+	*pid = ucred.pid;
+	return 0;
+}
+
+static int take_sample(pid_t pid, struct sample *s)
+{
+	char path[64], buf[1024], *p;
+	unsigned long long utime, stime;
+	FILE *f;
+
+	s->time = get_time_ns();
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+	if ((f = fopen(path, "re")) == NULL)
+		return -errno;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	/* skip the comm field, it can contain spaces */
+	if (p == NULL || (p = strrchr(buf, ')')) == NULL ||
+	    sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+		    &utime, &stime) != 2)
+		return -EINVAL;
+	s->cpu_ticks = utime + stime;
+
+	s->have_io = false;
+	snprintf(path, sizeof(path), "/proc/%d/io", (int)pid);
+	if ((f = fopen(path, "re")) != NULL) {
+		unsigned long long val;
+		while (fgets(buf, sizeof(buf), f) != NULL) {
+			if (sscanf(buf, "syscr: %llu", &val) == 1) {
+				s->syscr = val;
+				s->have_io = true;
+			} else if (sscanf(buf, "syscw: %llu", &val) == 1)
+				s->syscw = val;
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+static int create_playback_stream(struct conn *c, uint32_t *channel)
+{
+	struct tagstruct t = { 0 };
+	int res;
+
+	put_u32(&t, TAG_U32, COMMAND_CREATE_PLAYBACK_STREAM);
+	put_u32(&t, TAG_U32, ++c->tag);
+	put_u8(&t, TAG_SAMPLE_SPEC, SAMPLE_S16LE);
+	put_u8(&t, 0, CHANNELS);
+	put_u32(&t, 0, RATE);
+	put_u8(&t, TAG_CHANNEL_MAP, CHANNELS);
+	put_u8(&t, 0, POSITION_FL);
+	put_u8(&t, 0, POSITION_FR);
+	put_u32(&t, TAG_U32, -1);		/* sink index */
+	t.data[t.length++] = TAG_STRING_NULL;	/* sink name */
+	put_u32(&t, TAG_U32, -1);		/* maxlength */
+	put_bool(&t, false);			/* corked */
+	put_u32(&t, TAG_U32, -1);		/* tlength */
+	put_u32(&t, TAG_U32, -1);		/* prebuf */
+	put_u32(&t, TAG_U32, -1);		/* minreq */
+	put_u32(&t, TAG_U32, 0);		/* syncid */
+	put_u8(&t, TAG_CVOLUME, CHANNELS);
+	put_u32(&t, 0, 0x10000);
+	put_u32(&t, 0, 0x10000);
+	/* no_remap, no_remix, fix_format, fix_rate, fix_channels,
+	 * no_move, variable_rate */
+	for (int i = 0; i < 7; i++)
+		put_bool(&t, false);
+	put_bool(&t, false);			/* muted */
+	put_bool(&t, true);			/* adjust_latency */
+	put_props(&t, "media.name", "load");
+	put_bool(&t, false);			/* volume_set */
+	put_bool(&t, false);			/* early_requests */
+	put_bool(&t, false);			/* muted_set */
+	put_bool(&t, false);			/* dont_inhibit_auto_suspend */
+	put_bool(&t, false);			/* fail_on_suspend */
+	put_bool(&t, false);			/* relative_volume */
+	put_bool(&t, false);			/* passthrough */
+	put_u8(&t, TAG_U8, 0);			/* n_formats */
+
+	if ((res = conn_send_command(c, &t, NULL, 0)) < 0 ||
+	    (res = conn_wait_reply(c, c->tag)) < 0)
+		return res;
+
+	*channel = reply_u32(c, 0);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t n_streams = argc > 1 ? atoi(argv[1]) : 32;
+	uint32_t period_ms = argc > 2 ? atoi(argv[2]) : 10;
+	uint32_t seconds = argc > 3 ? atoi(argv[3]) : 10;
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	struct itimerspec its = { 0 };
+	struct conn **conns = NULL;
+	uint32_t *channels = NULL;
+	struct pollfd *pfds = NULL;
+	struct sample start = { 0 }, end;
+	uint64_t n_ticks = 0, n_blocks = 0, total_ticks, elapsed;
+	uint32_t i, block_size;
+	uint8_t *block = NULL;
+	pid_t pid = 0;
+	int res = 0, timerfd = -1;
+
+	if (n_streams == 0 || period_ms == 0 || seconds == 0) {
+		fprintf(stderr, "usage: %s [n-streams] [period-ms] [seconds]\n", argv[0]);
+		return 1;
+	}
+	if (conn_get_server_path(path, sizeof(path)) < 0) {
+		fprintf(stderr, "no server found, skipping\n");
+		return 77;
+	}
+
+	pw_init(&argc, &argv);
+
+	block_size = RATE * period_ms / 1000 * CHANNELS * sizeof(int16_t);
+	if (block_size > MAX_FRAME) {
+		fprintf(stderr, "period too large\n");
+		res = -EINVAL;
+		goto done;
+	}
+
+	conns = calloc(n_streams, sizeof(struct conn *));
+	channels = calloc(n_streams, sizeof(uint32_t));
+	pfds = calloc(n_streams + 1, sizeof(struct pollfd));
+	block = calloc(1, block_size);
+	if (conns == NULL || channels == NULL || pfds == NULL || block == NULL) {
+		res = -errno;
+		goto done;
+	}
+
+	for (i = 0; i < n_streams; i++) {
+		if ((conns[i] = calloc(1, sizeof(struct conn))) == NULL) {
+			res = -errno;
+			goto done;
+		}
+		if ((res = conn_connect(conns[i], path, "pw-benchmark-pulse-load", false, false)) < 0 ||
+		    (res = create_playback_stream(conns[i], &channels[i])) < 0) {
+			fprintf(stderr, "stream %u: %s\n", i, spa_strerror(res));
+			goto done;
+		}
+		pfds[i] = (struct pollfd) { .fd = conns[i]->fd, .events = POLLIN };
+	}
+	if ((res = get_server_pid(conns[0]->fd, &pid)) < 0)
+		goto done;
+
+	if ((timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0) {
+		res = -errno;
+		goto done;
+	}
+	its.it_value.tv_nsec = 1;
+	its.it_interval.tv_sec = period_ms / 1000;
+	its.it_interval.tv_nsec = (period_ms % 1000) * SPA_NSEC_PER_MSEC;
+	if (timerfd_settime(timerfd, 0, &its, NULL) < 0) {
+		res = -errno;
+		goto done;
+	}
+	pfds[n_streams] = (struct pollfd) { .fd = timerfd, .events = POLLIN };
+
+	fprintf(stdout, "server pid:%d streams:%u period:%ums block:%u bytes\n",
+			(int)pid, n_streams, period_ms, block_size);
+
+	while (n_ticks < (uint64_t)seconds * 1000 / period_ms) {
+		if (poll(pfds, n_streams + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			res = -errno;
+			goto done;
+		}
+		for (i = 0; i < n_streams; i++) {
+			/* drain requests and other notifications */
+			if (pfds[i].revents & POLLIN &&
+			    (res = conn_read(conns[i], &conns[i]->in)) < 0)
+				goto done;
+		}
+		if (pfds[n_streams].revents & POLLIN) {
+			uint64_t expirations;
+
+			if (read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+				continue;
+
+			for (i = 0; i < n_streams; i++) {
+				if ((res = conn_send(conns[i], channels[i], SEEK_RELATIVE,
+							block, block_size, NULL, 0)) < 0)
+					goto done;
+			}
+			n_ticks++;
+			if (n_ticks == (uint64_t)WARMUP_SEC * 1000 / period_ms) {
+				if ((res = take_sample(pid, &start)) < 0)
+					goto done;
+				n_blocks = 0;
+			}
+			n_blocks += n_streams;
+		}
+	}
+	if (start.time == 0 || (res = take_sample(pid, &end)) < 0) {
+		fprintf(stderr, "run longer than the %us warmup\n", WARMUP_SEC);
+		goto done;
+	}
+
+	elapsed = end.time - start.time;
+	total_ticks = end.cpu_ticks - start.cpu_ticks;
+
+	fprintf(stdout, "server cpu: %6.2f%% total, %6.3f%% per stream, %6.2f us per block\n",
+			100.0 * total_ticks / sysconf(_SC_CLK_TCK) / (elapsed / 1e9),
+			100.0 * total_ticks / sysconf(_SC_CLK_TCK) / (elapsed / 1e9) / n_streams,
+			1e6 * total_ticks / sysconf(_SC_CLK_TCK) / n_blocks);
+	if (start.have_io && end.have_io)
+		fprintf(stdout, "server syscalls: %6.2f reads and %6.2f writes per block, "
+				"%8.1f reads per second per stream\n",
+				(double)(end.syscr - start.syscr) / n_blocks,
+				(double)(end.syscw - start.syscw) / n_blocks,
+				(end.syscr - start.syscr) / (elapsed / 1e9) / n_streams);
+	else
+		fprintf(stdout, "server syscalls: not available\n");
+
+done:
+	if (timerfd >= 0)
+		close(timerfd);
+	for (i = 0; conns && i < n_streams; i++) {
+		if (conns[i]) {
+			conn_close(conns[i]);
+			free(conns[i]);
+		}
+	}
+	free(conns);
+	free(channels);
+	free(pfds);
+	free(block);
+
+	pw_deinit();
+
+	return res < 0 ? 1 : 0;
+}
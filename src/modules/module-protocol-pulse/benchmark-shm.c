@@ -0,0 +1,190 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Throughput of the memblock transports of the pulse server.
+ *
+ * A minimal stand-in client connects to a running server, creates an
+ * upload stream and writes blocks to it, inline on the socket, as
+ * references into a memfd pool and as references sent over the
+ * srbchannel. The time until the server acked the deletion of the
+ * stream is measured. The server needs pulse.shm and pulse.srbchannel
+ * enabled for the last two.
+ */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include <spa/utils/result.h>
+#include <pipewire/pipewire.h>
+
+#include "benchmark-client.h"
+
+PW_LOG_TOPIC(mod_topic, "mod.protocol-pulse");
+
+enum mode {
+	MODE_INLINE,
+	MODE_MEMFD,
+	MODE_SRBCHANNEL,
+	MODE_LAST,
+};
+
+static const char * const mode_names[] = {
+	[MODE_INLINE] = "inline",
+	[MODE_MEMFD] = "memfd",
+	[MODE_SRBCHANNEL] = "memfd+srbchannel",
+};
+
+static int run(const char *path, enum mode mode, uint32_t block_size, uint32_t n_blocks)
+{
+	struct conn *c;
+	struct tagstruct t = { 0 };
+	uint8_t *block;
+	uint32_t i, channel, n_slots;
+	uint64_t start, elapsed;
+	int res;
+
+	c = calloc(1, sizeof(*c));
+	block = calloc(1, block_size);
+	if (c == NULL || block == NULL) {
+		res = -errno;
+		goto done;
+	}
+	for (i = 0; i < block_size; i++)
+		block[i] = i;
+
+	if ((res = conn_connect(c, path, "pw-benchmark-pulse-shm",
+			mode != MODE_INLINE, mode == MODE_SRBCHANNEL)) < 0)
+		goto done;
+
+	if (mode != MODE_INLINE && (res = conn_setup_pool(c)) < 0)
+		goto done;
+	/* give the srbchannel setup a chance */
+	for (i = 0; i < 10 && mode == MODE_SRBCHANNEL && !c->srb_enabled; i++)
+		conn_process(c, 10);
+	if (mode == MODE_SRBCHANNEL && !c->srb_enabled) {
+		res = -ENOTSUP;
+		goto done;
+	}
+
+	put_u32(&t, TAG_U32, COMMAND_CREATE_UPLOAD_STREAM);
+	put_u32(&t, TAG_U32, ++c->tag);
+	put_string(&t, "benchmark");
+	put_u8(&t, TAG_SAMPLE_SPEC, SAMPLE_S16LE);
+	put_u8(&t, 0, 2);
+	put_u32(&t, 0, 48000);
+	put_u8(&t, TAG_CHANNEL_MAP, 2);
+	put_u8(&t, 0, POSITION_FL);
+	put_u8(&t, 0, POSITION_FR);
+	put_u32(&t, TAG_U32, block_size);
+	put_props(&t, "media.name", "benchmark");
+	if ((res = conn_send_command(c, &t, NULL, 0)) < 0 ||
+	    (res = conn_wait_reply(c, c->tag)) < 0)
+		goto done;
+	channel = reply_u32(c, 0);
+
+	n_slots = POOL_SIZE / block_size;
+	start = get_time_ns();
+
+	for (i = 0; i < n_blocks; i++) {
+		if (mode == MODE_INLINE) {
+			res = conn_send(c, channel, SEEK_ABSOLUTE, block, block_size, NULL, 0);
+		} else {
+			uint32_t offset = (i % n_slots) * block_size;
+			struct shm_info info = {
+				.block_id = htonl(i),
+				.shm_id = htonl(c->pool_id),
+				.offset = htonl(offset),
+				.length = htonl(block_size),
+			};
+			/* like pa_stream_write() copying into the pool */
+			memcpy(SPA_PTROFF(c->pool, offset, void), block, block_size);
+			res = conn_send(c, channel,
+					FLAG_SHMDATA | FLAG_SHMDATA_MEMFD_BLOCK | SEEK_ABSOLUTE,
+					&info, sizeof(info), NULL, 0);
+		}
+		if (res < 0)
+			goto done;
+		if ((i & 31) == 0 && (res = conn_process(c, 0)) < 0)
+			goto done;
+	}
+
+	/* the server handles frames in order, the ack means all data was copied */
+	spa_zero(t);
+	put_u32(&t, TAG_U32, COMMAND_DELETE_UPLOAD_STREAM);
+	put_u32(&t, TAG_U32, ++c->tag);
+	put_u32(&t, TAG_U32, channel);
+	if ((res = conn_send_command(c, &t, NULL, 0)) < 0 ||
+	    (res = conn_wait_reply(c, c->tag)) < 0)
+		goto done;
+
+	elapsed = get_time_ns() - start;
+
+	fprintf(stdout, "%-18s block:%6u blocks:%8u %8.1f MB/s %8.0f blocks/s %6.2f us/block released:%"PRIu64"\n",
+			mode_names[mode], block_size, n_blocks,
+			(double)block_size * n_blocks / (elapsed / 1e9) / 1e6,
+			n_blocks / (elapsed / 1e9),
+			elapsed / 1e3 / n_blocks, c->n_released);
+done:
+	if (c)
+		conn_close(c);
+	free(c);
+	free(block);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t block_size = argc > 1 ? atoi(argv[1]) : 4096;
+	uint32_t n_blocks = argc > 2 ? atoi(argv[2]) : 50000;
+	char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	enum mode mode;
+	int res;
+
+	if (block_size == 0 || block_size > MAX_FRAME || block_size % 4 != 0 || n_blocks == 0) {
+		fprintf(stderr, "usage: %s [block-size] [n-blocks]\n", argv[0]);
+		return 1;
+	}
+	if (conn_get_server_path(path, sizeof(path)) < 0) {
+		fprintf(stderr, "no server found, skipping\n");
+		return 77;
+	}
+
+	pw_init(&argc, &argv);
+
+	for (mode = 0; mode < MODE_LAST; mode++) {
+		if ((res = run(path, mode, block_size, n_blocks)) < 0)
+			fprintf(stdout, "%-18s %s\n", mode_names[mode], spa_strerror(res));
+	}
+
+	pw_deinit();
+
+	return 0;
+}
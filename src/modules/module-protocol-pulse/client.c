@@ -22,9 +22,13 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <errno.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
 
@@ -47,8 +51,11 @@
 #include "operation.h"
 #include "pending-sample.h"
 #include "server.h"
+#include "srbchannel.h"
 #include "stream.h"
 
+#define SRB_RETRY_NSEC	(1 * SPA_NSEC_PER_MSEC)
+
 #define client_emit_disconnect(c) spa_hook_list_call(&(c)->listener_list, struct client_events, disconnect, 0)
 
 struct client *client_new(struct server *server)
@@ -68,6 +75,7 @@ struct client *client_new(struct server *server)
 	spa_list_init(&client->pending_samples);
 	spa_list_init(&client->pending_streams);
 	spa_hook_list_init(&client->listener_list);
+	shm_import_init(&client->shm);
 
 	spa_list_append(&server->clients, &client->link);
 	server->n_clients++;
@@ -133,6 +141,14 @@ void client_disconnect(struct client *client)
 		pw_loop_destroy_source(impl->loop, client->source);
 		client->source = NULL;
 	}
+	if (client->srb_source) {
+		pw_loop_destroy_source(impl->loop, client->srb_source);
+		client->srb_source = NULL;
+	}
+	if (client->srb_timer) {
+		pw_loop_destroy_source(impl->loop, client->srb_timer);
+		client->srb_timer = NULL;
+	}
 
 	if (client->manager) {
 		pw_manager_destroy(client->manager);
@@ -158,12 +174,16 @@ void client_free(struct client *client)
 	spa_list_consume(p, &client->pending_samples, link)
 		pending_sample_free(p);
 
-	if (client->message)
-		message_free(client->message, false, false);
+	client_input_clear(&client->in);
+	client_input_clear(&client->srb_in);
 
 	spa_list_consume(msg, &client->out_messages, link)
 		message_free(msg, true, false);
 
+	if (client->srb)
+		srbchannel_free(client->srb);
+	shm_import_clear(&client->shm);
+
 	spa_list_consume(o, &client->operations, link)
 		operation_free(o);
 
@@ -201,7 +221,7 @@ int client_queue_message(struct client *client, struct message *msg)
 		goto error;
 	}
 
-	if (msg->length == 0) {
+	if (msg->length == 0 && msg->desc_flags == 0) {
 		res = 0;
 		goto error;
 	} else if (msg->length > msg->allocated) {
@@ -227,6 +247,53 @@ error:
 	return res;
 }
 
+static ssize_t client_send(struct client *client, struct message *m, const void *data, size_t size)
+{
+	struct msghdr msg = { 0 };
+	struct iovec iov[1];
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(MESSAGE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cmsgbuf;
+	ssize_t sent;
+
+	if (client->out_srb) {
+		sent = srbchannel_write(client->srb, data, size);
+		/* the peer will make room */
+		return sent > 0 ? sent : -ENOBUFS;
+	}
+
+	iov[0].iov_base = (void*)data;
+	iov[0].iov_len = size;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+
+	/* the fds go along with the first byte of the frame */
+	if (client->out_index == 0 && m->n_fds > 0) {
+		size_t fds_len = m->n_fds * sizeof(int);
+
+		msg.msg_control = &cmsgbuf;
+		msg.msg_controllen = CMSG_SPACE(fds_len);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(fds_len);
+		memcpy(CMSG_DATA(cmsg), m->fds, fds_len);
+		msg.msg_controllen = cmsg->cmsg_len;
+	}
+
+	while (true) {
+		sent = sendmsg(client->source->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		return sent;
+	}
+}
+
 static int client_try_flush_messages(struct client *client)
 {
 	pw_log_trace("client %p: flushing", client);
@@ -238,13 +305,17 @@ static int client_try_flush_messages(struct client *client)
 		struct descriptor desc;
 		const void *data;
 		size_t size;
+		ssize_t sent;
+
+		if (client->out_index == 0)
+			client->out_srb = client->srb_enabled && m->n_fds == 0;
 
 		if (client->out_index < sizeof(desc)) {
 			desc.length = htonl(m->length);
 			desc.channel = htonl(m->channel);
-			desc.offset_hi = 0;
-			desc.offset_lo = 0;
-			desc.flags = 0;
+			desc.offset_hi = htonl(m->desc_offset >> 32);
+			desc.offset_lo = htonl(m->desc_offset & 0xffffffffu);
+			desc.flags = htonl(m->desc_flags);
 
 			data = SPA_PTROFF(&desc, client->out_index, void);
 			size = sizeof(desc) - client->out_index;
@@ -260,17 +331,10 @@ static int client_try_flush_messages(struct client *client)
 			continue;
 		}
 
-		while (true) {
-			ssize_t sent = send(client->source->fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
-			if (sent < 0) {
-				int res = -errno;
-				if (res == -EINTR)
-					continue;
-				return res;
-			}
-			client->out_index += sent;
-			break;
-		}
+		if ((sent = client_send(client, m, data, size)) < 0)
+			return sent;
+
+		client->out_index += sent;
 	}
 	return 0;
 }
@@ -287,6 +351,19 @@ int client_flush_messages(struct client *client)
 			SPA_FLAG_CLEAR(mask, SPA_IO_OUT);
 			pw_loop_update_io(client->impl->loop, client->source, mask);
 		}
+	} else if (res == -ENOBUFS) {
+		/* the srbchannel is full, the socket being writable does not
+		 * help, poll for space instead */
+		uint32_t mask = client->source->mask;
+		struct timespec timeout = { 0, SRB_RETRY_NSEC };
+
+		if (SPA_FLAG_IS_SET(mask, SPA_IO_OUT)) {
+			SPA_FLAG_CLEAR(mask, SPA_IO_OUT);
+			pw_loop_update_io(client->impl->loop, client->source, mask);
+		}
+		if (client->srb_timer)
+			pw_loop_update_timer(client->impl->loop, client->srb_timer,
+					&timeout, NULL, false);
 	} else {
 		if (res != -EAGAIN && res != -EWOULDBLOCK)
 			return res;
@@ -388,3 +465,31 @@ int client_queue_subscribe_event(struct client *client, uint32_t mask, uint32_t
 
 	return client_queue_message(client, reply);
 }
+
+int client_queue_shm_release(struct client *client, uint32_t block_id)
+{
+	struct message *msg = message_alloc(client->impl, -1, 0);
+	if (msg == NULL)
+		return -errno;
+
+	msg->desc_flags = FLAG_SHMRELEASE;
+	msg->desc_offset = (uint64_t)block_id << 32;
+
+	return client_queue_message(client, msg);
+}
+
+void client_input_clear(struct client_input *in)
+{
+	uint32_t i;
+
+	if (in->message)
+		message_free(in->message, false, false);
+	in->message = NULL;
+	for (i = 0; i < in->n_fds; i++)
+		close(in->fds[i]);
+	in->n_fds = 0;
+	in->index = 0;
+	free(in->buffer);
+	in->buffer = NULL;
+	in->offset = in->length = 0;
+}
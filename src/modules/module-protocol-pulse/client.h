@@ -32,6 +32,9 @@
 #include <spa/utils/hook.h>
 #include <pipewire/map.h>
 
+#include "message.h"
+#include "shm.h"
+
 struct impl;
 struct server;
 struct message;
@@ -41,6 +44,7 @@ struct pw_core;
 struct pw_manager;
 struct pw_manager_object;
 struct pw_properties;
+struct srbchannel;
 
 struct descriptor {
 	uint32_t length;
@@ -50,6 +54,36 @@ struct descriptor {
 	uint32_t flags;
 };
 
+struct shm_info {
+	uint32_t block_id;
+	uint32_t shm_id;
+	uint32_t offset;
+	uint32_t length;
+};
+
+#define CLIENT_READ_BUFFER_SIZE	(64u * 1024u)
+
+/* state of the frame being received on the socket or the srbchannel */
+struct client_input {
+	uint32_t index;			/* bytes of the current frame received */
+	struct descriptor desc;
+	struct message *message;	/* packet or shm block being received */
+	uint32_t channel;		/* stream of an inline memblock or SPA_ID_INVALID */
+	uint32_t ring_index;		/* ringbuffer index of the inline memblock */
+
+	/* read-ahead, frames are parsed in place */
+	uint8_t *buffer;
+	uint32_t offset;
+	uint32_t length;
+	uint64_t position;		/* stream position of the buffer */
+	uint64_t frame_start;		/* stream position of the current frame */
+
+	/* fds received up to stream position fds_end */
+	uint64_t fds_end;
+	uint32_t n_fds;
+	int fds[MESSAGE_MAX_FDS];
+};
+
 struct client {
 	struct spa_list link;
 	struct impl *impl;
@@ -82,10 +116,15 @@ struct client {
 
 	uint32_t connect_tag;
 
-	uint32_t in_index;
+	struct client_input in;
 	uint32_t out_index;
-	struct descriptor desc;
-	struct message *message;
+
+	struct shm_import shm;
+	struct srbchannel *srb;
+	struct spa_source *srb_source;
+	struct spa_source *srb_timer;
+	struct client_input srb_in;
+	uint32_t srb_tag;
 
 	struct pw_map streams;
 	struct spa_list out_messages;
@@ -99,6 +138,10 @@ struct client {
 	unsigned int disconnect:1;
 	unsigned int new_msg_since_last_flush:1;
 	unsigned int authenticated:1;
+	unsigned int use_shm:1;			/**< memblocks can refer to client pools */
+	unsigned int use_memfd:1;
+	unsigned int srb_enabled:1;		/**< frames are sent on the srbchannel */
+	unsigned int out_srb:1;			/**< current frame goes to the srbchannel */
 
 	struct pw_manager_object *prev_default_sink;
 	struct pw_manager_object *prev_default_source;
@@ -120,6 +163,8 @@ void client_free(struct client *client);
 int client_queue_message(struct client *client, struct message *msg);
 int client_flush_messages(struct client *client);
 int client_queue_subscribe_event(struct client *client, uint32_t mask, uint32_t event, uint32_t id);
+int client_queue_shm_release(struct client *client, uint32_t block_id);
+void client_input_clear(struct client_input *in);
 
 static inline void client_unref(struct client *client)
 {
@@ -54,6 +54,8 @@ struct defs {
 	struct channel_map channel_map;
 	uint32_t quantum_limit;
 	uint32_t idle_timeout;
+	bool shm;
+	bool srbchannel;
 };
 
 struct stats {
@@ -82,6 +84,8 @@ struct impl {
 
 	struct pw_map samples;
 	struct pw_map modules;
+	struct spa_list sample_mixers;
+	uint32_t sample_play_index;
 
 	struct spa_list free_messages;
 	struct defs defs;
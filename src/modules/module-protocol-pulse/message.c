@@ -24,6 +24,7 @@
 
 #include <arpa/inet.h>
 #include <math.h>
+#include <unistd.h>
 
 #include <spa/debug/buffer.h>
 #include <spa/utils/defs.h>
@@ -853,15 +854,24 @@ struct message *message_alloc(struct impl *impl, uint32_t channel, uint32_t size
 	msg->channel = channel;
 	msg->offset = 0;
 	msg->length = size;
+	msg->desc_flags = 0;
+	msg->desc_offset = 0;
+	msg->n_fds = 0;
 
 	return msg;
 }
 
 void message_free(struct message *msg, bool dequeue, bool destroy)
 {
+	uint32_t i;
+
 	if (dequeue)
 		spa_list_remove(&msg->link);
 
+	for (i = 0; i < msg->n_fds; i++)
+		close(msg->fds[i]);
+	msg->n_fds = 0;
+
 	if (msg->impl->stat.allocated > MAX_ALLOCATED || msg->allocated > MAX_SIZE)
 		destroy = true;
 
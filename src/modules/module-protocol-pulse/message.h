@@ -33,6 +33,8 @@
 
 struct impl;
 
+#define MESSAGE_MAX_FDS	2
+
 struct message {
 	struct spa_list link;
 	struct impl *impl;
@@ -42,6 +44,10 @@ struct message {
 	uint32_t length;
 	uint32_t offset;
 	uint8_t *data;
+	uint32_t desc_flags;			/**< flags for the frame descriptor */
+	uint64_t desc_offset;			/**< offset for the frame descriptor */
+	uint32_t n_fds;
+	int fds[MESSAGE_MAX_FDS];		/**< owned fds, sent along with the frame */
 };
 
 enum {
@@ -29,6 +29,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
 #include <sys/time.h>
 
 #include <pipewire/log.h>
@@ -72,6 +76,8 @@
 #include "sample.h"
 #include "sample-play.h"
 #include "server.h"
+#include "shm.h"
+#include "srbchannel.h"
 #include "stream.h"
 #include "utils.h"
 #include "volume.h"
@@ -85,6 +91,8 @@
 #define DEFAULT_FORMAT		"F32"
 #define DEFAULT_POSITION	"[ FL FR ]"
 #define DEFAULT_IDLE_TIMEOUT	"0"
+#define DEFAULT_SHM		"false"
+#define DEFAULT_SRBCHANNEL	"false"
 
 #define MAX_FORMATS	32
 /* The max amount of data we send in one block when capturing. In PulseAudio this
@@ -133,12 +141,84 @@ void broadcast_subscribe_event(struct impl *impl, uint32_t mask, uint32_t event,
 	}
 }
 
+static bool client_can_use_shm(struct client *client)
+{
+	struct server *server = client->server;
+
+	if (!client->impl->defs.shm)
+		return false;
+	if (server == NULL || server->addr.ss_family != AF_UNIX)
+		return false;
+	/* only share memory with clients of the same user, like
+	 * PulseAudio does */
+	return get_client_uid(client, client->source->fd) == getuid();
+}
+
+static int setup_srbchannel(struct client *client)
+{
+	struct impl *impl = client->impl;
+	struct srbchannel *srb;
+	struct message *msg;
+	struct shm_info *info;
+	int res;
+
+	if ((srb = srbchannel_new()) == NULL)
+		return -errno;
+
+	if ((res = server_attach_srbchannel(client, srb)) < 0) {
+		srbchannel_free(srb);
+		return res;
+	}
+	client->srb_tag = srb->shm_id;
+
+	/* make the memory known to the client */
+	msg = message_alloc(impl, -1, 0);
+	if (msg == NULL)
+		return -errno;
+	message_put(msg,
+		TAG_U32, COMMAND_REGISTER_MEMFD_SHMID,
+		TAG_U32, -1,
+		TAG_U32, srb->shm_id,
+		TAG_INVALID);
+	msg->fds[msg->n_fds++] = fcntl(srb->memfd, F_DUPFD_CLOEXEC, 0);
+	if ((res = client_queue_message(client, msg)) < 0)
+		return res;
+
+	/* the semaphores, the client acks with the same tag when it
+	 * received the memory below */
+	msg = message_alloc(impl, -1, 0);
+	if (msg == NULL)
+		return -errno;
+	message_put(msg,
+		TAG_U32, COMMAND_ENABLE_SRBCHANNEL,
+		TAG_U32, client->srb_tag,
+		TAG_INVALID);
+	msg->fds[msg->n_fds++] = fcntl(srb->wait_fd, F_DUPFD_CLOEXEC, 0);
+	msg->fds[msg->n_fds++] = fcntl(srb->post_fd, F_DUPFD_CLOEXEC, 0);
+	if ((res = client_queue_message(client, msg)) < 0)
+		return res;
+
+	/* and the memory itself as a writable memblock */
+	msg = message_alloc(impl, 0, sizeof(*info));
+	if (msg == NULL)
+		return -errno;
+	info = (struct shm_info *) msg->data;
+	info->block_id = htonl(0);
+	info->shm_id = htonl(srb->shm_id);
+	info->offset = htonl(0);
+	info->length = htonl(srb->size);
+	msg->desc_flags = FLAG_SHMDATA | FLAG_SHMDATA_MEMFD_BLOCK | FLAG_SHMWRITABLE;
+
+	return client_queue_message(client, msg);
+}
+
 static int do_command_auth(struct client *client, uint32_t command, uint32_t tag, struct message *m)
 {
 	struct message *reply;
-	uint32_t version;
+	uint32_t version, flags = 0;
 	const void *cookie;
 	size_t len;
+	int res;
 
 	if (message_get(m,
 			TAG_U32, &version,
@@ -151,20 +231,84 @@ static int do_command_auth(struct client *client, uint32_t command, uint32_t tag
 	if (len != NATIVE_COOKIE_LENGTH)
 		return -EINVAL;
 
-	if ((version & PROTOCOL_VERSION_MASK) >= 13)
+	if ((version & PROTOCOL_VERSION_MASK) >= 13) {
+		flags = version & PROTOCOL_FLAG_MASK;
 		version &= PROTOCOL_VERSION_MASK;
+	}
 
 	client->version = version;
 	client->authenticated = true;
 
-	pw_log_info("client:%p AUTH tag:%u version:%d", client, tag, version);
+	if (SPA_FLAG_IS_SET(flags, PROTOCOL_FLAG_SHM) && client_can_use_shm(client)) {
+		client->use_shm = true;
+		client->use_memfd = version >= 31 &&
+			SPA_FLAG_IS_SET(flags, PROTOCOL_FLAG_MEMFD);
+	}
+
+	pw_log_info("client:%p AUTH tag:%u version:%d shm:%d memfd:%d", client, tag, version,
+			client->use_shm, client->use_memfd);
 
 	reply = reply_new(client, tag);
 	message_put(reply,
-			TAG_U32, PROTOCOL_VERSION,
+			TAG_U32, PROTOCOL_VERSION |
+				(client->use_shm ? PROTOCOL_FLAG_SHM : 0) |
+				(client->use_memfd ? PROTOCOL_FLAG_MEMFD : 0),
 			TAG_INVALID);
 
-	return client_queue_message(client, reply);
+	if ((res = client_queue_message(client, reply)) < 0)
+		return res;
+
+	if (client->use_memfd && version >= 30 && client->impl->defs.srbchannel) {
+		if ((res = setup_srbchannel(client)) < 0)
+			pw_log_warn("client %p: can't setup srbchannel: %s",
+					client, spa_strerror(res));
+	}
+	return 0;
+}
+
+static int do_register_memfd_shmid(struct client *client, uint32_t command, uint32_t tag, struct message *m)
+{
+	uint32_t shm_id;
+	int res;
+
+	if (!client->use_memfd || m->n_fds != 1)
+		return -EPROTO;
+
+	if (message_get(m,
+			TAG_U32, &shm_id,
+			TAG_INVALID) < 0)
+		return -EPROTO;
+
+	pw_log_info("client:%p [%s] REGISTER_MEMFD_SHMID shm_id:%u", client, client->name, shm_id);
+
+	/* the fd is now owned by the import */
+	m->n_fds = 0;
+	if ((res = shm_import_add_memfd(&client->shm, shm_id, m->fds[0])) < 0)
+		pw_log_warn("client:%p [%s] can't register memfd %u: %s", client,
+				client->name, shm_id, spa_strerror(res));
+	return res;
+}
+
+static int do_enable_srbchannel(struct client *client, uint32_t command, uint32_t tag, struct message *m)
+{
+	if (client->srb == NULL || client->srb_enabled || tag != client->srb_tag)
+		return -EPROTO;
+
+	pw_log_info("client:%p [%s] ENABLE_SRBCHANNEL tag:%u", client, client->name, tag);
+
+	/* the client reads from both the socket and the srbchannel, from
+	 * now on our frames go to the srbchannel */
+	client->srb_enabled = true;
+	return 0;
+}
+
+static int do_disable_srbchannel(struct client *client, uint32_t command, uint32_t tag, struct message *m)
+{
+	pw_log_info("client:%p [%s] DISABLE_SRBCHANNEL tag:%u", client, client->name, tag);
+
+	/* keep reading from it until the client goes away */
+	client->srb_enabled = false;
+	return 0;
 }
 
 static int reply_set_client_name(struct client *client, uint32_t tag)
@@ -2337,6 +2481,7 @@ static int do_finish_upload_stream(struct client *client, uint32_t command, uint
 		sample = calloc(1, sizeof(*sample));
 		if (sample == NULL)
 			goto error_errno;
+		spa_list_init(&sample->caches);
 
 		if (old != NULL) {
 			sample->index = old->index;
@@ -2351,6 +2496,7 @@ static int do_finish_upload_stream(struct client *client, uint32_t command, uint
 		}
 	} else {
 		pw_properties_free(old->props);
+		sample_free_caches(old);
 		free(old->buffer);
 		impl->stat.sample_cache -= old->length;
 
@@ -2509,7 +2655,7 @@ static void sample_play_ready_reply(void *data, struct client *client, uint32_t
 {
 	struct pending_sample *ps = data;
 	struct message *reply;
-	uint32_t index = id_to_index(client->manager, ps->play->id);
+	uint32_t index = ps->play->index;
 
 	pw_log_info("[%s] PLAY_SAMPLE tag:%u index:%u",
 			client->name, ps->tag, index);
@@ -2528,7 +2674,7 @@ static void sample_play_ready_reply(void *data, struct client *client, uint32_t
 		sample_play_finish(ps);
 }
 
-static void sample_play_ready(void *data, uint32_t id)
+static void sample_play_ready(void *data, uint32_t index)
 {
 	struct pending_sample *ps = data;
 	struct client *client = ps->client;
@@ -2558,6 +2704,23 @@ static void sample_play_done(void *data, int res)
 				on_sample_done, client);
 }
 
+static struct pending_sample *find_pending_sample(struct impl *impl, uint32_t index)
+{
+	struct server *s;
+	struct client *c;
+	struct pending_sample *ps;
+
+	spa_list_for_each(s, &impl->servers, link) {
+		spa_list_for_each(c, &s->clients, link) {
+			spa_list_for_each(ps, &c->pending_samples, link) {
+				if (ps->play->index == index)
+					return ps;
+			}
+		}
+	}
+	return NULL;
+}
+
 static const struct sample_play_events sample_play_events = {
 	VERSION_SAMPLE_PLAY_EVENTS,
 	.ready = sample_play_ready,
@@ -2613,7 +2776,7 @@ static int do_play_sample(struct client *client, uint32_t command, uint32_t tag,
 
 	pw_properties_setf(props, PW_KEY_TARGET_OBJECT, "%"PRIu64, o->serial);
 
-	play = sample_play_new(client->core, sample, props, sizeof(struct pending_sample));
+	play = sample_play_new(sample, props, sizeof(struct pending_sample));
 	props = NULL;
 	if (play == NULL)
 		goto error_errno;
@@ -4955,6 +5118,16 @@ static int do_kill(struct client *client, uint32_t command, uint32_t tag, struct
 		return -EINVAL;
 	}
 
+	if (command == COMMAND_KILL_SINK_INPUT &&
+	    (index & SAMPLE_PLAY_INDEX_FLAG)) {
+		struct pending_sample *ps;
+
+		if ((ps = find_pending_sample(client->impl, index)) == NULL)
+			return -ENOENT;
+		sample_play_stop(ps->play);
+		return reply_simple_ack(client, tag);
+	}
+
 	if ((o = select_object(manager, &sel)) == NULL)
 		return -ENOENT;
 
@@ -5410,12 +5583,12 @@ const struct command commands[COMMAND_MAX] =
 
 	/* Supported since protocol v30 (6.0) */
 	/* BOTH DIRECTIONS */
-	COMMAND(ENABLE_SRBCHANNEL, do_error_access),
-	COMMAND(DISABLE_SRBCHANNEL, do_error_access),
+	COMMAND(ENABLE_SRBCHANNEL, do_enable_srbchannel, COMMAND_ACCESS_WITHOUT_MANAGER),
+	COMMAND(DISABLE_SRBCHANNEL, do_disable_srbchannel, COMMAND_ACCESS_WITHOUT_MANAGER),
 
 	/* Supported since protocol v31 (9.0)
 	 * BOTH DIRECTIONS */
-	COMMAND(REGISTER_MEMFD_SHMID, do_error_access),
+	COMMAND(REGISTER_MEMFD_SHMID, do_register_memfd_shmid, COMMAND_ACCESS_WITHOUT_MANAGER),
 
 	/* Supported since protocol v35 (15.0) */
 	COMMAND(SEND_OBJECT_MESSAGE, do_send_object_message),
@@ -5457,6 +5630,8 @@ static void impl_clear(struct impl *impl)
 	spa_list_consume(msg, &impl->free_messages, link)
 		message_free(msg, true, true);
 
+	sample_mixers_destroy(impl);
+
 	pw_map_for_each(&impl->samples, impl_free_sample, impl);
 	pw_map_clear(&impl->samples);
 
@@ -5562,6 +5737,18 @@ static int parse_uint32(struct pw_properties *props, const char *key, const char
 	return 0;
 }
 
+static int parse_bool(struct pw_properties *props, const char *key, const char *def,
+		bool *res)
+{
+	const char *str;
+	if (props == NULL ||
+	    (str = pw_properties_get(props, key)) == NULL)
+		str = def;
+	*res = spa_atob(str);
+	pw_log_info(": defaults: %s = %s", key, *res ? "true" : "false");
+	return 0;
+}
+
 static void load_defaults(struct defs *def, struct pw_properties *props)
 {
 	parse_frac(props, "pulse.min.req", DEFAULT_MIN_REQ, &def->min_req);
@@ -5573,6 +5760,8 @@ static void load_defaults(struct defs *def, struct pw_properties *props)
 	parse_format(props, "pulse.default.format", DEFAULT_FORMAT, &def->sample_spec);
 	parse_position(props, "pulse.default.position", DEFAULT_POSITION, &def->channel_map);
 	parse_uint32(props, "pulse.idle.timeout", DEFAULT_IDLE_TIMEOUT, &def->idle_timeout);
+	parse_bool(props, "pulse.shm", DEFAULT_SHM, &def->shm);
+	parse_bool(props, "pulse.srbchannel", DEFAULT_SRBCHANNEL, &def->srbchannel);
 	def->sample_spec.channels = def->channel_map.channels;
 	def->quantum_limit = 8192;
 }
@@ -5623,6 +5812,7 @@ struct pw_protocol_pulse *pw_protocol_pulse_new(struct pw_context *context,
 	impl->rate_limit.burst = 1;
 	pw_map_init(&impl->samples, 16, 16);
 	pw_map_init(&impl->modules, 16, 16);
+	spa_list_init(&impl->sample_mixers);
 	spa_list_init(&impl->cleanup_clients);
 	spa_list_init(&impl->free_messages);
 
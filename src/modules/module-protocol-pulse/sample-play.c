@@ -22,190 +22,596 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include "config.h"
+
 #include <stdint.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <spa/node/io.h>
-#include <spa/param/audio/raw.h>
+#include <spa/param/audio/format-utils.h>
 #include <spa/pod/builder.h>
+#include <spa/support/cpu.h>
 #include <spa/utils/hook.h>
+#include <spa/utils/string.h>
+#ifdef HAVE_AUDIOMIXER
+#include <spa/plugins/audiomixer/mix-ops.h>
+#endif
 #include <pipewire/context.h>
 #include <pipewire/core.h>
+#include <pipewire/data-loop.h>
 #include <pipewire/log.h>
 #include <pipewire/properties.h>
 #include <pipewire/stream.h>
 
 #include "format.h"
+#include "internal.h"
 #include "log.h"
 #include "sample.h"
 #include "sample-play.h"
 
-static void sample_play_stream_state_changed(void *data, enum pw_stream_state old,
-					     enum pw_stream_state state, const char *error)
+#define MAX_VOICES		64
+#define MIXER_IDLE_TIMEOUT	(5 * SPA_NSEC_PER_SEC)
+
+/*
+ * One long-lived stream mixes all sample playbacks with the same target
+ * and policy properties. Samples are converted once to planar float at
+ * the mixer rate and cached in the sample, starting a playback only
+ * queues a voice to the mixer. When a mixer is full, another one with
+ * the same properties is made.
+ */
+static const char * const mixer_keys[] = {
+	PW_KEY_TARGET_OBJECT,
+	PW_KEY_MEDIA_ROLE,
+	"event.id",
+	PW_KEY_APP_NAME,
+	PW_KEY_APP_ID,
+	PW_KEY_APP_PROCESS_BINARY,
+};
+
+struct sample_mixer {
+	struct spa_list link;
+	struct impl *impl;
+	struct pw_properties *props;
+	const char *target;
+
+	struct pw_core *core;
+	struct pw_stream *stream;
+	struct spa_hook stream_listener;
+	struct pw_data_loop *data_loop;
+	struct spa_source *event;
+	struct spa_source *idle_timer;
+
+	struct spa_audio_info_raw info;
+#ifdef HAVE_AUDIOMIXER
+	struct mix_ops mix;
+#endif
+	uint32_t cpu_flags;
+	uint32_t id;
+
+	struct spa_list voices;		/* main thread */
+	uint32_t n_voices;
+	struct spa_list rt_voices;	/* data thread */
+	struct spa_list rt_draining;	/* data thread, mixed until the end */
+	uint64_t position;		/* data thread, frames mixed */
+
+	unsigned int ready:1;
+	unsigned int failed:1;
+	unsigned int active:1;
+};
+
+static void mixer_destroy(struct sample_mixer *m);
+
+static void mixer_notify(struct sample_mixer *m)
+{
+	struct sample_play *p, *t;
+
+	spa_list_for_each_safe(p, t, &m->voices, link) {
+		if (m->ready && !p->ready) {
+			p->ready = true;
+			p->id = m->id;
+			sample_play_emit_ready(p, p->index);
+		}
+		if ((__atomic_load_n(&p->finished, __ATOMIC_ACQUIRE) || m->failed) &&
+		    !p->done) {
+			p->done = true;
+			sample_play_emit_done(p, m->failed ? -EIO : 0);
+		}
+	}
+}
+
+static void on_mixer_event(void *data, uint64_t count)
+{
+	mixer_notify(data);
+}
+
+static void on_mixer_idle(void *data, uint64_t expirations)
+{
+	struct sample_mixer *m = data;
+
+	if (m->n_voices == 0)
+		mixer_destroy(m);
+}
+
+static void mixer_set_idle(struct sample_mixer *m, bool idle)
 {
-	struct sample_play *p = data;
+	struct impl *impl = m->impl;
+	struct timespec value = { 0 }, interval = { 0 };
+
+	if (idle) {
+		value.tv_sec = MIXER_IDLE_TIMEOUT / SPA_NSEC_PER_SEC;
+		pw_loop_update_timer(impl->loop, m->idle_timer, &value, &interval, false);
+	} else {
+		pw_loop_update_timer(impl->loop, m->idle_timer, NULL, NULL, false);
+	}
+	if (m->active == idle) {
+		m->active = !idle;
+		pw_stream_set_active(m->stream, m->active);
+	}
+}
+
+static void mixer_stream_state_changed(void *data, enum pw_stream_state old,
+				       enum pw_stream_state state, const char *error)
+{
+	struct sample_mixer *m = data;
 
 	switch (state) {
 	case PW_STREAM_STATE_UNCONNECTED:
 	case PW_STREAM_STATE_ERROR:
-		sample_play_emit_done(p, -EIO);
+		pw_log_info("sample mixer %p [%s]: %s", m, m->target,
+				error ? error : "unconnected");
+		/* new playbacks get a new mixer */
+		m->failed = true;
+		pw_loop_signal_event(m->impl->loop, m->event);
 		break;
 	case PW_STREAM_STATE_PAUSED:
-		p->id = pw_stream_get_node_id(p->stream);
-		sample_play_emit_ready(p, p->id);
+	case PW_STREAM_STATE_STREAMING:
+		if (!m->ready) {
+			m->id = pw_stream_get_node_id(m->stream);
+			m->ready = true;
+			pw_loop_signal_event(m->impl->loop, m->event);
+		}
 		break;
 	default:
 		break;
 	}
 }
 
-static void sample_play_stream_destroy(void *data)
+static void mixer_stream_param_changed(void *data, uint32_t id, const struct spa_pod *param)
 {
-	struct sample_play *p = data;
-
-	pw_log_info("destroy %s", p->sample->name);
+	struct sample_mixer *m = data;
+	struct spa_audio_info_raw info = { 0 };
 
-	spa_hook_remove(&p->listener);
-	p->stream = NULL;
+	if (id != SPA_PARAM_Format || param == NULL)
+		return;
 
-	sample_unref(p->sample);
-	p->sample = NULL;
+	/* we only offer one format */
+	if (spa_format_audio_raw_parse(param, &info) < 0 ||
+	    info.rate != m->info.rate || info.channels != m->info.channels)
+		pw_stream_set_error(m->stream, -EINVAL, "unexpected format");
 }
 
-static void sample_play_stream_process(void *data)
+static void mix_voices(struct sample_mixer *m, float *dst, const void *src[],
+		uint32_t n_src, uint32_t n_frames)
 {
-	struct sample_play *p = data;
-	struct sample *s = p->sample;
-	struct pw_buffer *b;
-	struct spa_buffer *buf;
-	uint32_t size;
-	uint8_t *d;
+#ifdef HAVE_AUDIOMIXER
+	mix_ops_process(&m->mix, dst, src, n_src, n_frames);
+#else
+	uint32_t i, n;
 
-	if (p->offset >= s->length) {
-		pw_stream_flush(p->stream, true);
+	if (n_src == 0) {
+		memset(dst, 0, n_frames * sizeof(float));
 		return;
 	}
-
-	size = s->length - p->offset;
-
-	if ((b = pw_stream_dequeue_buffer(p->stream)) == NULL) {
-		pw_log_warn("out of buffers: %m");
-		return;
+	if (dst != src[0])
+		memcpy(dst, src[0], n_frames * sizeof(float));
+	for (i = 1; i < n_src; i++) {
+		const float *s = src[i];
+		for (n = 0; n < n_frames; n++)
+			dst[n] += s[n];
 	}
+#endif
+}
 
-	buf = b->buffer;
-	if ((d = buf->datas[0].data) == NULL)
-		return;
+static void voice_finished(struct sample_mixer *m, struct sample_play *p)
+{
+	spa_list_remove(&p->rt_link);
+	p->added = false;
+	__atomic_store_n(&p->finished, true, __ATOMIC_RELEASE);
+	pw_loop_signal_event(m->impl->loop, m->event);
+}
 
-	size = SPA_MIN(size, buf->datas[0].maxsize);
-	if (b->requested)
-		size = SPA_MIN(size, b->requested * p->stride);
+/* voices are done when their last frame left the device */
+static void mixer_check_drained(struct sample_mixer *m)
+{
+	struct sample_play *p, *t;
+	struct pw_time time;
+	uint64_t delay = 0, played;
 
-	memcpy(d, s->buffer + p->offset, size);
+	if (spa_list_is_empty(&m->rt_draining))
+		return;
 
-	p->offset += size;
+	if (pw_stream_get_time_n(m->stream, &time, sizeof(time)) == 0 &&
+	    time.delay > 0 && time.rate.denom > 0)
+		delay = (uint64_t)time.delay * m->info.rate * time.rate.num / time.rate.denom;
 
-	buf->datas[0].chunk->offset = 0;
-	buf->datas[0].chunk->stride = p->stride;
-	buf->datas[0].chunk->size = size;
+	played = m->position > delay ? m->position - delay : 0;
 
-	pw_stream_queue_buffer(p->stream, b);
+	spa_list_for_each_safe(p, t, &m->rt_draining, rt_link) {
+		if (p->end <= played)
+			voice_finished(m, p);
+	}
 }
 
-static void sample_play_stream_drained(void *data)
+static void mixer_stream_process(void *data)
 {
-	struct sample_play *p = data;
+	struct sample_mixer *m = data;
+	struct sample_play *p, *t;
+	struct pw_buffer *b;
+	struct spa_buffer *buf;
+	const void *src[MAX_VOICES];
+	uint32_t i, c, n_frames, done = 0, n_src;
+
+	mixer_check_drained(m);
+
+	if ((b = pw_stream_dequeue_buffer(m->stream)) == NULL) {
+		pw_log_warn("out of buffers: %m");
+		return;
+	}
+	buf = b->buffer;
 
-	sample_play_emit_done(p, 0);
+	n_frames = UINT32_MAX;
+	for (c = 0; c < buf->n_datas; c++)
+		n_frames = SPA_MIN(n_frames, buf->datas[c].maxsize / sizeof(float));
+	if (b->requested)
+		n_frames = SPA_MIN(n_frames, b->requested);
+
+	while (done < n_frames) {
+		uint32_t n = n_frames - done;
+
+		/* mix up to the next voice that ends */
+		spa_list_for_each(p, &m->rt_voices, rt_link)
+			n = SPA_MIN(n, p->cache->n_frames - p->offset);
+
+		for (c = 0; c < buf->n_datas; c++) {
+			float *d = buf->datas[c].data;
+
+			if (d == NULL)
+				continue;
+
+			n_src = 0;
+			spa_list_for_each(p, &m->rt_voices, rt_link) {
+				if ((i = p->remap[c]) != SPA_ID_INVALID)
+					src[n_src++] = p->cache->data[i] + p->offset;
+			}
+			mix_voices(m, d + done, src, n_src, n);
+		}
+
+		spa_list_for_each_safe(p, t, &m->rt_voices, rt_link) {
+			p->offset += n;
+			if (p->offset >= p->cache->n_frames) {
+				spa_list_remove(&p->rt_link);
+				spa_list_append(&m->rt_draining, &p->rt_link);
+				p->end = m->position + done + n;
+			}
+		}
+		done += n;
+	}
+	m->position += n_frames;
+
+	for (c = 0; c < buf->n_datas; c++) {
+		buf->datas[c].chunk->offset = 0;
+		buf->datas[c].chunk->stride = sizeof(float);
+		buf->datas[c].chunk->size = n_frames * sizeof(float);
+	}
+	pw_stream_queue_buffer(m->stream, b);
 }
 
-static const struct pw_stream_events sample_play_stream_events = {
+static const struct pw_stream_events mixer_stream_events = {
 	PW_VERSION_STREAM_EVENTS,
-	.state_changed = sample_play_stream_state_changed,
-	.destroy = sample_play_stream_destroy,
-	.process = sample_play_stream_process,
-	.drained = sample_play_stream_drained,
+	.state_changed = mixer_stream_state_changed,
+	.param_changed = mixer_stream_param_changed,
+	.process = mixer_stream_process,
 };
 
-struct sample_play *sample_play_new(struct pw_core *core,
-				    struct sample *sample, struct pw_properties *props,
-				    size_t user_data_size)
+static struct sample_mixer *mixer_new(struct impl *impl, const struct pw_properties *play_props)
 {
-	struct sample_play *p;
+	struct sample_mixer *m;
 	uint8_t buffer[1024];
 	struct spa_pod_builder b = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
 	const struct spa_pod *params[1];
-	uint32_t n_params = 0;
+	const struct spa_support *support;
+	struct spa_cpu *cpu_iface;
+	struct pw_properties *props;
+	uint32_t n_support;
 	int res;
 
-	p = calloc(1, sizeof(*p) + user_data_size);
-	if (p == NULL) {
-		res = -errno;
-		goto error_free;
+	m = calloc(1, sizeof(*m));
+	if (m == NULL)
+		return NULL;
+
+	m->impl = impl;
+	m->id = SPA_ID_INVALID;
+	m->active = true;
+	spa_list_init(&m->voices);
+	spa_list_init(&m->rt_voices);
+	spa_list_init(&m->rt_draining);
+	m->data_loop = pw_context_get_data_loop(impl->context);
+
+	support = pw_context_get_support(impl->context, &n_support);
+	cpu_iface = spa_support_find(support, n_support, SPA_TYPE_INTERFACE_CPU);
+	m->cpu_flags = cpu_iface ? spa_cpu_get_flags(cpu_iface) : 0;
+
+	m->info.format = SPA_AUDIO_FORMAT_F32P;
+	m->info.rate = impl->defs.sample_spec.rate;
+	m->info.channels = impl->defs.channel_map.channels;
+	channel_map_to_positions(&impl->defs.channel_map, m->info.position);
+
+#ifdef HAVE_AUDIOMIXER
+	m->mix.fmt = SPA_AUDIO_FORMAT_F32;
+	m->mix.n_channels = 1;
+	m->mix.cpu_flags = m->cpu_flags;
+	if ((res = mix_ops_init(&m->mix)) < 0)
+		goto error;
+#endif
+
+	/* the mixer stream carries the properties of the first playback */
+	if ((m->props = pw_properties_copy(play_props)) == NULL)
+		goto error_errno;
+	m->target = pw_properties_get(m->props, PW_KEY_TARGET_OBJECT);
+
+	m->event = pw_loop_add_event(impl->loop, on_mixer_event, m);
+	m->idle_timer = pw_loop_add_timer(impl->loop, on_mixer_idle, m);
+	if (m->event == NULL || m->idle_timer == NULL)
+		goto error_errno;
+
+	m->core = pw_context_connect_self(impl->context, NULL, 0);
+	if (m->core == NULL)
+		goto error_errno;
+
+	if ((props = pw_properties_copy(m->props)) == NULL)
+		goto error_errno;
+	pw_properties_set(props, PW_KEY_NODE_NAME, "pulse-sample-mixer");
+	if (pw_properties_get(props, PW_KEY_MEDIA_NAME) == NULL)
+		pw_properties_set(props, PW_KEY_MEDIA_NAME, "Sample mixer");
+	pw_properties_set(props, PW_KEY_MEDIA_TYPE, "Audio");
+	pw_properties_set(props, PW_KEY_MEDIA_CATEGORY, "Playback");
+
+	m->stream = pw_stream_new(m->core, "pulse-sample-mixer", props);
+	if (m->stream == NULL)
+		goto error_errno;
+
+	pw_stream_add_listener(m->stream, &m->stream_listener,
+			&mixer_stream_events, m);
+
+	params[0] = spa_format_audio_raw_build(&b, SPA_PARAM_EnumFormat, &m->info);
+
+	if ((res = pw_stream_connect(m->stream,
+			PW_DIRECTION_OUTPUT,
+			PW_ID_ANY,
+			PW_STREAM_FLAG_AUTOCONNECT |
+			PW_STREAM_FLAG_MAP_BUFFERS |
+			PW_STREAM_FLAG_RT_PROCESS,
+			params, 1)) < 0)
+		goto error;
+
+	spa_list_append(&impl->sample_mixers, &m->link);
+
+	pw_log_info("sample mixer %p [%s]: new rate:%u channels:%u", m, m->target,
+			m->info.rate, m->info.channels);
+	return m;
+
+error_errno:
+	res = -errno;
+error:
+	spa_list_init(&m->link);
+	mixer_destroy(m);
+	errno = -res;
+	return NULL;
+}
+
+static void mixer_destroy(struct sample_mixer *m)
+{
+	struct impl *impl = m->impl;
+
+	pw_log_info("sample mixer %p [%s]: destroy", m, m->target);
+
+	spa_assert(spa_list_is_empty(&m->voices));
+
+	spa_list_remove(&m->link);
+
+	if (m->stream) {
+		spa_hook_remove(&m->stream_listener);
+		pw_stream_destroy(m->stream);
 	}
+	if (m->core)
+		pw_core_disconnect(m->core);
+	if (m->event)
+		pw_loop_destroy_source(impl->loop, m->event);
+	if (m->idle_timer)
+		pw_loop_destroy_source(impl->loop, m->idle_timer);
+#ifdef HAVE_AUDIOMIXER
+	if (m->mix.free)
+		mix_ops_free(&m->mix);
+#endif
+	pw_properties_free(m->props);
+	free(m);
+}
 
-	p->context = pw_core_get_context(core);
-	p->main_loop = pw_context_get_main_loop(p->context);
-	spa_hook_list_init(&p->hooks);
-	p->user_data = SPA_PTROFF(p, sizeof(struct sample_play), void);
+static bool mixer_matches(struct sample_mixer *m, const struct pw_properties *props)
+{
+	SPA_FOR_EACH_ELEMENT_VAR(mixer_keys, k) {
+		if (!spa_streq(pw_properties_get(m->props, *k),
+				pw_properties_get(props, *k)))
+			return false;
+	}
+	return true;
+}
 
-	pw_properties_update(props, &sample->props->dict);
+static struct sample_mixer *mixer_find(struct impl *impl, const struct pw_properties *props)
+{
+	struct sample_mixer *m;
+
+	spa_list_for_each(m, &impl->sample_mixers, link) {
+		if (!m->failed && m->n_voices < MAX_VOICES &&
+		    mixer_matches(m, props))
+			return m;
+	}
+	return mixer_new(impl, props);
+}
 
-	p->stream = pw_stream_new(core, sample->name, props);
-	props = NULL;
-	if (p->stream == NULL) {
-		res = -errno;
-		goto error_free;
+static void setup_remap(struct sample_play *p, const struct spa_audio_info_raw *info)
+{
+	const struct channel_map *map = &p->sample->map;
+	uint32_t i, j, channels = p->cache->channels;
+
+	for (i = 0; i < info->channels; i++) {
+		p->remap[i] = SPA_ID_INVALID;
+		if (channels == 1) {
+			/* mono goes to all channels */
+			p->remap[i] = 0;
+			continue;
+		}
+		for (j = 0; j < SPA_MIN(map->channels, channels); j++) {
+			if (map->map[j] == info->position[i]) {
+				p->remap[i] = j;
+				break;
+			}
+		}
+		if (p->remap[i] == SPA_ID_INVALID && channels == info->channels)
+			p->remap[i] = i;
 	}
+}
+
+static int do_add_voice(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct sample_play *p = user_data;
+
+	spa_list_append(&p->mixer->rt_voices, &p->rt_link);
+	p->added = true;
+	return 0;
+}
+
+static int do_remove_voice(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct sample_play *p = user_data;
+
+	if (p->added) {
+		spa_list_remove(&p->rt_link);
+		p->added = false;
+	}
+	return 0;
+}
+
+struct sample_play *sample_play_new(struct sample *sample, struct pw_properties *props,
+				    size_t user_data_size)
+{
+	struct impl *impl = sample->impl;
+	struct sample_play *p = NULL;
+	struct sample_mixer *m;
+	const struct sample_cache *cache;
+	int res;
+
+	pw_properties_update(props, &sample->props->dict);
+
+	m = mixer_find(impl, props);
+	if (m == NULL)
+		goto error_errno;
+
+	cache = sample_get_cache(sample, m->info.rate, m->cpu_flags);
+	if (cache == NULL)
+		goto error_errno;
+
+	p = calloc(1, sizeof(*p) + user_data_size);
+	if (p == NULL)
+		goto error_errno;
+
+	p->context = impl->context;
+	p->main_loop = impl->loop;
+	p->id = SPA_ID_INVALID;
+	p->index = SAMPLE_PLAY_INDEX_FLAG |
+		(impl->sample_play_index++ & ~SAMPLE_PLAY_INDEX_FLAG);
+	spa_hook_list_init(&p->hooks);
+	p->user_data = SPA_PTROFF(p, sizeof(struct sample_play), void);
 
-	/* safe to increment the reference count here because it will be decreased
-	   by the stream's 'destroy' event handler, which will be called
-	   (even if `pw_stream_connect()` fails) */
 	p->sample = sample_ref(sample);
-	p->stride = sample_spec_frame_size(&sample->ss);
+	p->cache = cache;
+	p->mixer = m;
+	setup_remap(p, &m->info);
 
-	pw_stream_add_listener(p->stream,
-			&p->listener,
-			&sample_play_stream_events, p);
+	pw_log_info("play %s index:%u on mixer %p", sample->name, p->index, m);
 
-	params[n_params++] = format_build_param(&b, SPA_PARAM_EnumFormat,
-			&sample->ss, &sample->map);
+	spa_list_append(&m->voices, &p->link);
+	m->n_voices++;
+	mixer_set_idle(m, false);
 
-	res = pw_stream_connect(p->stream,
-			PW_DIRECTION_OUTPUT,
-			PW_ID_ANY,
-			PW_STREAM_FLAG_AUTOCONNECT |
-			PW_STREAM_FLAG_MAP_BUFFERS |
-			PW_STREAM_FLAG_RT_PROCESS,
-			params, n_params);
-	if (res < 0)
-		goto error_cleanup;
+	pw_data_loop_invoke(m->data_loop, do_add_voice, 0, NULL, 0, false, p);
+
+	/* ready is emitted from the main loop, after the caller added
+	 * its listener */
+	if (m->ready || m->failed)
+		pw_loop_signal_event(impl->loop, m->event);
 
+	pw_properties_free(props);
 	return p;
 
-error_cleanup:
-	pw_stream_destroy(p->stream);
-error_free:
+error_errno:
+	res = -errno;
 	pw_properties_free(props);
-	free(p);
 	errno = -res;
 	return NULL;
 }
 
 void sample_play_destroy(struct sample_play *p)
 {
-	if (p->stream)
-		pw_stream_destroy(p->stream);
+	struct sample_mixer *m = p->mixer;
+
+	pw_log_info("destroy %s", p->sample->name);
+
+	pw_data_loop_invoke(m->data_loop, do_remove_voice, 0, NULL, 0, true, p);
+
+	spa_list_remove(&p->link);
+	if (--m->n_voices == 0) {
+		if (m->failed)
+			mixer_destroy(m);
+		else
+			mixer_set_idle(m, true);
+	}
+
+	sample_unref(p->sample);
 
 	spa_hook_list_clean(&p->hooks);
 
 	free(p);
 }
 
+void sample_play_stop(struct sample_play *p)
+{
+	struct sample_mixer *m = p->mixer;
+
+	if (p->done)
+		return;
+
+	pw_log_info("stop %s index:%u", p->sample->name, p->index);
+
+	/* after this the data thread no longer touches the voice */
+	pw_data_loop_invoke(m->data_loop, do_remove_voice, 0, NULL, 0, true, p);
+	__atomic_store_n(&p->finished, true, __ATOMIC_RELEASE);
+	pw_loop_signal_event(m->impl->loop, m->event);
+}
+
 void sample_play_add_listener(struct sample_play *p, struct spa_hook *listener,
 			      const struct sample_play_events *events, void *data)
 {
 	spa_hook_list_append(&p->hooks, listener, events, data);
 }
+
+void sample_mixers_destroy(struct impl *impl)
+{
+	struct sample_mixer *m;
+
+	spa_list_consume(m, &impl->sample_mixers, link)
+		mixer_destroy(m);
+}
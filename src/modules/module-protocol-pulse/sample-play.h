@@ -25,16 +25,20 @@
 #ifndef PULSER_SERVER_SAMPLE_PLAY_H
 #define PULSER_SERVER_SAMPLE_PLAY_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
 #include <spa/utils/list.h>
 #include <spa/utils/hook.h>
 
+#include "format.h"
+
+struct impl;
 struct sample;
-struct pw_core;
+struct sample_cache;
+struct sample_mixer;
 struct pw_loop;
-struct pw_stream;
 struct pw_context;
 struct pw_properties;
 
@@ -42,7 +46,7 @@ struct sample_play_events {
 #define VERSION_SAMPLE_PLAY_EVENTS	0
 	uint32_t version;
 
-	void (*ready) (void *data, uint32_t id);
+	void (*ready) (void *data, uint32_t index);
 
 	void (*done) (void *data, int err);
 };
@@ -50,27 +54,42 @@ struct sample_play_events {
 #define sample_play_emit_ready(p,i) spa_hook_list_call(&p->hooks, struct sample_play_events, ready, 0, i)
 #define sample_play_emit_done(p,r) spa_hook_list_call(&p->hooks, struct sample_play_events, done, 0, r)
 
+/* indexes of playbacks on a shared mixer, they are not objects so they
+ * are kept apart from the object serials */
+#define SAMPLE_PLAY_INDEX_FLAG	(1u << 30)
+
+/* A playback of a sample on a shared sample mixer */
 struct sample_play {
 	struct spa_list link;
+	struct spa_list rt_link;
 	struct sample *sample;
-	struct pw_stream *stream;
-	uint32_t id;
-	struct spa_hook listener;
+	struct sample_mixer *mixer;
+	const struct sample_cache *cache;
+	uint32_t id;			/* node id of the mixer */
+	uint32_t index;
 	struct pw_context *context;
 	struct pw_loop *main_loop;
 	uint32_t offset;
-	uint32_t stride;
+	uint32_t remap[CHANNELS_MAX];
+	uint64_t end;			/* mixer position after the last frame */
+	bool added;			/* data thread */
+	bool finished;			/* set by the data thread, atomic */
+	bool ready;			/* main thread */
+	bool done;			/* main thread */
 	struct spa_hook_list hooks;
 	void *user_data;
 };
 
-struct sample_play *sample_play_new(struct pw_core *core,
-				    struct sample *sample, struct pw_properties *props,
+struct sample_play *sample_play_new(struct sample *sample, struct pw_properties *props,
 				    size_t user_data_size);
 
 void sample_play_destroy(struct sample_play *p);
 
+void sample_play_stop(struct sample_play *p);
+
 void sample_play_add_listener(struct sample_play *p, struct spa_hook *listener,
 			      const struct sample_play_events *events, void *data);
 
+void sample_mixers_destroy(struct impl *impl);
+
 #endif /* PULSER_SERVER_SAMPLE_PLAY_H */
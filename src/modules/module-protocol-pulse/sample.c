@@ -22,8 +22,14 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <errno.h>
 #include <stdlib.h>
 
+#include <spa/param/audio/raw.h>
+#include <spa/utils/result.h>
+#include <spa/plugins/audioconvert/fmt-ops.h>
+#include <spa/plugins/audioconvert/resample.h>
+
 #include <pipewire/log.h>
 #include <pipewire/map.h>
 #include <pipewire/properties.h>
@@ -45,6 +51,152 @@ void sample_free(struct sample *sample)
 
 	pw_properties_free(sample->props);
 
+	sample_free_caches(sample);
 	free(sample->buffer);
 	free(sample);
 }
+
+static struct sample_cache *cache_new(uint32_t rate, uint32_t channels, uint32_t n_frames)
+{
+	struct sample_cache *c;
+	uint32_t i, stride = SPA_ROUND_UP_N(n_frames, 16);
+
+	c = calloc(1, sizeof(*c) + channels * stride * sizeof(float) + 64);
+	if (c == NULL)
+		return NULL;
+
+	c->rate = rate;
+	c->channels = channels;
+	c->n_frames = n_frames;
+	for (i = 0; i < channels; i++)
+		c->data[i] = SPA_PTR_ALIGN(SPA_PTROFF(c, sizeof(*c), void), 64, float) + i * stride;
+	return c;
+}
+
+static struct sample_cache *cache_resample(struct sample_cache *in, uint32_t rate,
+		uint32_t cpu_flags)
+{
+	struct sample_cache *out;
+	struct resample r;
+	uint32_t in_len, out_len, total = 0, i, delay;
+	const void *src[CHANNELS_MAX];
+	void *dst[CHANNELS_MAX];
+	float *zeros = NULL;
+	int res;
+
+	spa_zero(r);
+	r.channels = in->channels;
+	r.i_rate = in->rate;
+	r.o_rate = rate;
+	r.cpu_flags = cpu_flags;
+	r.quality = RESAMPLE_DEFAULT_QUALITY;
+	if ((res = resample_native_init(&r)) < 0) {
+		errno = -res;
+		return NULL;
+	}
+
+	out = cache_new(rate, in->channels,
+			SPA_ROUND_UP((uint64_t)in->n_frames * rate, in->rate) / in->rate);
+	delay = resample_delay(&r);
+	zeros = calloc(delay + 1, sizeof(float));
+	if (out == NULL || zeros == NULL)
+		goto error;
+
+	for (i = 0; i < in->channels; i++) {
+		src[i] = in->data[i];
+		dst[i] = out->data[i];
+	}
+	in_len = in->n_frames;
+	out_len = out->n_frames;
+	resample_process(&r, src, &in_len, dst, &out_len);
+	total += out_len;
+
+	/* flush the resampler delay */
+	for (i = 0; i < in->channels; i++) {
+		src[i] = zeros;
+		dst[i] = out->data[i] + total;
+	}
+	in_len = delay;
+	out_len = out->n_frames - total;
+	resample_process(&r, src, &in_len, dst, &out_len);
+	total += out_len;
+
+	out->n_frames = total;
+
+	resample_free(&r);
+	free(zeros);
+	return out;
+
+error:
+	res = -errno;
+	resample_free(&r);
+	free(out);
+	free(zeros);
+	errno = -res;
+	return NULL;
+}
+
+const struct sample_cache *sample_get_cache(struct sample *sample, uint32_t rate,
+		uint32_t cpu_flags)
+{
+	struct sample_cache *c, *conv;
+	struct convert cv;
+	uint32_t stride = sample_spec_frame_size(&sample->ss);
+	const void *src[1];
+	int res;
+
+	spa_list_for_each(c, &sample->caches, link)
+		if (c->rate == rate)
+			return c;
+
+	if (stride == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	conv = cache_new(sample->ss.rate, sample->ss.channels, sample->length / stride);
+	if (conv == NULL)
+		return NULL;
+
+	spa_zero(cv);
+	cv.src_fmt = sample->ss.format;
+	cv.dst_fmt = SPA_AUDIO_FORMAT_F32P;
+	cv.n_channels = sample->ss.channels;
+	cv.rate = sample->ss.rate;
+	cv.cpu_flags = cpu_flags;
+	if ((res = convert_init(&cv)) < 0) {
+		pw_log_warn("sample %s: can't convert format %s: %s", sample->name,
+				format_id2name(sample->ss.format), spa_strerror(res));
+		free(conv);
+		errno = -res;
+		return NULL;
+	}
+	src[0] = sample->buffer;
+	convert_process(&cv, (void**)conv->data, src, conv->n_frames);
+	convert_free(&cv);
+
+	if (sample->ss.rate != rate) {
+		c = cache_resample(conv, rate, cpu_flags);
+		free(conv);
+		if (c == NULL)
+			return NULL;
+	} else {
+		c = conv;
+	}
+
+	pw_log_info("sample %s: cached %u frames at rate %u", sample->name,
+			c->n_frames, c->rate);
+
+	spa_list_append(&sample->caches, &c->link);
+	return c;
+}
+
+void sample_free_caches(struct sample *sample)
+{
+	struct sample_cache *c;
+
+	spa_list_consume(c, &sample->caches, link) {
+		spa_list_remove(&c->link);
+		free(c);
+	}
+}
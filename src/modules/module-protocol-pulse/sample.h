@@ -27,11 +27,22 @@
 
 #include <stdint.h>
 
+#include <spa/utils/list.h>
+
 #include "format.h"
 
 struct impl;
 struct pw_properties;
 
+/* the sample converted to planar float at the mixer rate */
+struct sample_cache {
+	struct spa_list link;
+	uint32_t rate;
+	uint32_t channels;
+	uint32_t n_frames;
+	float *data[CHANNELS_MAX];
+};
+
 struct sample {
 	int ref;
 	uint32_t index;
@@ -42,10 +53,15 @@ struct sample {
 	struct pw_properties *props;
 	uint32_t length;
 	uint8_t *buffer;
+	struct spa_list caches;
 };
 
 void sample_free(struct sample *sample);
 
+const struct sample_cache *sample_get_cache(struct sample *sample, uint32_t rate,
+		uint32_t cpu_flags);
+void sample_free_caches(struct sample *sample);
+
 static inline struct sample *sample_ref(struct sample *sample)
 {
 	sample->ref++;
@@ -58,6 +58,8 @@
 #include "message.h"
 #include "reply.h"
 #include "server.h"
+#include "shm.h"
+#include "srbchannel.h"
 #include "stream.h"
 #include "utils.h"
 #include "flatpak-utils.h"
@@ -117,33 +119,52 @@ finish:
 	return 0;
 }
 
-static int handle_memblock(struct client *client, struct message *msg)
+static int write_shm_data(struct client *client, struct stream *stream, uint32_t index,
+		bool memfd, const struct shm_info *info)
+{
+	uint32_t offs = index % MAXLENGTH;
+	uint32_t shm_offset = ntohl(info->offset);
+	uint32_t len = SPA_MIN(ntohl(info->length), MAXLENGTH);
+	uint32_t l0 = SPA_MIN(len, MAXLENGTH - offs);
+	int res;
+
+	res = shm_import_read(&client->shm, memfd, ntohl(info->shm_id), shm_offset,
+			SPA_PTROFF(stream->buffer, offs, void), l0);
+	if (res >= 0 && len > l0)
+		res = shm_import_read(&client->shm, memfd, ntohl(info->shm_id),
+				shm_offset + l0, stream->buffer, len - l0);
+	return res;
+}
+
+static int memblock_begin(struct client *client, const struct descriptor *desc,
+		uint32_t length, struct stream **streamp, uint32_t *indexp)
 {
 	struct stream *stream;
 	uint32_t channel, flags, index;
 	int64_t offset, diff;
 	int32_t filled;
-	int res = 0;
 
-	channel = ntohl(client->desc.channel);
+	channel = ntohl(desc->channel);
 	offset = (int64_t) (
-		(((uint64_t) ntohl(client->desc.offset_hi)) << 32) |
-		(((uint64_t) ntohl(client->desc.offset_lo))));
-	flags = ntohl(client->desc.flags);
+		(((uint64_t) ntohl(desc->offset_hi)) << 32) |
+		(((uint64_t) ntohl(desc->offset_lo))));
+	flags = ntohl(desc->flags);
 
 	pw_log_debug("client %p: received memblock channel:%d offset:%" PRIi64 " flags:%08x size:%u",
-		     client, channel, offset, flags, msg->length);
+		     client, channel, offset, flags, length);
+
+	*streamp = NULL;
 
 	stream = pw_map_lookup(&client->streams, channel);
 	if (stream == NULL || stream->type == STREAM_TYPE_RECORD) {
 		pw_log_info("client %p [%s]: received memblock for unknown channel %d",
 			    client, client->name, channel);
-		goto finish;
+		return 0;
 	}
 
 	filled = spa_ringbuffer_get_write_index(&stream->ring, &index);
-	pw_log_debug("new block %p %p/%u filled:%d index:%d flags:%02x offset:%" PRIu64,
-		     msg, msg->data, msg->length, filled, index, flags, offset);
+	pw_log_debug("new block %u filled:%d index:%d flags:%02x offset:%" PRIu64,
+		     length, filled, index, flags, offset);
 
 	switch (flags & FLAG_SEEKMASK) {
 	case SEEK_RELATIVE:
@@ -159,8 +180,7 @@ static int handle_memblock(struct client *client, struct message *msg)
 	default:
 		pw_log_warn("client %p [%s]: received memblock frame with invalid seek mode: %" PRIu32,
 			    client, client->name, (uint32_t)(flags & FLAG_SEEKMASK));
-		res = -EPROTO;
-		goto finish;
+		return -EPROTO;
 	}
 
 	index += diff;
@@ -171,122 +191,348 @@ static int handle_memblock(struct client *client, struct message *msg)
 
 	if (filled < 0) {
 		/* underrun, reported on reader side */
-	} else if (filled + msg->length > stream->attr.maxlength) {
+	} else if (filled + length > stream->attr.maxlength) {
 		/* overrun */
 		stream_send_overflow(stream);
 	}
 
-	/* always write data to ringbuffer, we expect the other side
-	 * to recover */
-	spa_ringbuffer_write_data(&stream->ring,
-			stream->buffer, MAXLENGTH,
-			index % MAXLENGTH,
-			msg->data,
-			SPA_MIN(msg->length, MAXLENGTH));
-	index += msg->length;
+	*streamp = stream;
+	*indexp = index;
+	return 0;
+}
+
+static void memblock_end(struct stream *stream, uint32_t index, uint32_t length)
+{
+	index += length;
 	spa_ringbuffer_write_update(&stream->ring, index);
 
-	stream->write_index += msg->length;
-	stream->requested -= msg->length;
+	stream->write_index += length;
+	stream->requested -= length;
 
 	stream_send_request(stream);
 
 	if (stream->is_paused && !stream->corked)
 		stream_set_paused(stream, false, "new data");
+}
+
+static int handle_shm_memblock(struct client *client, const struct descriptor *desc, struct message *msg)
+{
+	const struct shm_info *info = (const struct shm_info *) msg->data;
+	uint32_t index, length = ntohl(info->length);
+	struct stream *stream;
+	int res;
+
+	res = memblock_begin(client, desc, length, &stream, &index);
+	if (res < 0 || stream == NULL)
+		goto finish;
+
+	/* always write data to ringbuffer, we expect the other side
+	 * to recover */
+	res = write_shm_data(client, stream, index,
+			SPA_FLAG_IS_SET(ntohl(desc->flags), FLAG_SHMDATA_MEMFD_BLOCK), info);
+	if (res < 0) {
+		/* drop the data but keep the client */
+		pw_log_warn("client %p [%s]: can't import block %u from pool %u, dropping: %s",
+			    client, client->name, ntohl(info->block_id),
+			    ntohl(info->shm_id), spa_strerror(res));
+		res = 0;
+		goto finish;
+	}
+	memblock_end(stream, index, length);
 
 finish:
+	/* we copied the data, the client can reuse the block */
+	client_queue_shm_release(client, ntohl(info->block_id));
 	message_free(msg, false, false);
 	return res;
 }
 
-static int do_read(struct client *client)
+static ssize_t client_recv(struct client *client, struct client_input *in, void *data, size_t size)
 {
-	struct impl * const impl = client->impl;
-	size_t size;
+	struct msghdr msg = { 0 };
+	struct iovec iov[1];
+	struct cmsghdr *cmsg;
+	union {
+		char buf[CMSG_SPACE(MESSAGE_MAX_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} cmsgbuf;
+	ssize_t r;
 	int res = 0;
-	void *data;
 
-	if (client->in_index < sizeof(client->desc)) {
-		data = SPA_PTROFF(&client->desc, client->in_index, void);
-		size = sizeof(client->desc) - client->in_index;
-	} else {
-		uint32_t idx = client->in_index - sizeof(client->desc);
-
-		if (client->message == NULL || client->message->length < idx) {
-			res = -EPROTO;
-			goto exit;
-		}
-
-		data = SPA_PTROFF(client->message->data, idx, void);
-		size = client->message->length - idx;
+	if (in == &client->srb_in) {
+		r = srbchannel_read(client->srb, data, size);
+		return r > 0 ? r : -EAGAIN;
 	}
 
-	while (true) {
-		ssize_t r = recv(client->source->fd, data, size, MSG_DONTWAIT);
+	iov[0].iov_base = data;
+	iov[0].iov_len = size;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = &cmsgbuf;
+	msg.msg_controllen = sizeof(cmsgbuf);
 
-		if (r == 0 && size != 0) {
-			res = -EPIPE;
-			goto exit;
-		} else if (r < 0) {
+	while (true) {
+		r = recvmsg(client->source->fd, &msg, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+		if (r < 0) {
 			if (errno == EINTR)
 				continue;
-			res = -errno;
-			if (res != -EAGAIN && res != -EWOULDBLOCK &&
-			    res != -EPIPE && res != -ECONNRESET)
-				pw_log_warn("recv client:%p res %zd: %m", client, r);
-			goto exit;
+			return -errno;
 		}
-
-		client->in_index += r;
 		break;
 	}
 
-	if (client->in_index == sizeof(client->desc)) {
-		uint32_t flags, length, channel;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		uint32_t i, n_fds;
+		int *fds;
 
-		flags = ntohl(client->desc.flags);
-		if ((flags & FLAG_SHMMASK) != 0) {
-			res = -EPROTO;
-			goto exit;
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		fds = (int*)CMSG_DATA(cmsg);
+		n_fds = (cmsg->cmsg_len - ((uint8_t*)fds - (uint8_t*)cmsg)) / sizeof(int);
+		for (i = 0; i < n_fds; i++) {
+			if (in->n_fds < MESSAGE_MAX_FDS) {
+				in->fds[in->n_fds++] = fds[i];
+			} else {
+				close(fds[i]);
+				res = -EPROTO;
+			}
 		}
+	}
+	if (msg.msg_flags & MSG_CTRUNC)
+		res = -EPROTO;
+	if (res < 0) {
+		pw_log_warn("client %p: received too many fds", client);
+		return res;
+	}
+	return r;
+}
 
-		length = ntohl(client->desc.length);
-		if (length > FRAME_SIZE_MAX_ALLOW || length <= 0) {
-			pw_log_warn("client %p: received invalid frame size: %u",
-				    client, length);
-			res = -EPROTO;
-			goto exit;
+static int frame_begin(struct client *client, struct client_input *in)
+{
+	struct impl * const impl = client->impl;
+	uint32_t flags, length, channel;
+	struct stream *stream;
+	uint32_t i;
+	int res;
+
+	flags = ntohl(in->desc.flags);
+	length = ntohl(in->desc.length);
+	channel = ntohl(in->desc.channel);
+
+	in->channel = SPA_ID_INVALID;
+
+	if ((flags & FLAG_SHMMASK) != 0) {
+		if (!client->use_shm)
+			return -EPROTO;
+		if (flags == FLAG_SHMRELEASE || flags == FLAG_SHMREVOKE) {
+			/* we copy imported blocks right away and the only block
+			 * we export is the srbchannel memory, nothing to do */
+			pw_log_debug("client %p: %s block %u", client,
+					flags == FLAG_SHMRELEASE ? "release" : "revoke",
+					ntohl(in->desc.offset_hi));
+			in->desc.length = 0;
+			return 0;
+		}
+		if ((flags & FLAG_SHMMASK & ~FLAG_SHMDATA_MEMFD_BLOCK) != FLAG_SHMDATA ||
+		    (!client->use_memfd && (flags & FLAG_SHMDATA_MEMFD_BLOCK)) ||
+		    length != sizeof(struct shm_info) || channel == (uint32_t) -1) {
+			pw_log_warn("client %p: received invalid shm frame flags:%08x length:%u",
+				    client, flags, length);
+			return -EPROTO;
 		}
+	}
 
-		channel = ntohl(client->desc.channel);
-		if (channel == (uint32_t) -1) {
-			if (flags != 0) {
-				pw_log_warn("client %p: received packet frame with invalid flags",
-					    client);
-				res = -EPROTO;
-				goto exit;
-			}
+	if (length > FRAME_SIZE_MAX_ALLOW || length <= 0) {
+		pw_log_warn("client %p: received invalid frame size: %u",
+			    client, length);
+		return -EPROTO;
+	}
+
+	if (channel == (uint32_t) -1) {
+		if (flags != 0) {
+			pw_log_warn("client %p: received packet frame with invalid flags",
+				    client);
+			return -EPROTO;
 		}
+	}
 
-		if (client->message)
-			message_free(client->message, false, false);
+	if (channel == (uint32_t) -1 || (flags & FLAG_SHMDATA)) {
+		in->message = message_alloc(impl, channel, length);
+		if (in->message == NULL)
+			return -errno;
+	} else {
+		/* inline audio is written to the ringbuffer as it arrives */
+		if ((res = memblock_begin(client, &in->desc, length, &stream, &in->ring_index)) < 0)
+			return res;
+		if (stream != NULL)
+			in->channel = channel;
+	}
 
-		client->message = message_alloc(impl, channel, length);
-	} else if (client->message &&
-	    client->in_index >= client->message->length + sizeof(client->desc)) {
-		struct message * const msg = client->message;
+	/* The fds of a read were sent with the last frame that starts in the
+	 * data of that read, the kernel does not merge data after fds. */
+	if (in->n_fds > 0 && in->frame_start < in->fds_end &&
+	    in->frame_start + sizeof(in->desc) + length >= in->fds_end) {
+		if (in->message) {
+			memcpy(in->message->fds, in->fds, in->n_fds * sizeof(int));
+			in->message->n_fds = in->n_fds;
+		} else {
+			for (i = 0; i < in->n_fds; i++)
+				close(in->fds[i]);
+		}
+		in->n_fds = 0;
+	}
+	return 0;
+}
+
+static void frame_data(struct client *client, struct client_input *in,
+		const void *data, uint32_t size)
+{
+	uint32_t idx = in->index - sizeof(in->desc);
+	struct stream *stream;
+
+	if (in->message != NULL) {
+		memcpy(SPA_PTROFF(in->message->data, idx, void), data, size);
+	} else if (in->channel != SPA_ID_INVALID && idx < MAXLENGTH) {
+		/* always write data to ringbuffer, we expect the other side
+		 * to recover */
+		stream = pw_map_lookup(&client->streams, in->channel);
+		if (stream != NULL)
+			spa_ringbuffer_write_data(&stream->ring,
+					stream->buffer, MAXLENGTH,
+					(in->ring_index + idx) % MAXLENGTH,
+					data, SPA_MIN(size, MAXLENGTH - idx));
+	}
+}
+
+static int frame_end(struct client *client, struct client_input *in)
+{
+	struct message * const msg = in->message;
+	struct stream *stream;
 
-		client->message = NULL;
-		client->in_index = 0;
+	in->message = NULL;
+	in->index = 0;
 
+	if (msg != NULL) {
 		if (msg->channel == (uint32_t)-1)
-			res = handle_packet(client, msg);
+			return handle_packet(client, msg);
 		else
-			res = handle_memblock(client, msg);
+			return handle_shm_memblock(client, &in->desc, msg);
 	}
+	if (in->channel != SPA_ID_INVALID &&
+	    (stream = pw_map_lookup(&client->streams, in->channel)) != NULL)
+		memblock_end(stream, in->ring_index, ntohl(in->desc.length));
 
-exit:
-	return res;
+	return 0;
+}
+
+static int fill_buffer(struct client *client, struct client_input *in)
+{
+	uint32_t n_fds = in->n_fds;
+	ssize_t r;
+
+	/* only a frame with a partial descriptor can still own fds */
+	if (n_fds > 0 && (in->index == 0 || in->index >= sizeof(in->desc))) {
+		pw_log_warn("client %p: received fds without a frame", client);
+		return -EPROTO;
+	}
+	if (in->buffer == NULL) {
+		in->buffer = malloc(CLIENT_READ_BUFFER_SIZE);
+		if (in->buffer == NULL)
+			return -errno;
+	}
+
+	while (true) {
+		r = client_recv(client, in, in->buffer, CLIENT_READ_BUFFER_SIZE);
+		if (r == 0)
+			return -EPIPE;
+		if (r < 0) {
+			if (r != -EAGAIN && r != -EWOULDBLOCK &&
+			    r != -EPIPE && r != -ECONNRESET && r != -EPROTO)
+				pw_log_warn("recv client:%p res %zd: %s", client, r, spa_strerror(r));
+			return r;
+		}
+		break;
+	}
+	in->position += in->length;
+	in->offset = 0;
+	in->length = r;
+	if (in->n_fds > n_fds)
+		in->fds_end = in->position + r;
+
+	return 0;
+}
+
+static int do_read(struct client *client, struct client_input *in)
+{
+	int res;
+
+	/* read as much as we can in one go and parse all frames in it */
+	if (in->offset == in->length &&
+	    (res = fill_buffer(client, in)) < 0)
+		return res;
+
+	while (in->offset < in->length && !client->disconnect) {
+		const void *data = &in->buffer[in->offset];
+		uint32_t avail = in->length - in->offset, size;
+
+		if (in->index < sizeof(in->desc)) {
+			if (in->index == 0)
+				in->frame_start = in->position + in->offset;
+
+			size = SPA_MIN(avail, sizeof(in->desc) - in->index);
+			memcpy(SPA_PTROFF(&in->desc, in->index, void), data, size);
+			in->offset += size;
+			in->index += size;
+
+			if (in->index < sizeof(in->desc))
+				break;
+			if ((res = frame_begin(client, in)) < 0)
+				return res;
+		} else {
+			size = SPA_MIN(avail, sizeof(in->desc) +
+					ntohl(in->desc.length) - in->index);
+			frame_data(client, in, data, size);
+			in->offset += size;
+			in->index += size;
+		}
+
+		if (in->index == sizeof(in->desc) + ntohl(in->desc.length) &&
+		    (res = frame_end(client, in)) < 0)
+			return res;
+	}
+
+	/* a short read means there is nothing left for now */
+	return in->length < CLIENT_READ_BUFFER_SIZE ? -EAGAIN : 0;
+}
+
+static void handle_client_error(struct client *client, int res)
+{
+	switch (res) {
+	case -EPIPE:
+	case -ECONNRESET:
+		pw_log_info("server %p: client %p [%s] disconnected",
+			    client->server, client, client->name);
+		SPA_FALLTHROUGH;
+	case -EPROTO:
+		/*
+		 * drop the server's reference to the client
+		 * (if it hasn't been dropped already),
+		 * it is guaranteed that this will not call `client_free()`
+		 * since the caller has acquired an extra reference
+		 * which will keep the client alive
+		 */
+		if (client_detach(client))
+			client_unref(client);
+
+		/* then disconnect the client */
+		client_disconnect(client);
+		break;
+	default:
+		pw_log_error("server %p: client %p [%s] error %d (%s)",
+			     client->server, client, client->name, res, spa_strerror(res));
+		break;
+	}
 }
 
 static void
@@ -310,7 +556,7 @@ on_client_data(void *data, int fd, uint32_t mask)
 	if (mask & SPA_IO_IN) {
 		pw_log_trace("client %p: can read", client);
 		while (true) {
-			res = do_read(client);
+			res = do_read(client, &client->in);
 			if (res < 0) {
 				if (res != -EAGAIN && res != -EWOULDBLOCK)
 					goto error;
@@ -331,35 +577,83 @@ done:
 	return;
 
 error:
-	switch (res) {
-	case -EPIPE:
-	case -ECONNRESET:
-		pw_log_info("server %p: client %p [%s] disconnected",
-			    client->server, client, client->name);
-		SPA_FALLTHROUGH;
-	case -EPROTO:
-		/*
-		 * drop the server's reference to the client
-		 * (if it hasn't been dropped already),
-		 * it is guaranteed that this will not call `client_free()`
-		 * since at the beginning of this function an extra reference
-		 * has been acquired which will keep the client alive
-		 */
-		if (client_detach(client))
-			client_unref(client);
+	handle_client_error(client, res);
+	goto done;
+}
 
-		/* then disconnect the client */
-		client_disconnect(client);
-		break;
-	default:
-		pw_log_error("server %p: client %p [%s] error %d (%s)",
-			     client->server, client, client->name, res, spa_strerror(res));
-		break;
-	}
+static void
+on_client_srb_data(void *data, int fd, uint32_t mask)
+{
+	struct client * const client = data;
+	int res;
 
+	client->ref++;
+
+	srbchannel_after_poll(client->srb);
+	do {
+		pw_log_trace("client %p: can read srbchannel", client);
+		while ((res = do_read(client, &client->srb_in)) >= 0);
+		if (res != -EAGAIN)
+			goto error;
+
+		/* the client might have made room for our frames */
+		res = client_flush_messages(client);
+		if (res < 0)
+			goto error;
+	} while (!client->disconnect && !srbchannel_before_poll(client->srb));
+
+done:
+	client_unref(client);
+	return;
+
+error:
+	handle_client_error(client, res);
 	goto done;
 }
 
+static void
+on_client_srb_timeout(void *data, uint64_t expirations)
+{
+	struct client * const client = data;
+	int res;
+
+	client->ref++;
+
+	res = client_flush_messages(client);
+	if (res < 0)
+		handle_client_error(client, res);
+
+	client_unref(client);
+}
+
+int server_attach_srbchannel(struct client *client, struct srbchannel *srb)
+{
+	struct impl * const impl = client->impl;
+
+	spa_assert(client->srb == NULL);
+
+	client->srb_source = pw_loop_add_io(impl->loop, srb->wait_fd, SPA_IO_IN,
+			false, on_client_srb_data, client);
+	if (client->srb_source == NULL)
+		goto error;
+
+	client->srb_timer = pw_loop_add_timer(impl->loop, on_client_srb_timeout, client);
+	if (client->srb_timer == NULL)
+		goto error;
+
+	client->srb = srb;
+	srbchannel_before_poll(srb);
+
+	return 0;
+
+error:
+	if (client->srb_source) {
+		pw_loop_destroy_source(impl->loop, client->srb_source);
+		client->srb_source = NULL;
+	}
+	return -errno;
+}
+
 static void
 on_connect(void *data, int fd, uint32_t mask)
 {
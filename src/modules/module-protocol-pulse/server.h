@@ -33,8 +33,10 @@
 #include <spa/utils/hook.h>
 
 struct impl;
+struct client;
 struct pw_array;
 struct spa_source;
+struct srbchannel;
 
 struct server {
 	struct spa_list link;
@@ -57,4 +59,8 @@ struct server {
 int servers_create_and_start(struct impl *impl, const char *addresses, struct pw_array *servers);
 void server_free(struct server *server);
 
+/** start reading frames from \a srb for \a client, on success the client
+ * takes ownership of \a srb */
+int server_attach_srbchannel(struct client *client, struct srbchannel *srb);
+
 #endif /* PULSER_SERVER_SERVER_H */
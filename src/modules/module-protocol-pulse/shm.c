@@ -0,0 +1,165 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <spa/utils/defs.h>
+#include <pipewire/log.h>
+
+#include "log.h"
+#include "shm.h"
+
+struct shm_segment {
+	struct spa_list link;
+	uint32_t id;
+	unsigned int memfd:1;
+	int fd;
+};
+
+static struct shm_segment *segment_new(struct shm_import *import, uint32_t id, bool memfd, int fd)
+{
+	struct shm_segment *s;
+
+	if (import->n_segments >= SHM_MAX_SEGMENTS) {
+		errno = ENOSPC;
+		return NULL;
+	}
+	if ((s = calloc(1, sizeof(*s))) == NULL)
+		return NULL;
+
+	s->id = id;
+	s->memfd = memfd;
+	s->fd = fd;
+
+	spa_list_append(&import->segments, &s->link);
+	import->n_segments++;
+
+	pw_log_debug("import %p: new %s segment id:%u", import,
+			memfd ? "memfd" : "shm", id);
+	return s;
+}
+
+static void segment_free(struct shm_import *import, struct shm_segment *s)
+{
+	spa_list_remove(&s->link);
+	import->n_segments--;
+	close(s->fd);
+	free(s);
+}
+
+static struct shm_segment *find_segment(struct shm_import *import, bool memfd, uint32_t id)
+{
+	struct shm_segment *s;
+	spa_list_for_each(s, &import->segments, link) {
+		if (s->id == id && s->memfd == memfd)
+			return s;
+	}
+	return NULL;
+}
+
+void shm_import_init(struct shm_import *import)
+{
+	spa_list_init(&import->segments);
+	import->n_segments = 0;
+}
+
+void shm_import_clear(struct shm_import *import)
+{
+	struct shm_segment *s;
+	spa_list_consume(s, &import->segments, link)
+		segment_free(import, s);
+}
+
+int shm_import_add_memfd(struct shm_import *import, uint32_t shm_id, int fd)
+{
+	if (find_segment(import, true, shm_id) != NULL) {
+		close(fd);
+		return -EEXIST;
+	}
+	if (segment_new(import, shm_id, true, fd) == NULL) {
+		int res = -errno;
+		close(fd);
+		return res;
+	}
+	return 0;
+}
+
+static struct shm_segment *open_segment(struct shm_import *import, uint32_t shm_id)
+{
+	struct shm_segment *s;
+	char path[64];
+	int fd, res;
+
+	snprintf(path, sizeof(path), "/dev/shm/pulse-shm-%u", shm_id);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW)) < 0) {
+		pw_log_info("import %p: can't open %s: %m", import, path);
+		return NULL;
+	}
+	if ((s = segment_new(import, shm_id, false, fd)) == NULL) {
+		res = errno;
+		close(fd);
+		errno = res;
+	}
+	return s;
+}
+
+int shm_import_read(struct shm_import *import, bool memfd, uint32_t shm_id,
+		uint32_t offset, void *data, size_t size)
+{
+	struct shm_segment *s;
+	off_t pos = offset;
+
+	if ((s = find_segment(import, memfd, shm_id)) == NULL) {
+		if (memfd)
+			return -ENOENT;
+		if ((s = open_segment(import, shm_id)) == NULL)
+			return -errno;
+	}
+
+	/* The client can truncate its pool at any time and libpulse does
+	 * not seal it against that, touching the pages of a mapping would
+	 * then raise SIGBUS. pread() copies the data just like a memcpy()
+	 * from a mapping would and fails on a truncated pool instead. */
+	while (size > 0) {
+		ssize_t r = pread(s->fd, data, size, pos);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (r == 0)
+			return -EINVAL;
+		data = SPA_PTROFF(data, r, void);
+		pos += r;
+		size -= r;
+	}
+	return 0;
+}
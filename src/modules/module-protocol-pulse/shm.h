@@ -0,0 +1,58 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PULSE_SERVER_SHM_H
+#define PULSE_SERVER_SHM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <spa/utils/list.h>
+
+/*
+ * Memory pools of a client that memblocks can refer to. memfd pools are
+ * registered by the client with REGISTER_MEMFD_SHMID, POSIX shm pools
+ * are opened from /dev/shm on first use.
+ */
+
+#define SHM_MAX_SEGMENTS	16u
+
+struct shm_import {
+	struct spa_list segments;
+	uint32_t n_segments;
+};
+
+void shm_import_init(struct shm_import *import);
+void shm_import_clear(struct shm_import *import);
+
+/** register a memfd pool, takes ownership of \a fd */
+int shm_import_add_memfd(struct shm_import *import, uint32_t shm_id, int fd);
+
+/** copy \a size bytes at \a offset from a block in the pool \a shm_id */
+int shm_import_read(struct shm_import *import, bool memfd, uint32_t shm_id,
+		uint32_t offset, void *data, size_t size);
+
+#endif /* PULSE_SERVER_SHM_H */
@@ -0,0 +1,318 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <spa/utils/defs.h>
+#include <pipewire/log.h>
+#include <pipewire/utils.h>
+
+#include "log.h"
+#include "srbchannel.h"
+
+/* The semaphores follow the PulseAudio fdsem: the poster only writes
+ * to the eventfd when the other side announced that it is going to
+ * sleep. Everything in the shared header can be modified by the peer
+ * so all values read from it are clamped before use. */
+
+static inline bool atomic_cas(int *val, int old, int new)
+{
+	return __atomic_compare_exchange_n(val, &old, new, false,
+			__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void sem_post(struct srb_sem *sem, int fd)
+{
+	uint64_t count = 1;
+
+	if (!atomic_cas(&sem->signalled, 0, 1))
+		return;
+	if (__atomic_load_n(&sem->waiting, __ATOMIC_SEQ_CST) <= 0)
+		return;
+
+	__atomic_fetch_add(&sem->in_pipe, 1, __ATOMIC_SEQ_CST);
+	while (write(fd, &count, sizeof(count)) != sizeof(count)) {
+		if (errno != EINTR) {
+			pw_log_warn("srbchannel %d: write failed: %m", fd);
+			break;
+		}
+	}
+}
+
+static void sem_flush(struct srb_sem *sem, int fd)
+{
+	uint64_t count;
+
+	if (__atomic_load_n(&sem->in_pipe, __ATOMIC_SEQ_CST) <= 0)
+		return;
+
+	while (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		if (errno != EINTR)
+			return;
+	}
+	__atomic_fetch_sub(&sem->in_pipe, (int)SPA_MIN(count, (uint64_t)INT32_MAX),
+			__ATOMIC_SEQ_CST);
+}
+
+static inline uint32_t ring_count(struct srb_ring *ring)
+{
+	int count = __atomic_load_n(ring->count, __ATOMIC_SEQ_CST);
+	return SPA_CLAMP(count, 0, (int)ring->capacity);
+}
+
+size_t srbchannel_read(struct srbchannel *srb, void *data, size_t size)
+{
+	struct srb_ring *ring = &srb->read;
+	size_t total = 0;
+	bool was_full = false;
+
+	while (size > 0) {
+		uint32_t avail = ring_count(ring), n;
+
+		n = SPA_MIN(avail, ring->capacity - ring->index);
+		n = SPA_MIN(n, size);
+		if (n == 0)
+			break;
+
+		memcpy(data, ring->memory + ring->index, n);
+
+		if (__atomic_fetch_sub(ring->count, (int)n, __ATOMIC_SEQ_CST) >= (int)ring->capacity)
+			was_full = true;
+		ring->index = (ring->index + n) % ring->capacity;
+
+		data = SPA_PTROFF(data, n, void);
+		size -= n;
+		total += n;
+	}
+	/* the peer might be waiting for space */
+	if (was_full)
+		sem_post(srb->post_sem, srb->post_fd);
+
+	return total;
+}
+
+size_t srbchannel_write(struct srbchannel *srb, const void *data, size_t size)
+{
+	struct srb_ring *ring = &srb->write;
+	size_t total = 0;
+
+	while (size > 0) {
+		uint32_t filled = ring_count(ring), n;
+
+		n = SPA_MIN(ring->capacity - filled, ring->capacity - ring->index);
+		n = SPA_MIN(n, size);
+		if (n == 0)
+			break;
+
+		memcpy(ring->memory + ring->index, data, n);
+
+		__atomic_fetch_add(ring->count, (int)n, __ATOMIC_SEQ_CST);
+		ring->index = (ring->index + n) % ring->capacity;
+
+		data = SPA_PTROFF(data, n, const void);
+		size -= n;
+		total += n;
+	}
+	if (total > 0)
+		sem_post(srb->post_sem, srb->post_fd);
+
+	return total;
+}
+
+bool srbchannel_before_poll(struct srbchannel *srb)
+{
+	struct srb_sem *sem = srb->wait_sem;
+
+	__atomic_fetch_add(&sem->waiting, 1, __ATOMIC_SEQ_CST);
+	if (atomic_cas(&sem->signalled, 1, 0)) {
+		__atomic_fetch_sub(&sem->waiting, 1, __ATOMIC_SEQ_CST);
+		return false;
+	}
+	return true;
+}
+
+void srbchannel_after_poll(struct srbchannel *srb)
+{
+	struct srb_sem *sem = srb->wait_sem;
+
+	__atomic_fetch_sub(&sem->waiting, 1, __ATOMIC_SEQ_CST);
+	sem_flush(sem, srb->wait_fd);
+	atomic_cas(&sem->signalled, 1, 0);
+}
+
+static void setup_rings(struct srbchannel *srb, bool creator)
+{
+	struct srb_header *hdr = srb->data;
+	struct srb_ring *r = creator ? &srb->read : &srb->write;
+	struct srb_ring *w = creator ? &srb->write : &srb->read;
+
+	r->memory = SPA_PTROFF(hdr, hdr->readbuf_offset, uint8_t);
+	r->count = &hdr->read_count;
+	w->memory = SPA_PTROFF(hdr, hdr->writebuf_offset, uint8_t);
+	w->count = &hdr->write_count;
+	r->capacity = w->capacity = hdr->capacity;
+	r->index = w->index = 0;
+
+	srb->wait_sem = creator ? &hdr->read_sem : &hdr->write_sem;
+	srb->post_sem = creator ? &hdr->write_sem : &hdr->read_sem;
+}
+
+struct srbchannel *srbchannel_new(void)
+{
+#ifdef HAVE_MEMFD_CREATE
+	struct srbchannel *srb;
+	struct srb_header *hdr;
+	uint32_t offset, capacity;
+	int res;
+
+	srb = calloc(1, sizeof(*srb));
+	if (srb == NULL)
+		return NULL;
+
+	srb->memfd = srb->wait_fd = srb->post_fd = -1;
+	srb->data = MAP_FAILED;
+	srb->size = SRBCHANNEL_SIZE;
+
+	if (pw_getrandom(&srb->shm_id, sizeof(srb->shm_id), 0) < 0)
+		srb->shm_id = (uint32_t)random();
+
+	srb->memfd = memfd_create("pipewire-pulse-srbchannel", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (srb->memfd < 0)
+		goto error_errno;
+	if (ftruncate(srb->memfd, srb->size) < 0)
+		goto error_errno;
+#ifdef F_ADD_SEALS
+	/* the peer can't resize the memory under us */
+	if (fcntl(srb->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0)
+		pw_log_warn("srbchannel %p: can't seal memfd: %m", srb);
+#endif
+	srb->data = mmap(NULL, srb->size, PROT_READ | PROT_WRITE, MAP_SHARED, srb->memfd, 0);
+	if (srb->data == MAP_FAILED)
+		goto error_errno;
+
+	/* we only read from wait_fd so it can be non-blocking, the peer
+	 * expects to be able to do blocking reads on post_fd */
+	srb->wait_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (srb->wait_fd < 0)
+		goto error_errno;
+	srb->post_fd = eventfd(0, EFD_CLOEXEC);
+	if (srb->post_fd < 0)
+		goto error_errno;
+
+	hdr = srb->data;
+	spa_zero(*hdr);
+	offset = SPA_ROUND_UP_N(sizeof(*hdr), 8);
+	capacity = SPA_ROUND_DOWN_N((srb->size - offset) / 2, 8);
+	hdr->readbuf_offset = offset;
+	hdr->writebuf_offset = offset + capacity;
+	hdr->capacity = capacity;
+
+	setup_rings(srb, true);
+
+	pw_log_debug("srbchannel %p: shm_id:%u size:%zu capacity:%u",
+			srb, srb->shm_id, srb->size, capacity);
+
+	return srb;
+
+error_errno:
+	res = -errno;
+	pw_log_warn("srbchannel %p: can't create: %m", srb);
+	srbchannel_free(srb);
+	errno = -res;
+	return NULL;
+#else
+	errno = ENOTSUP;
+	return NULL;
+#endif
+}
+
+struct srbchannel *srbchannel_new_from_template(int memfd, int readfd, int writefd)
+{
+	struct srbchannel *srb;
+	struct srb_header *hdr;
+	struct stat st;
+	int res;
+
+	srb = calloc(1, sizeof(*srb));
+	if (srb == NULL)
+		return NULL;
+
+	srb->data = MAP_FAILED;
+	srb->memfd = memfd;
+	srb->wait_fd = writefd;
+	srb->post_fd = readfd;
+
+	if (fstat(memfd, &st) < 0)
+		goto error_errno;
+	if (st.st_size < (off_t)sizeof(*hdr) || st.st_size > (off_t)UINT32_MAX) {
+		errno = EINVAL;
+		goto error_errno;
+	}
+	srb->size = st.st_size;
+	srb->data = mmap(NULL, srb->size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (srb->data == MAP_FAILED)
+		goto error_errno;
+
+	hdr = srb->data;
+	if (hdr->capacity <= 0 ||
+	    hdr->readbuf_offset < (int)sizeof(*hdr) ||
+	    hdr->writebuf_offset < (int)sizeof(*hdr) ||
+	    (size_t)hdr->readbuf_offset + hdr->capacity > srb->size ||
+	    (size_t)hdr->writebuf_offset + hdr->capacity > srb->size) {
+		errno = EINVAL;
+		goto error_errno;
+	}
+	setup_rings(srb, false);
+
+	return srb;
+
+error_errno:
+	res = -errno;
+	srbchannel_free(srb);
+	errno = -res;
+	return NULL;
+}
+
+void srbchannel_free(struct srbchannel *srb)
+{
+	if (srb->data != MAP_FAILED)
+		munmap(srb->data, srb->size);
+	if (srb->memfd >= 0)
+		close(srb->memfd);
+	if (srb->wait_fd >= 0)
+		close(srb->wait_fd);
+	if (srb->post_fd >= 0)
+		close(srb->post_fd);
+	free(srb);
+}
@@ -0,0 +1,98 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PULSE_SERVER_SRBCHANNEL_H
+#define PULSE_SERVER_SRBCHANNEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Shared ringbuffer channel, binary compatible with the PulseAudio
+ * srbchannel. A memfd holds a header followed by two ringbuffers, one
+ * for each direction, and a pair of eventfd semaphores is used to wake
+ * up the other side. Frames on the channel use the same format as on
+ * the socket.
+ */
+
+#define SRBCHANNEL_SIZE		(64u * 1024u)
+
+struct srb_sem {
+	int waiting;
+	int signalled;
+	int in_pipe;
+};
+
+struct srb_header {
+	int read_count;
+	int write_count;
+	struct srb_sem read_sem;
+	struct srb_sem write_sem;
+	int capacity;
+	int readbuf_offset;
+	int writebuf_offset;
+};
+
+struct srb_ring {
+	int *count;
+	uint8_t *memory;
+	uint32_t capacity;
+	uint32_t index;
+};
+
+struct srbchannel {
+	uint32_t shm_id;
+	int memfd;
+	void *data;
+	size_t size;
+
+	struct srb_ring read;
+	struct srb_ring write;
+
+	struct srb_sem *wait_sem;	/**< posted by the peer when there is data */
+	struct srb_sem *post_sem;	/**< posted by us when there is data */
+	int wait_fd;
+	int post_fd;
+};
+
+/** create a new channel with a fresh memfd and semaphores */
+struct srbchannel *srbchannel_new(void);
+/** attach to the memory and semaphores of a channel created by the peer */
+struct srbchannel *srbchannel_new_from_template(int memfd, int readfd, int writefd);
+void srbchannel_free(struct srbchannel *srb);
+
+/** read up to \a size bytes, returns the number of bytes read */
+size_t srbchannel_read(struct srbchannel *srb, void *data, size_t size);
+/** write up to \a size bytes, returns the number of bytes written */
+size_t srbchannel_write(struct srbchannel *srb, const void *data, size_t size);
+
+/** prepare to sleep on wait_fd. Returns false when the peer already
+ * posted new data and we should read again instead of sleeping. */
+bool srbchannel_before_poll(struct srbchannel *srb);
+/** call after wait_fd woke up */
+void srbchannel_after_poll(struct srbchannel *srb);
+
+#endif /* PULSE_SERVER_SRBCHANNEL_H */
@@ -0,0 +1,120 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include <spa/utils/defs.h>
+#include <pipewire/log.h>
+
+#include "shm.h"
+
+PW_LOG_TOPIC(mod_topic, "mod.protocol-pulse");
+
+#define POOL_SIZE	4096
+
+/* a pool like libpulse makes it, a memfd without seals */
+static int make_pool(void)
+{
+	uint8_t data[POOL_SIZE];
+	uint32_t i;
+	int fd;
+
+	fd = memfd_create("test-pulse-shm", MFD_CLOEXEC);
+	spa_assert(fd >= 0);
+	for (i = 0; i < POOL_SIZE; i++)
+		data[i] = i & 0xff;
+	spa_assert(write(fd, data, POOL_SIZE) == POOL_SIZE);
+	return fd;
+}
+
+static void test_read(void)
+{
+	struct shm_import import;
+	uint8_t data[256];
+	uint32_t i;
+	int fd;
+
+	shm_import_init(&import);
+	fd = make_pool();
+	spa_assert(shm_import_add_memfd(&import, 1, fd) == 0);
+	spa_assert(shm_import_add_memfd(&import, 1, dup(fd)) == -EEXIST);
+
+	spa_assert(shm_import_read(&import, true, 1, 1000, data, sizeof(data)) == 0);
+	for (i = 0; i < sizeof(data); i++)
+		spa_assert(data[i] == ((1000 + i) & 0xff));
+
+	spa_assert(shm_import_read(&import, true, 2, 0, data, sizeof(data)) == -ENOENT);
+	spa_assert(shm_import_read(&import, true, 1, POOL_SIZE - 10,
+				data, sizeof(data)) == -EINVAL);
+
+	shm_import_clear(&import);
+	spa_assert(import.n_segments == 0);
+}
+
+static void test_truncate(void)
+{
+	struct shm_import import;
+	uint8_t data[256];
+	int fd;
+
+	shm_import_init(&import);
+	fd = make_pool();
+	spa_assert(shm_import_add_memfd(&import, 1, dup(fd)) == 0);
+	spa_assert(shm_import_read(&import, true, 1, 2048, data, sizeof(data)) == 0);
+
+	/* the client shrinks its pool, this must fail and not crash */
+	spa_assert(ftruncate(fd, 1024) == 0);
+	spa_assert(shm_import_read(&import, true, 1, 2048, data, sizeof(data)) == -EINVAL);
+	spa_assert(shm_import_read(&import, true, 1, 512, data, sizeof(data)) == 0);
+
+	close(fd);
+	shm_import_clear(&import);
+}
+
+static void test_limit(void)
+{
+	struct shm_import import;
+	uint32_t i;
+
+	shm_import_init(&import);
+	for (i = 0; i < SHM_MAX_SEGMENTS; i++)
+		spa_assert(shm_import_add_memfd(&import, i, make_pool()) == 0);
+	spa_assert(shm_import_add_memfd(&import, i, make_pool()) == -ENOSPC);
+	shm_import_clear(&import);
+}
+
+int main(int argc, char *argv[])
+{
+	test_read();
+	test_truncate();
+	test_limit();
+	return 0;
+}
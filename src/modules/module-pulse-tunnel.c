@@ -66,6 +66,25 @@
  * automatically load the tunnel with the right parameters based on zeroconf
  * information.
  *
+ * ## Transport
+ *
+ * Audio is written into and read from the memblocks of the pulse stream
+ * directly. With a local server (`unix:` address) libpulse shares these
+ * blocks over a shm/memfd pool, so the data is copied once, between the
+ * local ringbuffer and the memblock. There is no zero-copy ring shared with
+ * the remote server: the native protocol has no way to hand a client-owned
+ * ringbuffer to the server.
+ *
+ * Every 10 seconds the tunnel logs, at info level on the `mod.pulse-tunnel`
+ * topic, the bytes transferred, the number of copies, the silence inserted,
+ * the under- and overflows and the min/avg/max latency in microseconds.
+ *
+ * No benchmark is shipped. To measure a local tunnel, start a second
+ * pipewire-pulse with a private `server.address` (for example
+ * `unix:/tmp/pulse-bench`), then load the tunnel with
+ * `pulse.server.address = "unix:/tmp/pulse-bench"` and
+ * `PIPEWIRE_DEBUG=mod.pulse-tunnel:I`.
+ *
  * ## Module Options
  *
  * - `tunnel.mode`: the desired tunnel to create, must be `source` or `sink`.
@@ -152,6 +171,8 @@ static const struct spa_dict_item module_props[] = {
 
 #define DEFAULT_LATENCY_MSEC	(200)
 
+#define STATS_INTERVAL_USEC	(10 * PA_USEC_PER_SEC)
+
 struct impl {
 	struct pw_context *context;
 
@@ -178,14 +199,28 @@ struct impl {
 
 	struct spa_ringbuffer ring;
 	void *buffer;
-	uint8_t empty[8192];
 
 	pa_threaded_mainloop *pa_mainloop;
 	pa_context *pa_context;
 	pa_stream *pa_stream;
+	pa_time_event *stats_event;
 
 	struct ratelimit rate_limit;
 
+	/* only written from the pulse mainloop thread */
+	struct {
+		uint64_t bytes;		/* bytes moved between the ring and pulse */
+		uint64_t copies;	/* memcpy calls into/out of pulse memblocks */
+		uint64_t silence;	/* bytes of silence filled in */
+		uint32_t underflows;
+		uint32_t overflows;
+		uint64_t min_latency;	/* in usec */
+		uint64_t max_latency;
+		uint64_t latency_sum;
+		uint32_t latency_count;
+	} stats;
+	uint32_t ring_overruns;		/* written from the data thread */
+
 	uint32_t target_latency;
 	uint32_t current_latency;
 	uint32_t target_buffer;
@@ -300,6 +335,7 @@ static void playback_stream_process(void *d)
 		pw_log_warn("%p: overrun write:%u filled:%d + size:%u > max:%u",
                                         impl, write_index, filled,
                                         size, RINGBUFFER_SIZE);
+		__atomic_fetch_add(&impl->ring_overruns, 1, __ATOMIC_RELAXED);
 		impl->resync = true;
 	} else {
 		update_rate(impl, true);
@@ -481,6 +517,42 @@ static void stream_state_cb(pa_stream *s, void * userdata)
 		pw_impl_module_schedule_destroy(impl->module);
 }
 
+static void update_latency_stats(struct impl *impl)
+{
+	uint64_t latency = (uint64_t)impl->current_latency * SPA_USEC_PER_SEC / impl->info.rate;
+
+	if (impl->stats.latency_count == 0 || latency < impl->stats.min_latency)
+		impl->stats.min_latency = latency;
+	if (latency > impl->stats.max_latency)
+		impl->stats.max_latency = latency;
+	impl->stats.latency_sum += latency;
+	impl->stats.latency_count++;
+}
+
+static void stats_timer_cb(pa_mainloop_api *api, pa_time_event *e,
+		const struct timeval *tv, void *userdata)
+{
+	struct impl *impl = userdata;
+
+	if (impl->stats.latency_count > 0) {
+		pw_log_info("%p: bytes:%"PRIu64" copies:%"PRIu64" silence:%"PRIu64
+				" underflows:%u overflows:%u ring-overruns:%u latency(us)"
+				" min:%"PRIu64" avg:%"PRIu64" max:%"PRIu64,
+				impl, impl->stats.bytes, impl->stats.copies,
+				impl->stats.silence, impl->stats.underflows,
+				impl->stats.overflows,
+				__atomic_load_n(&impl->ring_overruns, __ATOMIC_RELAXED),
+				impl->stats.min_latency,
+				impl->stats.latency_sum / impl->stats.latency_count,
+				impl->stats.max_latency);
+		impl->stats.min_latency = impl->stats.max_latency = 0;
+		impl->stats.latency_sum = 0;
+		impl->stats.latency_count = 0;
+	}
+	pa_context_rttime_restart(impl->pa_context, e,
+			pa_rtclock_now() + STATS_INTERVAL_USEC);
+}
+
 static void stream_read_request_cb(pa_stream *s, size_t length, void *userdata)
 {
 	struct impl *impl = userdata;
@@ -509,29 +581,37 @@ static void stream_read_request_cb(pa_stream *s, size_t length, void *userdata)
 		}
 		pw_log_debug("read %zd nbytes:%zd", length, nbytes);
 
-		if (length < nbytes)
+		if (nbytes == 0 || length < nbytes)
 			break;
 
-		while (nbytes > 0) {
-			uint32_t to_write = SPA_MIN(nbytes, sizeof(impl->empty));
-
+		if (p != NULL) {
+			/* p points into the memblock that the server shared with
+			 * us, copy it straight into the ring */
 			spa_ringbuffer_write_data(&impl->ring,
 					impl->buffer, RINGBUFFER_SIZE,
-					index & RINGBUFFER_MASK,
-					p ? p : impl->empty, to_write);
-
-			index += to_write;
-			p = p ? SPA_PTROFF(p, to_write, void) : NULL;
-			nbytes -= to_write;
-			length -= to_write;
-			filled += to_write;
+					index & RINGBUFFER_MASK, p, nbytes);
+			impl->stats.copies++;
+		} else {
+			/* a hole, clear the ring in place */
+			uint32_t offs = index & RINGBUFFER_MASK;
+			uint32_t l0 = SPA_MIN(nbytes, RINGBUFFER_SIZE - offs);
+
+			memset(SPA_PTROFF(impl->buffer, offs, void), 0, l0);
+			memset(impl->buffer, 0, nbytes - l0);
+			impl->stats.silence += nbytes;
 		}
+		impl->stats.bytes += nbytes;
+		index += nbytes;
+		length -= nbytes;
+		filled += nbytes;
+
 		pa_stream_drop(impl->pa_stream);
 	}
 
 	pa_stream_get_latency(impl->pa_stream, &latency, &negative);
 	impl->current_latency = latency * impl->info.rate / SPA_USEC_PER_SEC;
 	impl->current_latency += filled / impl->frame_size;
+	update_latency_stats(impl);
 
 	spa_ringbuffer_write_update(&impl->ring, index);
 }
@@ -557,27 +637,49 @@ static void stream_write_request_cb(pa_stream *s, size_t length, void *userdata)
 	pa_stream_get_latency(impl->pa_stream, &latency, &negative);
 	impl->current_latency = latency * impl->info.rate / SPA_USEC_PER_SEC;
 	impl->current_latency += avail / impl->frame_size;
+	update_latency_stats(impl);
 
+	/* All writes go through pa_stream_begin_write() so that we fill the
+	 * memblock of the stream directly. With a local server this block lives
+	 * in the shm/memfd pool that is shared with the server and pa_stream_write()
+	 * only passes a reference to it. */
 	while (avail < (int32_t)length) {
-		uint32_t maxsize = SPA_ROUND_DOWN(sizeof(impl->empty), impl->frame_size);
+		void *data;
+
 		/* send silence for the data we don't have */
-		size = SPA_MIN(length - avail, maxsize);
+		size = length - avail;
+		if (pa_stream_begin_write(impl->pa_stream, &data, &size) < 0 ||
+		    (size = SPA_ROUND_DOWN(size, impl->frame_size)) == 0) {
+			pw_log_warn("error allocating stream buffer: %s",
+					pa_strerror(pa_context_errno(impl->pa_context)));
+			pa_stream_cancel_write(impl->pa_stream);
+			return;
+		}
+		memset(data, 0, size);
+
 		if ((res = pa_stream_write(impl->pa_stream,
-				impl->empty, size,
-				NULL, 0, PA_SEEK_RELATIVE)) != 0)
+				data, size, NULL, 0, PA_SEEK_RELATIVE)) != 0)
 			pw_log_warn("error writing stream: %s", pa_strerror(res));
+		impl->stats.silence += size;
+		impl->stats.bytes += size;
 		length -= size;
 	}
 	while (length > 0 && avail >= (int32_t)length) {
 		void *data;
 
 		size = length;
-		pa_stream_begin_write(impl->pa_stream, &data, &size);
+		if (pa_stream_begin_write(impl->pa_stream, &data, &size) < 0) {
+			pw_log_warn("error allocating stream buffer: %s",
+					pa_strerror(pa_context_errno(impl->pa_context)));
+			break;
+		}
 
 		spa_ringbuffer_read_data(&impl->ring,
 				impl->buffer, RINGBUFFER_SIZE,
 				index & RINGBUFFER_MASK,
 				data, size);
+		impl->stats.copies++;
+		impl->stats.bytes += size;
 
 		if ((res = pa_stream_write(impl->pa_stream,
 			data, size, NULL, 0, PA_SEEK_RELATIVE)) != 0)
@@ -598,6 +700,7 @@ static void stream_underflow_cb(pa_stream *s, void *userdata)
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	if (ratelimit_test(&impl->rate_limit, SPA_TIMESPEC_TO_NSEC(&ts), SPA_LOG_LEVEL_WARN))
 		pw_log_warn("underflow");
+	impl->stats.underflows++;
 	impl->resync = true;
 }
 static void stream_overflow_cb(pa_stream *s, void *userdata)
@@ -607,6 +710,7 @@ static void stream_overflow_cb(pa_stream *s, void *userdata)
 	clock_gettime(CLOCK_MONOTONIC, &ts);
 	if (ratelimit_test(&impl->rate_limit, SPA_TIMESPEC_TO_NSEC(&ts), SPA_LOG_LEVEL_WARN))
 		pw_log_warn("overflow");
+	impl->stats.overflows++;
 	impl->resync = true;
 }
 
@@ -765,6 +869,18 @@ static int create_pulse_stream(struct impl *impl)
 		pa_threaded_mainloop_wait(impl->pa_mainloop);
 	}
 
+	/* memblocks are only shared with the server over shm/memfd
+	 * on a local connection */
+	pw_log_info("%p: connected to %s server:%s local:%d protocol:%u",
+			impl, pa_context_get_server(impl->pa_context),
+			pa_stream_get_device_name(impl->pa_stream),
+			pa_context_is_local(impl->pa_context),
+			pa_context_get_server_protocol_version(impl->pa_context));
+
+	impl->stats_event = pa_context_rttime_new(impl->pa_context,
+			pa_rtclock_now() + STATS_INTERVAL_USEC,
+			stats_timer_cb, impl);
+
 	pa_threaded_mainloop_unlock(impl->pa_mainloop);
 
 	return 0;
@@ -810,6 +926,10 @@ static void impl_destroy(struct impl *impl)
 
 	if (impl->pa_mainloop)
 		pa_threaded_mainloop_stop(impl->pa_mainloop);
+	if (impl->stats_event) {
+		pa_mainloop_api *api = pa_threaded_mainloop_get_api(impl->pa_mainloop);
+		api->time_free(impl->stats_event);
+	}
 	if (impl->pa_stream)
 		pa_stream_unref(impl->pa_stream);
 	if (impl->pa_context) {
@@ -41,7 +41,6 @@
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
 #include <openssl/engine.h>
-#include <openssl/aes.h>
 #include <openssl/md5.h>
 
 #include "config.h"
@@ -60,6 +59,7 @@
 #include <pipewire/i18n.h>
 
 #include "module-raop/rtsp-client.h"
+#include "module-raop/packet.h"
 
 /** \page page_module_raop_sink PipeWire Module: AirPlay Sink
  *
@@ -81,6 +81,8 @@
  *                    "auth_setup". Default is "none".
  * - `raop.audio.codec`: The audio codec to use. Needs to be "PCM". Defaults to "PCM".
  * - `raop.password`: The password to use.
+ * - `raop.encode-thread`: Build and send the packets in a separate thread instead
+ *                    of the processing thread. Defaults to false.
  * - `stream.props = {}`: properties to be passed to the sink stream
  *
  * Options with well-known behavior.
@@ -110,6 +112,7 @@
  *         raop.encryption.type = "RSA"
  *         #raop.audio.codec = "PCM"
  *         #raop.password = "****"
+ *         #raop.encode-thread = false
  *         #audio.format = "S16"
  *         #audio.rate = 44100
  *         #audio.channels = 2
@@ -140,7 +143,7 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 #define DEFAULT_UDP_CONTROL_PORT 6001
 #define DEFAULT_UDP_TIMING_PORT  6002
 
-#define AES_CHUNK_SIZE		16
+#define AES_CHUNK_SIZE		RAOP_AES_CHUNK_SIZE
 #ifndef MD5_DIGEST_LENGTH
 #define MD5_DIGEST_LENGTH	16
 #endif
@@ -158,12 +161,17 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 
 #define DEFAULT_LATENCY 22050
 
+/* samples queued for the encode thread, must be a power of 2 */
+#define RING_SIZE	(1u<<18)
+#define RING_MASK	(RING_SIZE-1)
+
 #define MODULE_USAGE	"[ raop.hostname=<name of host> ] "					\
 			"[ raop.port=<remote port> ] "						\
 			"[ raop.transport=<transport, default:udp> ] "				\
 			"[ raop.encryption.type=<encryption, default:none> ] "			\
 			"[ raop.audio.codec=PCM ] "						\
 			"[ raop.password=<password for auth> ] "				\
+			"[ raop.encode-thread=<build packets in a thread, default:false> ] "	\
 			"[ node.latency=<latency as fraction> ] "				\
 			"[ node.name=<name of the nodes> ] "					\
 			"[ node.description=<description of the nodes> ] "			\
@@ -230,9 +238,10 @@ struct impl {
 
 	unsigned int do_disconnect:1;
 
+	/* only used by the thread that sends the packets, see set_aes_key() */
 	uint8_t key[AES_CHUNK_SIZE]; /* Key for aes-cbc */
 	uint8_t iv[AES_CHUNK_SIZE];  /* Initialization vector for cbc */
-	AES_KEY aes;                 /* AES encryption */
+	EVP_CIPHER_CTX *aes;         /* AES encryption */
 
 	uint16_t control_port;
 	int control_fd;
@@ -255,13 +264,20 @@ struct impl {
 	uint32_t ssrc;
 	uint32_t sync;
 	uint32_t sync_period;
-	unsigned int first:1;
+	bool first;			/* written by the sending thread */
 	unsigned int connected:1;
 	unsigned int ready:1;
 	unsigned int recording:1;
 
 	uint8_t buffer[FRAMES_PER_TCP_PACKET * 4];
 	uint32_t filled;
+
+	/* when enabled, the data thread only queues the samples and the
+	 * packets are built and sent from the encode thread */
+	struct pw_thread_loop *encode_loop;
+	struct spa_source *encode_event;
+	struct spa_ringbuffer ring;
+	uint8_t *ring_data;
 };
 
 static void stream_destroy(void *d)
@@ -271,38 +287,6 @@ static void stream_destroy(void *d)
 	impl->stream = NULL;
 }
 
-static inline void bit_writer(uint8_t **p, int *pos, uint8_t data, int len)
-{
-	int rb = 8 - *pos - len;
-	if (rb >= 0) {
-		**p = (*pos ? **p : 0) | (data << rb);
-                *pos += len;
-	} else {
-		*(*p)++ |= (data >> -rb);
-		**p = data << (8+rb);
-		*pos = -rb;
-	}
-}
-
-static int aes_encrypt(struct impl *impl, uint8_t *data, int len)
-{
-    uint8_t nv[AES_CHUNK_SIZE];
-    uint8_t *buffer;
-    int i, j;
-
-    memcpy(nv, impl->iv, AES_CHUNK_SIZE);
-    for (i = 0; i + AES_CHUNK_SIZE <= len; i += AES_CHUNK_SIZE) {
-        buffer = data + i;
-        for (j = 0; j < AES_CHUNK_SIZE; j++)
-            buffer[j] ^= nv[j];
-
-        AES_encrypt(buffer, buffer, &impl->aes);
-
-        memcpy(nv, buffer, AES_CHUNK_SIZE);
-    }
-    return i;
-}
-
 static inline uint64_t timespec_to_ntp(struct timespec *ts)
 {
     uint64_t ntp = (uint64_t) ts->tv_nsec * UINT32_MAX / SPA_NSEC_PER_SEC;
@@ -363,36 +347,6 @@ static int send_udp_timing_packet(struct impl *impl, uint64_t remote, uint64_t r
 	return sendto(impl->timing_fd, pkt, sizeof(pkt), 0, dest_addr, addrlen);
 }
 
-static int write_codec_pcm(void *dst, void *frames, uint32_t n_frames)
-{
-	uint8_t *bp, *b, *d = frames;
-	int bpos = 0;
-	uint32_t i;
-
-	b = bp = dst;
-
-	bit_writer(&bp, &bpos, 1, 3); /* channel=1, stereo */
-	bit_writer(&bp, &bpos, 0, 4); /* Unknown */
-	bit_writer(&bp, &bpos, 0, 8); /* Unknown */
-	bit_writer(&bp, &bpos, 0, 4); /* Unknown */
-	bit_writer(&bp, &bpos, 1, 1); /* Hassize */
-	bit_writer(&bp, &bpos, 0, 2); /* Unused */
-	bit_writer(&bp, &bpos, 1, 1); /* Is-not-compressed */
-	bit_writer(&bp, &bpos, (n_frames >> 24) & 0xff, 8);
-	bit_writer(&bp, &bpos, (n_frames >> 16) & 0xff, 8);
-	bit_writer(&bp, &bpos, (n_frames >> 8)  & 0xff, 8);
-	bit_writer(&bp, &bpos, (n_frames)       & 0xff, 8);
-
-	for (i = 0; i < n_frames; i++) {
-		bit_writer(&bp, &bpos, *(d + 1), 8);
-		bit_writer(&bp, &bpos, *(d + 0), 8);
-		bit_writer(&bp, &bpos, *(d + 3), 8);
-		bit_writer(&bp, &bpos, *(d + 2), 8);
-		d += 4;
-	}
-	return bp - b + 1;
-}
-
 static int flush_to_udp_packet(struct impl *impl)
 {
 	const size_t max = 12 + 8 + impl->block_size;
@@ -421,7 +375,7 @@ static int flush_to_udp_packet(struct impl *impl)
 	switch (impl->codec) {
 	case CODEC_PCM:
 	case CODEC_ALAC:
-		len = write_codec_pcm(dst, impl->buffer, n_frames);
+		len = raop_write_pcm(dst, impl->buffer, n_frames);
 		break;
 	default:
 		len = 8 + impl->block_size;
@@ -429,7 +383,7 @@ static int flush_to_udp_packet(struct impl *impl)
 		break;
 	}
 	if (impl->encryption == CRYPTO_RSA)
-		aes_encrypt(impl, dst, len);
+		raop_aes_encrypt(impl->aes, impl->iv, dst, len);
 
 	impl->rtptime += n_frames;
 	impl->seq = (impl->seq + 1) & 0xffff;
@@ -464,7 +418,7 @@ static int flush_to_tcp_packet(struct impl *impl)
 	switch (impl->codec) {
 	case CODEC_PCM:
 	case CODEC_ALAC:
-		len = write_codec_pcm(dst, impl->buffer, n_frames);
+		len = raop_write_pcm(dst, impl->buffer, n_frames);
 		break;
 	default:
 		len = 8 + impl->block_size;
@@ -472,7 +426,7 @@ static int flush_to_tcp_packet(struct impl *impl)
 		break;
 	}
 	if (impl->encryption == CRYPTO_RSA)
-		aes_encrypt(impl, dst, len);
+		raop_aes_encrypt(impl->aes, impl->iv, dst, len);
 
 	pkt[0] |= htonl((uint32_t) len + 12);
 
@@ -487,6 +441,58 @@ static int flush_to_tcp_packet(struct impl *impl)
 	return res;
 }
 
+static void flush_packet(struct impl *impl)
+{
+	switch (impl->protocol) {
+	case PROTO_UDP:
+		flush_to_udp_packet(impl);
+		break;
+	case PROTO_TCP:
+		flush_to_tcp_packet(impl);
+		break;
+	}
+	impl->filled = 0;
+}
+
+/* encode thread, build and send packets from the queued samples */
+static void on_encode_event(void *data, uint64_t count)
+{
+	struct impl *impl = data;
+	uint32_t index, block_size = impl->block_size;
+	int32_t avail;
+
+	if (block_size == 0)
+		return;
+
+	while ((avail = spa_ringbuffer_get_read_index(&impl->ring, &index)) >= (int32_t)block_size) {
+		spa_ringbuffer_read_data(&impl->ring, impl->ring_data, RING_SIZE,
+				index & RING_MASK, impl->buffer, block_size);
+		spa_ringbuffer_read_update(&impl->ring, index + block_size);
+
+		impl->filled = block_size;
+		flush_packet(impl);
+	}
+}
+
+/* data thread, queue the samples for the encode thread */
+static void queue_samples(struct impl *impl, const uint8_t *data, uint32_t size)
+{
+	uint32_t index;
+	int32_t filled;
+
+	filled = spa_ringbuffer_get_write_index(&impl->ring, &index);
+	if (filled < 0 || filled + size > RING_SIZE) {
+		pw_log_debug("encode thread overrun, dropping %u bytes", size);
+		return;
+	}
+	spa_ringbuffer_write_data(&impl->ring, impl->ring_data, RING_SIZE,
+			index & RING_MASK, data, size);
+	spa_ringbuffer_write_update(&impl->ring, index + size);
+
+	pw_loop_signal_event(pw_thread_loop_get_loop(impl->encode_loop),
+			impl->encode_event);
+}
+
 static void playback_stream_process(void *d)
 {
 	struct impl *impl = d;
@@ -506,6 +512,11 @@ static void playback_stream_process(void *d)
 	size = SPA_MIN(bd->chunk->size, bd->maxsize - offs);
 	data = SPA_PTROFF(bd->data, offs, uint8_t);
 
+	if (impl->encode_loop != NULL) {
+		queue_samples(impl, data, size);
+		size = 0;
+	}
+
 	while (size > 0 && impl->block_size > 0) {
 		uint32_t avail, to_fill;
 
@@ -519,17 +530,8 @@ static void playback_stream_process(void *d)
 		size -= to_fill;
 		data += to_fill;
 
-		if (avail == 0) {
-			switch (impl->protocol) {
-			case PROTO_UDP:
-				flush_to_udp_packet(impl);
-				break;
-			case PROTO_TCP:
-				flush_to_tcp_packet(impl);
-				break;
-			}
-			impl->filled = 0;
-		}
+		if (avail == 0)
+			flush_packet(impl);
 	}
 
 	pw_stream_queue_buffer(impl->stream, buf);
@@ -1061,9 +1063,37 @@ static int rsa_encrypt(uint8_t *data, int len, uint8_t *res)
 	return size;
 }
 
+struct aes_key {
+	uint8_t key[AES_CHUNK_SIZE];
+	uint8_t iv[AES_CHUNK_SIZE];
+};
+
+static int do_set_aes_key(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct impl *impl = user_data;
+	const struct aes_key *k = data;
+
+	memcpy(impl->key, k->key, sizeof(impl->key));
+	memcpy(impl->iv, k->iv, sizeof(impl->iv));
+	return raop_aes_set_key(impl->aes, impl->key) < 0 ? -EIO : 0;
+}
+
+/* the key is changed on the thread that encrypts the packets */
+static int set_aes_key(struct impl *impl, const struct aes_key *k)
+{
+	if (impl->encode_loop != NULL)
+		return pw_loop_invoke(pw_thread_loop_get_loop(impl->encode_loop),
+				do_set_aes_key, 0, k, sizeof(*k), true, impl);
+	else
+		return pw_data_loop_invoke(pw_context_get_data_loop(impl->context),
+				do_set_aes_key, 0, k, sizeof(*k), true, impl);
+}
+
 static int rtsp_do_announce(struct impl *impl)
 {
 	const char *host;
+	struct aes_key aes_key;
 	uint8_t rsakey[512];
 	char key[512*2];
 	char iv[16*2];
@@ -1113,15 +1143,16 @@ static int rtsp_do_announce(struct impl *impl)
 		break;
 
 	case CRYPTO_RSA:
-		if (pw_getrandom(impl->key, sizeof(impl->key), 0) < 0 ||
-		    pw_getrandom(impl->iv, sizeof(impl->iv), 0) < 0)
+		if (pw_getrandom(aes_key.key, sizeof(aes_key.key), 0) < 0 ||
+		    pw_getrandom(aes_key.iv, sizeof(aes_key.iv), 0) < 0)
 			return -errno;
 
-		AES_set_encrypt_key(impl->key, 128, &impl->aes);
+		if ((res = set_aes_key(impl, &aes_key)) < 0)
+			return res;
 
-		i = rsa_encrypt(impl->key, 16, rsakey);
+		i = rsa_encrypt(aes_key.key, 16, rsakey);
 	        base64_encode(rsakey, i, key, '=');
-	        base64_encode(impl->iv, 16, iv, '=');
+	        base64_encode(aes_key.iv, 16, iv, '=');
 
 		asprintf(&sdp, "v=0\r\n"
 				"o=iTunes %s 0 IN IP%d %s\r\n"
@@ -1338,6 +1369,7 @@ static void rtsp_connected(void *data)
 static void connection_cleanup(struct impl *impl)
 {
 	impl->ready = false;
+	impl->recording = false;
 	if (impl->server_source != NULL) {
 		pw_loop_destroy_source(impl->loop, impl->server_source);
 		impl->server_source = NULL;
@@ -1488,6 +1520,25 @@ static const struct pw_stream_events playback_stream_events = {
 	.process = playback_stream_process
 };
 
+static int create_encode_thread(struct impl *impl)
+{
+	impl->ring_data = calloc(1, RING_SIZE);
+	if (impl->ring_data == NULL)
+		return -errno;
+	spa_ringbuffer_init(&impl->ring);
+
+	impl->encode_loop = pw_thread_loop_new("raop-encode", NULL);
+	if (impl->encode_loop == NULL)
+		return -errno;
+
+	impl->encode_event = pw_loop_add_event(pw_thread_loop_get_loop(impl->encode_loop),
+			on_encode_event, impl);
+	if (impl->encode_event == NULL)
+		return -errno;
+
+	return pw_thread_loop_start(impl->encode_loop);
+}
+
 static int create_stream(struct impl *impl)
 {
 	int res;
@@ -1569,6 +1620,11 @@ static void impl_destroy(struct impl *impl)
 	if (impl->rtsp)
 		pw_rtsp_client_destroy(impl->rtsp);
 
+	if (impl->encode_loop)
+		pw_thread_loop_destroy(impl->encode_loop);
+	free(impl->ring_data);
+	raop_aes_free(impl->aes);
+
 	pw_properties_free(impl->headers);
 	pw_properties_free(impl->stream_props);
 	pw_properties_free(impl->props);
@@ -1786,8 +1842,15 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 		str = "none";
 	if (spa_streq(str, "none"))
 		impl->encryption = CRYPTO_NONE;
-	else if (spa_streq(str, "RSA"))
+	else if (spa_streq(str, "RSA")) {
 		impl->encryption = CRYPTO_RSA;
+		/* the key is set for each session */
+		if ((impl->aes = raop_aes_new(impl->key)) == NULL) {
+			res = -EIO;
+			pw_log_error("can't create AES context");
+			goto error;
+		}
+	}
 	else if (spa_streq(str, "auth_setup"))
 		impl->encryption = CRYPTO_AUTH_SETUP;
 	else {
@@ -1833,6 +1896,12 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 			&impl->core_listener,
 			&core_events, impl);
 
+	if (pw_properties_get_bool(props, "raop.encode-thread", false) &&
+	    (res = create_encode_thread(impl)) < 0) {
+		pw_log_error("can't create encode thread: %s", spa_strerror(res));
+		goto error;
+	}
+
 	if ((res = create_stream(impl)) < 0)
 		goto error;
 
@@ -0,0 +1,284 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Cost of building and sending RAOP audio packets.
+ *
+ * Packets of FRAMES_PER_UDP_PACKET frames are built like raop-sink does,
+ * optionally encrypted, and sent over the loopback interface to a
+ * stand-in receiver thread that only counts them. The reference path is
+ * the bitwise packer with block by block AES that raop-sink used before,
+ * and its output is compared with the current path first.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <spa/utils/defs.h>
+
+#include "module-raop/packet.h"
+
+#define FRAMES_PER_UDP_PACKET	352
+#define MAX_PACKET		(12 + 8 + FRAMES_PER_UDP_PACKET * 4)
+#define N_PACKETS		100000
+
+struct receiver {
+	int fd;
+	uint64_t packets;
+	volatile bool running;
+};
+
+static inline void bit_writer(uint8_t **p, int *pos, uint8_t data, int len)
+{
+	int rb = 8 - *pos - len;
+	if (rb >= 0) {
+		**p = (*pos ? **p : 0) | (data << rb);
+		*pos += len;
+	} else {
+		*(*p)++ |= (data >> -rb);
+		**p = data << (8+rb);
+		*pos = -rb;
+	}
+}
+
+static int ref_write_pcm(void *dst, void *frames, uint32_t n_frames)
+{
+	uint8_t *bp, *b, *d = frames;
+	int bpos = 0;
+	uint32_t i;
+
+	b = bp = dst;
+
+	bit_writer(&bp, &bpos, 1, 3);
+	bit_writer(&bp, &bpos, 0, 4);
+	bit_writer(&bp, &bpos, 0, 8);
+	bit_writer(&bp, &bpos, 0, 4);
+	bit_writer(&bp, &bpos, 1, 1);
+	bit_writer(&bp, &bpos, 0, 2);
+	bit_writer(&bp, &bpos, 1, 1);
+	bit_writer(&bp, &bpos, (n_frames >> 24) & 0xff, 8);
+	bit_writer(&bp, &bpos, (n_frames >> 16) & 0xff, 8);
+	bit_writer(&bp, &bpos, (n_frames >> 8)  & 0xff, 8);
+	bit_writer(&bp, &bpos, (n_frames)       & 0xff, 8);
+
+	for (i = 0; i < n_frames; i++) {
+		bit_writer(&bp, &bpos, *(d + 1), 8);
+		bit_writer(&bp, &bpos, *(d + 0), 8);
+		bit_writer(&bp, &bpos, *(d + 3), 8);
+		bit_writer(&bp, &bpos, *(d + 2), 8);
+		d += 4;
+	}
+	return bp - b + 1;
+}
+
+/* AES-CBC done one block at a time, like the AES_encrypt() loop */
+static int ref_aes_encrypt(EVP_CIPHER_CTX *ecb, const uint8_t *iv, uint8_t *data, int len)
+{
+	uint8_t nv[RAOP_AES_CHUNK_SIZE];
+	int i, j, out;
+
+	memcpy(nv, iv, RAOP_AES_CHUNK_SIZE);
+	for (i = 0; i + RAOP_AES_CHUNK_SIZE <= len; i += RAOP_AES_CHUNK_SIZE) {
+		uint8_t *buffer = data + i;
+		for (j = 0; j < RAOP_AES_CHUNK_SIZE; j++)
+			buffer[j] ^= nv[j];
+		EVP_EncryptUpdate(ecb, buffer, &out, buffer, RAOP_AES_CHUNK_SIZE);
+		memcpy(nv, buffer, RAOP_AES_CHUNK_SIZE);
+	}
+	return i;
+}
+
+static void *receiver_thread(void *data)
+{
+	struct receiver *r = data;
+	uint8_t buf[2048];
+
+	while (r->running) {
+		if (recv(r->fd, buf, sizeof(buf), 0) > 0)
+			r->packets++;
+	}
+	return NULL;
+}
+
+static uint64_t get_cpu_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * SPA_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+struct ctx {
+	int fd;
+	EVP_CIPHER_CTX *cbc;
+	EVP_CIPHER_CTX *ecb;
+	uint8_t iv[RAOP_AES_CHUNK_SIZE];
+	int16_t samples[FRAMES_PER_UDP_PACKET * 2];
+};
+
+static uint32_t build_packet(struct ctx *c, uint8_t *pkt, bool ref, bool encrypt, uint16_t seq)
+{
+	uint32_t *hdr = (uint32_t*)pkt, len;
+	uint8_t *dst = pkt + 12;
+
+	hdr[0] = htonl(0x80600000 | seq);
+	hdr[1] = htonl(seq * FRAMES_PER_UDP_PACKET);
+	hdr[2] = htonl(0x12345678);
+
+	if (ref) {
+		len = ref_write_pcm(dst, c->samples, FRAMES_PER_UDP_PACKET);
+		if (encrypt)
+			ref_aes_encrypt(c->ecb, c->iv, dst, len);
+	} else {
+		len = raop_write_pcm(dst, c->samples, FRAMES_PER_UDP_PACKET);
+		if (encrypt)
+			raop_aes_encrypt(c->cbc, c->iv, dst, len);
+	}
+	return len + 12;
+}
+
+static int check(struct ctx *c)
+{
+	uint8_t a[MAX_PACKET], b[MAX_PACKET];
+	uint32_t la, lb, n;
+	int16_t samples[4];
+
+	/* short frames exercise the start and the end of the payload */
+	for (n = 0; n <= 2; n++) {
+		memset(a, 0xaa, sizeof(a));
+		memset(b, 0x55, sizeof(b));
+		samples[0] = -1; samples[1] = 0x1234; samples[2] = INT16_MIN; samples[3] = 1;
+		la = ref_write_pcm(a, samples, n);
+		lb = raop_write_pcm(b, samples, n);
+		if (la != lb || memcmp(a, b, la) != 0)
+			return -1;
+	}
+	la = build_packet(c, a, true, true, 1);
+	lb = build_packet(c, b, false, true, 1);
+	if (la != lb || memcmp(a, b, la) != 0)
+		return -1;
+	return 0;
+}
+
+static void run(struct ctx *c, struct receiver *r, bool ref, bool encrypt)
+{
+	uint8_t pkt[MAX_PACKET];
+	uint64_t start, build, elapsed, received;
+	uint32_t i, len;
+
+	start = get_cpu_nsec();
+	for (i = 0; i < N_PACKETS; i++)
+		build_packet(c, pkt, ref, encrypt, i);
+	build = get_cpu_nsec() - start;
+
+	received = r->packets;
+	start = get_cpu_nsec();
+	for (i = 0; i < N_PACKETS; i++) {
+		len = build_packet(c, pkt, ref, encrypt, i);
+		send(c->fd, pkt, len, 0);
+	}
+	elapsed = get_cpu_nsec() - start;
+
+	fprintf(stdout, "%-10s %-4s build:%6.2f us/packet total:%6.2f us/packet "
+			"%8.0f packets/s per core received:%"PRIu64"\n",
+			ref ? "reference" : "current", encrypt ? "aes" : "none",
+			build / 1000.0 / N_PACKETS, elapsed / 1000.0 / N_PACKETS,
+			N_PACKETS * (double)SPA_NSEC_PER_SEC / elapsed,
+			r->packets - received);
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint8_t key[RAOP_AES_CHUNK_SIZE] = "0123456789abcdef";
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	struct receiver r;
+	struct ctx c;
+	pthread_t thread;
+	struct timeval tv = { 0, 100000 };
+	int val = 4 * 1024 * 1024;
+	uint32_t i;
+
+	spa_zero(c);
+	spa_zero(r);
+	for (i = 0; i < SPA_N_ELEMENTS(c.samples); i++)
+		c.samples[i] = (int16_t)(rand() & 0xffff);
+	memcpy(c.iv, "fedcba9876543210", RAOP_AES_CHUNK_SIZE);
+
+	c.cbc = raop_aes_new(key);
+	c.ecb = EVP_CIPHER_CTX_new();
+	if (c.cbc == NULL || c.ecb == NULL ||
+	    EVP_EncryptInit_ex(c.ecb, EVP_aes_128_ecb(), NULL, key, NULL) != 1) {
+		fprintf(stderr, "can't set up AES\n");
+		return -1;
+	}
+	EVP_CIPHER_CTX_set_padding(c.ecb, 0);
+
+	if (check(&c) < 0) {
+		fprintf(stderr, "packets differ from the reference\n");
+		return -1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((r.fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	    bind(r.fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+	    getsockname(r.fd, (struct sockaddr*)&sa, &salen) < 0 ||
+	    (c.fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+	    connect(c.fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	setsockopt(r.fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+	setsockopt(r.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	r.running = true;
+	pthread_create(&thread, NULL, receiver_thread, &r);
+
+	run(&c, &r, true, false);
+	run(&c, &r, false, false);
+	run(&c, &r, true, true);
+	run(&c, &r, false, true);
+
+	r.running = false;
+	pthread_join(thread, NULL);
+
+	close(c.fd);
+	close(r.fd);
+	raop_aes_free(c.cbc);
+	EVP_CIPHER_CTX_free(c.ecb);
+
+	return 0;
+}
@@ -0,0 +1,140 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PIPEWIRE_RAOP_PACKET_H
+#define PIPEWIRE_RAOP_PACKET_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+
+#include <openssl/evp.h>
+
+#include <spa/utils/defs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RAOP_AES_CHUNK_SIZE	16
+
+/* Write n_frames of native S16 stereo as an uncompressed ALAC frame.
+ *
+ * The frame is a 23 bit header followed by the 32 bit frame count and the
+ * big endian samples, so everything after the header is shifted by 7 bits.
+ * Looking at the payload as 16 bit big endian words, each output word is
+ * the input word shifted left by one with the top bit of the next word.
+ * On little endian hosts, 4 words are done at once in a 64 bit register.
+ * Returns the number of bytes written, 3 + 4 + n_frames * 4. */
+static inline uint32_t raop_write_pcm(uint8_t *dst, const void *frames, uint32_t n_frames)
+{
+	const uint16_t *s = frames;
+	uint32_t i = 0, n_samples = n_frames * 2;
+	uint16_t hi = n_frames >> 16, lo = n_frames & 0xffff, w;
+	uint8_t *d;
+
+	/* channels=1 (stereo), 19 unknown/unused bits, hassize, not compressed */
+	dst[0] = 0x20;
+	dst[1] = 0x00;
+	dst[2] = 0x12 | (hi >> 15);
+
+	w = htons((hi << 1) | (lo >> 15));
+	memcpy(&dst[3], &w, sizeof(w));
+	w = htons((lo << 1) | (n_samples ? s[0] >> 15 : 0));
+	memcpy(&dst[5], &w, sizeof(w));
+
+	if (n_samples == 0)
+		return 7;
+
+	d = dst + 7;
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	for (; i + 4 < n_samples; i += 4) {
+		uint64_t x, y;
+
+		memcpy(&x, &s[i], sizeof(x));
+		y = ((x << 1) & 0xfffefffefffefffeULL) |
+			((x >> 31) & 0x0000000100010001ULL) |
+			((uint64_t)(s[i + 4] >> 15) << 48);
+		y = ((y & 0x00ff00ff00ff00ffULL) << 8) | ((y >> 8) & 0x00ff00ff00ff00ffULL);
+		memcpy(&d[2 * i], &y, sizeof(y));
+	}
+#endif
+	for (; i < n_samples - 1; i++) {
+		w = htons((s[i] << 1) | (s[i + 1] >> 15));
+		memcpy(&d[2 * i], &w, sizeof(w));
+	}
+	w = htons(s[i] << 1);
+	memcpy(&d[2 * i], &w, sizeof(w));
+
+	return 7 + n_samples * 2;
+}
+
+static inline EVP_CIPHER_CTX *raop_aes_new(const uint8_t key[RAOP_AES_CHUNK_SIZE])
+{
+	EVP_CIPHER_CTX *ctx;
+
+	if ((ctx = EVP_CIPHER_CTX_new()) == NULL)
+		return NULL;
+	if (EVP_EncryptInit_ex(ctx, EVP_aes_128_cbc(), NULL, key, NULL) != 1) {
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+	return ctx;
+}
+
+/* Replace the key of a context made with raop_aes_new() */
+static inline int raop_aes_set_key(EVP_CIPHER_CTX *ctx, const uint8_t key[RAOP_AES_CHUNK_SIZE])
+{
+	return EVP_EncryptInit_ex(ctx, NULL, NULL, key, NULL) == 1 ? 0 : -1;
+}
+
+static inline void raop_aes_free(EVP_CIPHER_CTX *ctx)
+{
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+/* Encrypt the complete AES blocks of data in place with AES-CBC, starting
+ * from iv for every packet. The trailing partial block stays in the clear.
+ * Returns the number of encrypted bytes or -1 on error. */
+static inline int raop_aes_encrypt(EVP_CIPHER_CTX *ctx, const uint8_t iv[RAOP_AES_CHUNK_SIZE],
+		uint8_t *data, int len)
+{
+	int n = SPA_ROUND_DOWN(len, RAOP_AES_CHUNK_SIZE), out;
+
+	if (n == 0)
+		return 0;
+	if (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, iv) != 1 ||
+	    EVP_EncryptUpdate(ctx, data, &out, data, n) != 1)
+		return -1;
+	return out;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIPEWIRE_RAOP_PACKET_H */
@@ -47,6 +47,7 @@
 
 #include <module-rtp/sap.h>
 #include <module-rtp/rtp.h>
+#include <module-rtp/sender.h>
 
 
 /** \page page_module_rtp_sink PipeWire Module: RTP sink
@@ -67,6 +68,7 @@
  * - `net.mtu = <int>`: MTU to use, default 1280
  * - `net.ttl = <int>`: TTL to use, default 1
  * - `net.loop = <bool>`: loopback multicast, default false
+ * - `net.gso = <bool>`: use UDP segmentation offload when available, default true
  * - `sess.min-ptime = <int>`: minimum packet time in milliseconds, default 2
  * - `sess.max-ptime = <int>`: maximum packet time in milliseconds, default 20
  * - `sess.name = <str>`: a session name
@@ -103,6 +105,7 @@
  *         #net.mtu = 1280
  *         #net.ttl = 1
  *         #net.loop = false
+ *         #net.gso = true
  *         #sess.min-ptime = 2
  *         #sess.max-ptime = 20
  *         #sess.name = "PipeWire RTP stream"
@@ -146,6 +149,7 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 #define DEFAULT_TTL		1
 #define DEFAULT_MTU		1280
 #define DEFAULT_LOOP		false
+#define DEFAULT_GSO		true
 
 #define DEFAULT_MIN_PTIME	2
 #define DEFAULT_MAX_PTIME	20
@@ -158,6 +162,7 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 		"net.mtu=<desired MTU, default:"SPA_STRINGIFY(DEFAULT_MTU)"> "			\
 		"net.ttl=<desired TTL, default:"SPA_STRINGIFY(DEFAULT_TTL)"> "			\
 		"net.loop=<desired loopback, default:"SPA_STRINGIFY(DEFAULT_LOOP)"> "		\
+		"net.gso=<use segmentation offload, default:"SPA_STRINGIFY(DEFAULT_GSO)"> "	\
 		"sess.name=<a name for the session> "						\
 		"sess.min-ptime=<minimum packet time in milliseconds, default:2> "		\
 		"sess.max-ptime=<maximum packet time in milliseconds, default:20> "		\
@@ -220,6 +225,7 @@ struct impl {
 	int mtu;
 	bool ttl;
 	bool mcast_loop;
+	bool gso;
 	uint32_t min_ptime;
 	uint32_t max_ptime;
 	uint32_t pbytes;
@@ -251,6 +257,8 @@ struct impl {
 
 	int rtp_fd;
 	int sap_fd;
+
+	struct rtp_sender sender;
 };
 
 
@@ -261,78 +269,43 @@ static void stream_destroy(void *d)
 	impl->stream = NULL;
 }
 
-static inline void
-set_iovec(struct spa_ringbuffer *rbuf, void *buffer, uint32_t size,
-		uint32_t offset, struct iovec *iov, uint32_t len)
-{
-	iov[0].iov_len = SPA_MIN(len, size - offset);
-	iov[0].iov_base = SPA_PTROFF(buffer, offset, void);
-	iov[1].iov_len = len - iov[0].iov_len;
-	iov[1].iov_base = buffer;
-}
-
 static void flush_packets(struct impl *impl)
 {
 	int32_t avail;
-	uint32_t index;
-	struct iovec iov[3];
-	struct msghdr msg;
-	ssize_t n;
-	struct rtp_header header;
-	int32_t tosend;
+	uint32_t index, n_packets, tosend = impl->pbytes;
+	int res;
 
 	avail = spa_ringbuffer_get_read_index(&impl->ring, &index);
 
-	tosend = impl->pbytes;
-
-	if (avail < tosend)
+	if (avail < (int32_t)tosend)
 		return;
 
-	spa_zero(header);
-	header.v = 2;
-	header.pt = impl->payload;
-	header.ssrc = htonl(impl->ssrc);
-
-	iov[0].iov_base = &header;
-	iov[0].iov_len = sizeof(header);
-
-	msg.msg_name = NULL;
-	msg.msg_namelen = 0;
-	msg.msg_iov = iov;
-	msg.msg_iovlen = 3;
-	msg.msg_control = NULL;
-	msg.msg_controllen = 0;
-	msg.msg_flags = 0;
-
-	while (avail >= tosend) {
-		header.sequence_number = htons(impl->seq);
-		header.timestamp = htonl(impl->timestamp);
-
-		set_iovec(&impl->ring,
-			impl->buffer, BUFFER_SIZE,
-			index & BUFFER_MASK,
-			&iov[1], tosend);
-
-		n = sendmsg(impl->rtp_fd, &msg, MSG_NOSIGNAL);
-		if (n < 0) {
-			switch (errno) {
-			case ECONNREFUSED:
-			case ECONNRESET:
-				pw_log_debug("remote end not listening");
-				break;
-			default:
-				pw_log_warn("sendmsg() failed: %m");
-				break;
-			}
+	/* build all packets of the quantum and send them in as few
+	 * syscalls as possible */
+	n_packets = avail / tosend;
+
+	res = rtp_sender_send(&impl->sender, impl->buffer, BUFFER_SIZE,
+			index, n_packets, impl->seq, impl->timestamp);
+	if (res < 0) {
+		switch (res) {
+		case -ECONNREFUSED:
+		case -ECONNRESET:
+			pw_log_debug("remote end not listening");
+			break;
+		default:
+			pw_log_warn("%s() failed: %s",
+					rtp_sender_mode_name(impl->sender.mode),
+					spa_strerror(res));
+			break;
 		}
+	} else if ((uint32_t)res < n_packets) {
+		pw_log_debug("sent %d of %u packets", res, n_packets);
+	}
 
-		impl->seq++;
-		impl->timestamp += tosend / impl->frame_size;
+	impl->seq += n_packets;
+	impl->timestamp += n_packets * (tosend / impl->frame_size);
 
-		index += tosend;
-		avail -= tosend;
-	}
-	spa_ringbuffer_read_update(&impl->ring, index);
+	spa_ringbuffer_read_update(&impl->ring, index + n_packets * tosend);
 }
 
 static void stream_process(void *data)
@@ -525,6 +498,13 @@ static int setup_stream(struct impl *impl)
 
 	impl->rtp_fd = fd;
 
+	if ((res = rtp_sender_init(&impl->sender, fd,
+			impl->gso ? RTP_SENDER_MODE_GSO : RTP_SENDER_MODE_MMSG,
+			impl->payload, impl->ssrc, impl->frame_size, impl->pbytes)) < 0)
+		return res;
+
+	pw_log_info("sending with %s", rtp_sender_mode_name(impl->sender.mode));
+
 	return 0;
 }
 
@@ -679,6 +659,7 @@ static void impl_destroy(struct impl *impl)
 	if (impl->timer)
 		pw_loop_destroy_source(impl->loop, impl->timer);
 
+	rtp_sender_clear(&impl->sender);
 	if (impl->rtp_fd != -1)
 		close(impl->rtp_fd);
 	if (impl->sap_fd != -1)
@@ -906,6 +887,7 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 	impl->mtu = pw_properties_get_uint32(props, "net.mtu", DEFAULT_MTU);
 	impl->ttl = pw_properties_get_uint32(props, "net.ttl", DEFAULT_TTL);
 	impl->mcast_loop = pw_properties_get_bool(props, "net.loop", DEFAULT_LOOP);
+	impl->gso = pw_properties_get_bool(props, "net.gso", DEFAULT_GSO);
 
 	impl->min_ptime = pw_properties_get_uint32(props, "sess.min-ptime", DEFAULT_MIN_PTIME);
 	impl->max_ptime = pw_properties_get_uint32(props, "sess.max-ptime", DEFAULT_MAX_PTIME);
@@ -46,6 +46,7 @@
 
 #include <module-rtp/sap.h>
 #include <module-rtp/rtp.h>
+#include <module-rtp/jitter.h>
 
 #ifdef __FreeBSD__
 #define ifr_ifindex ifr_index
@@ -64,8 +65,17 @@
  * - `sap.port = <str>`: port of the SAP messages, default 9875
  * - `local.ifname = <str>`: interface name to use
  * - `sess.latency.msec = <str>`: target network latency in milliseconds, default 100
+ * - `sess.jitter.depth = <int>`: number of packets that are held to put reordered
+ *    packets back in order, default 8, max 64, 0 disables reordering. The time
+ *    covered by these packets should be well below the network latency.
  * - `stream.props = {}`: properties to be passed to the stream
  *
+ * The ringbuffer of a session is sized from the format and the latency
+ * and the reorder buffer from the jitter depth. They are only allocated,
+ * together with the receive buffers, when packets arrive and are released
+ * again when no packets were received for a cleanup interval. The `rtp.memory`
+ * property of the stream holds the bytes in use by the session.
+ *
  * ## General options
  *
  * Options with well-known behavior:
@@ -84,6 +94,7 @@
  *         #sap.port = 9875
  *         #local.ifname = eth0
  *         sess.latency.msec = 100
+ *         #sess.jitter.depth = 8
  *         stream.props = {
  *            #media.class = "Audio/Source"
  *            #node.name = "rtp-source"
@@ -102,6 +113,7 @@
  *                 actions = {
  *                     create-stream = {
  *                         #sess.latency.msec = 100
+ *                         #sess.jitter.depth = 8
  *                         #target.object = ""
  *                     }
  *                 }
@@ -129,14 +141,18 @@ PW_LOG_TOPIC_STATIC(mod_topic, "mod." NAME);
 #define DEFAULT_SAP_IP			"224.0.0.56"
 #define DEFAULT_SAP_PORT		9875
 #define DEFAULT_SESS_LATENCY		100
+#define DEFAULT_JITTER_DEPTH		8
+
+#define MAX_RECV_PACKETS		16
 
-#define BUFFER_SIZE			(1u<<22)
-#define BUFFER_MASK			(BUFFER_SIZE-1)
+#define MIN_BUFFER_SIZE			(1u<<14)
+#define MAX_BUFFER_SIZE			(1u<<22)
 
 #define USAGE	"sap.ip=<SAP IP address to listen on, default "DEFAULT_SAP_IP"> "				\
 		"sap.port=<SAP port to listen on, default "SPA_STRINGIFY(DEFAULT_SAP_PORT)"> "			\
 		"local.ifname=<local interface name to use> "							\
 		"sess.latency.msec=<target network latency, default "SPA_STRINGIFY(DEFAULT_SESS_LATENCY)"> "	\
+		"sess.jitter.depth=<packets held for reordering, default "SPA_STRINGIFY(DEFAULT_JITTER_DEPTH)"> "	\
 		"stream.props= { key=value ... } "								\
 		"stream.rules=<rules> "
 
@@ -171,6 +187,7 @@ struct impl {
 	char *sap_ip;
 	int sap_port;
 	int sess_latency_msec;
+	uint32_t jitter_depth;
 	uint32_t cleanup_interval;
 
 	struct spa_list sessions;
@@ -228,13 +245,26 @@ struct session {
 	struct spa_hook stream_listener;
 
 	uint32_t expected_ssrc;
-	uint16_t expected_seq;
 	unsigned have_ssrc:1;
-	unsigned have_seq:1;
 	unsigned have_sync:1;
 
+	struct rtp_jitter jitter;
+	struct rtp_jitter_stats last_stats;
+
+	struct mmsghdr msgs[MAX_RECV_PACKETS];
+	struct iovec iov[MAX_RECV_PACKETS];
+
+	/* the ring, the jitter slots and the receive buffers, allocated on
+	 * the main thread when the first packet arrives and released again
+	 * when the session is idle */
+	struct spa_source *alloc_event;
+	uint64_t idle_received;
+	uint32_t buffer_size;
+	uint32_t mem_size;
+	unsigned alloc_pending:1;
+
 	struct spa_ringbuffer ring;
-	uint8_t buffer[BUFFER_SIZE];
+	uint8_t *buffer;
 
 	struct spa_io_rate_match *rate_match;
 	struct spa_dll dll;
@@ -274,7 +304,7 @@ static void stream_process(void *data)
 
 	target_buffer = sess->target_buffer + sess->last_packet_size / 2;
 
-	if (avail < wanted || sess->buffering) {
+	if (sess->buffer == NULL || avail < wanted || sess->buffering) {
 		memset(d[0].data, 0, wanted);
 		if (!sess->buffering && sess->have_sync) {
 			pw_log_debug("underrun %u/%u < %u, buffering...",
@@ -283,7 +313,7 @@ static void stream_process(void *data)
 		}
 	} else {
 		float error, corr;
-		if (avail > (int32_t)SPA_MIN(target_buffer * 8, BUFFER_SIZE)) {
+		if (avail > (int32_t)SPA_MIN(target_buffer * 8, sess->buffer_size)) {
 			pw_log_warn("overrun %u > %u", avail, target_buffer * 8);
 			index += avail - target_buffer;
 			avail = target_buffer;
@@ -313,8 +343,8 @@ static void stream_process(void *data)
 		}
 		spa_ringbuffer_read_data(&sess->ring,
 				sess->buffer,
-				BUFFER_SIZE,
-				index & BUFFER_MASK,
+				sess->buffer_size,
+				index & (sess->buffer_size - 1),
 				d[0].data, wanted);
 
 		index += wanted;
@@ -365,66 +395,43 @@ static const struct pw_stream_events out_stream_events = {
 	.process = stream_process
 };
 
-static void
-on_rtp_io(void *data, int fd, uint32_t mask)
+/* called by the jitter buffer with the packets in sequence order */
+static void session_write(void *data, uint32_t timestamp, const void *payload, uint32_t len)
 {
 	struct session *sess = data;
-	struct rtp_header *hdr;
-	ssize_t len, hlen;
-	uint8_t buffer[2048], *payload;
-
-	if (mask & SPA_IO_IN) {
-		uint32_t index, expected_index, timestamp;
-		uint16_t seq;
-		int32_t filled;
-
-		if ((len = recv(fd, buffer, sizeof(buffer), 0)) < 0)
-			goto receive_error;
-
-		if (len < 12)
-			goto short_packet;
-
-		hdr = (struct rtp_header*)buffer;
-		if (hdr->v != 2)
-			goto invalid_version;
-
-		hlen = 12 + hdr->cc * 4;
-		if (hlen > len)
-			goto invalid_len;
-
-		if (sess->have_ssrc && sess->expected_ssrc != hdr->ssrc)
-			goto unexpected_ssrc;
-		sess->expected_ssrc = hdr->ssrc;
-		sess->have_ssrc = true;
-
-		seq = ntohs(hdr->sequence_number);
-		if (sess->have_seq && sess->expected_seq != seq) {
-			pw_log_warn("unexpected seq (%d != %d)", seq, sess->expected_seq);
-		}
-		sess->expected_seq = seq + 1;
-		sess->have_seq = true;
-
-		len = SPA_ROUND_DOWN(len - hlen, sess->info.stride);
-		payload = &buffer[hlen];
-
-		filled = spa_ringbuffer_get_write_index(&sess->ring, &index);
+	uint32_t index, expected_index;
+	int32_t filled;
 
-		timestamp = ntohl(hdr->timestamp);
-		expected_index = timestamp * sess->info.stride;
+	filled = spa_ringbuffer_get_write_index(&sess->ring, &index);
 
-		if (!sess->have_sync) {
-			pw_log_trace("got rtp, no sync");
-			sess->ring.readindex = sess->ring.writeindex =
-				index = expected_index;
-			filled = 0;
-			sess->have_sync = true;
-			sess->buffering = true;
-			pw_log_debug("sync to timestamp %u", index);
+	expected_index = timestamp * sess->info.stride;
 
-			spa_dll_init(&sess->dll);
-			spa_dll_set_bw(&sess->dll, SPA_DLL_BW_MIN, 128, sess->info.info.rate);
-
-		} else if (expected_index != index) {
+	if (!sess->have_sync) {
+		pw_log_trace("got rtp, no sync");
+		sess->ring.readindex = sess->ring.writeindex =
+			index = expected_index;
+		filled = 0;
+		sess->have_sync = true;
+		sess->buffering = true;
+		pw_log_debug("sync to timestamp %u", index);
+
+		spa_dll_init(&sess->dll);
+		spa_dll_set_bw(&sess->dll, SPA_DLL_BW_MIN, 128, sess->info.info.rate);
+
+	} else if (expected_index != index) {
+		uint32_t gap = expected_index - index;
+
+		if (gap < sess->target_buffer && filled + gap + len <= sess->buffer_size) {
+			/* packets were lost, play silence for them */
+			uint32_t offset = index & (sess->buffer_size - 1);
+			uint32_t l0 = SPA_MIN(gap, sess->buffer_size - offset);
+
+			pw_log_debug("fill %u bytes of lost packets", gap);
+			memset(SPA_PTROFF(sess->buffer, offset, void), 0, l0);
+			memset(sess->buffer, 0, gap - l0);
+			index += gap;
+			filled += gap;
+		} else {
 			pw_log_trace("got rtp, wrong timestamp");
 			pw_log_debug("unexpected timestamp (%u != %u)",
 					index / sess->info.stride,
@@ -432,38 +439,62 @@ on_rtp_io(void *data, int fd, uint32_t mask)
 			index = expected_index;
 			filled = 0;
 		}
+	}
 
-		if (filled + len > BUFFER_SIZE) {
-			pw_log_debug("got rtp, capture overrun %u %zd", filled, len);
-			sess->have_sync = false;
-		} else {
-			uint32_t target_buffer;
-
-			pw_log_trace("got rtp packet len:%zd", len);
-			spa_ringbuffer_write_data(&sess->ring,
-					sess->buffer,
-					BUFFER_SIZE,
-					index & BUFFER_MASK,
-					payload, len);
-			index += len;
-			filled += len;
-			spa_ringbuffer_write_update(&sess->ring, index);
-
-			sess->last_packet_size = len;
-			target_buffer = sess->target_buffer + len/2;
-
-			if (sess->buffering && (uint32_t)filled > target_buffer) {
-				sess->buffering = false;
-				pw_log_debug("buffering done %u > %u",
-					filled, target_buffer);
-			}
+	if (filled + len > sess->buffer_size) {
+		pw_log_debug("got rtp, capture overrun %u %u", filled, len);
+		sess->have_sync = false;
+	} else {
+		uint32_t target_buffer;
+
+		pw_log_trace("got rtp packet len:%u", len);
+		spa_ringbuffer_write_data(&sess->ring,
+				sess->buffer,
+				sess->buffer_size,
+				index & (sess->buffer_size - 1),
+				payload, len);
+		index += len;
+		filled += len;
+		spa_ringbuffer_write_update(&sess->ring, index);
+
+		sess->last_packet_size = len;
+		target_buffer = sess->target_buffer + len/2;
+
+		if (sess->buffering && (uint32_t)filled > target_buffer) {
+			sess->buffering = false;
+			pw_log_debug("buffering done %u > %u",
+				filled, target_buffer);
 		}
 	}
-	return;
+}
 
-receive_error:
-	pw_log_warn("recv error: %m");
+static void handle_packet(struct session *sess, uint8_t *buffer, ssize_t len)
+{
+	struct rtp_header *hdr;
+	ssize_t hlen;
+
+	if (len < 12)
+		goto short_packet;
+
+	hdr = (struct rtp_header*)buffer;
+	if (hdr->v != 2)
+		goto invalid_version;
+
+	hlen = 12 + hdr->cc * 4;
+	if (hlen > len)
+		goto invalid_len;
+
+	if (sess->have_ssrc && sess->expected_ssrc != hdr->ssrc)
+		goto unexpected_ssrc;
+	sess->expected_ssrc = hdr->ssrc;
+	sess->have_ssrc = true;
+
+	len = SPA_ROUND_DOWN(len - hlen, sess->info.stride);
+
+	rtp_jitter_push(&sess->jitter, ntohs(hdr->sequence_number),
+			ntohl(hdr->timestamp), &buffer[hlen], len);
 	return;
+
 short_packet:
 	pw_log_warn("short packet received");
 	return;
@@ -479,6 +510,39 @@ unexpected_ssrc:
 	return;
 }
 
+static void
+on_rtp_io(void *data, int fd, uint32_t mask)
+{
+	struct session *sess = data;
+	int i, n;
+
+	if (mask & SPA_IO_IN) {
+		if (sess->buffer == NULL) {
+			/* drop the packet until the buffers are allocated */
+			if (recv(fd, NULL, 0, MSG_TRUNC) < 0)
+				goto receive_error;
+			if (!sess->alloc_pending) {
+				sess->alloc_pending = true;
+				pw_loop_signal_event(sess->impl->loop, sess->alloc_event);
+			}
+			return;
+		}
+		/* the source is level triggered, what is left after a full
+		 * batch wakes us up again */
+		if ((n = recvmmsg(fd, sess->msgs, MAX_RECV_PACKETS, 0, NULL)) < 0)
+			goto receive_error;
+
+		for (i = 0; i < n; i++)
+			handle_packet(sess, sess->iov[i].iov_base, sess->msgs[i].msg_len);
+	}
+	return;
+
+receive_error:
+	if (errno != EAGAIN)
+		pw_log_warn("recv error: %m");
+	return;
+}
+
 static int make_socket(const struct sockaddr* sa, socklen_t salen, char *ifname)
 {
 	int af, fd, val, res;
@@ -568,17 +632,103 @@ static void session_touch(struct session *sess)
 	sess->timestamp = SPA_TIMESPEC_TO_NSEC(&ts);
 }
 
+static void session_log_stats(struct session *sess)
+{
+	struct rtp_jitter_stats *st = &sess->jitter.stats;
+
+	pw_log_info("session %s: received:%"PRIu64" lost:%"PRIu64" reordered:%"PRIu64
+			" late:%"PRIu64" duplicate:%"PRIu64" resync:%"PRIu64,
+			sess->info.session, st->received, st->lost, st->reordered,
+			st->late, st->duplicate, st->resync);
+	sess->last_stats = *st;
+}
+
+static uint32_t session_memory(struct session *sess)
+{
+	return sizeof(*sess) + (sess->buffer ? sess->mem_size : 0);
+}
+
+static void session_update_memory(struct session *sess)
+{
+	struct spa_dict_item items[1];
+	char val[32];
+
+	if (sess->stream == NULL)
+		return;
+
+	snprintf(val, sizeof(val), "%u", session_memory(sess));
+	items[0] = SPA_DICT_ITEM_INIT("rtp.memory", val);
+	pw_stream_update_properties(sess->stream, &SPA_DICT_INIT(items, 1));
+}
+
+static int do_set_buffer(struct spa_loop *loop, bool async, uint32_t seq,
+		const void *data, size_t size, void *user_data)
+{
+	struct session *sess = user_data;
+	uint8_t *buffer = *(uint8_t**)data, *packets = NULL;
+	struct rtp_jitter_slot *slots = NULL;
+	uint32_t i;
+
+	if (buffer != NULL) {
+		slots = SPA_PTROFF(buffer, sess->buffer_size, struct rtp_jitter_slot);
+		packets = SPA_PTROFF(slots, sess->jitter.n_slots * sizeof(*slots), uint8_t);
+	}
+	for (i = 0; i < MAX_RECV_PACKETS; i++)
+		sess->iov[i].iov_base = packets ? packets + i * RTP_JITTER_MAX_PACKET : NULL;
+
+	rtp_jitter_set_slots(&sess->jitter, sess->jitter.n_slots ? slots : NULL);
+	sess->buffer = buffer;
+	sess->have_sync = false;
+	sess->alloc_pending = false;
+	return 0;
+}
+
+static void session_set_buffer(struct session *sess, uint8_t *buffer)
+{
+	uint8_t *old = sess->buffer;
+
+	pw_loop_invoke(sess->impl->data_loop, do_set_buffer, 0,
+			&buffer, sizeof(buffer), true, sess);
+	free(old);
+
+	pw_log_info("session %s: %s buffer of %u bytes", sess->info.session,
+			buffer ? "allocated" : "released", sess->mem_size);
+	session_update_memory(sess);
+}
+
+static void on_alloc_event(void *data, uint64_t count)
+{
+	struct session *sess = data;
+	uint8_t *buffer;
+
+	if (sess->buffer != NULL)
+		return;
+
+	if ((buffer = calloc(1, sess->mem_size)) == NULL) {
+		pw_log_error("session %s: can't allocate buffer of %u bytes: %m",
+				sess->info.session, sess->mem_size);
+		return;
+	}
+	session_set_buffer(sess, buffer);
+}
+
 static void session_free(struct session *sess)
 {
-	if (sess->impl) {
+	struct impl *impl = sess->impl;
+
+	if (spa_list_is_initialized(&sess->link)) {
 		pw_log_info("free session %s %s", sess->info.origin, sess->info.session);
-		sess->impl->n_sessions--;
+		session_log_stats(sess);
+		impl->n_sessions--;
 		spa_list_remove(&sess->link);
 	}
 	if (sess->stream)
 		pw_stream_destroy(sess->stream);
 	if (sess->source)
-		pw_loop_destroy_source(sess->impl->data_loop, sess->source);
+		pw_loop_destroy_source(impl->data_loop, sess->source);
+	if (sess->alloc_event)
+		pw_loop_destroy_source(impl->loop, sess->alloc_event);
+	free(sess->buffer);
 	free(sess);
 }
 
@@ -610,6 +760,7 @@ static int session_new(struct impl *impl, struct sdp_info *info)
 	uint8_t buffer[1024];
 	struct pw_properties *props;
 	int res, fd, sess_latency_msec;
+	uint32_t i;
 	const char *str;
 
 	if (impl->n_sessions >= MAX_SESSIONS) {
@@ -621,6 +772,7 @@ static int session_new(struct impl *impl, struct sdp_info *info)
 	if (session == NULL)
 		return -errno;
 
+	session->impl = impl;
 	session->info = *info;
 	session->first = true;
 
@@ -667,6 +819,26 @@ static int session_new(struct impl *impl, struct sdp_info *info)
 	session->target_buffer = msec_to_bytes(info, sess_latency_msec);
 	session->max_error = msec_to_bytes(info, ERROR_MSEC);
 
+	/* room for the overrun limit of the reader and the packets in flight */
+	session->buffer_size = SPA_CLAMP(session->target_buffer * 8 + 2 * RTP_JITTER_MAX_PACKET,
+			MIN_BUFFER_SIZE, MAX_BUFFER_SIZE);
+	while (session->buffer_size & (session->buffer_size - 1))
+		session->buffer_size += session->buffer_size & -session->buffer_size;
+	pw_properties_setf(props, "rtp.memory", "%u", session_memory(session));
+
+	rtp_jitter_init(&session->jitter, pw_properties_get_uint32(props,
+				"sess.jitter.depth", impl->jitter_depth),
+			session_write, session);
+	session->mem_size = session->buffer_size +
+		session->jitter.n_slots * sizeof(struct rtp_jitter_slot) +
+		MAX_RECV_PACKETS * RTP_JITTER_MAX_PACKET;
+
+	for (i = 0; i < MAX_RECV_PACKETS; i++) {
+		session->iov[i].iov_len = RTP_JITTER_MAX_PACKET;
+		session->msgs[i].msg_hdr.msg_iov = &session->iov[i];
+		session->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
 	pw_properties_setf(props, PW_KEY_NODE_RATE, "1/%d", info->info.rate);
 	pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%d/%d",
 			session->target_buffer / (2 * info->stride), info->info.rate);
@@ -708,6 +880,13 @@ static int session_new(struct impl *impl, struct sdp_info *info)
 		goto error;
 	}
 
+	session->alloc_event = pw_loop_add_event(impl->loop, on_alloc_event, session);
+	if (session->alloc_event == NULL) {
+		res = -errno;
+		pw_log_error("can't create event source: %m");
+		goto error;
+	}
+
 	session->source = pw_loop_add_io(impl->data_loop, fd,
 				SPA_IO_IN, true, on_rtp_io, session);
 	if (session->source == NULL) {
@@ -719,7 +898,6 @@ static int session_new(struct impl *impl, struct sdp_info *info)
 	pw_log_info("starting RTP listener");
 	session_touch(session);
 
-	session->impl = impl;
 	spa_list_append(&impl->sessions, &session->link);
 	impl->n_sessions++;
 
@@ -1030,6 +1208,20 @@ static void on_timer_event(void *data, uint64_t expirations)
 			pw_log_debug("More than %lu elapsed from last advertisement at %lu", interval, sess->timestamp);
 			pw_log_info("No advertisement packets found for timeout, closing RTP source");
 			session_free(sess);
+		} else {
+			struct rtp_jitter_stats *st = &sess->jitter.stats;
+
+			if (sess->buffer != NULL && st->received == sess->idle_received) {
+				pw_log_info("session %s: no packets received, release buffer",
+						sess->info.session);
+				session_set_buffer(sess, NULL);
+			}
+			sess->idle_received = st->received;
+
+			if (st->lost != sess->last_stats.lost ||
+			    st->late != sess->last_stats.late ||
+			    st->reordered != sess->last_stats.reordered)
+				session_log_stats(sess);
 		}
 	}
 }
@@ -1146,6 +1338,8 @@ int pipewire__module_init(struct pw_impl_module *module, const char *args)
 			"sap.port", DEFAULT_SAP_PORT);
 	impl->sess_latency_msec = pw_properties_get_uint32(impl->props,
 			"sess.latency.msec", DEFAULT_SESS_LATENCY);
+	impl->jitter_depth = pw_properties_get_uint32(impl->props,
+			"sess.jitter.depth", DEFAULT_JITTER_DEPTH);
 	impl->cleanup_interval = pw_properties_get_uint32(impl->props,
 			"sap.interval.sec", DEFAULT_CLEANUP_INTERVAL_SEC);
 
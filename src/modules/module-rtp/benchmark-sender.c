@@ -0,0 +1,257 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/*
+ * Cost of sending RTP streams with the different sender modes.
+ *
+ * A number of streams is sent over the loopback interface, each to its
+ * own receiving socket, one quantum at a time like rtp-sink does. The
+ * syscalls and the thread CPU time spent in sending are reported per
+ * stream and per second of audio.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <spa/utils/result.h>
+
+#include <module-rtp/sender.h>
+
+#define BUFFER_SIZE	(1u<<20)
+#define BUFFER_MASK	(BUFFER_SIZE-1)
+
+#define RATE		48000u
+#define FRAME_SIZE	4u
+
+struct stream {
+	int fd;
+	int recv_fd;
+	struct rtp_sender sender;
+	uint32_t index;
+	uint32_t avail;
+	uint16_t seq;
+	uint32_t timestamp;
+};
+
+static uint8_t buffer[BUFFER_SIZE];
+
+static uint64_t get_cpu_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec * SPA_NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int stream_open(struct stream *s, enum rtp_sender_mode mode, uint32_t pbytes)
+{
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	int val = 4 * 1024 * 1024;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = s->recv_fd = -1;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if ((s->recv_fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0 ||
+	    bind(s->recv_fd, (struct sockaddr*)&sa, sizeof(sa)) < 0 ||
+	    getsockname(s->recv_fd, (struct sockaddr*)&sa, &len) < 0)
+		return -errno;
+	setsockopt(s->recv_fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+	if ((s->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0)) < 0 ||
+	    connect(s->fd, (struct sockaddr*)&sa, sizeof(sa)) < 0)
+		return -errno;
+
+	return rtp_sender_init(&s->sender, s->fd, mode, 127, rand(), FRAME_SIZE, pbytes);
+}
+
+static void stream_close(struct stream *s)
+{
+	rtp_sender_clear(&s->sender);
+	if (s->fd >= 0)
+		close(s->fd);
+	if (s->recv_fd >= 0)
+		close(s->recv_fd);
+}
+
+static int stream_process(struct stream *s, uint32_t quantum)
+{
+	uint32_t pbytes = s->sender.pbytes, n_packets;
+	int res;
+
+	s->avail += quantum * FRAME_SIZE;
+	if (s->avail < pbytes)
+		return 0;
+
+	n_packets = s->avail / pbytes;
+	res = rtp_sender_send(&s->sender, buffer, BUFFER_SIZE,
+			s->index, n_packets, s->seq, s->timestamp);
+
+	s->seq += n_packets;
+	s->timestamp += n_packets * (pbytes / FRAME_SIZE);
+	s->index += n_packets * pbytes;
+	s->avail -= n_packets * pbytes;
+
+	return res;
+}
+
+static int stream_drain(struct stream *s, uint16_t *seq, uint32_t *count)
+{
+	uint8_t data[2048];
+	struct rtp_header *h = (struct rtp_header*)data;
+	ssize_t n;
+
+	while ((n = recv(s->recv_fd, data, sizeof(data), 0)) > 0) {
+		if ((size_t)n != sizeof(*h) + s->sender.pbytes ||
+		    ntohs(h->sequence_number) != *seq)
+			return -EBADMSG;
+		(*seq)++;
+		(*count)++;
+	}
+	return 0;
+}
+
+/* Send one second of audio on a single stream and check that all
+ * packets arrive intact and in order. */
+static int check(enum rtp_sender_mode mode, uint32_t quantum, uint32_t pbytes)
+{
+	struct stream s;
+	uint32_t i, count = 0, expected;
+	uint16_t seq = 0;
+	int res;
+
+	if ((res = stream_open(&s, mode, pbytes)) < 0)
+		goto done;
+
+	for (i = 0; i < RATE / quantum; i++) {
+		if ((res = stream_process(&s, quantum)) < 0)
+			goto done;
+		if ((res = stream_drain(&s, &seq, &count)) < 0)
+			goto done;
+	}
+	expected = (RATE / quantum) * quantum * FRAME_SIZE / pbytes;
+	if (count != expected) {
+		fprintf(stderr, "%s: received %u of %u packets\n",
+				rtp_sender_mode_name(mode), count, expected);
+		res = -EIO;
+	}
+done:
+	stream_close(&s);
+	return res;
+}
+
+static int run(enum rtp_sender_mode mode, uint32_t n_streams, uint32_t quantum,
+		uint32_t pbytes, uint32_t seconds)
+{
+	struct stream *streams;
+	uint32_t i, j, n_quantums = seconds * RATE / quantum;
+	uint64_t start, cpu = 0, syscalls = 0, packets = 0, errors = 0;
+	int res = 0;
+
+	if ((streams = calloc(n_streams, sizeof(*streams))) == NULL)
+		return -errno;
+	for (i = 0; i < n_streams; i++)
+		streams[i].fd = streams[i].recv_fd = -1;
+
+	for (i = 0; i < n_streams; i++) {
+		if ((res = stream_open(&streams[i], mode, pbytes)) < 0)
+			goto done;
+	}
+	if (streams[0].sender.mode != mode) {
+		res = -ENOTSUP;
+		goto done;
+	}
+
+	for (j = 0; j < n_quantums; j++) {
+		start = get_cpu_nsec();
+		for (i = 0; i < n_streams; i++) {
+			if (stream_process(&streams[i], quantum) < 0)
+				errors++;
+		}
+		cpu += get_cpu_nsec() - start;
+
+		/* drop what was received, outside of the measurement */
+		for (i = 0; i < n_streams; i++) {
+			uint8_t data[2048];
+			while (recv(streams[i].recv_fd, data, sizeof(data), 0) > 0);
+		}
+	}
+	for (i = 0; i < n_streams; i++) {
+		syscalls += streams[i].sender.syscalls;
+		packets += streams[i].sender.packets;
+	}
+
+	fprintf(stdout, "%-9s streams:%3u quantum:%5u packet:%5u %8.1f syscalls/s %8.1f packets/s "
+			"%8.2f us cpu/s per stream errors:%"PRIu64"\n",
+			rtp_sender_mode_name(mode), n_streams, quantum, pbytes,
+			(double)syscalls / seconds / n_streams,
+			(double)packets / seconds / n_streams,
+			(double)cpu / 1000.0 / seconds / n_streams, errors);
+done:
+	for (i = 0; i < n_streams; i++)
+		stream_close(&streams[i]);
+	free(streams);
+	return res;
+}
+
+int main(int argc, char *argv[])
+{
+	static const uint32_t n_streams[] = { 1, 8, 32 };
+	enum rtp_sender_mode mode;
+	uint32_t i, quantum = 1024, pbytes = 48 * FRAME_SIZE, seconds = 10;
+	int res;
+
+	if (argc > 1)
+		quantum = atoi(argv[1]);
+	if (argc > 2)
+		pbytes = SPA_ROUND_DOWN(atoi(argv[2]), FRAME_SIZE);
+	if (quantum == 0 || pbytes == 0 || pbytes > 1400) {
+		fprintf(stderr, "usage: %s [quantum] [packet-bytes]\n", argv[0]);
+		return -1;
+	}
+
+	for (mode = RTP_SENDER_MODE_MSG; mode <= RTP_SENDER_MODE_GSO; mode++) {
+		if ((res = check(mode, quantum, pbytes)) < 0 && res != -ENOTSUP) {
+			fprintf(stderr, "%s: check failed: %s\n",
+					rtp_sender_mode_name(mode), spa_strerror(res));
+			return -1;
+		}
+		for (i = 0; i < SPA_N_ELEMENTS(n_streams); i++) {
+			if ((res = run(mode, n_streams[i], quantum, pbytes, seconds)) < 0) {
+				fprintf(stdout, "%-9s %s\n", rtp_sender_mode_name(mode),
+						spa_strerror(res));
+				break;
+			}
+		}
+	}
+	return 0;
+}
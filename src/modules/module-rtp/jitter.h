@@ -0,0 +1,266 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PIPEWIRE_RTP_JITTER_H
+#define PIPEWIRE_RTP_JITTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <spa/utils/defs.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Puts received RTP packets back in sequence number order.
+ *
+ * Packets that arrive ahead of the next expected sequence number are
+ * held for up to depth packets. When the gap is filled, the held packets
+ * are delivered in order. When more than depth packets arrived after a
+ * gap, the missing packets are considered lost and delivery continues
+ * after them. Packets that arrive after their sequence number was
+ * delivered or skipped are late and dropped.
+ *
+ * The slots for the held packets are owned by the caller, see
+ * rtp_jitter_n_slots() and rtp_jitter_set_slots(). */
+
+#define RTP_JITTER_MAX_DEPTH	64u
+#define RTP_JITTER_MAX_PACKET	2048u
+
+/* like RFC 3550 MAX_DROPOUT and MAX_MISORDER, larger jumps resync */
+#define RTP_JITTER_MAX_DROPOUT	3000
+#define RTP_JITTER_MAX_MISORDER	100
+
+struct rtp_jitter_stats {
+	uint64_t received;
+	uint64_t lost;
+	uint64_t reordered;
+	uint64_t late;
+	uint64_t duplicate;
+	uint64_t resync;
+};
+
+struct rtp_jitter_slot {
+	uint32_t timestamp;
+	uint32_t len;
+	uint8_t data[RTP_JITTER_MAX_PACKET];
+};
+
+typedef void (*rtp_jitter_deliver_t) (void *data, uint32_t timestamp,
+		const void *payload, uint32_t len);
+
+struct rtp_jitter {
+	uint32_t depth;
+	rtp_jitter_deliver_t deliver;
+	void *data;
+
+	uint16_t next_seq;
+	unsigned have_seq:1;
+	uint32_t n_held;
+	uint64_t held;
+
+	struct rtp_jitter_stats stats;
+
+	uint32_t n_slots;
+	struct rtp_jitter_slot *slots;
+};
+
+/* the number of slots needed to hold depth packets, a power of 2 */
+static inline uint32_t rtp_jitter_n_slots(uint32_t depth)
+{
+	uint32_t n = 1;
+
+	depth = SPA_MIN(depth, RTP_JITTER_MAX_DEPTH);
+	if (depth == 0)
+		return 0;
+	while (n < depth)
+		n <<= 1;
+	return n;
+}
+
+/* forget the sequence and the held packets, keep the stats */
+static inline void rtp_jitter_reset(struct rtp_jitter *j)
+{
+	j->next_seq = 0;
+	j->have_seq = false;
+	j->n_held = 0;
+	j->held = 0;
+}
+
+/* the jitter buffer does nothing until it has slots, with a depth of 0
+ * it needs none */
+static inline void rtp_jitter_init(struct rtp_jitter *j, uint32_t depth,
+		rtp_jitter_deliver_t deliver, void *data)
+{
+	j->depth = SPA_MIN(depth, RTP_JITTER_MAX_DEPTH);
+	j->deliver = deliver;
+	j->data = data;
+	j->n_slots = rtp_jitter_n_slots(j->depth);
+	j->slots = NULL;
+	rtp_jitter_reset(j);
+	memset(&j->stats, 0, sizeof(j->stats));
+}
+
+/* slots holds rtp_jitter_n_slots(depth) slots or is NULL to release them,
+ * held packets are dropped */
+static inline void rtp_jitter_set_slots(struct rtp_jitter *j, struct rtp_jitter_slot *slots)
+{
+	j->slots = slots;
+	rtp_jitter_reset(j);
+}
+
+static inline bool rtp_jitter_is_ready(struct rtp_jitter *j)
+{
+	return j->n_slots == 0 || j->slots != NULL;
+}
+
+static inline uint32_t rtp_jitter_slot_index(struct rtp_jitter *j, uint16_t seq)
+{
+	return seq & (j->n_slots - 1);
+}
+
+/* deliver the held packets that are next in sequence */
+static inline void rtp_jitter_release(struct rtp_jitter *j)
+{
+	while (j->n_held > 0) {
+		uint32_t i = rtp_jitter_slot_index(j, j->next_seq);
+		struct rtp_jitter_slot *s = &j->slots[i];
+
+		if (!(j->held & (1ULL << i)))
+			break;
+
+		j->held &= ~(1ULL << i);
+		j->n_held--;
+		j->next_seq++;
+		j->deliver(j->data, s->timestamp, s->data, s->len);
+	}
+}
+
+/* give up on missing packets until the packet with seq can be held */
+static inline void rtp_jitter_skip(struct rtp_jitter *j, uint16_t seq)
+{
+	while ((uint16_t)(seq - j->next_seq) >= j->depth) {
+		uint32_t i = rtp_jitter_slot_index(j, j->next_seq);
+
+		if (j->held & (1ULL << i)) {
+			rtp_jitter_release(j);
+		} else {
+			j->stats.lost++;
+			j->next_seq++;
+		}
+	}
+	rtp_jitter_release(j);
+}
+
+/* deliver all held packets, counting the gaps as lost */
+static inline void rtp_jitter_flush(struct rtp_jitter *j)
+{
+	while (j->n_held > 0) {
+		uint32_t i = rtp_jitter_slot_index(j, j->next_seq);
+
+		if (j->held & (1ULL << i)) {
+			rtp_jitter_release(j);
+		} else {
+			j->stats.lost++;
+			j->next_seq++;
+		}
+	}
+}
+
+/* len must not be larger than RTP_JITTER_MAX_PACKET */
+static inline void rtp_jitter_push(struct rtp_jitter *j, uint16_t seq,
+		uint32_t timestamp, const void *payload, uint32_t len)
+{
+	struct rtp_jitter_slot *s;
+	uint32_t i;
+	int16_t diff;
+
+	if (!rtp_jitter_is_ready(j))
+		return;
+
+	j->stats.received++;
+
+	if (!j->have_seq) {
+		j->have_seq = true;
+		j->next_seq = seq;
+	}
+	diff = (int16_t)(seq - j->next_seq);
+
+	if (diff < -RTP_JITTER_MAX_MISORDER || diff > RTP_JITTER_MAX_DROPOUT) {
+		/* sender restarted or a long dropout, start over */
+		rtp_jitter_flush(j);
+		j->stats.resync++;
+		j->next_seq = seq;
+		diff = 0;
+	}
+	if (diff < 0) {
+		j->stats.late++;
+		return;
+	}
+	if (diff == 0) {
+		if (j->n_held > 0)
+			j->stats.reordered++;
+		j->next_seq++;
+		j->deliver(j->data, timestamp, payload, len);
+		rtp_jitter_release(j);
+		return;
+	}
+	if (j->depth == 0) {
+		/* nothing can be held, skip the gap */
+		j->stats.lost += diff;
+		j->next_seq = seq + 1;
+		j->deliver(j->data, timestamp, payload, len);
+		return;
+	}
+	if ((uint32_t)diff >= j->depth)
+		rtp_jitter_skip(j, seq);
+
+	if (seq == j->next_seq) {
+		j->next_seq++;
+		j->deliver(j->data, timestamp, payload, len);
+		rtp_jitter_release(j);
+		return;
+	}
+
+	i = rtp_jitter_slot_index(j, seq);
+	if (j->held & (1ULL << i)) {
+		j->stats.duplicate++;
+		return;
+	}
+	s = &j->slots[i];
+	s->timestamp = timestamp;
+	s->len = len;
+	memcpy(s->data, payload, len);
+	j->held |= 1ULL << i;
+	j->n_held++;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIPEWIRE_RTP_JITTER_H */
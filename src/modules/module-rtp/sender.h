@@ -0,0 +1,261 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#ifndef PIPEWIRE_RTP_SENDER_H
+#define PIPEWIRE_RTP_SENDER_H
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <spa/utils/defs.h>
+
+#include <module-rtp/rtp.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Sends batches of RTP packets taken from a ringbuffer on a connected
+ * UDP socket. All packets of a batch are built at once and then handed
+ * to the kernel with one sendmmsg() or, when UDP_SEGMENT is supported,
+ * as one GSO send() that the kernel splits into datagrams. */
+
+#define RTP_SENDER_MAX_PACKETS	64u
+#define RTP_SENDER_MAX_GSO	(63u*1024u)
+
+enum rtp_sender_mode {
+	RTP_SENDER_MODE_MSG,		/**< one sendmsg() per packet */
+	RTP_SENDER_MODE_MMSG,		/**< one sendmmsg() per batch */
+	RTP_SENDER_MODE_GSO,		/**< one send() per batch, segmented by the kernel */
+};
+
+struct rtp_sender {
+	int fd;
+	enum rtp_sender_mode mode;
+	uint8_t payload;
+	uint32_t ssrc;
+	uint32_t frame_size;
+	uint32_t pbytes;
+
+	uint32_t gso_packets;
+	uint8_t *gso_buffer;
+
+	uint64_t syscalls;
+	uint64_t packets;
+
+	struct rtp_header headers[RTP_SENDER_MAX_PACKETS];
+	struct iovec iov[RTP_SENDER_MAX_PACKETS][3];
+	struct mmsghdr msgs[RTP_SENDER_MAX_PACKETS];
+};
+
+static inline const char *rtp_sender_mode_name(enum rtp_sender_mode mode)
+{
+	switch (mode) {
+	case RTP_SENDER_MODE_MSG:
+		return "sendmsg";
+	case RTP_SENDER_MODE_MMSG:
+		return "sendmmsg";
+	case RTP_SENDER_MODE_GSO:
+		return "gso";
+	}
+	return "unknown";
+}
+
+/* Falls back to RTP_SENDER_MODE_MMSG when GSO is requested but not
+ * available on the socket, check the mode after init. */
+static inline int rtp_sender_init(struct rtp_sender *s, int fd, enum rtp_sender_mode mode,
+		uint8_t payload, uint32_t ssrc, uint32_t frame_size, uint32_t pbytes)
+{
+	uint32_t i;
+
+	memset(s, 0, sizeof(*s));
+	s->fd = fd;
+	s->mode = mode;
+	s->payload = payload;
+	s->ssrc = ssrc;
+	s->frame_size = frame_size;
+	s->pbytes = pbytes;
+
+	for (i = 0; i < RTP_SENDER_MAX_PACKETS; i++) {
+		s->iov[i][0].iov_base = &s->headers[i];
+		s->iov[i][0].iov_len = sizeof(struct rtp_header);
+		s->msgs[i].msg_hdr.msg_iov = s->iov[i];
+		s->msgs[i].msg_hdr.msg_iovlen = 3;
+	}
+
+	if (s->mode == RTP_SENDER_MODE_GSO) {
+		int val = sizeof(struct rtp_header) + pbytes;
+
+		s->gso_packets = SPA_MIN(RTP_SENDER_MAX_PACKETS, RTP_SENDER_MAX_GSO / (uint32_t)val);
+		s->mode = RTP_SENDER_MODE_MMSG;
+#ifdef UDP_SEGMENT
+		if (s->gso_packets > 1 &&
+		    setsockopt(fd, IPPROTO_UDP, UDP_SEGMENT, &val, sizeof(val)) == 0) {
+			if ((s->gso_buffer = malloc(s->gso_packets * val)) == NULL)
+				return -errno;
+			s->mode = RTP_SENDER_MODE_GSO;
+		}
+#endif
+	}
+	return 0;
+}
+
+static inline void rtp_sender_clear(struct rtp_sender *s)
+{
+	free(s->gso_buffer);
+	s->gso_buffer = NULL;
+}
+
+static inline void rtp_sender_fill_header(struct rtp_sender *s, struct rtp_header *header,
+		uint16_t seq, uint32_t timestamp)
+{
+	memset(header, 0, sizeof(*header));
+	header->v = 2;
+	header->pt = s->payload;
+	header->ssrc = htonl(s->ssrc);
+	header->sequence_number = htons(seq);
+	header->timestamp = htonl(timestamp);
+}
+
+static inline void rtp_sender_set_iovec(struct iovec *iov, const void *buffer, uint32_t size,
+		uint32_t index, uint32_t len)
+{
+	uint32_t offset = index & (size - 1);
+	iov[0].iov_len = SPA_MIN(len, size - offset);
+	iov[0].iov_base = SPA_PTROFF(buffer, offset, void);
+	iov[1].iov_len = len - iov[0].iov_len;
+	iov[1].iov_base = (void*)buffer;
+}
+
+static inline int rtp_sender_send_msg(struct rtp_sender *s, const void *buffer, uint32_t size,
+		uint32_t index, uint16_t seq, uint32_t timestamp)
+{
+	struct msghdr *msg = &s->msgs[0].msg_hdr;
+
+	rtp_sender_fill_header(s, &s->headers[0], seq, timestamp);
+	rtp_sender_set_iovec(&s->iov[0][1], buffer, size, index, s->pbytes);
+
+	s->syscalls++;
+	if (sendmsg(s->fd, msg, MSG_NOSIGNAL) < 0)
+		return -errno;
+	return 1;
+}
+
+static inline int rtp_sender_send_mmsg(struct rtp_sender *s, const void *buffer, uint32_t size,
+		uint32_t index, uint32_t n_packets, uint16_t seq, uint32_t timestamp)
+{
+	uint32_t i, frames = s->pbytes / s->frame_size;
+	int res;
+
+	for (i = 0; i < n_packets; i++) {
+		rtp_sender_fill_header(s, &s->headers[i], seq + i, timestamp + i * frames);
+		rtp_sender_set_iovec(&s->iov[i][1], buffer, size,
+				index + i * s->pbytes, s->pbytes);
+	}
+	s->syscalls++;
+	if ((res = sendmmsg(s->fd, s->msgs, n_packets, MSG_NOSIGNAL)) < 0)
+		return -errno;
+	return res;
+}
+
+static inline int rtp_sender_send_gso(struct rtp_sender *s, const void *buffer, uint32_t size,
+		uint32_t index, uint32_t n_packets, uint16_t seq, uint32_t timestamp)
+{
+	uint32_t i, offset, l0, frames = s->pbytes / s->frame_size;
+	uint8_t *p = s->gso_buffer;
+
+	for (i = 0; i < n_packets; i++) {
+		rtp_sender_fill_header(s, (struct rtp_header*)p, seq + i, timestamp + i * frames);
+		p += sizeof(struct rtp_header);
+
+		offset = (index + i * s->pbytes) & (size - 1);
+		l0 = SPA_MIN(s->pbytes, size - offset);
+		memcpy(p, SPA_PTROFF(buffer, offset, void), l0);
+		memcpy(p + l0, buffer, s->pbytes - l0);
+		p += s->pbytes;
+	}
+	s->syscalls++;
+	if (send(s->fd, s->gso_buffer, p - s->gso_buffer, MSG_NOSIGNAL) < 0)
+		return -errno;
+	return n_packets;
+}
+
+/* Send n_packets of pbytes each, starting at index in the ringbuffer of
+ * size bytes, which must be a power of two. Returns the number of packets
+ * that were sent or a negative errno when none could be sent. Packets that
+ * failed are not retried, like with a lossy network. */
+static inline int rtp_sender_send(struct rtp_sender *s, const void *buffer, uint32_t size,
+		uint32_t index, uint32_t n_packets, uint16_t seq, uint32_t timestamp)
+{
+	uint32_t n, done = 0, frames = s->pbytes / s->frame_size;
+	int res, sent = 0, err = 0;
+
+	while (done < n_packets) {
+		n = n_packets - done;
+
+		switch (s->mode) {
+		case RTP_SENDER_MODE_GSO:
+			n = SPA_MIN(n, s->gso_packets);
+			res = rtp_sender_send_gso(s, buffer, size, index, n, seq, timestamp);
+			if (res == -EIO) {
+				/* the route does not support segmentation offload */
+				s->mode = RTP_SENDER_MODE_MMSG;
+				continue;
+			}
+			break;
+		case RTP_SENDER_MODE_MMSG:
+			n = SPA_MIN(n, RTP_SENDER_MAX_PACKETS);
+			res = rtp_sender_send_mmsg(s, buffer, size, index, n, seq, timestamp);
+			break;
+		default:
+			n = 1;
+			res = rtp_sender_send_msg(s, buffer, size, index, seq, timestamp);
+			break;
+		}
+		if (res < 0)
+			err = res;
+		else
+			sent += res;
+
+		index += n * s->pbytes;
+		seq += n;
+		timestamp += n * frames;
+		done += n;
+	}
+	s->packets += sent;
+	return sent > 0 ? sent : err;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PIPEWIRE_RTP_SENDER_H */
@@ -0,0 +1,365 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <spa/utils/defs.h>
+
+#include <module-rtp/rtp.h>
+#include <module-rtp/jitter.h>
+
+#define N_PACKETS	1000
+#define PACKET_SIZE	192
+#define FRAMES		48
+
+struct result {
+	uint32_t n_delivered;
+	uint32_t last_timestamp;
+	bool first;
+	bool in_order;
+};
+
+static void deliver(void *data, uint32_t timestamp, const void *payload, uint32_t len)
+{
+	struct result *r = data;
+	const uint32_t *p = payload;
+
+	spa_assert(len == PACKET_SIZE);
+	/* the payload carries the timestamp to catch mixed up slots */
+	spa_assert(p[0] == timestamp);
+
+	if (!r->first && (int32_t)(timestamp - r->last_timestamp) <= 0)
+		r->in_order = false;
+	r->first = false;
+	r->last_timestamp = timestamp;
+	r->n_delivered++;
+}
+
+/* n is the sequence number before wrapping around */
+static void push(struct rtp_jitter *j, uint32_t n)
+{
+	uint32_t payload[PACKET_SIZE / 4] = { n * FRAMES, };
+	rtp_jitter_push(j, n, payload[0], payload, PACKET_SIZE);
+}
+
+static void init(struct rtp_jitter *j, uint32_t depth, struct result *r)
+{
+	static struct rtp_jitter_slot slots[RTP_JITTER_MAX_DEPTH];
+
+	spa_zero(*r);
+	r->first = r->in_order = true;
+	rtp_jitter_init(j, depth, deliver, r);
+	spa_assert(j->n_slots >= j->depth && j->n_slots <= RTP_JITTER_MAX_DEPTH);
+	rtp_jitter_set_slots(j, slots);
+}
+
+static void test_in_order(struct rtp_jitter *j)
+{
+	struct result r;
+	uint32_t i;
+
+	init(j, 8, &r);
+	for (i = 0; i < 100; i++)
+		push(j, i);
+
+	spa_assert(r.n_delivered == 100);
+	spa_assert(r.in_order);
+	spa_assert(j->stats.received == 100);
+	spa_assert(j->stats.lost == 0);
+	spa_assert(j->stats.reordered == 0);
+	spa_assert(j->stats.late == 0);
+}
+
+static void test_reorder(struct rtp_jitter *j)
+{
+	struct result r;
+	uint32_t i;
+
+	/* 0 2 1 4 3 6 5 ... */
+	init(j, 8, &r);
+	push(j, 0);
+	for (i = 1; i + 1 < 100; i += 2) {
+		push(j, i + 1);
+		push(j, i);
+	}
+	spa_assert(r.n_delivered == 99);
+	spa_assert(r.in_order);
+	spa_assert(j->stats.reordered == 49);
+	spa_assert(j->stats.lost == 0);
+
+	/* a packet that is 3 places late */
+	init(j, 8, &r);
+	push(j, 0);
+	push(j, 2);
+	push(j, 3);
+	push(j, 4);
+	push(j, 1);
+	spa_assert(r.n_delivered == 5);
+	spa_assert(r.in_order);
+	spa_assert(j->stats.reordered == 1);
+}
+
+static void test_loss(struct rtp_jitter *j)
+{
+	struct result r;
+	uint32_t i;
+
+	init(j, 4, &r);
+	for (i = 0; i < 20; i++) {
+		if (i != 5)
+			push(j, i);
+		if (i == 8)
+			spa_assert(r.n_delivered == 5);
+	}
+	spa_assert(r.in_order);
+	spa_assert(r.n_delivered == 19);
+	spa_assert(j->stats.lost == 1);
+
+	/* the lost packet arrives after it was skipped */
+	push(j, 5);
+	spa_assert(r.n_delivered == 19);
+	spa_assert(j->stats.late == 1);
+
+	/* without reordering, gaps are skipped right away */
+	init(j, 0, &r);
+	push(j, 0);
+	push(j, 2);
+	push(j, 1);
+	push(j, 3);
+	spa_assert(r.n_delivered == 3);
+	spa_assert(r.in_order);
+	spa_assert(j->stats.lost == 1);
+	spa_assert(j->stats.late == 1);
+}
+
+static void test_slots(struct rtp_jitter *j)
+{
+	struct rtp_jitter_slot slots[8];
+	struct result r;
+	uint32_t i;
+
+	spa_assert(rtp_jitter_n_slots(0) == 0);
+	spa_assert(rtp_jitter_n_slots(5) == 8);
+	spa_assert(rtp_jitter_n_slots(8) == 8);
+	spa_assert(rtp_jitter_n_slots(1000) == RTP_JITTER_MAX_DEPTH);
+
+	/* without slots, packets are ignored */
+	spa_zero(r);
+	r.first = r.in_order = true;
+	rtp_jitter_init(j, 5, deliver, &r);
+	push(j, 0);
+	spa_assert(r.n_delivered == 0);
+	spa_assert(j->stats.received == 0);
+
+	/* a depth that is not a power of 2 */
+	rtp_jitter_set_slots(j, slots);
+	push(j, 0);
+	for (i = 1; i < 41; i += 4) {
+		push(j, i + 3);
+		push(j, i + 2);
+		push(j, i + 1);
+		push(j, i);
+	}
+	spa_assert(r.n_delivered == 41);
+	spa_assert(r.in_order);
+	spa_assert(j->stats.lost == 0);
+
+	/* releasing the slots drops the held packets and the sequence */
+	push(j, 42);
+	rtp_jitter_set_slots(j, NULL);
+	rtp_jitter_set_slots(j, slots);
+	push(j, 1000);
+	spa_assert(r.n_delivered == 42);
+	spa_assert(j->stats.resync == 0);
+}
+
+static void test_duplicate(struct rtp_jitter *j)
+{
+	struct result r;
+
+	init(j, 8, &r);
+	push(j, 0);
+	push(j, 0);
+	push(j, 2);
+	push(j, 2);
+	push(j, 1);
+	spa_assert(r.n_delivered == 3);
+	spa_assert(r.in_order);
+	spa_assert(j->stats.late == 1);
+	spa_assert(j->stats.duplicate == 1);
+}
+
+static void test_wrap(struct rtp_jitter *j)
+{
+	struct result r;
+	uint32_t i, seq = 65530;
+
+	init(j, 8, &r);
+	for (i = 0; i < 12; i += 2) {
+		push(j, seq + i + 1);
+		push(j, seq + i);
+	}
+	/* the first packet starts the sequence, the one before it is late */
+	spa_assert(r.n_delivered == 11);
+	spa_assert(r.in_order);
+	spa_assert(j->stats.lost == 0);
+	spa_assert(j->stats.late == 1);
+	spa_assert(j->stats.reordered == 5);
+
+	/* a jump in sequence numbers resyncs */
+	init(j, 8, &r);
+	push(j, 10);
+	push(j, 11);
+	push(j, 30000);
+	push(j, 30001);
+	spa_assert(r.n_delivered == 4);
+	spa_assert(j->stats.resync == 1);
+	spa_assert(j->stats.lost == 0);
+}
+
+/* Replay packets over the loopback interface with reordering, loss and
+ * duplicates and receive them in batches like rtp-source does. */
+static void test_loopback(struct rtp_jitter *j)
+{
+	struct sockaddr_in sa;
+	socklen_t salen = sizeof(sa);
+	struct mmsghdr msgs[16];
+	struct iovec iov[16];
+	static uint8_t packets[16][RTP_JITTER_MAX_PACKET];
+	uint16_t order[N_PACKETS];
+	uint32_t i, n_sent = 0, n_dropped = 0;
+	struct result r;
+	int rfd, sfd, n, val = 1024 * 1024;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	rfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	spa_assert(rfd >= 0);
+	setsockopt(rfd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+	spa_assert(bind(rfd, (struct sockaddr*)&sa, sizeof(sa)) == 0);
+	spa_assert(getsockname(rfd, (struct sockaddr*)&sa, &salen) == 0);
+
+	sfd = socket(AF_INET, SOCK_DGRAM, 0);
+	spa_assert(sfd >= 0);
+	spa_assert(connect(sfd, (struct sockaddr*)&sa, sizeof(sa)) == 0);
+
+	/* shuffle within windows of 4 packets */
+	srand(4);
+	for (i = 0; i < N_PACKETS; i++)
+		order[i] = i;
+	for (i = 0; i + 4 <= N_PACKETS; i += 4) {
+		uint32_t k, a = i + rand() % 4, b = i + rand() % 4;
+		k = order[a]; order[a] = order[b]; order[b] = k;
+	}
+
+	for (i = 0; i < 16; i++) {
+		iov[i].iov_base = packets[i];
+		iov[i].iov_len = sizeof(packets[i]);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	init(j, 8, &r);
+
+	for (i = 0; i < N_PACKETS; i++) {
+		uint8_t data[sizeof(struct rtp_header) + PACKET_SIZE];
+		struct rtp_header *h = (struct rtp_header*)data;
+		uint32_t ts = order[i] * FRAMES;
+
+		if (order[i] % 50 == 7) {
+			n_dropped++;
+			continue;
+		}
+		memset(data, 0, sizeof(data));
+		h->v = 2;
+		h->pt = 127;
+		h->sequence_number = htons(order[i]);
+		h->timestamp = htonl(ts);
+		memcpy(&data[sizeof(*h)], &ts, sizeof(ts));
+
+		spa_assert(send(sfd, data, sizeof(data), 0) == sizeof(data));
+		n_sent++;
+		if (order[i] % 37 == 3) {
+			spa_assert(send(sfd, data, sizeof(data), 0) == sizeof(data));
+			n_sent++;
+		}
+
+		while ((n = recvmmsg(rfd, msgs, 16, 0, NULL)) > 0) {
+			int k;
+			for (k = 0; k < n; k++) {
+				h = (struct rtp_header*)packets[k];
+				spa_assert(msgs[k].msg_len == sizeof(data));
+				rtp_jitter_push(j, ntohs(h->sequence_number),
+						ntohl(h->timestamp), &packets[k][sizeof(*h)],
+						msgs[k].msg_len - sizeof(*h));
+			}
+		}
+	}
+	rtp_jitter_flush(j);
+
+	fprintf(stdout, "sent:%u received:%"PRIu64" delivered:%u lost:%"PRIu64
+			" reordered:%"PRIu64" late:%"PRIu64" duplicate:%"PRIu64"\n",
+			n_sent, j->stats.received, r.n_delivered, j->stats.lost,
+			j->stats.reordered, j->stats.late, j->stats.duplicate);
+
+	spa_assert(r.in_order);
+	spa_assert(j->stats.received == n_sent);
+	spa_assert(r.n_delivered == N_PACKETS - n_dropped);
+	spa_assert(j->stats.lost == n_dropped);
+	spa_assert(j->stats.reordered > 0);
+	spa_assert(j->stats.late + j->stats.duplicate == n_sent - r.n_delivered);
+
+	close(sfd);
+	close(rfd);
+}
+
+int main(int argc, char *argv[])
+{
+	struct rtp_jitter *j;
+
+	j = calloc(1, sizeof(*j));
+	spa_assert(j != NULL);
+
+	test_in_order(j);
+	test_reorder(j);
+	test_loss(j);
+	test_slots(j);
+	test_duplicate(j);
+	test_wrap(j);
+	test_loopback(j);
+
+	free(j);
+	return 0;
+}
@@ -35,6 +35,7 @@
 #include <sys/wait.h>
 #include <dirent.h>
 #include <regex.h>
+#include <pthread.h>
 #ifdef HAVE_PWD_H
 #include <pwd.h>
 #endif
@@ -397,10 +398,146 @@ error:
 	return res;
 }
 
-static int conf_load(const char *path, struct pw_properties *conf)
+/* Parsed config files, keyed on the path and the file identity so that a
+ * process that creates many contexts (or reloads the same fragments) only
+ * tokenizes each file once. A file that changed on disk replaces its entry
+ * and the least recently used entry is dropped when the cache is full. */
+#define CONF_CACHE_MAX	32
+
+struct conf_cache {
+	struct spa_list link;
+	char *path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct pw_properties *props;
+	struct pw_properties *removed;	/* keys set to null */
+};
+
+static pthread_mutex_t conf_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct spa_list conf_cache_list = SPA_LIST_INIT(&conf_cache_list);
+static uint32_t conf_cache_n_entries;
+
+static void conf_cache_free(struct conf_cache *c)
+{
+	spa_list_remove(&c->link);
+	conf_cache_n_entries--;
+	pw_properties_free(c->props);
+	pw_properties_free(c->removed);
+	free(c->path);
+	free(c);
+}
+
+static struct conf_cache *conf_cache_find(const char *path, const struct stat *sbuf)
+{
+	struct conf_cache *c;
+	spa_list_for_each(c, &conf_cache_list, link) {
+		if (!spa_streq(c->path, path))
+			continue;
+		if (c->dev == sbuf->st_dev && c->ino == sbuf->st_ino &&
+		    c->size == sbuf->st_size &&
+		    c->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+		    c->mtime.tv_nsec == sbuf->st_mtim.tv_nsec) {
+			spa_list_remove(&c->link);
+			spa_list_append(&conf_cache_list, &c->link);
+			return c;
+		}
+		conf_cache_free(c);
+		break;
+	}
+	return NULL;
+}
+
+static void conf_cache_add(const char *path, const struct stat *sbuf,
+		struct pw_properties *props, struct pw_properties *removed)
+{
+	struct conf_cache *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL ||
+	    (c->path = strdup(path)) == NULL) {
+		free(c);
+		pw_properties_free(props);
+		pw_properties_free(removed);
+		return;
+	}
+	if (conf_cache_n_entries >= CONF_CACHE_MAX)
+		conf_cache_free(spa_list_first(&conf_cache_list, struct conf_cache, link));
+
+	c->dev = sbuf->st_dev;
+	c->ino = sbuf->st_ino;
+	c->size = sbuf->st_size;
+	c->mtime = sbuf->st_mtim;
+	c->props = props;
+	c->removed = removed;
+	spa_list_append(&conf_cache_list, &c->link);
+	conf_cache_n_entries++;
+}
+
+/* Like pw_properties_update_string() but keys with a null value are
+ * collected in removed so that they can be removed again from the
+ * config the cached entry is applied to. */
+static void conf_parse(const char *str, size_t size,
+		struct pw_properties *props, struct pw_properties *removed)
+{
+	struct spa_json it[2];
+	char key[1024], *val;
+
+	spa_json_init(&it[0], str, size);
+	if (spa_json_enter_object(&it[0], &it[1]) <= 0)
+		spa_json_init(&it[1], str, size);
+
+	while (spa_json_get_string(&it[1], key, sizeof(key)) > 0) {
+		int len;
+		const char *value;
+
+		if ((len = spa_json_next(&it[1], &value)) <= 0)
+			break;
+
+		if (spa_json_is_null(value, len)) {
+			pw_properties_set(props, key, NULL);
+			pw_properties_set(removed, key, "");
+			continue;
+		}
+		if (spa_json_is_container(value, len))
+			len = spa_json_container_len(&it[1], value, len);
+
+		if ((val = malloc(len+1)) != NULL)
+			spa_json_parse_stringn(value, len, val, len+1);
+		pw_properties_set(props, key, val);
+		pw_properties_set(removed, key, NULL);
+		free(val);
+	}
+}
+
+static int conf_cache_apply(struct pw_properties *conf,
+		struct pw_properties *props, struct pw_properties *removed)
+{
+	const struct spa_dict_item *it;
+	int count;
+
+	count = pw_properties_update(conf, &props->dict);
+	spa_dict_for_each(it, &removed->dict)
+		count += pw_properties_set(conf, it->key, NULL);
+	return count;
+}
+
+void pw_conf_cache_clear(void)
+{
+	struct conf_cache *c;
+
+	pthread_mutex_lock(&conf_cache_lock);
+	spa_list_consume(c, &conf_cache_list, link)
+		conf_cache_free(c);
+	pthread_mutex_unlock(&conf_cache_lock);
+}
+
+static int conf_load(const char *path, struct pw_properties *conf, bool use_cache)
 {
 	char *data;
 	struct stat sbuf;
+	struct conf_cache *c;
+	struct pw_properties *parsed, *removed;
 	int fd, count;
 
 	if ((fd = open(path,  O_CLOEXEC | O_RDONLY)) < 0)
@@ -409,11 +546,42 @@ static int conf_load(const char *path, struct pw_properties *conf)
 	if (fstat(fd, &sbuf) < 0)
 		goto error_close;
 
+	if (use_cache) {
+		pthread_mutex_lock(&conf_cache_lock);
+		if ((c = conf_cache_find(path, &sbuf)) != NULL) {
+			count = conf_cache_apply(conf, c->props, c->removed);
+			pthread_mutex_unlock(&conf_cache_lock);
+			close(fd);
+			pw_log_info("%p: loaded cached config '%s' with %d items",
+					conf, path, count);
+			return 0;
+		}
+		pthread_mutex_unlock(&conf_cache_lock);
+	}
+
 	if (sbuf.st_size > 0) {
 		if ((data = mmap(NULL, sbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
 			goto error_close;
 
-		count = pw_properties_update_string(conf, data, sbuf.st_size);
+		parsed = removed = NULL;
+		if (use_cache &&
+		    (parsed = pw_properties_new(NULL, NULL)) != NULL &&
+		    (removed = pw_properties_new(NULL, NULL)) != NULL) {
+			conf_parse(data, sbuf.st_size, parsed, removed);
+			count = conf_cache_apply(conf, parsed, removed);
+
+			pthread_mutex_lock(&conf_cache_lock);
+			if (conf_cache_find(path, &sbuf) == NULL) {
+				conf_cache_add(path, &sbuf, parsed, removed);
+			} else {
+				pw_properties_free(parsed);
+				pw_properties_free(removed);
+			}
+			pthread_mutex_unlock(&conf_cache_lock);
+		} else {
+			pw_properties_free(parsed);
+			count = pw_properties_update_string(conf, data, sbuf.st_size);
+		}
 		munmap(data, sbuf.st_size);
 	} else {
 		count = 0;
@@ -491,7 +659,7 @@ int pw_conf_load_conf(const char *prefix, const char *name, struct pw_properties
 	pw_properties_set(conf, "config.name", name);
 	pw_properties_set(conf, "config.path", path);
 
-	if ((res = conf_load(path, conf)) < 0)
+	if ((res = conf_load(path, conf, true)) < 0)
 		return res;
 
 	pw_properties_setf(conf, "config.name.d", "%s.d", name);
@@ -520,7 +688,7 @@ int pw_conf_load_conf(const char *prefix, const char *name, struct pw_properties
 
 			snprintf(fname, sizeof(fname), "%s/%s", path, name);
 			if (check_override(conf, name, level)) {
-				if (conf_load(fname, override) >= 0)
+				if (conf_load(fname, override, true) >= 0)
 					add_override(conf, override, fname, name, level, i);
 				pw_properties_clear(override);
 			} else {
@@ -548,7 +716,7 @@ int pw_conf_load_state(const char *prefix, const char *name, struct pw_propertie
 		pw_log_debug("%p: can't load config '%s': %m", conf, path);
 		return -ENOENT;
 	}
-	return conf_load(path, conf);
+	return conf_load(path, conf, false);
 }
 
 struct data {
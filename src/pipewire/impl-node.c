@@ -1082,6 +1082,17 @@ static inline int resume_node(struct pw_impl_node *this, int status)
 
 	spa_system_clock_gettime(data_system, CLOCK_MONOTONIC, &ts);
 	nsec = SPA_TIMESPEC_TO_NSEC(&ts);
+
+	/* only when we were woken up in this cycle, drivers starting
+	 * a new cycle have no meaningful times here */
+	if (SPA_LIKELY(activation->status == PW_NODE_ACTIVATION_AWAKE &&
+	    activation->awake_time >= activation->signal_time &&
+	    nsec >= activation->awake_time)) {
+		pw_node_activation_hist_add(&activation->wakeup_hist,
+				activation->awake_time - activation->signal_time);
+		pw_node_activation_hist_add(&activation->run_hist,
+				nsec - activation->awake_time);
+	}
 	activation->status = PW_NODE_ACTIVATION_FINISHED;
 	activation->finish_time = nsec;
 
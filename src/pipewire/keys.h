@@ -294,6 +294,8 @@ extern "C" {
 								  *  and might select a less accurate but faster
 								  *  conversion algorithm. */
 #define PW_KEY_STREAM_DONT_REMIX	"stream.dont-remix"	/**< don't remix channels */
+#define PW_KEY_STREAM_METER		"stream.meter"		/**< measure the levels of an audio stream,
+								  *  see pw_stream_get_meter(). Since 0.3.66 */
 #define PW_KEY_STREAM_CAPTURE_SINK	"stream.capture.sink"	/**< Try to capture the sink output instead of
 								  *  source output */
 
@@ -701,6 +701,8 @@ void pw_deinit(void)
 	spa_list_consume(h, &registry->handles, link)
 		unref_handle(h);
 
+	pw_conf_cache_clear();
+
 	free(support->i18n_domain);
 	spa_zero(global_support);
 	pthread_mutex_unlock(&support_lock);
@@ -588,6 +588,38 @@ struct pw_node_target {
 	unsigned int active:1;
 };
 
+/* log scaled histogram of nanosecond durations. Bucket 0 counts values below
+ * 1 << MIN_SHIFT, after that every octave is split into SUB buckets and the
+ * last bucket counts everything that does not fit. */
+#define PW_NODE_ACTIVATION_HIST_MIN_SHIFT	10
+#define PW_NODE_ACTIVATION_HIST_SUB_SHIFT	2
+#define PW_NODE_ACTIVATION_HIST_SUB		(1u << PW_NODE_ACTIVATION_HIST_SUB_SHIFT)
+#define PW_NODE_ACTIVATION_HIST_OCTAVES		20
+#define PW_NODE_ACTIVATION_HIST_BUCKETS		(PW_NODE_ACTIVATION_HIST_OCTAVES * PW_NODE_ACTIVATION_HIST_SUB + 2)
+
+struct pw_node_activation_hist {
+	uint32_t count[PW_NODE_ACTIVATION_HIST_BUCKETS];	/* only written by the node,
+								 * counters wrap around */
+};
+
+static inline uint32_t pw_node_activation_hist_index(uint64_t nsec)
+{
+	uint32_t msb, idx;
+	if (nsec < (1u << PW_NODE_ACTIVATION_HIST_MIN_SHIFT))
+		return 0;
+	msb = 63 - __builtin_clzll(nsec);
+	idx = 1 + (msb - PW_NODE_ACTIVATION_HIST_MIN_SHIFT) * PW_NODE_ACTIVATION_HIST_SUB +
+		((nsec >> (msb - PW_NODE_ACTIVATION_HIST_SUB_SHIFT)) & (PW_NODE_ACTIVATION_HIST_SUB - 1));
+	return SPA_MIN(idx, PW_NODE_ACTIVATION_HIST_BUCKETS - 1u);
+}
+
+static inline void pw_node_activation_hist_add(struct pw_node_activation_hist *h, uint64_t nsec)
+{
+	uint32_t idx = pw_node_activation_hist_index(nsec);
+	/* single writer, a relaxed store is enough to avoid torn reads */
+	__atomic_store_n(&h->count[idx], h->count[idx] + 1, __ATOMIC_RELAXED);
+}
+
 struct pw_node_activation {
 #define PW_NODE_ACTIVATION_NOT_TRIGGERED	0
 #define PW_NODE_ACTIVATION_TRIGGERED		1
@@ -638,6 +670,9 @@ struct pw_node_activation {
 	uint32_t command;				/* next command */
 	uint32_t reposition_owner;			/* owner id with new reposition info, last one
 							 * to update wins */
+
+	struct pw_node_activation_hist wakeup_hist;	/* awake - signal time of each cycle */
+	struct pw_node_activation_hist run_hist;	/* finish - awake time of each cycle */
 };
 
 #define ATOMIC_CAS(v,ov,nv)						\
@@ -1295,6 +1330,8 @@ bool pw_log_is_default(void);
 void pw_log_init(void);
 void pw_log_deinit(void);
 
+void pw_conf_cache_clear(void);
+
 void pw_settings_init(struct pw_context *context);
 int pw_settings_expose(struct pw_context *context);
 void pw_settings_clean(struct pw_context *context);
@@ -35,14 +35,105 @@
 PW_LOG_TOPIC_EXTERN(log_properties);
 #define PW_LOG_TOPIC_DEFAULT log_properties
 
+/* dictionaries with fewer items than this are scanned linearly */
+#define INDEX_MIN_ITEMS	16
+
 /** \cond */
+struct index_slot {
+	uint32_t hash;
+	uint32_t pos;			/* item index + 1, 0 for an empty slot */
+};
+
 struct properties {
 	struct pw_properties this;
 
 	struct pw_array items;
+
+	struct index_slot *index;	/* open addressing hash of the keys */
+	uint32_t index_size;		/* number of slots, power of 2 */
+	bool index_valid;
+	bool index_sorted;		/* index matches the sorted items */
 };
 /** \endcond */
 
+static inline uint32_t key_hash(const char *key)
+{
+	/* FNV-1a */
+	uint32_t h = 2166136261u;
+	while (*key)
+		h = (h ^ (uint8_t)*key++) * 16777619u;
+	return h;
+}
+
+static void index_insert(struct properties *impl, uint32_t hash, uint32_t pos)
+{
+	uint32_t i, mask = impl->index_size - 1;
+
+	for (i = hash & mask; impl->index[i].pos != 0; i = (i + 1) & mask);
+	impl->index[i].hash = hash;
+	impl->index[i].pos = pos + 1;
+}
+
+static uint32_t index_find_slot(struct properties *impl, uint32_t hash, uint32_t pos)
+{
+	uint32_t i, mask = impl->index_size - 1;
+
+	for (i = hash & mask; impl->index[i].pos != pos + 1; i = (i + 1) & mask);
+	return i;
+}
+
+/* remove the slot of item pos and shift the following slots of the
+ * probe sequence back so that lookups don't stop early */
+static void index_remove(struct properties *impl, uint32_t hash, uint32_t pos)
+{
+	uint32_t i, j, k, mask = impl->index_size - 1;
+
+	i = j = index_find_slot(impl, hash, pos);
+	while (true) {
+		j = (j + 1) & mask;
+		if (impl->index[j].pos == 0)
+			break;
+		k = impl->index[j].hash & mask;
+		if ((j > i && (k <= i || k > j)) ||
+		    (j < i && (k <= i && k > j))) {
+			impl->index[i] = impl->index[j];
+			i = j;
+		}
+	}
+	impl->index[i].pos = 0;
+}
+
+static void index_move(struct properties *impl, uint32_t hash, uint32_t from, uint32_t to)
+{
+	impl->index[index_find_slot(impl, hash, from)].pos = to + 1;
+}
+
+/* (re)build the index for all items, keeping the load factor below 1/2 */
+static void index_build(struct properties *impl)
+{
+	uint32_t i, size, n_items = impl->this.dict.n_items;
+	const struct spa_dict_item *items = impl->this.dict.items;
+
+	impl->index_valid = false;
+	impl->index_sorted = SPA_FLAG_IS_SET(impl->this.dict.flags, SPA_DICT_FLAG_SORTED);
+	if (n_items < INDEX_MIN_ITEMS)
+		return;
+
+	for (size = 64; size < n_items * 2; size <<= 1);
+	if (size > impl->index_size) {
+		struct index_slot *index;
+		if ((index = realloc(impl->index, size * sizeof(struct index_slot))) == NULL)
+			return;
+		impl->index = index;
+		impl->index_size = size;
+	}
+	memset(impl->index, 0, impl->index_size * sizeof(struct index_slot));
+	for (i = 0; i < n_items; i++)
+		index_insert(impl, key_hash(items[i].key), i);
+
+	impl->index_valid = true;
+}
+
 static int add_func(struct pw_properties *this, char *key, char *value)
 {
 	struct spa_dict_item *item;
@@ -60,6 +151,11 @@ static int add_func(struct pw_properties *this, char *key, char *value)
 
 	this->dict.items = impl->items.data;
 	this->dict.n_items++;
+
+	if (impl->index_valid && this->dict.n_items * 2 <= impl->index_size)
+		index_insert(impl, key_hash(key), this->dict.n_items - 1);
+	else if (this->dict.n_items >= INDEX_MIN_ITEMS)
+		index_build(impl);
 	return 0;
 }
 
@@ -71,7 +167,23 @@ static void clear_item(struct spa_dict_item *item)
 
 static int find_index(const struct pw_properties *this, const char *key)
 {
+	const struct properties *impl = SPA_CONTAINER_OF(this, const struct properties, this);
 	const struct spa_dict_item *item;
+
+	/* the dict can be sorted in place with spa_dict_qsort(), the index
+	 * is then only used after it was rebuilt, see do_replace() */
+	if (impl->index_valid &&
+	    (!SPA_FLAG_IS_SET(this->dict.flags, SPA_DICT_FLAG_SORTED) ||
+	     impl->index_sorted)) {
+		uint32_t i, pos, hash = key_hash(key), mask = impl->index_size - 1;
+
+		for (i = hash & mask; (pos = impl->index[i].pos) != 0; i = (i + 1) & mask) {
+			if (impl->index[i].hash == hash &&
+			    spa_streq(this->dict.items[pos - 1].key, key))
+				return pos - 1;
+		}
+		return -1;
+	}
 	item = spa_dict_lookup_item(&this->dict, key);
 	if (item == NULL)
 		return -1;
@@ -287,6 +399,7 @@ void pw_properties_clear(struct pw_properties *properties)
 		clear_item(item);
 	pw_array_reset(&impl->items);
 	properties->dict.n_items = 0;
+	impl->index_valid = false;
 }
 
 /** Update properties
@@ -375,6 +488,7 @@ void pw_properties_free(struct pw_properties *properties)
 	impl = SPA_CONTAINER_OF(properties, struct properties, this);
 	pw_properties_clear(properties);
 	pw_array_clear(&impl->items);
+	free(impl->index);
 	free(impl);
 }
 
@@ -386,6 +500,13 @@ static int do_replace(struct pw_properties *properties, const char *key, char *v
 	if (key == NULL || key[0] == 0)
 		goto exit_noupdate;
 
+	/* items were moved around by a sort, rehash before we start to
+	 * modify them. Sorting again gives the same order until an item
+	 * is added or removed, which clears the flag. */
+	if (impl->index_valid && !impl->index_sorted &&
+	    SPA_FLAG_IS_SET(properties->dict.flags, SPA_DICT_FLAG_SORTED))
+		index_build(impl);
+
 	index = find_index(properties, key);
 
 	if (index == -1) {
@@ -393,6 +514,7 @@ static int do_replace(struct pw_properties *properties, const char *key, char *v
 			return 0;
 		add_func(properties, strdup(key), copy ? strdup(value) : value);
 		SPA_FLAG_CLEAR(properties->dict.flags, SPA_DICT_FLAG_SORTED);
+		impl->index_sorted = false;
 	} else {
 		struct spa_dict_item *item =
 		    pw_array_get_unchecked(&impl->items, index, struct spa_dict_item);
@@ -401,15 +523,21 @@ static int do_replace(struct pw_properties *properties, const char *key, char *v
 			goto exit_noupdate;
 
 		if (value == NULL) {
+			uint32_t n_last = pw_array_get_len(&impl->items, struct spa_dict_item) - 1;
 			struct spa_dict_item *last = pw_array_get_unchecked(&impl->items,
-						     pw_array_get_len(&impl->items, struct spa_dict_item) - 1,
-						     struct spa_dict_item);
+						     n_last, struct spa_dict_item);
+			if (impl->index_valid) {
+				index_remove(impl, key_hash(item->key), index);
+				if ((uint32_t)index != n_last)
+					index_move(impl, key_hash(last->key), n_last, index);
+			}
 			clear_item(item);
 			item->key = last->key;
 			item->value = last->value;
 			impl->items.size -= sizeof(struct spa_dict_item);
 			properties->dict.n_items--;
 			SPA_FLAG_CLEAR(properties->dict.flags, SPA_DICT_FLAG_SORTED);
+			impl->index_sorted = false;
 		} else {
 			free((char *) item->value);
 			item->value = copy ? strdup(value) : value;
@@ -61,8 +61,11 @@ struct buffer {
 #define BUFFER_FLAG_MAPPED	(1 << 0)
 #define BUFFER_FLAG_QUEUED	(1 << 1)
 #define BUFFER_FLAG_ADDED	(1 << 2)
+#define BUFFER_FLAG_WAIT	(1 << 3)	/* wait holds a capture wait time */
 	uint32_t flags;
 	struct spa_meta_busy *busy;
+	uint64_t time;		/* when the buffer was handed to the other side */
+	uint64_t wait;		/* capture wait time, added to the stats on recycle */
 };
 
 struct queue {
@@ -158,6 +161,9 @@ struct stream {
 	struct data data;
 	uintptr_t seq;
 	struct pw_time time;
+	uintptr_t stats_seq;
+	struct pw_stream_stats stats;	/* only written from the data thread */
+	struct spa_io_meter *meter;
 	uint64_t base_pos;
 	uint32_t clock_id;
 	struct spa_latency_info latency;
@@ -364,6 +370,45 @@ static inline struct buffer *queue_pop(struct stream *stream, struct queue *queu
 
 	return buffer;
 }
+static inline uint64_t get_time_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+static inline bool take_wait(struct buffer *buffer, uint64_t now, uint64_t *wait)
+{
+	if (buffer->time == 0)
+		return false;
+	*wait = now > buffer->time ? now - buffer->time : 0;
+	buffer->time = 0;
+	return true;
+}
+
+/* call between SEQ_WRITE(impl->stats_seq) */
+static inline void update_wait(struct stream *impl, uint64_t wait)
+{
+	struct pw_stream_stats *s = &impl->stats;
+
+	s->wait_last = wait;
+	s->wait_total += wait;
+	s->wait_max = SPA_MAX(s->wait_max, wait);
+	s->wait_count++;
+}
+
+/* call between SEQ_WRITE(impl->stats_seq) */
+static inline void update_depth(struct stream *impl, struct queue *queue)
+{
+	struct pw_stream_stats *s = &impl->stats;
+	uint32_t index;
+	int32_t depth = spa_ringbuffer_get_read_index(&queue->ring, &index);
+
+	s->depth_total += depth;
+	s->depth_max = SPA_MAX(s->depth_max, (uint32_t)depth);
+	s->cycles++;
+}
+
 static inline void clear_queue(struct stream *stream, struct queue *queue)
 {
 	spa_ringbuffer_init(&queue->ring);
@@ -938,6 +983,7 @@ static int impl_port_use_buffers(void *object,
 
 		b->flags = 0;
 		b->id = i;
+		b->time = 0;
 
 		if (SPA_FLAG_IS_SET(impl_flags, PW_STREAM_FLAG_MAP_BUFFERS)) {
 			for (j = 0; j < buffers[i]->n_datas; j++) {
@@ -1008,8 +1054,18 @@ static int impl_node_process_input(void *object)
 	if (io->status == SPA_STATUS_HAVE_DATA &&
 	    (b = get_buffer(stream, io->buffer_id)) != NULL) {
 		/* push new buffer */
+		bool late = !queue_is_empty(impl, &impl->dequeued);
+
 		pw_log_trace_fp("%p: push %d %p", stream, b->id, io);
+		/* the buffer can be dequeued as soon as it is pushed */
+		b->time = get_time_ns();
 		if (queue_push(impl, &impl->dequeued, b) == 0) {
+			SEQ_WRITE(impl->stats_seq);
+			if (late)
+				impl->stats.late++;
+			impl->stats.buffers++;
+			update_depth(impl, &impl->dequeued);
+			SEQ_WRITE(impl->stats_seq);
 			copy_position(impl, impl->dequeued.incount);
 			if (b->busy)
 				ATOMIC_INC(b->busy->count);
@@ -1020,6 +1076,12 @@ static int impl_node_process_input(void *object)
 		/* pop buffer to recycle */
 		if ((b = queue_pop(impl, &impl->queued))) {
 			pw_log_trace_fp("%p: recycle buffer %d", stream, b->id);
+			if (SPA_FLAG_IS_SET(b->flags, BUFFER_FLAG_WAIT)) {
+				SEQ_WRITE(impl->stats_seq);
+				update_wait(impl, b->wait);
+				SEQ_WRITE(impl->stats_seq);
+				SPA_FLAG_CLEAR(b->flags, BUFFER_FLAG_WAIT);
+			}
 			io->buffer_id = b->id;
 		} else {
 			pw_log_trace_fp("%p: no buffers to recycle", stream);
@@ -1041,6 +1103,7 @@ static int impl_node_process_output(void *object)
 	struct buffer *b;
 	int res;
 	bool ask_more;
+	uint64_t wait;
 
 	if (io == NULL)
 		return -EIO;
@@ -1051,6 +1114,7 @@ again:
 
 	ask_more = false;
 	if ((res = io->status) != SPA_STATUS_HAVE_DATA) {
+		SEQ_WRITE(impl->stats_seq);
 		/* recycle old buffer */
 		if ((b = get_buffer(stream, io->buffer_id)) != NULL) {
 			pw_log_trace_fp("%p: recycle buffer %d", stream, b->id);
@@ -1060,6 +1124,9 @@ again:
 		/* pop new buffer */
 		if ((b = queue_pop(impl, &impl->queued)) != NULL) {
 			impl->drained = false;
+			impl->stats.buffers++;
+			if (take_wait(b, get_time_ns(), &wait))
+				update_wait(impl, wait);
 			io->buffer_id = b->id;
 			res = io->status = SPA_STATUS_HAVE_DATA;
 			pw_log_trace_fp("%p: pop %d %p", stream, b->id, io);
@@ -1083,8 +1150,11 @@ again:
 			io->buffer_id = SPA_ID_INVALID;
 			res = io->status = SPA_STATUS_NEED_DATA;
 			pw_log_trace_fp("%p: no more buffers %p", stream, io);
+			impl->stats.skipped++;
 			ask_more = true;
 		}
+		update_depth(impl, &impl->queued);
+		SEQ_WRITE(impl->stats_seq);
 	} else {
 		ask_more = !impl->process_rt &&
 			queue_is_empty(impl, &impl->queued) &&
@@ -1989,6 +2059,14 @@ pw_stream_connect(struct pw_stream *stream,
 			res = -errno;
 			goto error_node;
 		}
+		if ((str = pw_properties_get(stream->properties, PW_KEY_STREAM_METER)) &&
+		    pw_properties_parse_bool(str)) {
+			if ((impl->meter = calloc(1, sizeof(struct spa_io_meter))) == NULL ||
+			    (res = spa_node_set_io(impl->node->node, SPA_IO_Meter,
+						impl->meter, sizeof(struct spa_io_meter))) < 0)
+				pw_log_warn("%p: can't enable meters: %s", stream,
+						impl->meter ? spa_strerror(res) : "no memory");
+		}
 	} else {
 		impl->node = pw_context_create_node(impl->context, props, 0);
 		props = NULL;
@@ -2060,6 +2138,8 @@ int pw_stream_disconnect(struct pw_stream *stream)
 		pw_impl_node_destroy(impl->node);
 		impl->node = NULL;
 	}
+	free(impl->meter);
+	impl->meter = NULL;
 	if (impl->disconnect_core) {
 		impl->disconnect_core = false;
 		spa_hook_remove(&stream->core_listener);
@@ -2262,6 +2342,43 @@ do_trigger_deprecated(struct spa_loop *loop,
 	return spa_node_call_ready(&impl->callbacks, res);
 }
 
+SPA_EXPORT
+int pw_stream_get_stats(struct pw_stream *stream, struct pw_stream_stats *stats, size_t size)
+{
+	struct stream *impl = SPA_CONTAINER_OF(stream, struct stream, this);
+	uintptr_t seq1, seq2;
+
+	do {
+		seq1 = SEQ_READ(impl->stats_seq);
+		memcpy(stats, &impl->stats, SPA_MIN(size, sizeof(struct pw_stream_stats)));
+		seq2 = SEQ_READ(impl->stats_seq);
+	} while (!SEQ_READ_SUCCESS(seq1, seq2));
+
+	return 0;
+}
+
+SPA_EXPORT
+int pw_stream_get_meter(struct pw_stream *stream, struct spa_io_meter *meter, bool reset)
+{
+	struct stream *impl = SPA_CONTAINER_OF(stream, struct stream, this);
+	struct spa_io_meter *m = impl->meter;
+	uint32_t seq1, seq2;
+
+	if (m == NULL)
+		return -ENOTSUP;
+
+	do {
+		seq1 = SEQ_READ(m->seq);
+		*meter = *m;
+		seq2 = SEQ_READ(m->seq);
+	} while (!SEQ_READ_SUCCESS(seq1, seq2));
+
+	/* the node resets the peaks when it did not update them since */
+	if (reset)
+		__atomic_store_n(&m->reset_seq, seq1, __ATOMIC_RELEASE);
+	return 0;
+}
+
 SPA_EXPORT
 struct pw_buffer *pw_stream_dequeue_buffer(struct pw_stream *stream)
 {
@@ -2286,6 +2403,11 @@ struct pw_buffer *pw_stream_dequeue_buffer(struct pw_stream *stream)
 			return NULL;
 		}
 	}
+	/* the stats are written from the data thread, the wait time is
+	 * added when the buffer is recycled */
+	if (impl->direction == SPA_DIRECTION_INPUT &&
+	    take_wait(b, get_time_ns(), &b->wait))
+		SPA_FLAG_SET(b->flags, BUFFER_FLAG_WAIT);
 	return &b->this;
 }
 
@@ -2300,6 +2422,9 @@ int pw_stream_queue_buffer(struct pw_stream *stream, struct pw_buffer *buffer)
 		ATOMIC_DEC(b->busy->count);
 
 	pw_log_trace_fp("%p: queue buffer %d", stream, b->id);
+	/* the buffer can be popped as soon as it is pushed */
+	if (impl->direction == SPA_DIRECTION_OUTPUT)
+		b->time = get_time_ns();
 	if ((res = queue_push(impl, &impl->queued, b)) < 0)
 		return res;
 
@@ -191,6 +191,7 @@ struct pw_stream;
 #include <spa/buffer/buffer.h>
 #include <spa/param/param.h>
 #include <spa/pod/command.h>
+#include <spa/node/io.h>
 
 /** \enum pw_stream_state The state of a stream */
 enum pw_stream_state {
@@ -324,6 +325,42 @@ struct pw_time {
 	uint32_t avail_buffers;		/**< The number of buffers that can be dequeued. Since 0.3.50 */
 };
 
+/** Buffer statistics of a stream.
+ *
+ * Use pw_stream_get_stats() to get a snapshot of the statistics. The counters
+ * start when the stream is created and increase monotonically. Averages
+ * can be calculated by dividing the totals by their count.
+ *
+ * The wait time is the time a buffer spends in the queue towards the other
+ * side of the stream. For capture streams this is the time between the graph
+ * handing a buffer to the stream and the application dequeueing it. For
+ * playback streams it is the time between the application queueing a buffer
+ * and the graph consuming it.
+ *
+ * The queue depth is sampled once per graph cycle. For capture streams this is
+ * the number of buffers waiting to be dequeued, for playback streams the number
+ * of buffers queued by the application.
+ *
+ * Since 0.3.66
+ */
+struct pw_stream_stats {
+	uint64_t buffers;		/**< number of buffers exchanged with the graph */
+	uint64_t skipped;		/**< playback streams: graph cycles where no buffer was
+					  *  queued. For streams with \ref PW_STREAM_FLAG_DRIVER
+					  *  these are frames skipped by the pacing of the
+					  *  driver. */
+	uint64_t late;			/**< capture streams: buffers that arrived while the
+					  *  previous buffer was not dequeued yet */
+	uint64_t cycles;		/**< number of graph cycles, the count for depth_total */
+	uint64_t depth_total;		/**< sum of the sampled queue depths */
+	uint32_t depth_max;		/**< maximum sampled queue depth */
+	uint32_t padding;
+	uint64_t wait_count;		/**< number of wait time measurements */
+	uint64_t wait_total;		/**< sum of the wait times in nanoseconds */
+	uint64_t wait_last;		/**< last wait time in nanoseconds */
+	uint64_t wait_max;		/**< maximum wait time in nanoseconds */
+};
+
 #include <pipewire/port.h>
 
 /** Events for a stream. These events are always called from the mainloop
@@ -489,6 +526,16 @@ int pw_stream_set_control(struct pw_stream *stream, uint32_t id, uint32_t n_valu
 /** Query the time on the stream */
 int pw_stream_get_time_n(struct pw_stream *stream, struct pw_time *time, size_t size);
 
+/** Query the buffer statistics of the stream. Since 0.3.66 */
+int pw_stream_get_stats(struct pw_stream *stream, struct pw_stream_stats *stats, size_t size);
+
+/** Get a snapshot of the level meters of an audio stream that was created
+ * with the PW_KEY_STREAM_METER property. When \a reset is true, the peak
+ * values are cleared after the snapshot, unless they were updated in the
+ * meantime, then they are reported again in the next snapshot. Returns
+ * -ENOTSUP when the stream has no meters. Since 0.3.66 */
+int pw_stream_get_meter(struct pw_stream *stream, struct spa_io_meter *meter, bool reset);
+
 /** Query the time on the stream, deprecated since 0.3.50,
  * use pw_stream_get_time_n() to get the fields added since 0.3.50. */
 SPA_DEPRECATED
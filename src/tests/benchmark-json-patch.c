@@ -0,0 +1,182 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+
+#include <spa/utils/list.h>
+
+#include <pipewire/pipewire.h>
+#include <pipewire/map.h>
+
+#include "../tools/json-patch.h"
+
+/* replays changes on a registry of ports, like pw-dump -m sees them */
+#define MAX_OBJECTS	10000
+#define MAX_COUNT	100000
+
+struct object {
+	struct spa_list link;
+	uint32_t id;
+	char *dump;
+	int dump_size;
+};
+
+static struct object objects[MAX_OBJECTS];
+
+static const char *states[] = { "idle", "running", "suspended" };
+
+static char *gen_dump(uint32_t id, uint32_t change, int *size)
+{
+	char *str = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&str, &len);
+	uint32_t i;
+
+	fprintf(f, "{ \"id\": %u, \"type\": \"PipeWire:Interface:Port\", \"version\": 3, "
+			"\"info\": { \"direction\": \"output\", \"change-mask\": [ \"props\", \"params\" ], "
+			"\"state\": \"%s\", \"props\": { ", id, states[change % 3]);
+	for (i = 0; i < 16; i++)
+		fprintf(f, "\"port.prop%u\": \"value %u of port %u\", ", i, i, id);
+	fprintf(f, "\"object.serial\": %u }, \"params\": { \"EnumFormat\": [ ", id);
+	for (i = 0; i < 8; i++)
+		fprintf(f, "{ \"mediaType\": \"audio\", \"mediaSubtype\": \"raw\", "
+				"\"format\": \"F32P\", \"rate\": %u, \"channels\": 2 }%s",
+				44100 + i * 100, i < 7 ? ", " : " ");
+	fprintf(f, "], \"Latency\": [ { \"direction\": \"Output\", \"minQuantum\": %u } ] } } }",
+			change);
+	fclose(f);
+	*size = len;
+	return str;
+}
+
+static uint64_t get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+static void count_op(void *data, const char *op, const char *path,
+		const char *value, int len)
+{
+	uint64_t *bytes = data;
+	*bytes += strlen(op) + strlen(path) + len;
+}
+
+static void test_lookup(struct pw_map *map, struct spa_list *list, uint32_t n_objects)
+{
+	uint64_t t1, t2, t3;
+	uint32_t i;
+
+	t1 = get_time();
+	for (i = 0; i < MAX_COUNT; i++) {
+		uint32_t id = random() % n_objects;
+		struct object *o;
+		spa_list_for_each(o, list, link)
+			if (o->id == id)
+				break;
+		assert(o->id == id);
+	}
+	t2 = get_time();
+	for (i = 0; i < MAX_COUNT; i++) {
+		uint32_t id = random() % n_objects;
+		struct object *o = pw_map_lookup(map, id);
+		assert(o->id == id);
+	}
+	t3 = get_time();
+
+	fprintf(stderr, "%u list lookup elapsed %"PRIu64" count %u = %"PRIu64"/sec\n",
+			n_objects, t2 - t1, MAX_COUNT,
+			MAX_COUNT * (uint64_t)SPA_NSEC_PER_SEC / (t2 - t1));
+	fprintf(stderr, "%u map lookup elapsed %"PRIu64" count %u = %"PRIu64"/sec %f speedup\n",
+			n_objects, t3 - t2, MAX_COUNT,
+			MAX_COUNT * (uint64_t)SPA_NSEC_PER_SEC / (t3 - t2),
+			(double)(t2 - t1) / (t3 - t2));
+}
+
+static void test_patch(uint32_t n_objects)
+{
+	uint64_t t1, t2, full = 0, patch = 0;
+	uint32_t i;
+	char path[1024];
+
+	t1 = get_time();
+	for (i = 0; i < MAX_COUNT / 10; i++) {
+		struct object *o = &objects[random() % n_objects];
+		int size;
+		char *dump = gen_dump(o->id, i + 1, &size);
+
+		full += size;
+		snprintf(path, sizeof(path), "/%u", o->id);
+		json_patch_diff(path, sizeof(path), o->dump, o->dump_size,
+				dump, size, 3, count_op, &patch);
+		free(o->dump);
+		o->dump = dump;
+		o->dump_size = size;
+	}
+	t2 = get_time();
+
+	fprintf(stderr, "%u patch elapsed %"PRIu64" count %u = %"PRIu64"/sec "
+			"bytes full:%"PRIu64" patch:%"PRIu64" %f smaller\n",
+			n_objects, t2 - t1, MAX_COUNT / 10,
+			MAX_COUNT / 10 * (uint64_t)SPA_NSEC_PER_SEC / (t2 - t1),
+			full, patch, (double)full / patch);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pw_map map = PW_MAP_INIT(64);
+	struct spa_list list;
+	uint32_t i;
+
+	pw_init(&argc, &argv);
+
+	spa_list_init(&list);
+	for (i = 0; i < MAX_OBJECTS; i++) {
+		struct object *o = &objects[i];
+		o->id = i;
+		o->dump = gen_dump(i, 0, &o->dump_size);
+		spa_list_append(&list, &o->link);
+		pw_map_insert_at(&map, i, o);
+	}
+
+	test_lookup(&map, &list, 100);
+	test_lookup(&map, &list, 1000);
+	test_lookup(&map, &list, MAX_OBJECTS);
+
+	test_patch(MAX_OBJECTS);
+
+	for (i = 0; i < MAX_OBJECTS; i++)
+		free(objects[i].dump);
+	pw_map_clear(&map);
+
+	pw_deinit();
+
+	return 0;
+}
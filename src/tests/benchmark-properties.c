@@ -0,0 +1,151 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <assert.h>
+
+#include <spa/utils/string.h>
+
+#include <pipewire/pipewire.h>
+
+#define MAX_COUNT 100000
+#define MAX_ITEMS 1000
+
+static char values[MAX_ITEMS][32];
+
+static void gen_values(void)
+{
+	uint32_t i, j, idx;
+	static const char chars[] = "abcdefghijklmnopqrstuvwxyz.:*ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+	for (i = 0; i < MAX_ITEMS; i++) {
+		for (j = 0; j < 32; j++) {
+			idx = random() % (sizeof(chars) - 1);
+			values[i][j] = chars[idx];
+		}
+		/* make the keys unique */
+		snprintf(&values[i][16], 16, "%u", i);
+	}
+}
+
+static struct pw_properties *gen_props(uint32_t n_items)
+{
+	struct pw_properties *props;
+	uint32_t i;
+
+	props = pw_properties_new(NULL, NULL);
+	for (i = 0; i < n_items; i++)
+		pw_properties_set(props, values[i], values[i]);
+	return props;
+}
+
+static uint64_t get_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return SPA_TIMESPEC_TO_NSEC(&ts);
+}
+
+static void test_query(const struct pw_properties *props, bool dict)
+{
+	uint32_t i, idx;
+	const char *str;
+
+	for (i = 0; i < MAX_COUNT; i++) {
+		idx = random() % props->dict.n_items;
+		if (dict)
+			str = spa_dict_lookup(&props->dict, props->dict.items[idx].key);
+		else
+			str = pw_properties_get(props, props->dict.items[idx].key);
+		assert(spa_streq(str, props->dict.items[idx].value));
+	}
+}
+
+static void test_lookup(uint32_t n_items)
+{
+	struct pw_properties *props;
+	uint64_t t1, t2, t3, t4, t5;
+	uint32_t i;
+
+	t1 = get_time();
+	props = gen_props(n_items);
+	t2 = get_time();
+
+	fprintf(stderr, "%d build elapsed %"PRIu64"\n", n_items, t2 - t1);
+
+	/* the linear scan of spa_dict_lookup() on the same items */
+	test_query(props, true);
+	t3 = get_time();
+
+	fprintf(stderr, "%d dict elapsed %"PRIu64" count %u = %"PRIu64"/sec\n", n_items,
+			t3 - t2, MAX_COUNT, MAX_COUNT * (uint64_t)SPA_NSEC_PER_SEC / (t3 - t2));
+
+	test_query(props, false);
+	t4 = get_time();
+
+	fprintf(stderr, "%d props elapsed %"PRIu64" count %u = %"PRIu64"/sec %f speedup\n", n_items,
+			t4 - t3, MAX_COUNT, MAX_COUNT * (uint64_t)SPA_NSEC_PER_SEC / (t4 - t3),
+			(double)(t3 - t2) / (t4 - t3));
+
+	/* update existing keys, this is what rule matching and
+	 * property updates do most */
+	for (i = 0; i < MAX_COUNT; i++) {
+		uint32_t idx = random() % n_items;
+		pw_properties_set(props, values[idx], (i & 1) ? "0" : values[idx]);
+	}
+	t5 = get_time();
+
+	fprintf(stderr, "%d set elapsed %"PRIu64" count %u = %"PRIu64"/sec\n", n_items,
+			t5 - t4, MAX_COUNT, MAX_COUNT * (uint64_t)SPA_NSEC_PER_SEC / (t5 - t4));
+
+	pw_properties_free(props);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pw_properties *props;
+
+	pw_init(&argc, &argv);
+
+	gen_values();
+
+	/* warmup */
+	props = gen_props(1000);
+	test_query(props, false);
+	pw_properties_free(props);
+
+	test_lookup(10);
+	test_lookup(20);
+	test_lookup(50);
+	test_lookup(100);
+	test_lookup(1000);
+
+	pw_deinit();
+
+	return 0;
+}
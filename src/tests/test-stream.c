@@ -23,9 +23,12 @@
  */
 
 #include <pipewire/pipewire.h>
+#include <pipewire/impl-module.h>
 #include <pipewire/main-loop.h>
 #include <pipewire/stream.h>
 
+#include <spa/param/format.h>
+#include <spa/pod/builder.h>
 #include <spa/utils/string.h>
 
 #define TEST_FUNC(a,b,func)	\
@@ -69,9 +72,11 @@ static void test_abi(void)
 #if defined(__x86_64__) && defined(__LP64__)
 	spa_assert_se(sizeof(struct pw_buffer) == 32);
 	spa_assert_se(sizeof(struct pw_time) == 56);
+	spa_assert_se(sizeof(struct pw_stream_stats) == 80);
 #else
 	fprintf(stderr, "%zd\n", sizeof(struct pw_buffer));
 	fprintf(stderr, "%zd\n", sizeof(struct pw_time));
+	fprintf(stderr, "%zd\n", sizeof(struct pw_stream_stats));
 #endif
 
 	spa_assert_se(PW_VERSION_STREAM_EVENTS == 2);
@@ -152,6 +157,7 @@ static void test_create(void)
 	struct spa_hook listener = { 0, };
 	const char *error = NULL;
 	struct pw_time tm;
+	struct pw_stream_stats stats;
 
 	loop = pw_main_loop_new(NULL);
 	context = pw_context_new(pw_main_loop_get_loop(loop), NULL, 12);
@@ -180,7 +186,16 @@ static void test_create(void)
 	spa_assert_se(tm.queued == 0);
 	spa_assert_se(tm.buffered == 0);
 
+	spa_assert_se(pw_stream_get_stats(stream, &stats, sizeof(stats)) == 0);
+	spa_assert_se(stats.buffers == 0);
+	spa_assert_se(stats.skipped == 0);
+	spa_assert_se(stats.late == 0);
+	spa_assert_se(stats.cycles == 0);
+	spa_assert_se(stats.wait_count == 0);
+
 	spa_assert_se(pw_stream_dequeue_buffer(stream) == NULL);
+	spa_assert_se(pw_stream_get_stats(stream, &stats, sizeof(stats)) == 0);
+	spa_assert_se(stats.wait_count == 0);
 
 	/* check destroy */
 	destroy_count = 0;
@@ -243,6 +258,169 @@ static void test_properties(void)
 	pw_main_loop_destroy(loop);
 }
 
+#define STATS_CYCLES	16
+
+struct stats_data {
+	struct pw_main_loop *loop;
+	struct pw_core *core;
+	struct pw_stream *out;
+	struct pw_stream *in;
+	struct spa_hook out_listener;
+	struct spa_hook in_listener;
+	struct pw_proxy *link;
+	uint32_t n_triggers;
+	uint32_t n_in;
+};
+
+static void stats_link(struct stats_data *d)
+{
+	struct pw_properties *props;
+	uint32_t out_id = pw_stream_get_node_id(d->out);
+	uint32_t in_id = pw_stream_get_node_id(d->in);
+
+	if (d->link != NULL || out_id == SPA_ID_INVALID || in_id == SPA_ID_INVALID)
+		return;
+
+	props = pw_properties_new(NULL, NULL);
+	pw_properties_setf(props, PW_KEY_LINK_OUTPUT_NODE, "%u", out_id);
+	pw_properties_setf(props, PW_KEY_LINK_INPUT_NODE, "%u", in_id);
+	d->link = pw_core_create_object(d->core, "link-factory",
+			PW_TYPE_INTERFACE_Link, PW_VERSION_LINK, &props->dict, 0);
+	spa_assert_se(d->link != NULL);
+	pw_properties_free(props);
+}
+
+static void stats_state_changed(void *data, enum pw_stream_state old,
+		enum pw_stream_state state, const char *error)
+{
+	struct stats_data *d = data;
+
+	spa_assert_se(state != PW_STREAM_STATE_ERROR);
+	if (state == PW_STREAM_STATE_PAUSED)
+		stats_link(d);
+}
+
+static void stats_out_process(void *data)
+{
+	struct stats_data *d = data;
+	struct pw_buffer *b;
+	struct spa_data *sd;
+
+	if ((b = pw_stream_dequeue_buffer(d->out)) == NULL)
+		return;
+	sd = &b->buffer->datas[0];
+	sd->chunk->offset = 0;
+	sd->chunk->stride = 1;
+	sd->chunk->size = 0;
+	pw_stream_queue_buffer(d->out, b);
+}
+
+static void stats_in_process(void *data)
+{
+	struct stats_data *d = data;
+	struct pw_buffer *b;
+
+	if ((b = pw_stream_dequeue_buffer(d->in)) == NULL)
+		return;
+	pw_stream_queue_buffer(d->in, b);
+	if (++d->n_in == STATS_CYCLES)
+		pw_main_loop_quit(d->loop);
+}
+
+static const struct pw_stream_events stats_out_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = stats_state_changed,
+	.process = stats_out_process,
+};
+
+static const struct pw_stream_events stats_in_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = stats_state_changed,
+	.process = stats_in_process,
+};
+
+static void stats_on_timeout(void *data, uint64_t expirations)
+{
+	struct stats_data *d = data;
+
+	/* the output stream drives the graph */
+	if (pw_stream_get_state(d->out, NULL) == PW_STREAM_STATE_STREAMING)
+		pw_stream_trigger_process(d->out);
+	spa_assert_se(++d->n_triggers < 5000);
+}
+
+static void test_stats(void)
+{
+	struct stats_data d = { 0, };
+	struct pw_context *context;
+	struct pw_loop *l;
+	struct spa_source *timer;
+	struct timespec value, interval;
+	uint8_t buffer[1024];
+	struct spa_pod_builder b;
+	const struct spa_pod *params[1];
+	struct pw_stream_stats out_stats, in_stats;
+
+	d.loop = pw_main_loop_new(NULL);
+	l = pw_main_loop_get_loop(d.loop);
+	context = pw_context_new(l, NULL, 0);
+	spa_assert_se(context != NULL);
+	spa_assert_se(pw_context_load_module(context,
+				"libpipewire-module-link-factory", NULL, NULL) != NULL);
+	d.core = pw_context_connect_self(context, NULL, 0);
+	spa_assert_se(d.core != NULL);
+
+	d.out = pw_stream_new(d.core, "test-out", NULL);
+	d.in = pw_stream_new(d.core, "test-in", NULL);
+	spa_assert_se(d.out != NULL && d.in != NULL);
+	pw_stream_add_listener(d.out, &d.out_listener, &stats_out_events, &d);
+	pw_stream_add_listener(d.in, &d.in_listener, &stats_in_events, &d);
+
+	spa_pod_builder_init(&b, buffer, sizeof(buffer));
+	params[0] = spa_pod_builder_add_object(&b,
+			SPA_TYPE_OBJECT_Format, SPA_PARAM_EnumFormat,
+			SPA_FORMAT_mediaType,		SPA_POD_Id(SPA_MEDIA_TYPE_application),
+			SPA_FORMAT_mediaSubtype,	SPA_POD_Id(SPA_MEDIA_SUBTYPE_control));
+
+	spa_assert_se(pw_stream_connect(d.out, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+			PW_STREAM_FLAG_DRIVER | PW_STREAM_FLAG_MAP_BUFFERS,
+			params, 1) == 0);
+	spa_assert_se(pw_stream_connect(d.in, PW_DIRECTION_INPUT, PW_ID_ANY,
+			PW_STREAM_FLAG_MAP_BUFFERS,
+			params, 1) == 0);
+
+	timer = pw_loop_add_timer(l, stats_on_timeout, &d);
+	value.tv_sec = 0;
+	value.tv_nsec = 1;
+	interval.tv_sec = 0;
+	interval.tv_nsec = SPA_NSEC_PER_MSEC;
+	pw_loop_update_timer(l, timer, &value, &interval, false);
+
+	pw_main_loop_run(d.loop);
+
+	spa_assert_se(pw_stream_get_stats(d.out, &out_stats, sizeof(out_stats)) == 0);
+	spa_assert_se(out_stats.buffers > 0);
+	spa_assert_se(out_stats.cycles > 0);
+	spa_assert_se(out_stats.wait_count > 0);
+	spa_assert_se(out_stats.wait_count <= out_stats.buffers);
+	spa_assert_se(out_stats.wait_max >= out_stats.wait_last);
+
+	spa_assert_se(pw_stream_get_stats(d.in, &in_stats, sizeof(in_stats)) == 0);
+	spa_assert_se(in_stats.buffers >= STATS_CYCLES);
+	spa_assert_se(in_stats.cycles == in_stats.buffers);
+	spa_assert_se(in_stats.depth_max > 0);
+	spa_assert_se(in_stats.wait_count > 0);
+	spa_assert_se(in_stats.wait_total > 0);
+	spa_assert_se(in_stats.wait_max >= in_stats.wait_last);
+
+	pw_loop_destroy_source(l, timer);
+	pw_proxy_destroy(d.link);
+	pw_stream_destroy(d.in);
+	pw_stream_destroy(d.out);
+	pw_context_destroy(context);
+	pw_main_loop_destroy(d.loop);
+}
+
 int main(int argc, char *argv[])
 {
 	pw_init(&argc, &argv);
@@ -250,6 +428,7 @@ int main(int argc, char *argv[])
 	test_abi();
 	test_create();
 	test_properties();
+	test_stats();
 
 	pw_deinit();
 
@@ -0,0 +1,132 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <string.h>
+#include <alloca.h>
+
+#include <spa/utils/json.h>
+
+#include "json-patch.h"
+
+/* find the raw encoded key in a JSON object and return the length of
+ * its value */
+static int json_object_find(const char *obj, int obj_len,
+		const char *key, int key_len, const char **value)
+{
+	struct spa_json it[2];
+	const char *k, *v;
+	int kl, vl;
+
+	spa_json_init(&it[0], obj, obj_len);
+	if (spa_json_enter_object(&it[0], &it[1]) <= 0)
+		return -EINVAL;
+
+	while ((kl = spa_json_next(&it[1], &k)) > 0) {
+		if ((vl = spa_json_next(&it[1], &v)) <= 0)
+			break;
+		if (spa_json_is_container(v, vl))
+			vl = spa_json_container_len(&it[1], v, vl);
+		if (kl == key_len && memcmp(k, key, kl) == 0) {
+			*value = v;
+			return vl;
+		}
+	}
+	return -ENOENT;
+}
+
+/* append an escaped JSON pointer token to path */
+static void path_append(char *path, size_t size, const char *key, int key_len)
+{
+	char *str = alloca(key_len + 1);
+	size_t len = strlen(path);
+	const char *p;
+
+	if (spa_json_parse_stringn(key, key_len, str, key_len + 1) <= 0)
+		return;
+	if (len + 1 < size)
+		path[len++] = '/';
+	for (p = str; *p && len + 2 < size; p++) {
+		if (*p == '~' || *p == '/') {
+			path[len++] = '~';
+			path[len++] = *p == '~' ? '0' : '1';
+		} else {
+			path[len++] = *p;
+		}
+	}
+	path[len] = '\0';
+}
+
+void json_patch_diff(char *path, size_t size,
+		const char *old, int old_len, const char *new, int new_len, int depth,
+		json_patch_op_func_t func, void *data)
+{
+	struct spa_json it[2];
+	size_t len = strlen(path);
+	const char *k, *v, *ov;
+	int kl, vl, ovl;
+
+	if (old_len == new_len && memcmp(old, new, new_len) == 0)
+		return;
+
+	if (depth == 0 || !spa_json_is_object(old, old_len) ||
+	    !spa_json_is_object(new, new_len)) {
+		func(data, "replace", path, new, new_len);
+		return;
+	}
+
+	spa_json_init(&it[0], new, new_len);
+	if (spa_json_enter_object(&it[0], &it[1]) <= 0)
+		return;
+	while ((kl = spa_json_next(&it[1], &k)) > 0) {
+		if ((vl = spa_json_next(&it[1], &v)) <= 0)
+			break;
+		if (spa_json_is_container(v, vl))
+			vl = spa_json_container_len(&it[1], v, vl);
+
+		path_append(path, size, k, kl);
+		if ((ovl = json_object_find(old, old_len, k, kl, &ov)) < 0)
+			func(data, "add", path, v, vl);
+		else
+			json_patch_diff(path, size, ov, ovl, v, vl, depth - 1, func, data);
+		path[len] = '\0';
+	}
+
+	spa_json_init(&it[0], old, old_len);
+	if (spa_json_enter_object(&it[0], &it[1]) <= 0)
+		return;
+	while ((kl = spa_json_next(&it[1], &k)) > 0) {
+		if ((vl = spa_json_next(&it[1], &v)) <= 0)
+			break;
+		if (spa_json_is_container(v, vl))
+			vl = spa_json_container_len(&it[1], v, vl);
+
+		if (json_object_find(new, new_len, k, kl, &ov) >= 0)
+			continue;
+		path_append(path, size, k, kl);
+		func(data, "remove", path, NULL, 0);
+		path[len] = '\0';
+	}
+}
@@ -35,6 +35,8 @@
 #include <assert.h>
 #include <ctype.h>
 #include <locale.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <sndfile.h>
 
@@ -45,6 +47,7 @@
 #include <spa/utils/result.h>
 #include <spa/utils/string.h>
 #include <spa/utils/json.h>
+#include <spa/utils/ringbuffer.h>
 #include <spa/debug/types.h>
 
 #include <pipewire/pipewire.h>
@@ -74,6 +77,7 @@
 #define DEFAULT_FORMAT		"s16"
 #define DEFAULT_VOLUME		1.0
 #define DEFAULT_QUALITY		4
+#define DEFAULT_BUFFER_TIME	2000
 
 enum mode {
 	mode_none,
@@ -148,6 +152,29 @@ struct data {
 
 	fill_fn fill;
 
+	/* read-ahead/write-behind of PCM data in a separate thread */
+	unsigned int buffer_time;
+	struct {
+		struct pw_thread_loop *loop;
+		struct spa_source *event;
+		fill_fn fill;
+		struct spa_ringbuffer ring;
+		uint8_t *buffer;
+		uint32_t size;
+		uint32_t read_offs;	/* offsets in buffer, the ring indexes */
+		uint32_t write_offs;	/* wrap at 2^32, not at size */
+		bool eof;
+		uint64_t underruns;
+		uint64_t overruns;
+	} io;
+	struct {
+		void *data;
+		size_t size;
+		const uint8_t *start;
+		uint64_t frames;
+		uint64_t pos;
+	} map;
+
 	struct spa_io_position *position;
 	bool drained;
 	uint64_t clock_time;
@@ -786,9 +813,14 @@ static void on_process(void *userdata)
 		n_frames = d->maxsize / data->stride;
 		n_frames = SPA_MIN(n_frames, (int)b->requested);
 
-#ifdef HAVE_PW_CAT_FFMPEG_INTEGRATION
 		n_fill_frames = data->fill(data, p, n_frames);
+		if (n_fill_frames == -EAGAIN) {
+			/* the read-ahead buffer ran empty, send an empty buffer
+			 * and try again next cycle */
+			n_fill_frames = n_frames = 0;
+		}
 
+#ifdef HAVE_PW_CAT_FFMPEG_INTEGRATION
 		if (n_fill_frames > 0 || n_frames == 0) {
 			d->chunk->offset = 0;
 			if (data->data_type == TYPE_ENCODED) {
@@ -811,8 +843,6 @@ static void on_process(void *userdata)
 				printf("drain start\n");
 		}
 #else
-		n_fill_frames = data->fill(data, p, n_frames);
-
 		if (n_fill_frames > 0 || n_frames == 0) {
 			d->chunk->offset = 0;
 			d->chunk->stride = data->stride;
@@ -888,6 +918,203 @@ static void do_print_delay(void *userdata, uint64_t expirations)
 		time.queued_buffers, time.avail_buffers);
 }
 
+/* called from the io thread, unless the buffer is disabled, so that the
+ * page faults on the mapping don't stall the stream */
+static int mmap_playback_fill(struct data *d, void *dest, unsigned int n_frames)
+{
+	n_frames = SPA_MIN(n_frames, d->map.frames - d->map.pos);
+	memcpy(dest, d->map.start + d->map.pos * d->stride, n_frames * d->stride);
+	d->map.pos += n_frames;
+	return n_frames;
+}
+
+/* called from the io thread, read from the file until the ring is full */
+static void io_read_ahead(struct data *d)
+{
+	uint32_t index;
+	int32_t filled;
+	int res;
+
+	while (!__atomic_load_n(&d->io.eof, __ATOMIC_ACQUIRE)) {
+		uint32_t offs, n_frames;
+
+		filled = spa_ringbuffer_get_write_index(&d->io.ring, &index);
+		offs = d->io.write_offs;
+		n_frames = SPA_MIN(d->io.size - filled, d->io.size - offs) / d->stride;
+		if (n_frames == 0)
+			break;
+
+		res = d->io.fill(d, d->io.buffer + offs, n_frames);
+		if (res < 0)
+			fprintf(stderr, "fill error %d\n", res);
+		if (res > 0) {
+			d->io.write_offs = (offs + res * d->stride) % d->io.size;
+			spa_ringbuffer_write_update(&d->io.ring, index + res * d->stride);
+		}
+		if (res <= 0)
+			__atomic_store_n(&d->io.eof, true, __ATOMIC_RELEASE);
+	}
+}
+
+/* called from the io thread, or after it was stopped, write everything
+ * in the ring to the file */
+static void io_write_behind(struct data *d)
+{
+	uint32_t index;
+	int32_t filled;
+	int res;
+
+	while (true) {
+		uint32_t offs, n_frames;
+
+		filled = spa_ringbuffer_get_read_index(&d->io.ring, &index);
+		offs = d->io.read_offs;
+		n_frames = SPA_MIN((uint32_t)filled, d->io.size - offs) / d->stride;
+		if (n_frames == 0)
+			break;
+
+		res = d->io.fill(d, d->io.buffer + offs, n_frames);
+		if (res <= 0) {
+			fprintf(stderr, "fill error %d\n", res);
+			break;
+		}
+		d->io.read_offs = (offs + res * d->stride) % d->io.size;
+		spa_ringbuffer_read_update(&d->io.ring, index + res * d->stride);
+	}
+}
+
+static void on_io_event(void *userdata, uint64_t count)
+{
+	struct data *d = userdata;
+
+	if (d->mode == mode_playback)
+		io_read_ahead(d);
+	else
+		io_write_behind(d);
+}
+
+static int ring_playback_fill(struct data *d, void *dest, unsigned int n_frames)
+{
+	uint32_t index, avail;
+	int32_t filled;
+
+	filled = spa_ringbuffer_get_read_index(&d->io.ring, &index);
+	avail = filled / d->stride;
+
+	if (avail < n_frames) {
+		if (__atomic_load_n(&d->io.eof, __ATOMIC_ACQUIRE)) {
+			/* the thread is done, this is the last data */
+			if (avail == 0)
+				return 0;
+		} else {
+			d->io.underruns++;
+			if (avail == 0)
+				goto done;
+		}
+		n_frames = avail;
+	}
+	spa_ringbuffer_read_data(&d->io.ring, d->io.buffer, d->io.size,
+			d->io.read_offs, dest, n_frames * d->stride);
+	d->io.read_offs = (d->io.read_offs + n_frames * d->stride) % d->io.size;
+	spa_ringbuffer_read_update(&d->io.ring, index + n_frames * d->stride);
+done:
+	pw_loop_signal_event(pw_thread_loop_get_loop(d->io.loop), d->io.event);
+	return avail == 0 ? -EAGAIN : (int)n_frames;
+}
+
+static int ring_record_fill(struct data *d, void *src, unsigned int n_frames)
+{
+	uint32_t index, avail;
+	int32_t filled;
+
+	filled = spa_ringbuffer_get_write_index(&d->io.ring, &index);
+	avail = (d->io.size - filled) / d->stride;
+
+	if (avail < n_frames) {
+		/* the file can't keep up, drop what does not fit */
+		d->io.overruns++;
+		n_frames = avail;
+	}
+	spa_ringbuffer_write_data(&d->io.ring, d->io.buffer, d->io.size,
+			d->io.write_offs, src, n_frames * d->stride);
+	d->io.write_offs = (d->io.write_offs + n_frames * d->stride) % d->io.size;
+	spa_ringbuffer_write_update(&d->io.ring, index + n_frames * d->stride);
+
+	pw_loop_signal_event(pw_thread_loop_get_loop(d->io.loop), d->io.event);
+	return n_frames;
+}
+
+/* move the file io of raw audio to a separate thread with a ring buffer
+ * of buffer_time so that a slow disk does not stall the stream */
+static int setup_io(struct data *data)
+{
+	uint64_t frames;
+	int res;
+
+	if (data->buffer_time == 0 || data->data_type != TYPE_PCM ||
+	    data->stride == 0 || data->rate == 0)
+		return 0;
+	/* reading ahead from a pipe would only add latency */
+	if (data->mode == mode_playback && spa_streq(data->filename, "-"))
+		return 0;
+
+	frames = SPA_MAX((uint64_t)data->rate * data->buffer_time / 1000, 1u);
+	if (frames * data->stride > INT32_MAX)
+		frames = INT32_MAX / data->stride;
+
+	data->io.size = frames * data->stride;
+	data->io.buffer = malloc(data->io.size);
+	if (data->io.buffer == NULL)
+		return -errno;
+	spa_ringbuffer_init(&data->io.ring);
+
+	data->io.fill = data->fill;
+	data->fill = data->mode == mode_playback ?
+		ring_playback_fill : ring_record_fill;
+
+	/* start with a full buffer */
+	if (data->mode == mode_playback)
+		io_read_ahead(data);
+
+	data->io.loop = pw_thread_loop_new("pw-cat-io", NULL);
+	if (data->io.loop == NULL)
+		return -errno;
+
+	data->io.event = pw_loop_add_event(pw_thread_loop_get_loop(data->io.loop),
+			on_io_event, data);
+	if (data->io.event == NULL)
+		return -errno;
+
+	if ((res = pw_thread_loop_start(data->io.loop)) < 0)
+		return res;
+
+	if (data->verbose)
+		printf("IO: buffer of %"PRIu64" frames (%u bytes)\n",
+				frames, data->io.size);
+	return 0;
+}
+
+static void cleanup_io(struct data *data)
+{
+	if (data->io.loop) {
+		pw_thread_loop_stop(data->io.loop);
+		if (data->io.event)
+			pw_loop_destroy_source(pw_thread_loop_get_loop(data->io.loop),
+					data->io.event);
+		pw_thread_loop_destroy(data->io.loop);
+	}
+	if (data->io.buffer) {
+		if (data->mode == mode_record)
+			io_write_behind(data);
+		if (data->verbose || data->io.underruns || data->io.overruns)
+			fprintf(stderr, "IO: underruns:%"PRIu64" overruns:%"PRIu64"\n",
+					data->io.underruns, data->io.overruns);
+		free(data->io.buffer);
+	}
+	if (data->map.data)
+		munmap(data->map.data, data->map.size);
+}
+
 enum {
 	OPT_VERSION = 1000,
 	OPT_MEDIA_TYPE,
@@ -900,6 +1127,7 @@ enum {
 	OPT_CHANNELMAP,
 	OPT_FORMAT,
 	OPT_VOLUME,
+	OPT_BUFFER_TIME,
 };
 
 static const struct option long_options[] = {
@@ -926,6 +1154,7 @@ static const struct option long_options[] = {
 	{ "format",		required_argument, NULL, OPT_FORMAT },
 	{ "volume",		required_argument, NULL, OPT_VOLUME },
 	{ "quality",		required_argument, NULL, 'q' },
+	{ "buffer-time",	required_argument, NULL, OPT_BUFFER_TIME },
 
 	{ NULL, 0, NULL, 0 }
 };
@@ -970,12 +1199,15 @@ static void show_usage(const char *name, bool is_error)
              "      --format                          Sample format %s (req. for rec) (default %s)\n"
 	     "      --volume                          Stream volume 0-1.0 (default %.3f)\n"
 	     "  -q  --quality                         Resampler quality (0 - 15) (default %d)\n"
+	     "      --buffer-time                     File read-ahead/write-behind in ms,\n"
+	     "                                          0 disables (default %d)\n"
 	     "\n"),
 	     DEFAULT_RATE,
 	     DEFAULT_CHANNELS,
 	     STR_FMTS, DEFAULT_FORMAT,
 	     DEFAULT_VOLUME,
-	     DEFAULT_QUALITY);
+	     DEFAULT_QUALITY,
+	     DEFAULT_BUFFER_TIME);
 
 	if (spa_streq(name, "pw-cat")) {
 		fputs(
@@ -1361,6 +1593,84 @@ static int setup_encodedfile(struct data *data)
 }
 #endif
 
+/* map a WAV file with a native sample format so that we can read the
+ * samples without going through sndfile */
+static int setup_mmap(struct data *data, const SF_INFO *info)
+{
+	const uint8_t *p;
+	struct stat st;
+	size_t offs, len = 0;
+	int fd, res = 0;
+
+	if (__BYTE_ORDER != __LITTLE_ENDIAN)
+		return -ENOTSUP;
+
+	switch (info->format & SF_FORMAT_TYPEMASK) {
+	case SF_FORMAT_WAV:
+	case SF_FORMAT_WAVEX:
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	switch (info->format & SF_FORMAT_SUBMASK) {
+	case SF_FORMAT_PCM_U8:
+	case SF_FORMAT_PCM_16:
+	case SF_FORMAT_PCM_32:
+	case SF_FORMAT_FLOAT:
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	if ((fd = open(data->filename, O_RDONLY | O_CLOEXEC)) < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		res = -errno;
+		goto exit;
+	}
+	if (st.st_size < 12 || (uint64_t)st.st_size > SIZE_MAX) {
+		res = -EINVAL;
+		goto exit;
+	}
+	data->map.size = st.st_size;
+	data->map.data = mmap(NULL, data->map.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (data->map.data == MAP_FAILED) {
+		res = -errno;
+		data->map.data = NULL;
+		goto exit;
+	}
+	p = data->map.data;
+
+	if (memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0) {
+		res = -EINVAL;
+		goto exit;
+	}
+	for (offs = 12; offs + 8 <= data->map.size; offs += 8 + len + (len & 1)) {
+		len = p[offs + 4] | p[offs + 5] << 8 | p[offs + 6] << 16 |
+			(uint32_t)p[offs + 7] << 24;
+		if (memcmp(p + offs, "data", 4) == 0) {
+			data->map.start = p + offs + 8;
+			len = SPA_MIN(len, data->map.size - offs - 8);
+			break;
+		}
+	}
+	/* only use the mapping when we agree with sndfile about the data */
+	if (data->map.start == NULL || len / data->stride != (size_t)info->frames) {
+		res = -EINVAL;
+		goto exit;
+	}
+	data->map.frames = info->frames;
+	madvise(data->map.data, data->map.size, MADV_SEQUENTIAL);
+exit:
+	if (res < 0 && data->map.data) {
+		munmap(data->map.data, data->map.size);
+		spa_zero(data->map);
+	}
+	close(fd);
+	return res;
+}
+
 static int setup_sndfile(struct data *data)
 {
 	const struct format_info *fi = NULL;
@@ -1459,6 +1769,12 @@ static int setup_sndfile(struct data *data)
 		fprintf(stderr, "PCM: unhandled format %d\n", data->spa_format);
 		return -EINVAL;
 	}
+	if (data->mode == mode_playback && setup_mmap(data, &info) >= 0) {
+		if (data->verbose)
+			printf("PCM: reading %"PRIu64" frames from mapped file\n",
+					data->map.frames);
+		data->fill = mmap_playback_fill;
+	}
 	return 0;
 }
 
@@ -1574,6 +1890,7 @@ int main(int argc, char *argv[])
 	/* negative means no volume adjustment */
 	data.volume = -1.0;
 	data.quality = -1;
+	data.buffer_time = DEFAULT_BUFFER_TIME;
 	data.props = pw_properties_new(
 			PW_KEY_APP_NAME, prog,
 			PW_KEY_NODE_NAME, prog,
@@ -1696,6 +2013,15 @@ int main(int argc, char *argv[])
 		case OPT_VOLUME:
 			data.volume = atof(optarg);
 			break;
+
+		case OPT_BUFFER_TIME:
+			ret = atoi(optarg);
+			if (ret < 0) {
+				fprintf(stderr, "error: bad buffer time %d\n", ret);
+				goto error_usage;
+			}
+			data.buffer_time = (unsigned int)ret;
+			break;
 		default:
 			goto error_usage;
 		}
@@ -1824,6 +2150,11 @@ int main(int argc, char *argv[])
 	}
 	ret = setup_properties(&data);
 
+	if ((ret = setup_io(&data)) < 0) {
+		fprintf(stderr, "error: can't set up file io: %s\n", spa_strerror(ret));
+		goto error_bad_file;
+	}
+
 	switch (data.data_type) {
 #ifdef HAVE_PW_CAT_FFMPEG_INTEGRATION
 	case TYPE_ENCODED:
@@ -1949,6 +2280,7 @@ error_connect_fail:
 	}
 error_no_stream:
 error_bad_file:
+	cleanup_io(&data);
 	spa_hook_remove(&data.core_listener);
 	pw_core_disconnect(data.core);
 error_ctx_connect_failed:
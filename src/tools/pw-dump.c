@@ -48,6 +48,8 @@
 #include <pipewire/pipewire.h>
 #include <pipewire/extensions/metadata.h>
 
+#include "json-patch.h"
+
 #define INDENT 2
 
 static bool colors = false;
@@ -71,6 +73,7 @@ struct data {
 	struct spa_hook registry_listener;
 
 	struct spa_list object_list;
+	struct pw_map objects;
 
 	const char *pattern;
 
@@ -84,6 +87,7 @@ struct data {
 	uint32_t state;
 
 	unsigned int monitor:1;
+	unsigned int patch:1;
 };
 
 struct param {
@@ -128,6 +132,10 @@ struct object {
 	struct pw_proxy *proxy;
 	struct spa_hook proxy_listener;
 	struct spa_hook object_listener;
+
+	/* the last dump of the object, for patch mode */
+	char *dump;
+	size_t dump_size;
 };
 
 static void core_sync(struct data *d)
@@ -184,12 +192,7 @@ static struct param *add_param(struct spa_list *params, int seq,
 
 static struct object *find_object(struct data *d, uint32_t id)
 {
-	struct object *o;
-	spa_list_for_each(o, &d->object_list, link) {
-		if (o->id == id)
-			return o;
-	}
-	return NULL;
+	return pw_map_lookup(&d->objects, id);
 }
 
 static void object_update_params(struct spa_list *param_list, struct spa_list *pending_list,
@@ -223,12 +226,15 @@ static void object_update_params(struct spa_list *param_list, struct spa_list *p
 static void object_destroy(struct object *o)
 {
 	spa_list_remove(&o->link);
+	if (pw_map_lookup(&o->data->objects, o->id) == o)
+		pw_map_insert_at(&o->data->objects, o->id, NULL);
 	if (o->proxy)
 		pw_proxy_destroy(o->proxy);
 	pw_properties_free(o->props);
 	clear_params(&o->param_list, SPA_ID_INVALID);
 	clear_params(&o->pending_list, SPA_ID_INVALID);
 	free(o->type);
+	free(o->dump);
 	free(o);
 }
 
@@ -1169,6 +1175,42 @@ static void json_dump(struct data *d, const char *key, const char *value)
 		json_dump_val(d, key, &it[0], val, len);
 }
 
+static SPA_PRINTF_FUNC(3,4) void put_patch_begin(struct data *d, const char *op, const char *fmt, ...)
+{
+	char path[1024];
+	va_list va;
+
+	va_start(va, fmt);
+	vsnprintf(path, sizeof(path), fmt, va);
+	va_end(va);
+
+	if (d->state == STATE_FIRST)
+		put_begin(d, NULL, "[", 0);
+	put_begin(d, NULL, "{", 0);
+	put_string(d, "op", op);
+	put_string(d, "path", path);
+}
+
+static void put_patch_end(struct data *d)
+{
+	put_end(d, "}", 0);
+}
+
+static void put_patch_value(struct data *d, const char *op, const char *path,
+		const char *value, int len)
+{
+	struct spa_json it[1];
+	const char *val;
+
+	put_patch_begin(d, op, "%s", path);
+	if (value != NULL) {
+		spa_json_init(&it[0], value, len);
+		if ((len = spa_json_next(&it[0], &val)) > 0)
+			json_dump_val(d, "value", &it[0], val, len);
+	}
+	put_patch_end(d);
+}
+
 /* metadata */
 
 struct metadata_entry {
@@ -1187,7 +1229,8 @@ static void metadata_dump(struct object *o)
 	put_dict(d, "props", &o->props->dict);
 	put_begin(d, "metadata", "[", 0);
 	spa_list_for_each(e, &o->data_list, link) {
-		if (e->changed == 0)
+		/* patch mode compares against the complete previous state */
+		if (e->changed == 0 && !d->patch)
 			continue;
 		put_begin(d, NULL, "{", STATE_SIMPLE);
 		put_int(d, "subject", e->subject);
@@ -1334,6 +1377,7 @@ static void registry_event_global(void *data, uint32_t id,
 {
 	struct data *d = data;
 	struct object *o;
+	size_t size;
 
 	o = calloc(1, sizeof(*o));
 	if (o == NULL) {
@@ -1372,6 +1416,11 @@ static void registry_event_global(void *data, uint32_t id,
 	}
 	spa_list_append(&d->object_list, &o->link);
 
+	size = pw_map_get_size(&d->objects);
+	while (id > size)
+		pw_map_insert_at(&d->objects, size++, NULL);
+	pw_map_insert_at(&d->objects, id, o);
+
 	core_sync(d);
 	return;
 
@@ -1418,19 +1467,27 @@ static void registry_event_global_remove(void *data, uint32_t id)
 
 	d->state = STATE_FIRST;
 	if (d->pattern != NULL && !object_matches(o, d->pattern))
-		return;
-	if (d->state == STATE_FIRST)
-		put_begin(d, NULL, "[", 0);
-	put_begin(d, NULL, "{", 0);
-	put_int(d, "id", o->id);
-	if (o->class && o->class->dump)
-		put_value(d, "info", NULL);
-	else if (o->props)
-		put_value(d, "props", NULL);
-	put_end(d, "}", 0);
+		goto done;
+	if (d->patch) {
+		/* only remove what we added before */
+		if (o->dump != NULL) {
+			put_patch_begin(d, "remove", "/%u", o->id);
+			put_patch_end(d);
+		}
+	} else {
+		if (d->state == STATE_FIRST)
+			put_begin(d, NULL, "[", 0);
+		put_begin(d, NULL, "{", 0);
+		put_int(d, "id", o->id);
+		if (o->class && o->class->dump)
+			put_value(d, "info", NULL);
+		else if (o->props)
+			put_value(d, "props", NULL);
+		put_end(d, "}", 0);
+	}
 	if (d->state != STATE_FIRST)
 		put_end(d, "]\n", 0);
-
+done:
 	object_destroy(o);
 }
 
@@ -1440,7 +1497,7 @@ static const struct pw_registry_events registry_events = {
 	.global_remove = registry_event_global_remove,
 };
 
-static void dump_objects(struct data *d)
+static void put_object(struct data *d, const char *key, struct object *o)
 {
 	static const struct flags_info fl[] = {
 		{ "r", PW_PERM_R },
@@ -1450,26 +1507,96 @@ static void dump_objects(struct data *d)
 		{ NULL, },
 	};
 
+	put_begin(d, key, "{", 0);
+	put_int(d, "id", o->id);
+	put_value(d, "type", o->type);
+	put_int(d, "version", o->version);
+	put_flags(d, "permissions", o->permissions, fl);
+	if (o->class && o->class->dump)
+		o->class->dump(o);
+	else if (o->props)
+		put_dict(d, "props", &o->props->dict);
+	put_end(d, "}", 0);
+}
+
+/* dump the object without colors into a new string */
+static char *render_object(struct data *d, struct object *o, size_t *size)
+{
+	FILE *out = d->out;
+	bool old_colors = colors;
+	int level = d->level;
+	uint32_t state = d->state;
+	char *str = NULL;
+
+	if ((d->out = open_memstream(&str, size)) == NULL) {
+		d->out = out;
+		return NULL;
+	}
+	colors = false;
+	d->level = 0;
+	d->state = STATE_FIRST;
+
+	put_object(d, NULL, o);
+
+	if (fclose(d->out) != 0) {
+		free(str);
+		str = NULL;
+	}
+	d->out = out;
+	colors = old_colors;
+	d->level = level;
+	d->state = state;
+	return str;
+}
+
+static void patch_op(void *data, const char *op, const char *path,
+		const char *value, int len)
+{
+	put_patch_value(data, op, path, value, len);
+}
+
+static void patch_object(struct data *d, struct object *o)
+{
+	char path[1024];
+	size_t size;
+	char *dump;
+
+	if ((dump = render_object(d, o, &size)) == NULL) {
+		pw_log_error("can't render object %u: %m", o->id);
+		return;
+	}
+	if (o->dump == NULL) {
+		put_patch_begin(d, "add", "/%u", o->id);
+		put_object(d, "value", o);
+		put_patch_end(d);
+	} else {
+		snprintf(path, sizeof(path), "/%u", o->id);
+		/* compare down to the individual props and params */
+		json_patch_diff(path, sizeof(path), o->dump, o->dump_size,
+				dump, size, 3, patch_op, d);
+	}
+	free(o->dump);
+	o->dump = dump;
+	o->dump_size = size;
+}
+
+static void dump_objects(struct data *d)
+{
 	struct object *o;
 
 	d->state = STATE_FIRST;
 	spa_list_for_each(o, &d->object_list, link) {
-		if (d->pattern != NULL && !object_matches(o, d->pattern))
-			continue;
 		if (o->changed == 0)
 			continue;
-		if (d->state == STATE_FIRST)
-			put_begin(d, NULL, "[", 0);
-		put_begin(d, NULL, "{", 0);
-		put_int(d, "id", o->id);
-		put_value(d, "type", o->type);
-		put_int(d, "version", o->version);
-		put_flags(d, "permissions", o->permissions, fl);
-		if (o->class && o->class->dump)
-			o->class->dump(o);
-		else if (o->props)
-			put_dict(d, "props", &o->props->dict);
-		put_end(d, "}", 0);
+		if (d->pattern != NULL && !object_matches(o, d->pattern))
+			continue;
+		if (d->patch) {
+			patch_object(d, o);
+		} else {
+			if (d->state == STATE_FIRST)
+				put_begin(d, NULL, "[", 0);
+			put_object(d, NULL, o);
+		}
 		o->changed = 0;
 	}
 	if (d->state != STATE_FIRST)
@@ -1504,9 +1631,12 @@ static void on_core_done(void *data, uint32_t id, int seq)
 
 		pw_log_debug("sync end %u/%u", d->sync_seq, seq);
 
-		spa_list_for_each(o, &d->object_list, link)
+		spa_list_for_each(o, &d->object_list, link) {
+			if (spa_list_is_empty(&o->pending_list))
+				continue;
 			object_update_params(&o->param_list, &o->pending_list,
 					o->n_params, o->params);
+		}
 
 		dump_objects(d);
 		if (!d->monitor)
@@ -1534,6 +1664,7 @@ static void show_help(struct data *data, const char *name, bool error)
 		"      --version                         Show version\n"
 		"  -r, --remote                          Remote daemon name\n"
 		"  -m, --monitor                         monitor changes\n"
+		"  -p, --patch                           output changes as JSON patch operations\n"
 		"  -N, --no-colors                       disable color output\n"
 		"  -C, --color[=WHEN]                    whether to enable color support. WHEN is `never`, `always`, or `auto`\n",
 		name);
@@ -1550,6 +1681,7 @@ int main(int argc, char *argv[])
 		{ "version",	no_argument,		NULL, 'V' },
 		{ "remote",	required_argument,	NULL, 'r' },
 		{ "monitor",	no_argument,		NULL, 'm' },
+		{ "patch",	no_argument,		NULL, 'p' },
 		{ "no-colors",	no_argument,		NULL, 'N' },
 		{ "color",	optional_argument,	NULL, 'C' },
 		{ NULL, 0, NULL, 0}
@@ -1564,7 +1696,7 @@ int main(int argc, char *argv[])
 		colors = true;
 	setlinebuf(data.out);
 
-	while ((c = getopt_long(argc, argv, "hVr:mNC", long_options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hVr:mpNC", long_options, NULL)) != -1) {
 		switch (c) {
 		case 'h' :
 			show_help(&data, argv[0], false);
@@ -1583,6 +1715,9 @@ int main(int argc, char *argv[])
 		case 'm' :
 			data.monitor = true;
 			break;
+		case 'p' :
+			data.patch = true;
+			break;
 		case 'N' :
 			colors = false;
 			break;
@@ -1636,6 +1771,7 @@ int main(int argc, char *argv[])
 	}
 
 	spa_list_init(&data.object_list);
+	pw_map_init(&data.objects, 64, 64);
 
 	pw_core_add_listener(data.core,
 			&data.core_listener,
@@ -1650,6 +1786,7 @@ int main(int argc, char *argv[])
 
 	spa_list_consume(o, &data.object_list, link)
 		object_destroy(o);
+	pw_map_clear(&data.objects);
 	if (data.info)
 		pw_core_info_free(data.info);
 
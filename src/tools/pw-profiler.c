@@ -430,6 +430,7 @@ static void profiler_profile(void *data, const struct spa_pod *pod)
 	struct spa_pod *o;
 	struct spa_pod_prop *p;
 	struct point point;
+	bool have_driver;
 
 	SPA_POD_STRUCT_FOREACH(pod, o) {
 		int res = 0;
@@ -437,6 +438,7 @@ static void profiler_profile(void *data, const struct spa_pod *pod)
 			continue;
 
 		spa_zero(point);
+		have_driver = false;
 		SPA_POD_OBJECT_FOREACH((struct spa_pod_object*)o, p) {
 			switch(p->key) {
 			case SPA_PROFILER_info:
@@ -447,6 +449,7 @@ static void profiler_profile(void *data, const struct spa_pod *pod)
 				break;
 			case SPA_PROFILER_driverBlock:
 				res = process_driver_block(d, &p->value, &point);
+				have_driver = true;
 				break;
 			case SPA_PROFILER_followerBlock:
 				process_follower_block(d, &p->value, &point);
@@ -457,7 +460,9 @@ static void profiler_profile(void *data, const struct spa_pod *pod)
 			if (res < 0)
 				break;
 		}
-		if (res < 0)
+		/* objects without a driver block, like the histograms,
+		 * are not a cycle */
+		if (res < 0 || !have_driver)
 			continue;
 
 		dump_point(d, &point);
@@ -41,6 +41,7 @@
 
 #define MAX_FORMAT		16
 #define MAX_NAME		128
+#define MAX_BUCKETS		128
 
 struct driver {
 	int64_t count;
@@ -60,6 +61,14 @@ struct measurement {
 	struct spa_fraction latency;
 };
 
+struct histogram {
+	uint32_t min_shift;
+	uint32_t sub;
+	uint32_t n_buckets;
+	uint32_t prev[MAX_BUCKETS];
+	uint32_t delta[MAX_BUCKETS];		/* counts since the previous update */
+};
+
 struct node {
 	struct spa_list link;
 	struct data *data;
@@ -73,6 +82,8 @@ struct node {
 	int32_t last_error_status;
 	uint32_t generation;
 	char format[MAX_FORMAT+1];
+	struct histogram wakeup_hist;
+	struct histogram run_hist;
 	struct pw_proxy *proxy;
 	struct spa_hook proxy_listener;
 	unsigned int inactive:1;
@@ -99,6 +110,7 @@ struct data {
 	struct spa_list node_list;
 	uint32_t generation;
 	unsigned pending_refresh:1;
+	unsigned show_percentiles:1;
 
 	WINDOW *win;
 };
@@ -403,6 +415,85 @@ static int process_follower_block(struct data *d, const struct spa_pod *pod, str
 	return 0;
 }
 
+static void update_histogram(struct histogram *h, uint32_t min_shift, uint32_t sub,
+		const uint32_t *counts, uint32_t n_counts)
+{
+	uint32_t i;
+
+	if (h->min_shift != min_shift || h->sub != sub || h->n_buckets != n_counts) {
+		/* new layout, we can only start counting from here */
+		h->min_shift = min_shift;
+		h->sub = sub;
+		h->n_buckets = n_counts;
+		memcpy(h->prev, counts, n_counts * sizeof(uint32_t));
+		spa_zero(h->delta);
+		return;
+	}
+	for (i = 0; i < n_counts; i++) {
+		h->delta[i] = counts[i] - h->prev[i];
+		h->prev[i] = counts[i];
+	}
+}
+
+static int process_follower_histogram(struct data *d, const struct spa_pod *pod)
+{
+	uint32_t id = 0, min_shift = 0, sub = 0, n_wakeup, n_run;
+	uint32_t wakeup[MAX_BUCKETS], run[MAX_BUCKETS];
+	struct spa_pod *wakeup_pod = NULL, *run_pod = NULL;
+	struct node *n;
+	int res;
+
+	if ((res = spa_pod_parse_struct(pod,
+			SPA_POD_Int(&id),
+			SPA_POD_Int(&min_shift),
+			SPA_POD_Int(&sub),
+			SPA_POD_Pod(&wakeup_pod),
+			SPA_POD_Pod(&run_pod))) < 0)
+		return res;
+
+	if (sub == 0 || min_shift == 0 || min_shift >= 32)
+		return -EINVAL;
+
+	n_wakeup = spa_pod_copy_array(wakeup_pod, SPA_TYPE_Int, wakeup, MAX_BUCKETS);
+	n_run = spa_pod_copy_array(run_pod, SPA_TYPE_Int, run, MAX_BUCKETS);
+	if (n_wakeup == 0 || n_run == 0)
+		return -EINVAL;
+
+	if ((n = find_node(d, id)) == NULL)
+		return -ENOENT;
+
+	update_histogram(&n->wakeup_hist, min_shift, sub, wakeup, n_wakeup);
+	update_histogram(&n->run_hist, min_shift, sub, run, n_run);
+	return 0;
+}
+
+/* upper bound in nsec of the bucket that contains the percentile, -1 when
+ * there is no data and -2 when it is in the overflow bucket */
+static uint64_t histogram_percentile(const struct histogram *h, uint32_t percent)
+{
+	uint64_t total = 0, sum = 0, target;
+	uint32_t i, octave, s;
+
+	for (i = 0; i < h->n_buckets; i++)
+		total += h->delta[i];
+	if (total == 0)
+		return -1;
+
+	target = (total * percent + 99) / 100;
+	for (i = 0; i < h->n_buckets; i++) {
+		sum += h->delta[i];
+		if (sum >= target)
+			break;
+	}
+	if (i + 1 >= h->n_buckets)
+		return -2;
+
+	/* the upper bound of bucket i is the lower bound of i + 1 */
+	octave = i / h->sub;
+	s = i % h->sub;
+	return ((uint64_t)(h->sub + s) << (octave + h->min_shift)) / h->sub;
+}
+
 static const char *print_time(char *buf, bool active, size_t len, uint64_t val)
 {
 	if (val == (uint64_t)-1 || !active)
@@ -487,6 +578,22 @@ static void print_node(struct data *d, struct driver *i, struct node *n, int y)
 	else
 		busy = -1;
 
+	if (d->show_percentiles) {
+		mvwprintw(d->win, y, 0, "%s %4.1u %6.1u %6.1u %s %s %s %s  %3.1u %16.16s %s%s",
+			state_as_string(n->state),
+			n->id,
+			frac.num, frac.denom,
+			print_time(buf1, active, 64, histogram_percentile(&n->wakeup_hist, 50)),
+			print_time(buf2, active, 64, histogram_percentile(&n->wakeup_hist, 99)),
+			print_time(buf3, active, 64, histogram_percentile(&n->run_hist, 50)),
+			print_time(buf4, active, 64, histogram_percentile(&n->run_hist, 99)),
+			i->xrun_count + n->errors,
+			active ? n->format : "",
+			n->driver == n ? "" : " + ",
+			n->name);
+		return;
+	}
+
 	mvwprintw(d->win, y, 0, "%s %4.1u %6.1u %6.1u %s %s %s %s  %3.1u %16.16s %s%s",
 			state_as_string(n->state),
 			n->id,
@@ -506,6 +613,8 @@ static void clear_node(struct node *n)
 	n->driver = n;
 	spa_zero(n->measurement);
 	spa_zero(n->info);
+	spa_zero(n->wakeup_hist);
+	spa_zero(n->run_hist);
 	n->errors = 0;
 	n->last_error_status = 0;
 }
@@ -517,7 +626,10 @@ static void do_refresh(struct data *d)
 
 	wclear(d->win);
 	wattron(d->win, A_REVERSE);
-	wprintw(d->win, "%-*.*s", COLS, COLS, "S   ID  QUANT   RATE    WAIT    BUSY   W/Q   B/Q  ERR FORMAT           NAME ");
+	if (d->show_percentiles)
+		wprintw(d->win, "%-*.*s", COLS, COLS, "S   ID  QUANT   RATE   W-P50   W-P99   B-P50   B-P99  ERR FORMAT           NAME ");
+	else
+		wprintw(d->win, "%-*.*s", COLS, COLS, "S   ID  QUANT   RATE    WAIT    BUSY   W/Q   B/Q  ERR FORMAT           NAME ");
 	wattroff(d->win, A_REVERSE);
 	wprintw(d->win, "\n");
 
@@ -585,6 +697,9 @@ static void profiler_profile(void *data, const struct spa_pod *pod)
 			case SPA_PROFILER_followerBlock:
 				process_follower_block(d, &p->value, &point);
 				break;
+			case SPA_PROFILER_followerHistogram:
+				process_follower_histogram(d, &p->value);
+				break;
 			default:
 				break;
 			}
@@ -738,6 +853,10 @@ static void do_handle_io(void *data, int fd, uint32_t mask)
 		case 'q':
 			pw_main_loop_quit(d->loop);
 			break;
+		case 'p':
+			d->show_percentiles = !d->show_percentiles;
+			do_refresh(d);
+			break;
 		default:
 			do_refresh(d);
 			break;
@@ -93,10 +93,80 @@ PWTEST(config_load_nullname)
 	return PWTEST_PASS;
 }
 
+PWTEST(config_load_cached)
+{
+	char path[PATH_MAX];
+	int r;
+	FILE *fp;
+	struct pw_properties *props;
+
+	pwtest_mkstemp(path);
+	fp = fopen(path, "we");
+	fputs("data = x other = { a = b }", fp);
+	fclose(fp);
+
+	/* second load is served from the parsed config cache */
+	props = pw_properties_new("ignore", "me", NULL);
+	r = pw_conf_load_conf(NULL, path, props);
+	pwtest_neg_errno_ok(r);
+	pwtest_str_eq(pw_properties_get(props, "data"), "x");
+	pw_properties_free(props);
+
+	props = pw_properties_new("ignore", "me", NULL);
+	r = pw_conf_load_conf(NULL, path, props);
+	pwtest_neg_errno_ok(r);
+	pwtest_str_eq(pw_properties_get(props, "ignore"), "me");
+	pwtest_str_eq(pw_properties_get(props, "data"), "x");
+	pwtest_str_eq(pw_properties_get(props, "other"), "{ a = b }");
+	pw_properties_free(props);
+
+	/* a modified file is parsed again */
+	fp = fopen(path, "we");
+	fputs("data = something-else", fp);
+	fclose(fp);
+
+	props = pw_properties_new("ignore", "me", NULL);
+	r = pw_conf_load_conf(NULL, path, props);
+	pwtest_neg_errno_ok(r);
+	pwtest_str_eq(pw_properties_get(props, "data"), "something-else");
+	pwtest_ptr_null(pw_properties_get(props, "other"));
+	pw_properties_free(props);
+
+	return PWTEST_PASS;
+}
+
+PWTEST(config_load_cached_null)
+{
+	char path[PATH_MAX];
+	int i, r;
+	FILE *fp;
+	struct pw_properties *props;
+
+	pwtest_mkstemp(path);
+	fp = fopen(path, "we");
+	fputs("data = x ignore = null other = null other = y", fp);
+	fclose(fp);
+
+	/* a null value removes the pre-set key, also when cached */
+	for (i = 0; i < 2; i++) {
+		props = pw_properties_new("ignore", "me", "other", "z", NULL);
+		r = pw_conf_load_conf(NULL, path, props);
+		pwtest_neg_errno_ok(r);
+		pwtest_str_eq(pw_properties_get(props, "data"), "x");
+		pwtest_ptr_null(pw_properties_get(props, "ignore"));
+		pwtest_str_eq(pw_properties_get(props, "other"), "y");
+		pw_properties_free(props);
+	}
+
+	return PWTEST_PASS;
+}
+
 PWTEST_SUITE(context)
 {
 	pwtest_add(config_load_abspath, PWTEST_NOARG);
 	pwtest_add(config_load_nullname, PWTEST_NOARG);
+	pwtest_add(config_load_cached, PWTEST_NOARG);
+	pwtest_add(config_load_cached_null, PWTEST_NOARG);
 
 	return PWTEST_PASS;
 }
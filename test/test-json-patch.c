@@ -0,0 +1,116 @@
+/* PipeWire
+ *
+ * Copyright © 2023 PipeWire authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "pwtest.h"
+
+#include <spa/utils/defs.h>
+
+#include "tools/json-patch.h"
+
+static void collect_op(void *data, const char *op, const char *path,
+		const char *value, int len)
+{
+	FILE *f = data;
+
+	if (value != NULL)
+		fprintf(f, "%s %s %.*s\n", op, path, len, value);
+	else
+		fprintf(f, "%s %s\n", op, path);
+}
+
+static void check_diff(const char *old, const char *new, const char *expected)
+{
+	char path[64] = "/42", *ops = NULL;
+	size_t size = 0;
+	FILE *f;
+
+	f = open_memstream(&ops, &size);
+	pwtest_ptr_notnull(f);
+	json_patch_diff(path, sizeof(path), old, strlen(old), new, strlen(new), 3,
+			collect_op, f);
+	fclose(f);
+
+	pwtest_str_eq(ops, expected);
+	/* the path is restored */
+	pwtest_str_eq(path, "/42");
+	free(ops);
+}
+
+PWTEST(json_patch_same)
+{
+	check_diff("{ \"id\": 42, \"info\": { \"state\": \"idle\" } }",
+		   "{ \"id\": 42, \"info\": { \"state\": \"idle\" } }",
+		   "");
+	return PWTEST_PASS;
+}
+
+PWTEST(json_patch_members)
+{
+	check_diff("{ \"id\": 42, \"type\": \"Node\", \"gone\": true }",
+		   "{ \"id\": 42, \"type\": \"Port\", \"new\": [ 1, 2 ] }",
+		   "replace /42/type \"Port\"\n"
+		   "add /42/new [ 1, 2 ]\n"
+		   "remove /42/gone\n");
+	/* not an object on one side, replace all of it */
+	check_diff("{ \"id\": 42 }", "[ 42 ]",
+		   "replace /42 [ 42 ]\n");
+	return PWTEST_PASS;
+}
+
+PWTEST(json_patch_escape)
+{
+	/* ~ and / in keys are escaped as ~0 and ~1 */
+	check_diff("{ \"a/b\": 1, \"m~n\": { \"x\": 1 }, \"~/\": 1 }",
+		   "{ \"a/b\": 2, \"m~n\": { \"x\": 1, \"y\": 2 } }",
+		   "replace /42/a~1b 2\n"
+		   "add /42/m~0n/y 2\n"
+		   "remove /42/~0~1\n");
+	return PWTEST_PASS;
+}
+
+PWTEST(json_patch_depth)
+{
+	/* members are compared 3 levels down, deeper changes replace the
+	 * member at the third level */
+	check_diff("{ \"info\": { \"state\": \"idle\", \"props\": "
+			"{ \"node.name\": \"a\", \"obj\": { \"deep\": 1, \"same\": 0 } } } }",
+		   "{ \"info\": { \"state\": \"running\", \"props\": "
+			"{ \"node.name\": \"a\", \"obj\": { \"deep\": 2, \"same\": 0 } } } }",
+		   "replace /42/info/state \"running\"\n"
+		   "replace /42/info/props/obj { \"deep\": 2, \"same\": 0 }\n");
+	return PWTEST_PASS;
+}
+
+PWTEST_SUITE(json_patch)
+{
+	pwtest_add(json_patch_same, PWTEST_NOARG);
+	pwtest_add(json_patch_members, PWTEST_NOARG);
+	pwtest_add(json_patch_escape, PWTEST_NOARG);
+	pwtest_add(json_patch_depth, PWTEST_NOARG);
+
+	return PWTEST_PASS;
+}
@@ -605,6 +605,87 @@ PWTEST(properties_update)
 	return PWTEST_PASS;
 }
 
+PWTEST(properties_many)
+{
+	struct pw_properties *props, *copy;
+	char key[64], val[64];
+	int i;
+
+	props = pw_properties_new(NULL, NULL);
+	pwtest_ptr_notnull(props);
+
+	/* large enough to use the hash index */
+	for (i = 0; i < 200; i++) {
+		spa_scnprintf(key, sizeof(key), "key.%d", i);
+		spa_scnprintf(val, sizeof(val), "value.%d", i);
+		pwtest_int_eq(pw_properties_set(props, key, val), 1);
+	}
+	pwtest_int_eq(props->dict.n_items, 200U);
+	for (i = 0; i < 200; i++) {
+		spa_scnprintf(key, sizeof(key), "key.%d", i);
+		spa_scnprintf(val, sizeof(val), "value.%d", i);
+		pwtest_str_eq(pw_properties_get(props, key), val);
+	}
+	pwtest_ptr_null(pw_properties_get(props, "key.200"));
+
+	/* removing moves the last item around */
+	for (i = 0; i < 200; i += 3) {
+		spa_scnprintf(key, sizeof(key), "key.%d", i);
+		pwtest_int_eq(pw_properties_set(props, key, NULL), 1);
+	}
+	for (i = 0; i < 200; i++) {
+		spa_scnprintf(key, sizeof(key), "key.%d", i);
+		spa_scnprintf(val, sizeof(val), "value.%d", i);
+		if (i % 3 == 0)
+			pwtest_ptr_null(pw_properties_get(props, key));
+		else
+			pwtest_str_eq(pw_properties_get(props, key), val);
+	}
+
+	/* sorting in place reorders the items under the index */
+	spa_dict_qsort(&props->dict);
+	pwtest_str_eq(pw_properties_get(props, "key.1"), "value.1");
+	pwtest_int_eq(pw_properties_set(props, "key.0", "again"), 1);
+	pwtest_int_eq(pw_properties_set(props, "key.2", "changed"), 1);
+	pwtest_str_eq(pw_properties_get(props, "key.0"), "again");
+	pwtest_str_eq(pw_properties_get(props, "key.2"), "changed");
+	pwtest_str_eq(pw_properties_get(props, "key.199"), "value.199");
+	pwtest_ptr_null(pw_properties_get(props, "key.3"));
+
+	/* removing after a sort patches the index in place */
+	for (i = 1; i < 200; i += 3) {
+		spa_scnprintf(key, sizeof(key), "key.%d", i);
+		pwtest_int_eq(pw_properties_set(props, key, NULL), 1);
+	}
+	spa_dict_qsort(&props->dict);
+	pwtest_int_eq(pw_properties_set(props, "key.1", "back"), 1);
+	for (i = 2; i < 200; i++) {
+		spa_scnprintf(key, sizeof(key), "key.%d", i);
+		spa_scnprintf(val, sizeof(val), "value.%d", i);
+		if (i % 3 != 2)
+			pwtest_ptr_null(pw_properties_get(props, key));
+		else if (i != 2)
+			pwtest_str_eq(pw_properties_get(props, key), val);
+	}
+	pwtest_str_eq(pw_properties_get(props, "key.1"), "back");
+
+	copy = pw_properties_copy(props);
+	pwtest_int_eq(copy->dict.n_items, props->dict.n_items);
+	pwtest_str_eq(pw_properties_get(copy, "key.2"), "changed");
+	pwtest_str_eq(pw_properties_get(copy, "key.197"), "value.197");
+	pw_properties_free(copy);
+
+	pw_properties_clear(props);
+	pwtest_int_eq(props->dict.n_items, 0U);
+	pwtest_ptr_null(pw_properties_get(props, "key.1"));
+	pwtest_int_eq(pw_properties_set(props, "key.1", "value.1"), 1);
+	pwtest_str_eq(pw_properties_get(props, "key.1"), "value.1");
+
+	pw_properties_free(props);
+
+	return PWTEST_PASS;
+}
+
 PWTEST_SUITE(properties)
 {
 	pwtest_add(properties_abi, PWTEST_NOARG);
@@ -624,6 +705,7 @@ PWTEST_SUITE(properties)
 	pwtest_add(properties_new_dict, PWTEST_NOARG);
 	pwtest_add(properties_new_json, PWTEST_NOARG);
 	pwtest_add(properties_update, PWTEST_NOARG);
+	pwtest_add(properties_many, PWTEST_NOARG);
 
 	return PWTEST_PASS;
 }
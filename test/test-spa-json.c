@@ -231,6 +231,43 @@ PWTEST(json_overflow)
 	return PWTEST_PASS;
 }
 
+PWTEST(json_long_runs)
+{
+	struct spa_json it[3];
+	const char *value;
+	const char *json =
+			"# a comment that is long enough to span more than one block {\n"
+			"{\n"
+			"                                        \"a key that is longer than sixteen bytes\" =\n"
+			"\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\"escaped \\\" quote after more than sixteen bytes\"\n"
+			"    \"utf8\" = \"0123456789abcdef\xc3\xa9 0123456789abcdef\"\r"
+			"    # trailing comment ] }\r\n"
+			"    \"arr\" = [ \"0123456789abcdef0123456789abcdef\" ]\n"
+			"}\n";
+
+	spa_json_init(&it[0], json, strlen(json));
+
+	expect_type(&it[0], TYPE_OBJECT);
+	spa_json_enter(&it[0], &it[1]);
+	expect_string(&it[1], "a key that is longer than sixteen bytes");
+	expect_string(&it[1], "escaped \" quote after more than sixteen bytes");
+	expect_string(&it[1], "utf8");
+	expect_string(&it[1], "0123456789abcdef\xc3\xa9 0123456789abcdef");
+	expect_string(&it[1], "arr");
+	expect_type(&it[1], TYPE_ARRAY);
+	spa_json_enter(&it[1], &it[2]);
+	expect_string(&it[2], "0123456789abcdef0123456789abcdef");
+	pwtest_int_eq(spa_json_next(&it[2], &value), 0);
+	pwtest_int_eq(spa_json_next(&it[1], &value), 0);
+
+	/* control characters inside strings are still rejected */
+	json = "\"0123456789abcdef0123456789\x01\"";
+	spa_json_init(&it[0], json, strlen(json));
+	pwtest_int_lt(spa_json_next(&it[0], &value), 0);
+
+	return PWTEST_PASS;
+}
+
 PWTEST(json_float)
 {
 	struct {
@@ -325,6 +362,7 @@ PWTEST_SUITE(spa_json)
 	pwtest_add(json_encode, PWTEST_NOARG);
 	pwtest_add(json_array, PWTEST_NOARG);
 	pwtest_add(json_overflow, PWTEST_NOARG);
+	pwtest_add(json_long_runs, PWTEST_NOARG);
 	pwtest_add(json_float, PWTEST_NOARG);
 	pwtest_add(json_float_check, PWTEST_NOARG);
 	pwtest_add(json_int, PWTEST_NOARG);